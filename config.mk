@@ -59,6 +59,16 @@ WITH_MEMORY_TRACKING:=yes
 # Not currently supported.
 #WITH_DB_UPGRADE:=yes
 
+# Comment out to remove support for the shared memory transport, which lets
+# clients on the same host connect through a pair of memory rings rather than
+# a socket. Ignored on systems other than Linux.
+WITH_SHM:=yes
+
+# Comment out to remove debug log messages from the broker and client library.
+# They are only formatted when debug logging is enabled, but removing them
+# saves a test and branch for every packet sent and received.
+WITH_DEBUG_LOGGING:=yes
+
 # =============================================================================
 # End of user configuration
 # =============================================================================
@@ -98,9 +108,9 @@ BROKER_CFLAGS:=${LIB_CFLAGS} ${CPPFLAGS} -DVERSION="\"${VERSION}\"" -DTIMESTAMP=
 CLIENT_CFLAGS:=${CFLAGS} ${CPPFLAGS} -I../lib -DVERSION="\"${VERSION}\""
 
 ifeq ($(UNAME),FreeBSD)
-	BROKER_LIBS:=-lm
+	BROKER_LIBS:=-lm -lpthread
 else
-	BROKER_LIBS:=-ldl -lm
+	BROKER_LIBS:=-ldl -lm -lpthread
 endif
 LIB_LIBS:=
 PASSWD_LIBS:=
@@ -177,6 +187,18 @@ ifeq ($(WITH_MEMORY_TRACKING),yes)
 	endif
 endif
 
+ifeq ($(WITH_SHM),yes)
+	ifeq ($(UNAME),Linux)
+		LIB_CFLAGS:=$(LIB_CFLAGS) -DWITH_SHM
+		BROKER_CFLAGS:=$(BROKER_CFLAGS) -DWITH_SHM
+	endif
+endif
+
+ifeq ($(WITH_DEBUG_LOGGING),yes)
+	LIB_CFLAGS:=$(LIB_CFLAGS) -DWITH_DEBUG_LOGGING
+	BROKER_CFLAGS:=$(BROKER_CFLAGS) -DWITH_DEBUG_LOGGING
+endif
+
 #ifeq ($(WITH_DB_UPGRADE),yes)
 #	BROKER_CFLAGS:=$(BROKER_CFLAGS) -DWITH_DB_UPGRADE
 #endif
@@ -162,6 +162,11 @@ int mosquittopp::connect_async(const char *host, int port, int keepalive)
 	return mosquitto_connect_async(m_mosq, host, port, keepalive);
 }
 
+int mosquittopp::connect_shm(const char *path, int keepalive)
+{
+	return mosquitto_connect_shm(m_mosq, path, keepalive);
+}
+
 int mosquittopp::reconnect()
 {
 	return mosquitto_reconnect(m_mosq);
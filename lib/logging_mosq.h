@@ -33,4 +33,26 @@ POSSIBILITY OF SUCH DAMAGE.
 
 int _mosquitto_log_printf(struct mosquitto *mosq, int priority, const char *fmt, ...);
 
+/* Check whether a message at this priority would go anywhere, without making
+ * a call. The broker keeps g_log_mask up to date in mqtt3_log_init(). */
+#ifdef WITH_BROKER
+extern int g_log_mask;
+#  define _mosquitto_log_enabled(mosq, priority) (g_log_mask & (priority))
+#else
+#  define _mosquitto_log_enabled(mosq, priority) ((mosq)->on_log != NULL)
+#endif
+
+/* Debug messages are logged for every packet, so only format them when they
+ * are wanted, and compile them out altogether without WITH_DEBUG_LOGGING. */
+#ifdef WITH_DEBUG_LOGGING
+#  define _mosquitto_log_debug(mosq, ...) \
+	do{ \
+		if(_mosquitto_log_enabled(mosq, MOSQ_LOG_DEBUG)){ \
+			_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, __VA_ARGS__); \
+		} \
+	}while(0)
+#else
+#  define _mosquitto_log_debug(mosq, ...) do{}while(0)
+#endif
+
 #endif
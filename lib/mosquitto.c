@@ -51,6 +51,7 @@ typedef int ssize_t;
 #include <net_mosq.h>
 #include <read_handle.h>
 #include <send_mosq.h>
+#include <shm_mosq.h>
 #include <util_mosq.h>
 #include <will_mosq.h>
 
@@ -174,6 +175,9 @@ int mosquitto_reinitialise(struct mosquitto *mosq, const char *id, bool clean_se
 	_mosquitto_packet_cleanup(&mosq->in_packet);
 	mosq->out_packet = NULL;
 	mosq->current_out_packet = NULL;
+	mosq->out_packet_last = NULL;
+	mosq->out_packet_count = 0;
+	mosq->out_packet_bytes = 0;
 	mosq->last_msg_in = time(NULL);
 	mosq->last_msg_out = time(NULL);
 	mosq->ping_t = 0;
@@ -318,8 +322,11 @@ void _mosquitto_destroy(struct mosquitto *mosq)
 		}
 
 		_mosquitto_packet_cleanup(packet);
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 	}
+	mosq->out_packet_last = NULL;
+	mosq->out_packet_count = 0;
+	mosq->out_packet_bytes = 0;
 
 	_mosquitto_packet_cleanup(&mosq->in_packet);
 }
@@ -345,15 +352,39 @@ int mosquitto_connect(struct mosquitto *mosq, const char *host, int port, int ke
 	return mosquitto_reconnect(mosq);
 }
 
+int mosquitto_connect_shm(struct mosquitto *mosq, const char *path, int keepalive)
+{
+#ifdef WITH_SHM
+	int rc;
+
+	if(!path || !_mosquitto_socket_is_unix(path)) return MOSQ_ERR_INVAL;
+	rc = mosquitto_connect_async(mosq, path, 0, keepalive);
+	if(rc) return rc;
+	mosq->shm_transport = true;
+
+	return mosquitto_reconnect(mosq);
+#else
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+}
+
 int mosquitto_connect_async(struct mosquitto *mosq, const char *host, int port, int keepalive)
 {
 	if(!mosq) return MOSQ_ERR_INVAL;
-	if(!host || port <= 0) return MOSQ_ERR_INVAL;
+	if(!host) return MOSQ_ERR_INVAL;
+#ifndef WIN32
+	if(port <= 0 && !_mosquitto_socket_is_unix(host)) return MOSQ_ERR_INVAL;
+#else
+	if(port <= 0) return MOSQ_ERR_INVAL;
+#endif
 
 	if(mosq->host) _mosquitto_free(mosq->host);
 	mosq->host = _mosquitto_strdup(host);
 	if(!mosq->host) return MOSQ_ERR_NOMEM;
 	mosq->port = port;
+#ifdef WITH_SHM
+	mosq->shm_transport = false;
+#endif
 
 	mosq->keepalive = keepalive;
 	pthread_mutex_lock(&mosq->state_mutex);
@@ -368,7 +399,12 @@ int mosquitto_reconnect(struct mosquitto *mosq)
 	int rc;
 	struct _mosquitto_packet *packet;
 	if(!mosq) return MOSQ_ERR_INVAL;
-	if(!mosq->host || mosq->port <= 0) return MOSQ_ERR_INVAL;
+	if(!mosq->host) return MOSQ_ERR_INVAL;
+#ifndef WIN32
+	if(mosq->port <= 0 && !_mosquitto_socket_is_unix(mosq->host)) return MOSQ_ERR_INVAL;
+#else
+	if(mosq->port <= 0) return MOSQ_ERR_INVAL;
+#endif
 
 	pthread_mutex_lock(&mosq->state_mutex);
 	mosq->state = mosq_cs_new;
@@ -400,14 +436,25 @@ int mosquitto_reconnect(struct mosquitto *mosq)
 		}
 
 		_mosquitto_packet_cleanup(packet);
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 	}
+	mosq->out_packet_last = NULL;
+	mosq->out_packet_count = 0;
+	mosq->out_packet_bytes = 0;
 	pthread_mutex_unlock(&mosq->out_packet_mutex);
 	pthread_mutex_unlock(&mosq->current_out_packet_mutex);
 
 	_mosquitto_messages_reconnect_reset(mosq);
 
+#ifdef WITH_SHM
+	if(mosq->shm_transport){
+		rc = _mosquitto_shm_connect(mosq, mosq->host);
+	}else{
+		rc = _mosquitto_socket_connect(mosq, mosq->host, mosq->port);
+	}
+#else
 	rc = _mosquitto_socket_connect(mosq, mosq->host, mosq->port);
+#endif
 	if(rc){
 		return rc;
 	}
@@ -676,12 +723,28 @@ int mosquitto_loop(struct mosquitto *mosq, int timeout, int max_packets)
 	if(!mosq || max_packets < 1) return MOSQ_ERR_INVAL;
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
 
+#ifdef WITH_SHM
+	if(mosq->shm && (mosq->out_packet || mosq->current_out_packet)){
+		/* The eventfd is always writable as far as select() is concerned, so
+		 * write now instead. If the ring fills up, the broker wakes us when
+		 * it has made room. */
+		rc = mosquitto_loop_write(mosq, max_packets);
+		if(rc || mosq->sock == INVALID_SOCKET){
+			return rc;
+		}
+	}
+#endif
+
 	FD_ZERO(&readfds);
 	FD_SET(mosq->sock, &readfds);
 	FD_ZERO(&writefds);
 	pthread_mutex_lock(&mosq->out_packet_mutex);
 	if(mosq->out_packet || mosq->current_out_packet){
+#ifdef WITH_SHM
+		if(!mosq->shm) FD_SET(mosq->sock, &writefds);
+#else
 		FD_SET(mosq->sock, &writefds);
+#endif
 #ifdef WITH_TLS
 	}else if(mosq->ssl && mosq->want_write){
 		FD_SET(mosq->sock, &writefds);
@@ -831,6 +894,9 @@ int mosquitto_loop_read(struct mosquitto *mosq, int max_packets)
 	int i;
 	if(max_packets < 1) return MOSQ_ERR_INVAL;
 
+#ifdef WITH_SHM
+	if(mosq->shm) _mosquitto_shm_wake_clear(mosq);
+#endif
 	max_packets = mosq->queue_len;
 	if(max_packets < 1) max_packets = 1;
 	/* Queue len here tells us how many messages are awaiting processing and
@@ -839,9 +905,15 @@ int mosquitto_loop_read(struct mosquitto *mosq, int max_packets)
 	for(i=0; i<max_packets; i++){
 		rc = _mosquitto_packet_read(mosq);
 		if(rc || errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
+#ifdef WITH_SHM
+			if(!rc && mosq->shm) _mosquitto_shm_rearm(mosq);
+#endif
 			return _mosquitto_loop_rc_handle(mosq, rc);
 		}
 	}
+#ifdef WITH_SHM
+	if(mosq->shm) _mosquitto_shm_rearm(mosq);
+#endif
 	return rc;
 }
 
@@ -867,7 +939,7 @@ int mosquitto_loop_write(struct mosquitto *mosq, int max_packets)
 
 bool mosquitto_want_write(struct mosquitto *mosq)
 {
-	if(mosq->out_packet){
+	if(mosq->out_packet_count){
 		return true;
 	}else{
 		return false;
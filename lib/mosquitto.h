@@ -322,8 +322,11 @@ libmosq_EXPORT int mosquitto_username_pw_set(struct mosquitto *mosq, const char
  *
  * Parameters:
  * 	mosq -      a valid mosquitto instance.
- * 	host -      the hostname or ip address of the broker to connect to.
- * 	port -      the network port to connect to. Usually 1883.
+ * 	host -      the hostname or ip address of the broker to connect to, or
+ * 	            the path of a unix domain socket starting with "/" ("@" for
+ * 	            the Linux abstract namespace).
+ * 	port -      the network port to connect to. Usually 1883. Ignored for
+ * 	            unix domain sockets.
  * 	keepalive - the number of seconds after which the broker should send a PING
  *              message to the client if no other messages have been exchanged
  *              in that time.
@@ -341,6 +344,46 @@ libmosq_EXPORT int mosquitto_username_pw_set(struct mosquitto *mosq, const char
  */
 libmosq_EXPORT int mosquitto_connect(struct mosquitto *mosq, const char *host, int port, int keepalive);
 
+/*
+ * Function: mosquitto_connect_shm
+ *
+ * Connect to a broker on the same host using shared memory. The broker must
+ * have a unix domain socket listener with shm_transport enabled. The socket
+ * is only used to hand the broker a block of shared memory and a pair of
+ * eventfds, after which packets go through a ring in each direction and no
+ * system calls are needed while both sides are busy. Only available on
+ * Linux.
+ *
+ * The client must use <mosquitto_loop>, <mosquitto_loop_forever> or
+ * <mosquitto_loop_start>. The descriptor returned by <mosquitto_socket> is
+ * an eventfd that becomes readable when there is work to do, it is never
+ * necessary to wait for it to become writable.
+ *
+ * A broker that goes away without closing the connection is noticed through
+ * the keepalive, as with a network connection that fails silently.
+ *
+ * Parameters:
+ * 	mosq -      a valid mosquitto instance.
+ * 	path -      the path of the unix domain socket listener, starting with
+ * 	            "/", or "@" for the Linux abstract namespace.
+ * 	keepalive - the number of seconds after which the broker should send a PING
+ *              message to the client if no other messages have been exchanged
+ *              in that time.
+ *
+ * Returns:
+ * 	MOSQ_ERR_SUCCESS -       on success.
+ * 	MOSQ_ERR_INVAL -         if the input parameters were invalid.
+ * 	MOSQ_ERR_NOMEM -         if an out of memory condition occurred.
+ * 	MOSQ_ERR_CONN_REFUSED -  if the broker would not accept the shared memory.
+ * 	MOSQ_ERR_ERRNO -         if a system call returned an error. The variable
+ * 	                         errno contains the error code.
+ * 	MOSQ_ERR_NOT_SUPPORTED - if shared memory support is not available.
+ *
+ * See Also:
+ * 	<mosquitto_connect>, <mosquitto_reconnect>, <mosquitto_disconnect>
+ */
+libmosq_EXPORT int mosquitto_connect_shm(struct mosquitto *mosq, const char *path, int keepalive);
+
 /*
  * Function: mosquitto_connect_async
  *
@@ -353,8 +396,11 @@ libmosq_EXPORT int mosquitto_connect(struct mosquitto *mosq, const char *host, i
  *
  * Parameters:
  * 	mosq -      a valid mosquitto instance.
- * 	host -      the hostname or ip address of the broker to connect to.
- * 	port -      the network port to connect to. Usually 1883.
+ * 	host -      the hostname or ip address of the broker to connect to, or
+ * 	            the path of a unix domain socket starting with "/" ("@" for
+ * 	            the Linux abstract namespace).
+ * 	port -      the network port to connect to. Usually 1883. Ignored for
+ * 	            unix domain sockets.
  * 	keepalive - the number of seconds after which the broker should send a PING
  *              message to the client if no other messages have been exchanged
  *              in that time.
@@ -63,6 +63,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <mosquitto.h>
 #ifdef WITH_BROKER
+#  include <uthash.h>
 struct mosquitto_client_msg;
 #endif
 
@@ -83,9 +84,14 @@ enum mosquitto_client_state {
 	mosq_cs_new = 0,
 	mosq_cs_connected = 1,
 	mosq_cs_disconnecting = 2,
-	mosq_cs_connect_async = 3
+	mosq_cs_connect_async = 3,
+	mosq_cs_authenticating = 4
 };
 
+/* Packets up to this length, which covers all of the acks, PINGREQ, PINGRESP
+ * and DISCONNECT, are built in payload_inline rather than on the heap. */
+#define MOSQ_PACKET_INLINE_SIZE 8
+
 struct _mosquitto_packet{
 	uint8_t command;
 	uint8_t have_remaining;
@@ -96,8 +102,10 @@ struct _mosquitto_packet{
 	uint32_t packet_length;
 	uint32_t to_process;
 	uint32_t pos;
-	uint8_t *payload;
+	uint32_t payload_size; /* Allocated length of payload, in_packet only. */
+	uint8_t *payload; /* May point at payload_inline. */
 	struct _mosquitto_packet *next;
+	uint8_t payload_inline[MOSQ_PACKET_INLINE_SIZE];
 };
 
 struct mosquitto_message_all{
@@ -129,6 +137,9 @@ struct mosquitto {
 	struct _mosquitto_packet in_packet;
 	struct _mosquitto_packet *current_out_packet;
 	struct _mosquitto_packet *out_packet;
+	struct _mosquitto_packet *out_packet_last;
+	uint32_t out_packet_count; /* Packets in out_packet and current_out_packet. */
+	uint32_t out_packet_bytes; /* Length of those packets. */
 	struct mosquitto_message *will;
 #ifdef WITH_TLS
 	SSL *ssl;
@@ -146,6 +157,9 @@ struct mosquitto {
 #endif
 	bool want_read;
 	bool want_write;
+#ifdef WITH_SHM
+	struct _mosquitto_shm *shm; /* Set if sock is the eventfd of a shared memory connection. */
+#endif
 #if defined(WITH_THREADING) && !defined(WITH_BROKER)
 	pthread_mutex_t callback_mutex;
 	pthread_mutex_t log_callback_mutex;
@@ -160,9 +174,20 @@ struct mosquitto {
 	struct _mqtt3_bridge *bridge;
 	struct mosquitto_client_msg *msgs;
 	struct _mosquitto_acl_user *acl_list;
+	struct _mosquitto_acl_cache *acl_cache;
+	int acl_cache_size;
+	struct _mosquitto_auth_request *auth_request;
 	struct _mqtt3_listener *listener;
+	UT_hash_handle hh_id; /* In db->contexts_by_id, keyed on id. */
+	int db_index; /* Slot in db->contexts or db->offline_contexts, or -1. */
+	bool offline; /* In db->offline_contexts rather than db->contexts. */
+	bool connect_pending; /* In listener->pending_count until CONNECT is done. */
 	time_t disconnect_t;
 	int pollfd_index;
+	time_t slow_t; /* When out_packet_bytes first reached max_output_bytes, or 0. */
+	bool ready; /* On the list of contexts that may have messages to write. */
+	struct mosquitto *ready_prev;
+	struct mosquitto *ready_next;
 #else
 	void *userdata;
 	bool in_callback;
@@ -180,6 +205,9 @@ struct mosquitto {
 	char *host;
 	int port;
 	int queue_len;
+#ifdef WITH_SHM
+	bool shm_transport; /* Connect with mosquitto_connect_shm() semantics. */
+#endif
 #endif
 };
 
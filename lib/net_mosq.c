@@ -30,6 +30,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #ifndef WIN32
@@ -77,12 +78,21 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <memory_mosq.h>
 #include <mqtt3_protocol.h>
 #include <net_mosq.h>
+#include <shm_mosq.h>
 #include <util_mosq.h>
 
 #ifdef WITH_TLS
 static int tls_ex_index_mosq = -1;
 #endif
 
+/* Freed packets, linked through next, kept so that sending acks and pings
+ * doesn't need the heap. */
+static struct _mosquitto_packet *packet_pool = NULL;
+static int packet_pool_count = 0;
+#if defined(WITH_THREADING) && !defined(WITH_BROKER)
+static pthread_mutex_t packet_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 void _mosquitto_net_init(void)
 {
 #ifdef WIN32
@@ -102,6 +112,17 @@ void _mosquitto_net_init(void)
 
 void _mosquitto_net_cleanup(void)
 {
+	struct _mosquitto_packet *packet;
+
+	pthread_mutex_lock(&packet_pool_mutex);
+	while(packet_pool){
+		packet = packet_pool;
+		packet_pool = packet_pool->next;
+		_mosquitto_free(packet);
+	}
+	packet_pool_count = 0;
+	pthread_mutex_unlock(&packet_pool_mutex);
+
 #ifdef WITH_TLS
 	ERR_free_strings();
 	EVP_cleanup();
@@ -112,6 +133,45 @@ void _mosquitto_net_cleanup(void)
 #endif
 }
 
+/* Get a zeroed packet, from the pool if possible. */
+struct _mosquitto_packet *_mosquitto_packet_new(void)
+{
+	struct _mosquitto_packet *packet;
+
+	pthread_mutex_lock(&packet_pool_mutex);
+	packet = packet_pool;
+	if(packet){
+		packet_pool = packet->next;
+		packet_pool_count--;
+	}
+	pthread_mutex_unlock(&packet_pool_mutex);
+
+	if(packet){
+		memset(packet, 0, sizeof(struct _mosquitto_packet));
+	}else{
+		packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	}
+	return packet;
+}
+
+/* Return a packet from _mosquitto_packet_new() to the pool. The payload must
+ * already have been freed with _mosquitto_packet_cleanup(). */
+void _mosquitto_packet_free(struct _mosquitto_packet *packet)
+{
+	if(!packet) return;
+
+	pthread_mutex_lock(&packet_pool_mutex);
+	if(packet_pool_count < MOSQ_PACKET_POOL_MAX){
+		packet->next = packet_pool;
+		packet_pool = packet;
+		packet_pool_count++;
+		packet = NULL;
+	}
+	pthread_mutex_unlock(&packet_pool_mutex);
+
+	if(packet) _mosquitto_free(packet);
+}
+
 void _mosquitto_packet_cleanup(struct _mosquitto_packet *packet)
 {
 	if(!packet) return;
@@ -122,16 +182,30 @@ void _mosquitto_packet_cleanup(struct _mosquitto_packet *packet)
 	packet->remaining_count = 0;
 	packet->remaining_mult = 1;
 	packet->remaining_length = 0;
-	if(packet->payload) _mosquitto_free(packet->payload);
+	if(packet->payload && packet->payload != packet->payload_inline) _mosquitto_free(packet->payload);
 	packet->payload = NULL;
+	packet->payload_size = 0;
 	packet->to_process = 0;
 	packet->pos = 0;
 }
 
-int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *packet)
+/* Reset values ready for the next incoming packet, but keep the payload
+ * buffer so it can be used again. */
+void _mosquitto_packet_reuse(struct _mosquitto_packet *packet)
 {
-	struct _mosquitto_packet *tail;
+	if(!packet) return;
+
+	packet->command = 0;
+	packet->have_remaining = 0;
+	packet->remaining_count = 0;
+	packet->remaining_mult = 1;
+	packet->remaining_length = 0;
+	packet->to_process = 0;
+	packet->pos = 0;
+}
 
+int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *packet)
+{
 	assert(mosq);
 	assert(packet);
 
@@ -141,14 +215,13 @@ int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *pa
 	packet->next = NULL;
 	pthread_mutex_lock(&mosq->out_packet_mutex);
 	if(mosq->out_packet){
-		tail = mosq->out_packet;
-		while(tail->next){
-			tail = tail->next;
-		}
-		tail->next = packet;
+		mosq->out_packet_last->next = packet;
 	}else{
 		mosq->out_packet = packet;
 	}
+	mosq->out_packet_last = packet;
+	mosq->out_packet_count++;
+	mosq->out_packet_bytes += packet->packet_length;
 	pthread_mutex_unlock(&mosq->out_packet_mutex);
 #ifdef WITH_BROKER
 	return _mosquitto_packet_write(mosq);
@@ -182,6 +255,10 @@ int _mosquitto_socket_close(struct mosquitto *mosq)
 	}
 #endif
 
+#ifdef WITH_SHM
+	_mosquitto_shm_close(mosq);
+#endif
+
 	if(mosq->sock != INVALID_SOCKET){
 		rc = COMPAT_CLOSE(mosq->sock);
 		mosq->sock = INVALID_SOCKET;
@@ -209,28 +286,63 @@ static unsigned int psk_client_callback(SSL *ssl, const char *hint,
 }
 #endif
 
-/* Create a socket and connect it to 'ip' on port 'port'.
- * Returns -1 on failure (ip is NULL, socket creation/connection error)
- * Returns sock number on success.
- */
-int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t port)
-{
-	int sock = INVALID_SOCKET;
 #ifndef WIN32
-	int opt;
+/* Hosts starting with '/' are unix domain socket paths, hosts starting with
+ * '@' are names in the Linux abstract socket namespace. */
+bool _mosquitto_socket_is_unix(const char *host)
+{
+	return host && (host[0] == '/' || host[0] == '@');
+}
+
+/* Fill in addr for a unix domain socket path, as used by
+ * _mosquitto_socket_is_unix(). */
+int _mosquitto_socket_unix_addr(const char *path, struct sockaddr_un *addr, socklen_t *addrlen)
+{
+	size_t len;
+
+	len = strlen(path);
+	if(len < 2 || len >= sizeof(addr->sun_path)) return MOSQ_ERR_INVAL;
+
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, path, len);
+	if(path[0] == '@'){
+		/* Abstract names aren't NULL terminated and start with a NULL. */
+		addr->sun_path[0] = '\0';
+		*addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+	}else{
+		*addrlen = sizeof(struct sockaddr_un);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _mosquitto_socket_connect_unix(const char *host, int *sock)
+{
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+
+	if(_mosquitto_socket_unix_addr(host, &addr, &addrlen)) return MOSQ_ERR_INVAL;
+
+	*sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(*sock == INVALID_SOCKET) return MOSQ_ERR_ERRNO;
+
+	if(connect(*sock, (struct sockaddr *)&addr, addrlen) == -1){
+		COMPAT_CLOSE(*sock);
+		*sock = INVALID_SOCKET;
+		return MOSQ_ERR_ERRNO;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
 #endif
+
+static int _mosquitto_socket_connect_tcp(const char *host, uint16_t port, int *sock)
+{
 	struct addrinfo hints;
 	struct addrinfo *ainfo, *rp;
 	int s;
-#ifdef WIN32
-	uint32_t val = 1;
-#endif
-#ifdef WITH_TLS
-	int ret;
-	BIO *bio;
-#endif
 
-	if(!mosq || !host || !port) return MOSQ_ERR_INVAL;
+	*sock = INVALID_SOCKET;
+	if(!port) return MOSQ_ERR_INVAL;
 
 	memset(&hints, 0, sizeof(struct addrinfo));
 	hints.ai_family = PF_UNSPEC;
@@ -241,8 +353,8 @@ int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t
 	if(s) return MOSQ_ERR_UNKNOWN;
 
 	for(rp = ainfo; rp != NULL; rp = rp->ai_next){
-		sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-		if(sock == INVALID_SOCKET) continue;
+		*sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if(*sock == INVALID_SOCKET) continue;
 		
 		if(rp->ai_family == PF_INET){
 			((struct sockaddr_in *)rp->ai_addr)->sin_port = htons(port);
@@ -251,19 +363,56 @@ int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t
 		}else{
 			continue;
 		}
-		if(connect(sock, rp->ai_addr, rp->ai_addrlen) != -1){
+		if(connect(*sock, rp->ai_addr, rp->ai_addrlen) != -1){
 			break;
 		}
 
 #ifdef WIN32
 		errno = WSAGetLastError();
 #endif
-		COMPAT_CLOSE(sock);
+		COMPAT_CLOSE(*sock);
 	}
 	freeaddrinfo(ainfo);
 	if(!rp){
+		*sock = INVALID_SOCKET;
 		return MOSQ_ERR_ERRNO;
 	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Create a socket and connect it to 'ip' on port 'port', or to the unix
+ * domain socket 'ip' if it starts with '/' or '@', in which case port is
+ * ignored.
+ * Returns -1 on failure (ip is NULL, socket creation/connection error)
+ * Returns sock number on success.
+ */
+int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t port)
+{
+	int sock = INVALID_SOCKET;
+#ifndef WIN32
+	int opt;
+#endif
+	int rc;
+#ifdef WIN32
+	uint32_t val = 1;
+#endif
+#ifdef WITH_TLS
+	int ret;
+	BIO *bio;
+#endif
+
+	if(!mosq || !host) return MOSQ_ERR_INVAL;
+
+#ifndef WIN32
+	if(_mosquitto_socket_is_unix(host)){
+		rc = _mosquitto_socket_connect_unix(host, &sock);
+	}else{
+		rc = _mosquitto_socket_connect_tcp(host, port, &sock);
+	}
+#else
+	rc = _mosquitto_socket_connect_tcp(host, port, &sock);
+#endif
+	if(rc) return rc;
 
 	/* Set non-blocking */
 #ifndef WIN32
@@ -538,6 +687,11 @@ ssize_t _mosquitto_net_read(struct mosquitto *mosq, void *buf, size_t count)
 #endif
 	assert(mosq);
 	errno = 0;
+#ifdef WITH_SHM
+	if(mosq->shm){
+		return _mosquitto_shm_read(mosq, buf, count);
+	}
+#endif
 #ifdef WITH_TLS
 	if(mosq->ssl){
 		ret = SSL_read(mosq->ssl, buf, count);
@@ -588,6 +742,11 @@ ssize_t _mosquitto_net_write(struct mosquitto *mosq, void *buf, size_t count)
 	assert(mosq);
 
 	errno = 0;
+#ifdef WITH_SHM
+	if(mosq->shm){
+		return _mosquitto_shm_write(mosq, buf, count);
+	}
+#endif
 #ifdef WITH_TLS
 	if(mosq->ssl){
 		ret = SSL_write(mosq->ssl, buf, count);
@@ -639,6 +798,9 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 	if(mosq->out_packet && !mosq->current_out_packet){
 		mosq->current_out_packet = mosq->out_packet;
 		mosq->out_packet = mosq->out_packet->next;
+		if(!mosq->out_packet){
+			mosq->out_packet_last = NULL;
+		}
 	}
 	pthread_mutex_unlock(&mosq->out_packet_mutex);
 
@@ -695,11 +857,16 @@ int _mosquitto_packet_write(struct mosquitto *mosq)
 		mosq->current_out_packet = mosq->out_packet;
 		if(mosq->out_packet){
 			mosq->out_packet = mosq->out_packet->next;
+			if(!mosq->out_packet){
+				mosq->out_packet_last = NULL;
+			}
 		}
+		mosq->out_packet_count--;
+		mosq->out_packet_bytes -= packet->packet_length;
 		pthread_mutex_unlock(&mosq->out_packet_mutex);
 
 		_mosquitto_packet_cleanup(packet);
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 
 		pthread_mutex_lock(&mosq->msgtime_mutex);
 		mosq->last_msg_out = time(NULL);
@@ -717,6 +884,7 @@ int _mosquitto_packet_read(struct mosquitto *mosq)
 {
 	uint8_t byte;
 	ssize_t read_length;
+	uint32_t size;
 	int rc = 0;
 
 	if(!mosq) return MOSQ_ERR_INVAL;
@@ -733,7 +901,8 @@ int _mosquitto_packet_read(struct mosquitto *mosq)
 	 * combined variable header and actual payload. This is the most likely to
 	 * fail due to longer length, so save current data and current position.
 	 * After all data is read, send to _mosquitto_handle_packet() to deal with.
-	 * Finally, free the memory and reset everything to starting conditions.
+	 * Finally, reset everything to starting conditions, keeping the payload
+	 * buffer for the next packet.
 	 */
 	if(!mosq->in_packet.command){
 		read_length = _mosquitto_net_read(mosq, &byte, 1);
@@ -799,8 +968,20 @@ int _mosquitto_packet_read(struct mosquitto *mosq)
 		}while((byte & 128) != 0);
 
 		if(mosq->in_packet.remaining_length > 0){
-			mosq->in_packet.payload = _mosquitto_malloc(mosq->in_packet.remaining_length*sizeof(uint8_t));
-			if(!mosq->in_packet.payload) return MOSQ_ERR_NOMEM;
+			if(mosq->in_packet.remaining_length > mosq->in_packet.payload_size){
+				/* Grow geometrically so a client sending steadily larger
+				 * packets doesn't cause an allocation for each one. */
+				size = mosq->in_packet.payload_size*2;
+				if(size < mosq->in_packet.remaining_length) size = mosq->in_packet.remaining_length;
+				if(size < 64) size = 64;
+				if(mosq->in_packet.payload) _mosquitto_free(mosq->in_packet.payload);
+				mosq->in_packet.payload = _mosquitto_malloc(size*sizeof(uint8_t));
+				if(!mosq->in_packet.payload){
+					mosq->in_packet.payload_size = 0;
+					return MOSQ_ERR_NOMEM;
+				}
+				mosq->in_packet.payload_size = size;
+			}
 			mosq->in_packet.to_process = mosq->in_packet.remaining_length;
 		}
 		mosq->in_packet.have_remaining = 1;
@@ -842,8 +1023,8 @@ int _mosquitto_packet_read(struct mosquitto *mosq)
 	rc = _mosquitto_packet_handle(mosq);
 #endif
 
-	/* Free data and reset values */
-	_mosquitto_packet_cleanup(&mosq->in_packet);
+	/* Reset values, keeping the buffer for the next packet. */
+	_mosquitto_packet_reuse(&mosq->in_packet);
 
 	pthread_mutex_lock(&mosq->msgtime_mutex);
 	mosq->last_msg_in = time(NULL);
@@ -30,6 +30,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #define _NET_MOSQ_H_
 
 #ifndef WIN32
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #else
 #include <winsock2.h>
@@ -69,9 +72,19 @@ struct mosquitto_db;
 void _mosquitto_net_init(void);
 void _mosquitto_net_cleanup(void);
 
+/* Maximum number of freed packets kept for reuse. */
+#define MOSQ_PACKET_POOL_MAX 1024
+
+struct _mosquitto_packet *_mosquitto_packet_new(void);
+void _mosquitto_packet_free(struct _mosquitto_packet *packet);
 void _mosquitto_packet_cleanup(struct _mosquitto_packet *packet);
+void _mosquitto_packet_reuse(struct _mosquitto_packet *packet);
 int _mosquitto_packet_queue(struct mosquitto *mosq, struct _mosquitto_packet *packet);
 int _mosquitto_socket_connect(struct mosquitto *mosq, const char *host, uint16_t port);
+#ifndef WIN32
+bool _mosquitto_socket_is_unix(const char *host);
+int _mosquitto_socket_unix_addr(const char *path, struct sockaddr_un *addr, socklen_t *addrlen);
+#endif
 int _mosquitto_socket_close(struct mosquitto *mosq);
 
 int _mosquitto_read_byte(struct _mosquitto_packet *packet, uint8_t *byte);
@@ -125,7 +125,7 @@ int _mosquitto_handle_publish(struct mosquitto *mosq)
 			return rc;
 		}
 	}
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG,
+	_mosquitto_log_debug(mosq,
 			"Client %s received PUBLISH (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))",
 			mosq->id, message->dup, message->msg.qos, message->msg.retain,
 			message->msg.mid, message->msg.topic,
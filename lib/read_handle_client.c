@@ -47,7 +47,7 @@ int _mosquitto_handle_connack(struct mosquitto *mosq)
 		return MOSQ_ERR_PROTOCOL;
 	}
 #endif
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s received CONNACK", mosq->id);
+	_mosquitto_log_debug(mosq, "Client %s received CONNACK", mosq->id);
 	rc = _mosquitto_read_byte(&mosq->in_packet, &byte); // Reserved byte, not used
 	if(rc) return rc;
 	rc = _mosquitto_read_byte(&mosq->in_packet, &result);
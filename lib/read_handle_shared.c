@@ -53,9 +53,9 @@ int _mosquitto_handle_pingreq(struct mosquitto *mosq)
 	}
 #endif
 #ifdef WITH_BROKER
-	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received PINGREQ from %s", mosq->id);
+	_mosquitto_log_debug(NULL, "Received PINGREQ from %s", mosq->id);
 #else
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s received PINGREQ", mosq->id);
+	_mosquitto_log_debug(mosq, "Client %s received PINGREQ", mosq->id);
 #endif
 	return _mosquitto_send_pingresp(mosq);
 }
@@ -70,9 +70,9 @@ int _mosquitto_handle_pingresp(struct mosquitto *mosq)
 #endif
 	mosq->ping_t = 0; /* No longer waiting for a PINGRESP. */
 #ifdef WITH_BROKER
-	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received PINGRESP from %s", mosq->id);
+	_mosquitto_log_debug(NULL, "Received PINGRESP from %s", mosq->id);
 #else
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s received PINGRESP", mosq->id);
+	_mosquitto_log_debug(mosq, "Client %s received PINGRESP", mosq->id);
 #endif
 	return MOSQ_ERR_SUCCESS;
 }
@@ -91,14 +91,14 @@ int _mosquitto_handle_pubackcomp(struct mosquitto *mosq, const char *type)
 	rc = _mosquitto_read_uint16(&mosq->in_packet, &mid);
 	if(rc) return rc;
 #ifdef WITH_BROKER
-	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received %s from %s (Mid: %d)", type, mosq->id, mid);
+	_mosquitto_log_debug(NULL, "Received %s from %s (Mid: %d)", type, mosq->id, mid);
 
 	if(mid){
 		rc = mqtt3_db_message_delete(mosq, mid, mosq_md_out);
 		if(rc) return rc;
 	}
 #else
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s received %s (Mid: %d)", mosq->id, type, mid);
+	_mosquitto_log_debug(mosq, "Client %s received %s (Mid: %d)", mosq->id, type, mid);
 
 	if(!_mosquitto_message_delete(mosq, mid, mosq_md_out)){
 		/* Only inform the client the message has been sent once. */
@@ -129,11 +129,11 @@ int _mosquitto_handle_pubrec(struct mosquitto *mosq)
 	rc = _mosquitto_read_uint16(&mosq->in_packet, &mid);
 	if(rc) return rc;
 #ifdef WITH_BROKER
-	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received PUBREC from %s (Mid: %d)", mosq->id, mid);
+	_mosquitto_log_debug(NULL, "Received PUBREC from %s (Mid: %d)", mosq->id, mid);
 
 	rc = mqtt3_db_message_update(mosq, mid, mosq_md_out, ms_wait_for_pubcomp);
 #else
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s received PUBREC (Mid: %d)", mosq->id, mid);
+	_mosquitto_log_debug(mosq, "Client %s received PUBREC (Mid: %d)", mosq->id, mid);
 
 	rc = _mosquitto_message_update(mosq, mid, mosq_md_out, mosq_ms_wait_pubcomp);
 #endif
@@ -161,14 +161,14 @@ int _mosquitto_handle_pubrel(struct mosquitto_db *db, struct mosquitto *mosq)
 	rc = _mosquitto_read_uint16(&mosq->in_packet, &mid);
 	if(rc) return rc;
 #ifdef WITH_BROKER
-	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received PUBREL from %s (Mid: %d)", mosq->id, mid);
+	_mosquitto_log_debug(NULL, "Received PUBREL from %s (Mid: %d)", mosq->id, mid);
 
 	if(mqtt3_db_message_release(db, mosq, mid, mosq_md_in)){
 		/* Message not found. */
 		return MOSQ_ERR_SUCCESS;
 	}
 #else
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s received PUBREL (Mid: %d)", mosq->id, mid);
+	_mosquitto_log_debug(mosq, "Client %s received PUBREL (Mid: %d)", mosq->id, mid);
 
 	if(!_mosquitto_message_remove(mosq, mid, mosq_md_in, &message)){
 		/* Only pass the message on if we have removed it from the queue - this
@@ -200,9 +200,9 @@ int _mosquitto_handle_suback(struct mosquitto *mosq)
 
 	assert(mosq);
 #ifdef WITH_BROKER
-	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received SUBACK from %s", mosq->id);
+	_mosquitto_log_debug(NULL, "Received SUBACK from %s", mosq->id);
 #else
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s received SUBACK", mosq->id);
+	_mosquitto_log_debug(mosq, "Client %s received SUBACK", mosq->id);
 #endif
 	rc = _mosquitto_read_uint16(&mosq->in_packet, &mid);
 	if(rc) return rc;
@@ -245,9 +245,9 @@ int _mosquitto_handle_unsuback(struct mosquitto *mosq)
 	}
 #endif
 #ifdef WITH_BROKER
-	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received UNSUBACK from %s", mosq->id);
+	_mosquitto_log_debug(NULL, "Received UNSUBACK from %s", mosq->id);
 #else
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s received UNSUBACK", mosq->id);
+	_mosquitto_log_debug(mosq, "Client %s received UNSUBACK", mosq->id);
 #endif
 	rc = _mosquitto_read_uint16(&mosq->in_packet, &mid);
 	if(rc) return rc;
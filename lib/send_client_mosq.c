@@ -54,7 +54,7 @@ int _mosquitto_send_connect(struct mosquitto *mosq, uint16_t keepalive, bool cle
 	assert(mosq);
 	assert(mosq->id);
 
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_packet_new();
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	payloadlen = 2+strlen(mosq->id);
@@ -75,7 +75,7 @@ int _mosquitto_send_connect(struct mosquitto *mosq, uint16_t keepalive, bool cle
 	packet->remaining_length = 12+payloadlen;
 	rc = _mosquitto_packet_alloc(packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 		return rc;
 	}
 
@@ -117,10 +117,10 @@ int _mosquitto_send_connect(struct mosquitto *mosq, uint16_t keepalive, bool cle
 	mosq->keepalive = keepalive;
 #ifdef WITH_BROKER
 # ifdef WITH_BRIDGE
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Bridge %s sending CONNECT", mosq->id);
+	_mosquitto_log_debug(mosq, "Bridge %s sending CONNECT", mosq->id);
 # endif
 #else
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending CONNECT", mosq->id);
+	_mosquitto_log_debug(mosq, "Client %s sending CONNECT", mosq->id);
 #endif
 	return _mosquitto_packet_queue(mosq, packet);
 }
@@ -130,10 +130,10 @@ int _mosquitto_send_disconnect(struct mosquitto *mosq)
 	assert(mosq);
 #ifdef WITH_BROKER
 # ifdef WITH_BRIDGE
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Bridge %s sending DISCONNECT", mosq->id);
+	_mosquitto_log_debug(mosq, "Bridge %s sending DISCONNECT", mosq->id);
 # endif
 #else
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending DISCONNECT", mosq->id);
+	_mosquitto_log_debug(mosq, "Client %s sending DISCONNECT", mosq->id);
 #endif
 	return _mosquitto_send_simple_command(mosq, DISCONNECT);
 }
@@ -149,7 +149,7 @@ int _mosquitto_send_subscribe(struct mosquitto *mosq, int *mid, bool dup, const
 	assert(mosq);
 	assert(topic);
 
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_packet_new();
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packetlen = 2 + 2+strlen(topic) + 1;
@@ -158,7 +158,7 @@ int _mosquitto_send_subscribe(struct mosquitto *mosq, int *mid, bool dup, const
 	packet->remaining_length = packetlen;
 	rc = _mosquitto_packet_alloc(packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 		return rc;
 	}
 
@@ -173,10 +173,10 @@ int _mosquitto_send_subscribe(struct mosquitto *mosq, int *mid, bool dup, const
 
 #ifdef WITH_BROKER
 # ifdef WITH_BRIDGE
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Bridge %s sending SUBSCRIBE (Mid: %d, Topic: %s, QoS: %d)", mosq->id, local_mid, topic, topic_qos);
+	_mosquitto_log_debug(mosq, "Bridge %s sending SUBSCRIBE (Mid: %d, Topic: %s, QoS: %d)", mosq->id, local_mid, topic, topic_qos);
 # endif
 #else
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending SUBSCRIBE (Mid: %d, Topic: %s, QoS: %d)", mosq->id, local_mid, topic, topic_qos);
+	_mosquitto_log_debug(mosq, "Client %s sending SUBSCRIBE (Mid: %d, Topic: %s, QoS: %d)", mosq->id, local_mid, topic, topic_qos);
 #endif
 
 	return _mosquitto_packet_queue(mosq, packet);
@@ -194,7 +194,7 @@ int _mosquitto_send_unsubscribe(struct mosquitto *mosq, int *mid, bool dup, cons
 	assert(mosq);
 	assert(topic);
 
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_packet_new();
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packetlen = 2 + 2+strlen(topic);
@@ -203,7 +203,7 @@ int _mosquitto_send_unsubscribe(struct mosquitto *mosq, int *mid, bool dup, cons
 	packet->remaining_length = packetlen;
 	rc = _mosquitto_packet_alloc(packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 		return rc;
 	}
 
@@ -217,10 +217,10 @@ int _mosquitto_send_unsubscribe(struct mosquitto *mosq, int *mid, bool dup, cons
 
 #ifdef WITH_BROKER
 # ifdef WITH_BRIDGE
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Bridge %s sending UNSUBSCRIBE (Mid: %d, Topic: %s)", mosq->id, local_mid, topic);
+	_mosquitto_log_debug(mosq, "Bridge %s sending UNSUBSCRIBE (Mid: %d, Topic: %s)", mosq->id, local_mid, topic);
 # endif
 #else
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending UNSUBSCRIBE (Mid: %d, Topic: %s)", mosq->id, local_mid, topic);
+	_mosquitto_log_debug(mosq, "Client %s sending UNSUBSCRIBE (Mid: %d, Topic: %s)", mosq->id, local_mid, topic);
 #endif
 	return _mosquitto_packet_queue(mosq, packet);
 }
@@ -50,9 +50,9 @@ int _mosquitto_send_pingreq(struct mosquitto *mosq)
 	int rc;
 	assert(mosq);
 #ifdef WITH_BROKER
-	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PINGREQ to %s", mosq->id);
+	_mosquitto_log_debug(NULL, "Sending PINGREQ to %s", mosq->id);
 #else
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending PINGREQ", mosq->id);
+	_mosquitto_log_debug(mosq, "Client %s sending PINGREQ", mosq->id);
 #endif
 	rc = _mosquitto_send_simple_command(mosq, PINGREQ);
 	if(rc == MOSQ_ERR_SUCCESS){
@@ -64,9 +64,9 @@ int _mosquitto_send_pingreq(struct mosquitto *mosq)
 int _mosquitto_send_pingresp(struct mosquitto *mosq)
 {
 #ifdef WITH_BROKER
-	if(mosq) _mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PINGRESP to %s", mosq->id);
+	if(mosq) _mosquitto_log_debug(NULL, "Sending PINGRESP to %s", mosq->id);
 #else
-	if(mosq) _mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending PINGRESP", mosq->id);
+	if(mosq) _mosquitto_log_debug(mosq, "Client %s sending PINGRESP", mosq->id);
 #endif
 	return _mosquitto_send_simple_command(mosq, PINGRESP);
 }
@@ -74,9 +74,9 @@ int _mosquitto_send_pingresp(struct mosquitto *mosq)
 int _mosquitto_send_puback(struct mosquitto *mosq, uint16_t mid)
 {
 #ifdef WITH_BROKER
-	if(mosq) _mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBACK to %s (Mid: %d)", mosq->id, mid);
+	if(mosq) _mosquitto_log_debug(NULL, "Sending PUBACK to %s (Mid: %d)", mosq->id, mid);
 #else
-	if(mosq) _mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending PUBACK (Mid: %d)", mosq->id, mid);
+	if(mosq) _mosquitto_log_debug(mosq, "Client %s sending PUBACK (Mid: %d)", mosq->id, mid);
 #endif
 	return _mosquitto_send_command_with_mid(mosq, PUBACK, mid, false);
 }
@@ -84,9 +84,9 @@ int _mosquitto_send_puback(struct mosquitto *mosq, uint16_t mid)
 int _mosquitto_send_pubcomp(struct mosquitto *mosq, uint16_t mid)
 {
 #ifdef WITH_BROKER
-	if(mosq) _mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBCOMP to %s (Mid: %d)", mosq->id, mid);
+	if(mosq) _mosquitto_log_debug(NULL, "Sending PUBCOMP to %s (Mid: %d)", mosq->id, mid);
 #else
-	if(mosq) _mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending PUBCOMP (Mid: %d)", mosq->id, mid);
+	if(mosq) _mosquitto_log_debug(mosq, "Client %s sending PUBCOMP (Mid: %d)", mosq->id, mid);
 #endif
 	return _mosquitto_send_command_with_mid(mosq, PUBCOMP, mid, false);
 }
@@ -156,7 +156,7 @@ int _mosquitto_send_publish(struct mosquitto *mosq, uint16_t mid, const char *to
 						_mosquitto_free(mapped_topic);
 						mapped_topic = topic_temp;
 					}
-					_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, mapped_topic, (long)payloadlen);
+					_mosquitto_log_debug(NULL, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, mapped_topic, (long)payloadlen);
 					g_pub_bytes_sent += payloadlen;
 					rc =  _mosquitto_send_real_publish(mosq, mid, mapped_topic, payloadlen, payload, qos, retain, dup);
 					_mosquitto_free(mapped_topic);
@@ -166,10 +166,10 @@ int _mosquitto_send_publish(struct mosquitto *mosq, uint16_t mid, const char *to
 		}
 	}
 #endif
-	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, topic, (long)payloadlen);
+	_mosquitto_log_debug(NULL, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, topic, (long)payloadlen);
 	g_pub_bytes_sent += payloadlen;
 #else
-	_mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending PUBLISH (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, topic, (long)payloadlen);
+	_mosquitto_log_debug(mosq, "Client %s sending PUBLISH (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, topic, (long)payloadlen);
 #endif
 
 	return _mosquitto_send_real_publish(mosq, mid, topic, payloadlen, payload, qos, retain, dup);
@@ -178,9 +178,9 @@ int _mosquitto_send_publish(struct mosquitto *mosq, uint16_t mid, const char *to
 int _mosquitto_send_pubrec(struct mosquitto *mosq, uint16_t mid)
 {
 #ifdef WITH_BROKER
-	if(mosq) _mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBREC to %s (Mid: %d)", mosq->id, mid);
+	if(mosq) _mosquitto_log_debug(NULL, "Sending PUBREC to %s (Mid: %d)", mosq->id, mid);
 #else
-	if(mosq) _mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending PUBREC (Mid: %d)", mosq->id, mid);
+	if(mosq) _mosquitto_log_debug(mosq, "Client %s sending PUBREC (Mid: %d)", mosq->id, mid);
 #endif
 	return _mosquitto_send_command_with_mid(mosq, PUBREC, mid, false);
 }
@@ -188,9 +188,9 @@ int _mosquitto_send_pubrec(struct mosquitto *mosq, uint16_t mid)
 int _mosquitto_send_pubrel(struct mosquitto *mosq, uint16_t mid, bool dup)
 {
 #ifdef WITH_BROKER
-	if(mosq) _mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBREL to %s (Mid: %d)", mosq->id, mid);
+	if(mosq) _mosquitto_log_debug(NULL, "Sending PUBREL to %s (Mid: %d)", mosq->id, mid);
 #else
-	if(mosq) _mosquitto_log_printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending PUBREL (Mid: %d)", mosq->id, mid);
+	if(mosq) _mosquitto_log_debug(mosq, "Client %s sending PUBREL (Mid: %d)", mosq->id, mid);
 #endif
 	return _mosquitto_send_command_with_mid(mosq, PUBREL|2, mid, dup);
 }
@@ -202,7 +202,7 @@ int _mosquitto_send_command_with_mid(struct mosquitto *mosq, uint8_t command, ui
 	int rc;
 
 	assert(mosq);
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_packet_new();
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->command = command;
@@ -212,7 +212,7 @@ int _mosquitto_send_command_with_mid(struct mosquitto *mosq, uint8_t command, ui
 	packet->remaining_length = 2;
 	rc = _mosquitto_packet_alloc(packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 		return rc;
 	}
 
@@ -229,7 +229,7 @@ int _mosquitto_send_simple_command(struct mosquitto *mosq, uint8_t command)
 	int rc;
 
 	assert(mosq);
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_packet_new();
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->command = command;
@@ -237,7 +237,7 @@ int _mosquitto_send_simple_command(struct mosquitto *mosq, uint8_t command)
 
 	rc = _mosquitto_packet_alloc(packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 		return rc;
 	}
 
@@ -255,7 +255,7 @@ int _mosquitto_send_real_publish(struct mosquitto *mosq, uint16_t mid, const cha
 
 	packetlen = 2+strlen(topic) + payloadlen;
 	if(qos > 0) packetlen += 2; /* For message id */
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_packet_new();
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->mid = mid;
@@ -263,7 +263,7 @@ int _mosquitto_send_real_publish(struct mosquitto *mosq, uint16_t mid, const cha
 	packet->remaining_length = packetlen;
 	rc = _mosquitto_packet_alloc(packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 		return rc;
 	}
 	/* Variable header (topic string) */
@@ -0,0 +1,383 @@
+/*
+Copyright (c) 2013 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE
+
+#include <config.h>
+
+#ifdef WITH_SHM
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <memory_mosq.h>
+#include <mosquitto_internal.h>
+#include <net_mosq.h>
+#include <shm_mosq.h>
+
+#define SHM_BARRIER() __sync_synchronize()
+
+static void _shm_wake(int fd)
+{
+	uint64_t one = 1;
+	ssize_t rc;
+
+	/* Only fails if the counter is about to overflow, in which case the
+	 * other side has plenty of wakeups already. */
+	rc = write(fd, &one, sizeof(one));
+	(void)rc;
+}
+
+/* Map a connection created by the client. On the broker side everything in
+ * the memory is checked before use, because the client controls it. Takes
+ * ownership of peer_fd on success. mem_fd is left for the caller to close. */
+int _mosquitto_shm_map(struct mosquitto *mosq, int mem_fd, int peer_fd, bool broker)
+{
+	struct _mosquitto_shm *shm;
+	struct _mosquitto_shm_header *header;
+	struct stat st;
+	uint32_t size;
+	int seals;
+	void *map;
+
+	if(!mosq || mem_fd < 0 || peer_fd < 0) return MOSQ_ERR_INVAL;
+
+	if(broker){
+		/* Without these the client could shrink the memory under us and
+		 * turn our next access into a SIGBUS. */
+		seals = fcntl(mem_fd, F_GET_SEALS);
+		if(seals == -1 || (seals & (F_SEAL_SHRINK | F_SEAL_SEAL)) != (F_SEAL_SHRINK | F_SEAL_SEAL)){
+			return MOSQ_ERR_PROTOCOL;
+		}
+	}
+	if(fstat(mem_fd, &st)) return MOSQ_ERR_ERRNO;
+	if(st.st_size < (off_t)(sizeof(struct _mosquitto_shm_header) + 2*MOSQ_SHM_RING_MIN)
+			|| st.st_size > (off_t)(sizeof(struct _mosquitto_shm_header) + 2*MOSQ_SHM_RING_MAX)){
+
+		return MOSQ_ERR_PROTOCOL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+	if(map == MAP_FAILED) return MOSQ_ERR_ERRNO;
+	header = (struct _mosquitto_shm_header *)map;
+	size = header->ring_size;
+	if(header->magic != MOSQ_SHM_MAGIC || header->version != MOSQ_SHM_VERSION
+			|| size < MOSQ_SHM_RING_MIN || size > MOSQ_SHM_RING_MAX
+			|| (size & (size-1))
+			|| st.st_size != (off_t)(sizeof(struct _mosquitto_shm_header) + 2*size)){
+
+		munmap(map, st.st_size);
+		return MOSQ_ERR_PROTOCOL;
+	}
+
+	shm = _mosquitto_calloc(1, sizeof(struct _mosquitto_shm));
+	if(!shm){
+		munmap(map, st.st_size);
+		return MOSQ_ERR_NOMEM;
+	}
+	shm->map = map;
+	shm->map_len = st.st_size;
+	shm->size = size;
+	if(broker){
+		shm->in = &header->c2b;
+		shm->out = &header->b2c;
+		shm->in_data = (uint8_t *)map + sizeof(struct _mosquitto_shm_header);
+		shm->out_data = shm->in_data + size;
+	}else{
+		shm->in = &header->b2c;
+		shm->out = &header->c2b;
+		shm->out_data = (uint8_t *)map + sizeof(struct _mosquitto_shm_header);
+		shm->in_data = shm->out_data + size;
+	}
+	shm->in_tail = shm->in->tail;
+	shm->out_head = shm->out->head;
+	shm->peer_fd = peer_fd;
+	/* Nothing has been read yet, so the first write must wake us. */
+	shm->in->reader_waiting = 1;
+	SHM_BARRIER();
+	mosq->shm = shm;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Create the shared memory and eventfds, hand them to the broker listening
+ * on path and wait for it to accept them. On success mosq->sock is our
+ * eventfd. */
+int _mosquitto_shm_connect(struct mosquitto *mosq, const char *path)
+{
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	struct _mosquitto_shm_header *header;
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(3*sizeof(int))];
+	} cbuf;
+	struct cmsghdr *cmsg;
+	/* Memory, broker eventfd, client eventfd. */
+	int fds[3] = {-1, -1, -1};
+	size_t len;
+	uint8_t byte;
+	int sock = INVALID_SOCKET;
+	int rc;
+
+	if(!mosq || !path) return MOSQ_ERR_INVAL;
+	if(_mosquitto_socket_unix_addr(path, &addr, &addrlen)) return MOSQ_ERR_INVAL;
+
+	len = sizeof(struct _mosquitto_shm_header) + 2*MOSQ_SHM_RING_SIZE;
+	fds[0] = memfd_create("mosquitto", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(fds[0] == -1) return MOSQ_ERR_ERRNO;
+	if(ftruncate(fds[0], len)
+			|| fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)){
+		rc = MOSQ_ERR_ERRNO;
+		goto cleanup;
+	}
+	header = mmap(NULL, sizeof(struct _mosquitto_shm_header), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if(header == MAP_FAILED){
+		rc = MOSQ_ERR_ERRNO;
+		goto cleanup;
+	}
+	header->magic = MOSQ_SHM_MAGIC;
+	header->version = MOSQ_SHM_VERSION;
+	header->ring_size = MOSQ_SHM_RING_SIZE;
+	munmap(header, sizeof(struct _mosquitto_shm_header));
+
+	fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(fds[1] == -1 || fds[2] == -1){
+		rc = MOSQ_ERR_ERRNO;
+		goto cleanup;
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock == INVALID_SOCKET || connect(sock, (struct sockaddr *)&addr, addrlen)){
+		rc = MOSQ_ERR_ERRNO;
+		goto cleanup;
+	}
+
+	byte = MOSQ_SHM_VERSION;
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	memset(&msg, 0, sizeof(msg));
+	memset(&cbuf, 0, sizeof(cbuf));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(3*sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, 3*sizeof(int));
+	if(sendmsg(sock, &msg, MSG_NOSIGNAL) != 1){
+		rc = MOSQ_ERR_ERRNO;
+		goto cleanup;
+	}
+
+	/* The broker replies with a single zero byte once it has mapped the
+	 * memory, anything else means it didn't like what we sent. */
+	if(recv(sock, &byte, 1, 0) != 1){
+		rc = MOSQ_ERR_CONN_LOST;
+		goto cleanup;
+	}
+	if(byte != 0){
+		rc = MOSQ_ERR_CONN_REFUSED;
+		goto cleanup;
+	}
+
+	rc = _mosquitto_shm_map(mosq, fds[0], fds[1], false);
+	if(rc) goto cleanup;
+	fds[1] = -1;
+	COMPAT_CLOSE(sock);
+	close(fds[0]);
+	mosq->sock = fds[2];
+	return MOSQ_ERR_SUCCESS;
+
+cleanup:
+	if(sock != INVALID_SOCKET) COMPAT_CLOSE(sock);
+	if(fds[0] != -1) close(fds[0]);
+	if(fds[1] != -1) close(fds[1]);
+	if(fds[2] != -1) close(fds[2]);
+	return rc;
+}
+
+/* Tell the other side we've gone and release the memory. mosq->sock, our
+ * own eventfd, is closed as normal by the caller. */
+void _mosquitto_shm_close(struct mosquitto *mosq)
+{
+	struct _mosquitto_shm *shm;
+
+	if(!mosq || !mosq->shm) return;
+	shm = mosq->shm;
+
+	shm->out->closed = 1;
+	SHM_BARRIER();
+	_shm_wake(shm->peer_fd);
+
+	munmap(shm->map, shm->map_len);
+	close(shm->peer_fd);
+	_mosquitto_free(shm);
+	mosq->shm = NULL;
+}
+
+ssize_t _mosquitto_shm_read(struct mosquitto *mosq, void *buf, size_t count)
+{
+	struct _mosquitto_shm *shm = mosq->shm;
+	uint32_t avail;
+	uint32_t offset;
+	uint32_t first;
+	bool closed;
+
+	/* Read closed before head, so that everything written before the other
+	 * side closed is seen. */
+	closed = shm->in->closed;
+	SHM_BARRIER();
+	avail = shm->in->head - shm->in_tail;
+	if(avail == 0){
+		if(closed) return 0;
+
+		/* Ask to be woken, then look again in case data arrived in between. */
+		shm->in->reader_waiting = 1;
+		SHM_BARRIER();
+		avail = shm->in->head - shm->in_tail;
+		if(avail == 0){
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	if(avail > shm->size){
+		errno = EPROTO;
+		return -1;
+	}
+	SHM_BARRIER();
+
+	if(count > avail) count = avail;
+	offset = shm->in_tail & (shm->size-1);
+	first = shm->size - offset;
+	if(first > count) first = count;
+	memcpy(buf, &shm->in_data[offset], first);
+	if(count > first){
+		memcpy((uint8_t *)buf+first, shm->in_data, count-first);
+	}
+
+	SHM_BARRIER();
+	shm->in_tail += count;
+	shm->in->tail = shm->in_tail;
+	SHM_BARRIER();
+	if(shm->in->writer_waiting && __sync_bool_compare_and_swap(&shm->in->writer_waiting, 1, 0)){
+		_shm_wake(shm->peer_fd);
+	}
+	return count;
+}
+
+ssize_t _mosquitto_shm_write(struct mosquitto *mosq, void *buf, size_t count)
+{
+	struct _mosquitto_shm *shm = mosq->shm;
+	uint32_t space;
+	uint32_t offset;
+	uint32_t first;
+
+	space = shm->size - (shm->out_head - shm->out->tail);
+	if(space == 0){
+		/* Full. Ask to be woken when the other side has made room, then
+		 * look again in case it already has. */
+		shm->out->writer_waiting = 1;
+		SHM_BARRIER();
+		space = shm->size - (shm->out_head - shm->out->tail);
+		if(space == 0){
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	if(space > shm->size){
+		errno = EPROTO;
+		return -1;
+	}
+	SHM_BARRIER();
+
+	if(count > space) count = space;
+	offset = shm->out_head & (shm->size-1);
+	first = shm->size - offset;
+	if(first > count) first = count;
+	memcpy(&shm->out_data[offset], buf, first);
+	if(count > first){
+		memcpy(shm->out_data, (uint8_t *)buf+first, count-first);
+	}
+
+	SHM_BARRIER();
+	shm->out_head += count;
+	shm->out->head = shm->out_head;
+	SHM_BARRIER();
+	if(shm->out->reader_waiting && __sync_bool_compare_and_swap(&shm->out->reader_waiting, 1, 0)){
+		_shm_wake(shm->peer_fd);
+	}
+	return count;
+}
+
+/* Is there anything left to read, including the other side closing? If not,
+ * ask to be woken when there is. */
+bool _mosquitto_shm_readable(struct mosquitto *mosq)
+{
+	struct _mosquitto_shm *shm = mosq->shm;
+
+	if(shm->in->head != shm->in_tail || shm->in->closed) return true;
+
+	shm->in->reader_waiting = 1;
+	SHM_BARRIER();
+	return shm->in->head != shm->in_tail || shm->in->closed;
+}
+
+/* Reset our eventfd after waking up. */
+void _mosquitto_shm_wake_clear(struct mosquitto *mosq)
+{
+	uint64_t value;
+	ssize_t rc;
+
+	rc = read(mosq->sock, &value, sizeof(value));
+	(void)rc;
+}
+
+/* Called when we stop reading before the ring is empty. The other side won't
+ * wake us for data that is already there, so wake ourselves. */
+void _mosquitto_shm_rearm(struct mosquitto *mosq)
+{
+	if(_mosquitto_shm_readable(mosq)){
+		_shm_wake(mosq->sock);
+	}
+}
+
+#endif
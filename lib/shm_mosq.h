@@ -0,0 +1,104 @@
+/*
+Copyright (c) 2013 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef _SHM_MOSQ_H_
+#define _SHM_MOSQ_H_
+
+#ifdef WITH_SHM
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <mosquitto_internal.h>
+
+/* Shared memory transport.
+ *
+ * The client creates a sealed memfd holding a _mosquitto_shm_header followed
+ * by the data of two rings, one for each direction, and two eventfds, and
+ * passes all three to the broker over a unix socket listener that has
+ * shm_transport enabled. From then on the MQTT byte stream goes through the
+ * rings instead of the socket, and the eventfds are only written when the
+ * other side has said it is about to sleep.
+ */
+
+#define MOSQ_SHM_MAGIC 0x4853514D /* "MQSH" */
+#define MOSQ_SHM_VERSION 1
+#define MOSQ_SHM_RING_SIZE (1024*1024)
+#define MOSQ_SHM_RING_MIN 4096
+#define MOSQ_SHM_RING_MAX (64*1024*1024)
+
+/* One direction of a connection. The producer owns the first cache line and
+ * the consumer the second, except that the waiting flags are set by the side
+ * going to sleep and cleared by the side that wakes it. */
+struct _mosquitto_shm_ring{
+	volatile uint32_t head;
+	volatile uint32_t writer_waiting;
+	volatile uint32_t closed;
+	uint8_t pad1[52];
+	volatile uint32_t tail;
+	volatile uint32_t reader_waiting;
+	uint8_t pad2[56];
+};
+
+struct _mosquitto_shm_header{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ring_size;
+	uint8_t pad[52];
+	struct _mosquitto_shm_ring c2b; /* Client to broker. */
+	struct _mosquitto_shm_ring b2c; /* Broker to client. */
+};
+
+/* Local state for one end of a connection. The positions are kept here as
+ * well as in the rings, because the other side can write anything it likes
+ * to the shared copies. */
+struct _mosquitto_shm{
+	void *map;
+	size_t map_len;
+	struct _mosquitto_shm_ring *in;
+	struct _mosquitto_shm_ring *out;
+	uint8_t *in_data;
+	uint8_t *out_data;
+	uint32_t size;
+	uint32_t in_tail;
+	uint32_t out_head;
+	int peer_fd;
+};
+
+int _mosquitto_shm_connect(struct mosquitto *mosq, const char *path);
+int _mosquitto_shm_map(struct mosquitto *mosq, int mem_fd, int peer_fd, bool broker);
+void _mosquitto_shm_close(struct mosquitto *mosq);
+ssize_t _mosquitto_shm_read(struct mosquitto *mosq, void *buf, size_t count);
+ssize_t _mosquitto_shm_write(struct mosquitto *mosq, void *buf, size_t count);
+bool _mosquitto_shm_readable(struct mosquitto *mosq);
+void _mosquitto_shm_wake_clear(struct mosquitto *mosq);
+void _mosquitto_shm_rearm(struct mosquitto *mosq);
+
+#endif
+#endif
@@ -72,8 +72,12 @@ int _mosquitto_packet_alloc(struct _mosquitto_packet *packet)
 	}while(remaining_length > 0 && packet->remaining_count < 5);
 	if(packet->remaining_count == 5) return MOSQ_ERR_PAYLOAD_SIZE;
 	packet->packet_length = packet->remaining_length + 1 + packet->remaining_count;
-	packet->payload = _mosquitto_malloc(sizeof(uint8_t)*packet->packet_length);
-	if(!packet->payload) return MOSQ_ERR_NOMEM;
+	if(packet->packet_length <= MOSQ_PACKET_INLINE_SIZE){
+		packet->payload = packet->payload_inline;
+	}else{
+		packet->payload = _mosquitto_malloc(sizeof(uint8_t)*packet->packet_length);
+		if(!packet->payload) return MOSQ_ERR_NOMEM;
+	}
 
 	packet->payload[0] = packet->command;
 	for(i=0; i<packet->remaining_count; i++){
@@ -0,0 +1,280 @@
+/*
+Copyright (c) 2013 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include <async.h>
+
+#ifndef WIN32
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct mqtt3_async_item *queue_head = NULL;
+static struct mqtt3_async_item *queue_tail = NULL;
+/* Self pipe used to wake the main loop. At most one byte is outstanding. */
+static int wake_fds[2] = {-1, -1};
+static int wake_pending = 0;
+
+/* Work waiting for a worker thread. */
+static pthread_mutex_t work_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static struct mqtt3_async_item *work_head = NULL;
+static struct mqtt3_async_item *work_tail = NULL;
+static pthread_t *workers = NULL;
+static int worker_count = 0;
+static int workers_stop = 0;
+
+static void _async_workers_stop(void);
+
+int mqtt3_async_init(void)
+{
+	int i;
+
+	if(wake_fds[0] != -1) return 0;
+
+	if(pipe(wake_fds)) return 1;
+	for(i=0; i<2; i++){
+		if(fcntl(wake_fds[i], F_SETFL, fcntl(wake_fds[i], F_GETFL, 0) | O_NONBLOCK) == -1
+				|| fcntl(wake_fds[i], F_SETFD, FD_CLOEXEC) == -1){
+
+			mqtt3_async_cleanup();
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void mqtt3_async_cleanup(void)
+{
+	_async_workers_stop();
+
+	if(wake_fds[0] != -1) close(wake_fds[0]);
+	if(wake_fds[1] != -1) close(wake_fds[1]);
+	wake_fds[0] = -1;
+	wake_fds[1] = -1;
+
+	pthread_mutex_lock(&queue_mutex);
+	queue_head = NULL;
+	queue_tail = NULL;
+	wake_pending = 0;
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+int mqtt3_async_fd(void)
+{
+	return wake_fds[0];
+}
+
+void mqtt3_async_complete(struct mqtt3_async_item *item, int result)
+{
+	char c = 0;
+
+	item->next = NULL;
+	item->result = result;
+
+	pthread_mutex_lock(&queue_mutex);
+	if(queue_tail){
+		queue_tail->next = item;
+	}else{
+		queue_head = item;
+	}
+	queue_tail = item;
+	if(!wake_pending){
+		/* Written under the lock, so that mqtt3_async_get() can't drain the
+		 * pipe before the byte arrives and leave it readable. The pipe is
+		 * non-blocking and holds at most one byte, so this never waits. */
+		while(write(wake_fds[1], &c, 1) == -1 && errno == EINTR){
+		}
+		wake_pending = 1;
+	}
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+struct mqtt3_async_item *mqtt3_async_get(void)
+{
+	struct mqtt3_async_item *item;
+	char buf[16];
+
+	pthread_mutex_lock(&queue_mutex);
+	item = queue_head;
+	if(item){
+		queue_head = item->next;
+		if(!queue_head) queue_tail = NULL;
+	}else if(wake_pending){
+		/* Queue drained, allow the next completion to wake us again. */
+		while(read(wake_fds[0], buf, sizeof(buf)) > 0){
+		}
+		wake_pending = 0;
+	}
+	pthread_mutex_unlock(&queue_mutex);
+
+	return item;
+}
+
+static void *_async_worker(void *arg)
+{
+	struct mqtt3_async_item *item;
+
+	while(1){
+		pthread_mutex_lock(&work_mutex);
+		while(!work_head && !workers_stop){
+			pthread_cond_wait(&work_cond, &work_mutex);
+		}
+		if(workers_stop){
+			pthread_mutex_unlock(&work_mutex);
+			return NULL;
+		}
+		item = work_head;
+		work_head = item->next;
+		if(!work_head) work_tail = NULL;
+		pthread_mutex_unlock(&work_mutex);
+
+		item->work(item);
+		mqtt3_async_complete(item, item->result);
+	}
+	return NULL;
+}
+
+int mqtt3_async_workers_start(int count)
+{
+	int i;
+	sigset_t sigblock, origsig;
+
+	if(worker_count) return 0;
+	if(count < 1) return 1;
+	if(mqtt3_async_init()) return 1;
+
+	/* Not tracked, the memory functions aren't thread safe and nothing else
+	 * here uses them. */
+	workers = calloc(count, sizeof(pthread_t));
+	if(!workers) return 1;
+
+	/* Leave signal handling to the main thread. */
+	sigfillset(&sigblock);
+	pthread_sigmask(SIG_SETMASK, &sigblock, &origsig);
+	workers_stop = 0;
+	for(i=0; i<count; i++){
+		if(pthread_create(&workers[i], NULL, _async_worker, NULL)){
+			break;
+		}
+		worker_count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &origsig, NULL);
+	if(!worker_count){
+		free(workers);
+		workers = NULL;
+		return 1;
+	}
+	return 0;
+}
+
+static void _async_workers_stop(void)
+{
+	int i;
+
+	if(!worker_count) return;
+
+	pthread_mutex_lock(&work_mutex);
+	workers_stop = 1;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&work_mutex);
+
+	for(i=0; i<worker_count; i++){
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+	workers = NULL;
+	worker_count = 0;
+	/* Anything not yet started is abandoned, we're shutting down. */
+	work_head = NULL;
+	work_tail = NULL;
+}
+
+int mqtt3_async_run(struct mqtt3_async_item *item)
+{
+	if(!worker_count) return 1;
+
+	item->next = NULL;
+	pthread_mutex_lock(&work_mutex);
+	if(work_tail){
+		work_tail->next = item;
+	}else{
+		work_head = item;
+	}
+	work_tail = item;
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&work_mutex);
+
+	return 0;
+}
+
+#else
+
+/* Not supported on Windows, asynchronous plugin functions are not used. */
+int mqtt3_async_init(void)
+{
+	return 1;
+}
+
+void mqtt3_async_cleanup(void)
+{
+}
+
+int mqtt3_async_fd(void)
+{
+	return -1;
+}
+
+void mqtt3_async_complete(struct mqtt3_async_item *item, int result)
+{
+}
+
+struct mqtt3_async_item *mqtt3_async_get(void)
+{
+	return NULL;
+}
+
+int mqtt3_async_workers_start(int count)
+{
+	return 1;
+}
+
+int mqtt3_async_run(struct mqtt3_async_item *item)
+{
+	return 1;
+}
+#endif
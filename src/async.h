@@ -0,0 +1,79 @@
+/*
+Copyright (c) 2013 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef ASYNC_H
+#define ASYNC_H
+
+/* Results of work done outside the main loop, such as asynchronous
+ * authentication, are handed back to the main loop through this queue. Slow
+ * work of the broker's own can also be handed to a small pool of worker
+ * threads. This lives apart from the rest of the broker because the broker
+ * headers replace the pthread functions with dummies. */
+
+struct mosquitto_db;
+
+/* Requests that can be completed asynchronously must begin with this, so
+ * that completing one never needs to allocate memory on another thread. */
+struct mqtt3_async_item{
+	struct mqtt3_async_item *next;
+	int result;
+	/* Run on a worker thread by mqtt3_async_run(). Must set result and must
+	 * not use the _mosquitto_ memory functions or touch broker state. */
+	void (*work)(struct mqtt3_async_item *item);
+	/* Run by the main loop once the request has completed. */
+	void (*done)(struct mosquitto_db *db, struct mqtt3_async_item *item);
+};
+
+/* Set up the queue. Returns 0 on success. Safe to call more than once. */
+int mqtt3_async_init(void);
+void mqtt3_async_cleanup(void);
+
+/* Descriptor for the main loop to poll for reading. Becomes readable when
+ * there are completed requests waiting. Returns -1 if the queue isn't in
+ * use. */
+int mqtt3_async_fd(void);
+
+/* Queue a completed request along with its result. May be called from any
+ * thread, including from within the function that started the request. */
+void mqtt3_async_complete(struct mqtt3_async_item *item, int result);
+
+/* Main loop only. Take the oldest completed request from the queue. Returns
+ * NULL if the queue is empty. */
+struct mqtt3_async_item *mqtt3_async_get(void);
+
+/* Start count worker threads, also setting up the queue if needed. Does
+ * nothing if workers are already running. Returns 0 on success. */
+int mqtt3_async_workers_start(int count);
+
+/* Run item->work on a worker thread, then complete the item with the result
+ * it set. Returns 0 if the item was queued, or 1 if there are no workers, in
+ * which case the caller must do the work itself. */
+int mqtt3_async_run(struct mqtt3_async_item *item);
+
+#endif
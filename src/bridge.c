@@ -46,10 +46,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 int mqtt3_bridge_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge)
 {
-	int i;
 	struct mosquitto *new_context = NULL;
-	int null_index = -1;
-	struct mosquitto **tmp_contexts;
 	char hostname[256];
 	int len;
 	char *id;
@@ -75,43 +72,29 @@ int mqtt3_bridge_new(struct mosquitto_db *db, struct _mqtt3_bridge *bridge)
 		return MOSQ_ERR_NOMEM;
 	}
 
-	/* Search for existing id (possible from persistent db) and also look for a
-	 * gap in the db->contexts[] array in case the id isn't found. */
-	for(i=0; i<db->context_count; i++){
-		if(db->contexts[i]){
-			if(!strcmp(db->contexts[i]->id, id)){
-				new_context = db->contexts[i];
-				break;
-			}
-		}else if(db->contexts[i] == NULL && null_index == -1){
-			i = null_index;
-			break;
-		}
-	}
+	/* Search for existing id (possible from persistent db). */
+	new_context = mqtt3_context_find(db, id);
 	if(!new_context){
-		/* id wasn't found, so generate a new context */
+		/* id wasn't found, so generate a new context. */
 		new_context = mqtt3_context_init(-1);
 		if(!new_context){
+			_mosquitto_free(id);
 			return MOSQ_ERR_NOMEM;
 		}
-		if(null_index == -1){
-			/* There were no gaps in the db->contexts[] array, so need to append. */
-			db->context_count++;
-			tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*db->context_count);
-			if(tmp_contexts){
-				db->contexts = tmp_contexts;
-				db->contexts[db->context_count-1] = new_context;
-			}else{
-				_mosquitto_free(new_context);
-				return MOSQ_ERR_NOMEM;
-			}
-		}else{
-			db->contexts[null_index] = new_context;
+		if(mqtt3_context_add(db, new_context)){
+			_mosquitto_free(id);
+			mqtt3_context_cleanup(NULL, new_context, true);
+			return MOSQ_ERR_NOMEM;
 		}
-		new_context->id = id;
+		mqtt3_context_id_set(db, new_context, id);
 	}else{
 		/* id was found, so context->id already in memory. */
 		_mosquitto_free(id);
+		/* Restored from the persistent db, bridges always live in the
+		 * active table. */
+		if(new_context->offline && mqtt3_context_online(db, new_context)){
+			return MOSQ_ERR_NOMEM;
+		}
 	}
 	new_context->bridge = bridge;
 	new_context->is_bridge = true;
@@ -151,7 +134,6 @@ int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context)
 	context->last_msg_out = time(NULL);
 	context->keepalive = context->bridge->keepalive;
 	context->clean_session = context->bridge->clean_session;
-	context->in_packet.payload = NULL;
 	context->ping_t = 0;
 	mqtt3_bridge_packet_cleanup(context);
 	mqtt3_db_message_reconnect_reset(context);
@@ -168,7 +150,7 @@ int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context)
 
 	for(i=0; i<context->bridge->topic_count; i++){
 		if(context->bridge->topics[i].direction == bd_out || context->bridge->topics[i].direction == bd_both){
-			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Bridge %s doing local SUBSCRIBE on topic %s", context->id, context->bridge->topics[i].local_topic);
+			_mosquitto_log_debug(NULL, "Bridge %s doing local SUBSCRIBE on topic %s", context->id, context->bridge->topics[i].local_topic);
 			if(mqtt3_sub_add(db, context, context->bridge->topics[i].local_topic, context->bridge->topics[i].qos, &db->subs)) return 1;
 		}
 	}
@@ -213,13 +195,21 @@ void mqtt3_bridge_packet_cleanup(struct mosquitto *context)
 	struct _mosquitto_packet *packet;
 	if(!context) return;
 
-	_mosquitto_packet_cleanup(context->current_out_packet);
+	if(context->current_out_packet){
+		_mosquitto_packet_cleanup(context->current_out_packet);
+		_mosquitto_packet_free(context->current_out_packet);
+		context->current_out_packet = NULL;
+	}
     while(context->out_packet){
 		_mosquitto_packet_cleanup(context->out_packet);
 		packet = context->out_packet;
 		context->out_packet = context->out_packet->next;
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 	}
+	context->out_packet_last = NULL;
+	context->out_packet_count = 0;
+	context->out_packet_bytes = 0;
+	context->slow_t = 0;
 
 	_mosquitto_packet_cleanup(&(context->in_packet));
 }
@@ -65,6 +65,8 @@ static void _config_init_reload(struct mqtt3_config *config)
 {
 	int i;
 	/* Set defaults */
+	config->acl_cache_size = 0;
+	config->acl_cache_ttl = 60;
 	if(config->acl_file) _mosquitto_free(config->acl_file);
 	config->acl_file = NULL;
 	config->allow_anonymous = true;
@@ -88,6 +90,11 @@ static void _config_init_reload(struct mqtt3_config *config)
 	config->log_type = MOSQ_LOG_ERR | MOSQ_LOG_WARNING | MOSQ_LOG_NOTICE | MOSQ_LOG_INFO;
 #endif
 	config->log_timestamp = true;
+	config->log_topic_interval = 1;
+	config->log_topic_max_lines = 100;
+	config->log_topic_qos = 2;
+	config->max_output_bytes = 0;
+	config->password_cache_ttl = 0;
 	if(config->password_file) _mosquitto_free(config->password_file);
 	config->password_file = NULL;
 	config->persistence = false;
@@ -95,11 +102,16 @@ static void _config_init_reload(struct mqtt3_config *config)
 	config->persistence_location = NULL;
 	if(config->persistence_file) _mosquitto_free(config->persistence_file);
 	config->persistence_file = NULL;
+	config->persistence_background = false;
+	config->persistence_durable_acks = false;
+	config->persistence_wal_compact_size = 10485760;
 	config->persistent_client_expiration = 0;
 	if(config->psk_file) _mosquitto_free(config->psk_file);
 	config->psk_file = NULL;
 	config->queue_qos0_messages = false;
 	config->retry_interval = 20;
+	config->slow_consumer_policy = scp_disconnect;
+	config->slow_consumer_timeout = 60;
 	config->store_clean_interval = 10;
 	config->sys_interval = 10;
 	if(config->auth_options){
@@ -119,13 +131,26 @@ void mqtt3_config_init(struct mqtt3_config *config)
 	_config_init_reload(config);
 	config->config_file = NULL;
 	config->daemon = false;
+	config->password_check_threads = 2;
 	config->default_listener.host = NULL;
 	config->default_listener.port = 0;
+	config->default_listener.unix_path = NULL;
+	config->default_listener.socket_mode = -1;
+#ifdef WITH_SHM
+	config->default_listener.shm_transport = false;
+#endif
 	config->default_listener.max_connections = -1;
+	config->default_listener.max_connection_rate = 0;
+	config->default_listener.max_pending_connections = 0;
 	config->default_listener.mount_point = NULL;
 	config->default_listener.socks = NULL;
 	config->default_listener.sock_count = 0;
 	config->default_listener.client_count = 0;
+	config->default_listener.accept_count = 0;
+	config->default_listener.reject_count = 0;
+	config->default_listener.pending_count = 0;
+	config->default_listener.conn_tokens = 0;
+	config->default_listener.conn_token_t = 0;
 #ifdef WITH_TLS
 	config->default_listener.cafile = NULL;
 	config->default_listener.capath = NULL;
@@ -136,9 +161,13 @@ void mqtt3_config_init(struct mqtt3_config *config)
 	config->default_listener.require_certificate = false;
 	config->default_listener.crlfile = NULL;
 	config->default_listener.use_identity_as_username = false;
+	config->default_listener.tls_session_cache_size = 1024;
+	config->default_listener.tls_session_lifetime = 3600;
+	config->default_listener.tls_session_tickets = true;
 #endif
 	config->listeners = NULL;
 	config->listener_count = 0;
+	config->persistence_wal = false;
 	config->pid_file = NULL;
 	config->user = NULL;
 #ifdef WITH_BRIDGE
@@ -163,6 +192,7 @@ void mqtt3_config_cleanup(struct mqtt3_config *config)
 	if(config->listeners){
 		for(i=0; i<config->listener_count; i++){
 			if(config->listeners[i].host) _mosquitto_free(config->listeners[i].host);
+			if(config->listeners[i].unix_path) _mosquitto_free(config->listeners[i].unix_path);
 			if(config->listeners[i].mount_point) _mosquitto_free(config->listeners[i].mount_point);
 			if(config->listeners[i].socks) _mosquitto_free(config->listeners[i].socks);
 #ifdef WITH_TLS
@@ -302,11 +332,23 @@ int mqtt3_config_parse_args(struct mqtt3_config *config, int argc, char *argv[])
 		}else{
 			config->listeners[config->listener_count-1].mount_point = NULL;
 		}
+		config->listeners[config->listener_count-1].unix_path = NULL;
+		config->listeners[config->listener_count-1].socket_mode = -1;
+#ifdef WITH_SHM
+		config->listeners[config->listener_count-1].shm_transport = false;
+#endif
 		config->listeners[config->listener_count-1].max_connections = config->default_listener.max_connections;
+		config->listeners[config->listener_count-1].max_connection_rate = config->default_listener.max_connection_rate;
+		config->listeners[config->listener_count-1].max_pending_connections = config->default_listener.max_pending_connections;
 		config->listeners[config->listener_count-1].client_count = 0;
 		config->listeners[config->listener_count-1].socks = NULL;
 		config->listeners[config->listener_count-1].sock_count = 0;
 		config->listeners[config->listener_count-1].client_count = 0;
+		config->listeners[config->listener_count-1].accept_count = 0;
+		config->listeners[config->listener_count-1].reject_count = 0;
+		config->listeners[config->listener_count-1].pending_count = 0;
+		config->listeners[config->listener_count-1].conn_tokens = 0;
+		config->listeners[config->listener_count-1].conn_token_t = 0;
 #ifdef WITH_TLS
 		config->listeners[config->listener_count-1].cafile = config->default_listener.cafile;
 		config->listeners[config->listener_count-1].capath = config->default_listener.capath;
@@ -318,6 +360,10 @@ int mqtt3_config_parse_args(struct mqtt3_config *config, int argc, char *argv[])
 		config->listeners[config->listener_count-1].ssl_ctx = NULL;
 		config->listeners[config->listener_count-1].crlfile = config->default_listener.crlfile;
 		config->listeners[config->listener_count-1].use_identity_as_username = config->default_listener.use_identity_as_username;
+		config->listeners[config->listener_count-1].tls_session_cache_size = config->default_listener.tls_session_cache_size;
+		config->listeners[config->listener_count-1].tls_session_lifetime = config->default_listener.tls_session_lifetime;
+		config->listeners[config->listener_count-1].tls_session_tickets = config->default_listener.tls_session_tickets;
+		config->listeners[config->listener_count-1].ticket_key_count = 0;
 #endif
 	}
 
@@ -432,7 +478,13 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 			}
 			token = strtok_r(buf, " ", &saveptr);
 			if(token){
-				if(!strcmp(token, "acl_file")){
+				if(!strcmp(token, "acl_cache_size")){
+					if(_conf_parse_int(&token, "acl_cache_size", &config->acl_cache_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->acl_cache_size < 0) config->acl_cache_size = 0;
+				}else if(!strcmp(token, "acl_cache_ttl")){
+					if(_conf_parse_int(&token, "acl_cache_ttl", &config->acl_cache_ttl, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->acl_cache_ttl < 0) config->acl_cache_ttl = 0;
+				}else if(!strcmp(token, "acl_file")){
 					if(reload){
 						if(config->acl_file){
 							_mosquitto_free(config->acl_file);
@@ -946,17 +998,44 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 							return MOSQ_ERR_NOMEM;
 						}
-						port_tmp = atoi(token);
-						if(port_tmp < 1 || port_tmp > 65535){
-							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid port value (%d).", port_tmp);
+						cur_listener = &config->listeners[config->listener_count-1];
+						cur_listener->unix_path = NULL;
+						cur_listener->socket_mode = -1;
+#ifdef WITH_SHM
+						cur_listener->shm_transport = false;
+#endif
+						if(token[0] == '/' || token[0] == '@'){
+#ifndef WIN32
+							/* Unix domain socket, either a path or an abstract name. */
+							cur_listener->unix_path = _mosquitto_strdup(token);
+							if(!cur_listener->unix_path){
+								_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+								return MOSQ_ERR_NOMEM;
+							}
+							port_tmp = 0;
+#else
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unix socket listeners are not supported on Windows.");
 							return MOSQ_ERR_INVAL;
+#endif
+						}else{
+							port_tmp = atoi(token);
+							if(port_tmp < 1 || port_tmp > 65535){
+								_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid port value (%d).", port_tmp);
+								return MOSQ_ERR_INVAL;
+							}
 						}
-						cur_listener = &config->listeners[config->listener_count-1];
 						cur_listener->mount_point = NULL;
 						cur_listener->port = port_tmp;
 						cur_listener->socks = NULL;
 						cur_listener->sock_count = 0;
 						cur_listener->client_count = 0;
+						cur_listener->accept_count = 0;
+						cur_listener->reject_count = 0;
+						cur_listener->pending_count = 0;
+						cur_listener->conn_tokens = 0;
+						cur_listener->conn_token_t = 0;
+						cur_listener->max_connection_rate = 0;
+						cur_listener->max_pending_connections = 0;
 #ifdef WITH_TLS
 						cur_listener->cafile = NULL;
 						cur_listener->capath = NULL;
@@ -967,9 +1046,17 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 						cur_listener->require_certificate = false;
 						cur_listener->ssl_ctx = NULL;
 						cur_listener->crlfile = NULL;
+						cur_listener->tls_session_cache_size = 1024;
+						cur_listener->tls_session_lifetime = 3600;
+						cur_listener->tls_session_tickets = true;
+						cur_listener->ticket_key_count = 0;
 #endif
 						token = strtok_r(NULL, " ", &saveptr);
 						if(token){
+							if(cur_listener->unix_path){
+								_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: A bind address can't be used with a unix socket listener.");
+								return MOSQ_ERR_INVAL;
+							}
 							cur_listener->host = _mosquitto_strdup(token);
 						}else{
 							cur_listener->host = NULL;
@@ -1010,6 +1097,21 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					}
 				}else if(!strcmp(token, "log_timestamp")){
 					if(_conf_parse_bool(&token, token, &config->log_timestamp, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "log_topic_interval")){
+					if(_conf_parse_int(&token, "log_topic_interval", &config->log_topic_interval, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->log_topic_interval < 0){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid log_topic_interval value (%d).", config->log_topic_interval);
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "log_topic_max_lines")){
+					if(_conf_parse_int(&token, "log_topic_max_lines", &config->log_topic_max_lines, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->log_topic_max_lines < 0) config->log_topic_max_lines = 0;
+				}else if(!strcmp(token, "log_topic_qos")){
+					if(_conf_parse_int(&token, "log_topic_qos", &config->log_topic_qos, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->log_topic_qos < 0 || config->log_topic_qos > 2){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid log_topic_qos value (%d).", config->log_topic_qos);
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "log_type")){
 					token = strtok_r(NULL, " ", &saveptr);
 					if(token){
@@ -1033,6 +1135,15 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty log_type value in configuration.");
 					}
+				}else if(!strcmp(token, "max_connection_rate")){
+					if(reload) continue; // Listeners not valid for reloading.
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						cur_listener->max_connection_rate = atoi(token);
+						if(cur_listener->max_connection_rate < 0) cur_listener->max_connection_rate = 0;
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty max_connection_rate value in configuration.");
+					}
 				}else if(!strcmp(token, "max_connections")){
 					if(reload) continue; // Listeners not valid for reloading.
 					token = strtok_r(NULL, " ", &saveptr);
@@ -1050,6 +1161,18 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty max_inflight_messages value in configuration.");
 					}
+				}else if(!strcmp(token, "max_output_bytes")){
+					if(_conf_parse_int(&token, "max_output_bytes", &config->max_output_bytes, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->max_output_bytes < 0) config->max_output_bytes = 0;
+				}else if(!strcmp(token, "max_pending_connections")){
+					if(reload) continue; // Listeners not valid for reloading.
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						cur_listener->max_pending_connections = atoi(token);
+						if(cur_listener->max_pending_connections < 0) cur_listener->max_pending_connections = 0;
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty max_pending_connections value in configuration.");
+					}
 				}else if(!strcmp(token, "max_queued_messages")){
 					token = strtok_r(NULL, " ", &saveptr);
 					if(token){
@@ -1115,6 +1238,13 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
+				}else if(!strcmp(token, "password_cache_ttl")){
+					if(_conf_parse_int(&token, "password_cache_ttl", &config->password_cache_ttl, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->password_cache_ttl < 0) config->password_cache_ttl = 0;
+				}else if(!strcmp(token, "password_check_threads")){
+					if(reload) continue; // Not valid for reloading.
+					if(_conf_parse_int(&token, "password_check_threads", &config->password_check_threads, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->password_check_threads < 0) config->password_check_threads = 0;
 				}else if(!strcmp(token, "password_file")){
 					if(reload){
 						if(config->password_file){
@@ -1125,10 +1255,20 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					if(_conf_parse_string(&token, "password_file", &config->password_file, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistence") || !strcmp(token, "retained_persistence")){
 					if(_conf_parse_bool(&token, token, &config->persistence, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_background")){
+					if(_conf_parse_bool(&token, "persistence_background", &config->persistence_background, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_durable_acks")){
+					if(_conf_parse_bool(&token, "persistence_durable_acks", &config->persistence_durable_acks, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistence_file")){
 					if(_conf_parse_string(&token, "persistence_file", &config->persistence_file, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistence_location")){
 					if(_conf_parse_string(&token, "persistence_location", &config->persistence_location, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_wal")){
+					if(reload) continue; // Write-ahead log not valid for reloading.
+					if(_conf_parse_bool(&token, "persistence_wal", &config->persistence_wal, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_wal_compact_size")){
+					if(_conf_parse_int(&token, "persistence_wal_compact_size", &config->persistence_wal_compact_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->persistence_wal_compact_size < 0) config->persistence_wal_compact_size = 0;
 				}else if(!strcmp(token, "persistent_client_expiration")){
 					token = strtok_r(NULL, " ", &saveptr);
 					if(token){
@@ -1221,6 +1361,52 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid retry_interval value (%d).", config->retry_interval);
 						return MOSQ_ERR_INVAL;
 					}
+				}else if(!strcmp(token, "shm_transport")){
+#ifdef WITH_SHM
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_bool(&token, "shm_transport", &cur_listener->shm_transport, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_listener->shm_transport && !cur_listener->unix_path){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: shm_transport can only be used with unix socket listeners.");
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Shared memory support not available.");
+#endif
+				}else if(!strcmp(token, "slow_consumer_policy")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(!strcmp(token, "disconnect")){
+							config->slow_consumer_policy = scp_disconnect;
+						}else if(!strcmp(token, "drop")){
+							config->slow_consumer_policy = scp_drop;
+						}else if(!strcmp(token, "conflate")){
+							config->slow_consumer_policy = scp_conflate;
+						}else{
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid slow_consumer_policy value in configuration (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty slow_consumer_policy value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "slow_consumer_timeout")){
+					if(_conf_parse_int(&token, "slow_consumer_timeout", &config->slow_consumer_timeout, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->slow_consumer_timeout < 0){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid slow_consumer_timeout value (%d).", config->slow_consumer_timeout);
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "socket_mode")){
+					if(reload) continue; // Listeners not valid for reloading.
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						cur_listener->socket_mode = strtol(token, NULL, 8);
+						if(cur_listener->socket_mode < 0 || cur_listener->socket_mode > 0777){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid socket_mode value (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty socket_mode value in configuration.");
+					}
 				}else if(!strcmp(token, "start_type")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; // FIXME
@@ -1276,6 +1462,32 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					}
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "tls_session_cache_size")){
+#ifdef WITH_TLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_int(&token, "tls_session_cache_size", &cur_listener->tls_session_cache_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_listener->tls_session_cache_size < 0) cur_listener->tls_session_cache_size = 0;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_session_lifetime")){
+#ifdef WITH_TLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_int(&token, "tls_session_lifetime", &cur_listener->tls_session_lifetime, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_listener->tls_session_lifetime < 1){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid tls_session_lifetime value (%d).", cur_listener->tls_session_lifetime);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_session_tickets")){
+#ifdef WITH_TLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_bool(&token, "tls_session_tickets", &cur_listener->tls_session_tickets, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
 #endif
 				}else if(!strcmp(token, "topic")){
 #ifdef WITH_BRIDGE
@@ -56,6 +56,12 @@ struct mosquitto *mqtt3_context_init(int sock)
 	context->password = NULL;
 	context->listener = NULL;
 	context->acl_list = NULL;
+	context->acl_cache = NULL;
+	context->acl_cache_size = 0;
+	context->auth_request = NULL;
+	context->db_index = -1;
+	context->offline = false;
+	context->connect_pending = false;
 	/* is_bridge records whether this client is a bridge or not. This could be
 	 * done by looking at context->bridge for bridges that we create ourself,
 	 * but incoming bridges need some other way of being recorded. */
@@ -65,6 +71,13 @@ struct mosquitto *mqtt3_context_init(int sock)
 	_mosquitto_packet_cleanup(&context->in_packet);
 	context->out_packet = NULL;
 	context->current_out_packet = NULL;
+	context->out_packet_last = NULL;
+	context->out_packet_count = 0;
+	context->out_packet_bytes = 0;
+	context->slow_t = 0;
+	context->ready = false;
+	context->ready_prev = NULL;
+	context->ready_next = NULL;
 
 	context->address = NULL;
 	if(!_mosquitto_socket_get_address(sock, address, 1024)){
@@ -96,6 +109,16 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 	struct mosquitto_client_msg *msg, *next;
 	if(!context) return;
 
+#ifdef WITH_PERSISTENCE
+	mqtt3_db_wal_ack_drop(context);
+#endif
+	/* Decisions may depend on the username, which can change on reconnect. */
+	mosquitto_acl_cache_flush(context);
+	if(context->auth_request){
+		/* The check is still running, let the request be freed when it ends. */
+		context->auth_request->context = NULL;
+		context->auth_request = NULL;
+	}
 	if(context->username){
 		_mosquitto_free(context->username);
 		context->username = NULL;
@@ -104,6 +127,7 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 		_mosquitto_free(context->password);
 		context->password = NULL;
 	}
+	mqtt3_context_connect_done(context);
 	if(context->sock != -1){
 		if(context->listener){
 			context->listener->client_count--;
@@ -121,17 +145,28 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 		context->address = NULL;
 	}
 	if(context->id){
+		if(db){
+			HASH_DELETE(hh_id, db->contexts_by_id, context);
+		}
 		_mosquitto_free(context->id);
 		context->id = NULL;
 	}
 	_mosquitto_packet_cleanup(&(context->in_packet));
-	_mosquitto_packet_cleanup(context->current_out_packet);
+	if(context->current_out_packet){
+		_mosquitto_packet_cleanup(context->current_out_packet);
+		_mosquitto_packet_free(context->current_out_packet);
+		context->current_out_packet = NULL;
+	}
 	while(context->out_packet){
 		_mosquitto_packet_cleanup(context->out_packet);
 		packet = context->out_packet;
 		context->out_packet = context->out_packet->next;
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 	}
+	context->out_packet_last = NULL;
+	context->out_packet_count = 0;
+	context->out_packet_bytes = 0;
+	context->slow_t = 0;
 	if(context->will){
 		if(context->will->topic) _mosquitto_free(context->will->topic);
 		if(context->will->payload) _mosquitto_free(context->will->payload);
@@ -148,22 +183,191 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 		context->msgs = NULL;
 	}
 	if(do_free){
+		mqtt3_db_ready_remove(context);
 		_mosquitto_free(context);
 	}
 }
 
+/* Put context in a free slot of db->contexts, growing the table if there
+ * isn't one. */
+int mqtt3_context_add(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto **tmp_contexts;
+	int *tmp_free;
+	int new_size;
+	int slot;
+
+	if(db->context_free_count){
+		slot = db->context_free[--db->context_free_count];
+	}else{
+		if(db->context_count == db->context_size){
+			new_size = db->context_size ? db->context_size*2 : 64;
+			tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto *)*new_size);
+			if(!tmp_contexts) return MOSQ_ERR_NOMEM;
+			db->contexts = tmp_contexts;
+			tmp_free = _mosquitto_realloc(db->context_free, sizeof(int)*new_size);
+			if(!tmp_free) return MOSQ_ERR_NOMEM;
+			db->context_free = tmp_free;
+			db->context_size = new_size;
+		}
+		slot = db->context_count++;
+	}
+	db->contexts[slot] = context;
+	context->db_index = slot;
+	context->offline = false;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Take context out of whichever table it is in. Slots in db->contexts are
+ * left NULL, so this is safe whilst looping over db->contexts. Slots in
+ * db->offline_contexts are filled from the end of the table. */
+void mqtt3_context_remove(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto *last;
+
+	if(context->db_index < 0) return;
+
+	if(context->offline){
+		db->offline_count--;
+		last = db->offline_contexts[db->offline_count];
+		db->offline_contexts[context->db_index] = last;
+		last->db_index = context->db_index;
+	}else{
+		db->contexts[context->db_index] = NULL;
+		db->context_free[db->context_free_count++] = context->db_index;
+	}
+	context->db_index = -1;
+	context->offline = false;
+}
+
+/* Move a persistent client that has no connection to db->offline_contexts,
+ * so that the main loop no longer needs to look at it. */
+int mqtt3_context_offline(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto **tmp_contexts;
+	int new_size;
+
+	if(context->offline) return MOSQ_ERR_SUCCESS;
+
+	if(db->offline_count == db->offline_size){
+		new_size = db->offline_size ? db->offline_size*2 : 64;
+		tmp_contexts = _mosquitto_realloc(db->offline_contexts, sizeof(struct mosquitto *)*new_size);
+		if(!tmp_contexts) return MOSQ_ERR_NOMEM;
+		db->offline_contexts = tmp_contexts;
+		db->offline_size = new_size;
+	}
+	mqtt3_context_remove(db, context);
+	db->offline_contexts[db->offline_count] = context;
+	context->db_index = db->offline_count;
+	context->offline = true;
+	db->offline_count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Move a context from db->offline_contexts back to db->contexts, for when a
+ * persistent client reconnects. */
+int mqtt3_context_online(struct mosquitto_db *db, struct mosquitto *context)
+{
+	if(!context->offline) return MOSQ_ERR_SUCCESS;
+
+	mqtt3_context_remove(db, context);
+	if(mqtt3_context_add(db, context)){
+		/* Can't fail, there is room for the slot that was just freed. */
+		mqtt3_context_offline(db, context);
+		return MOSQ_ERR_NOMEM;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Close up the gaps in db->contexts once they make up at least half of it.
+ * Must only be called when nothing is looping over db->contexts. */
+void mqtt3_context_compact(struct mosquitto_db *db)
+{
+	struct mosquitto **tmp_contexts;
+	int *tmp_free;
+	int i, j;
+
+	if(db->context_free_count < 64 || db->context_free_count*2 < db->context_count){
+		return;
+	}
+
+	j = 0;
+	for(i=0; i<db->context_count; i++){
+		if(db->contexts[i]){
+			db->contexts[j] = db->contexts[i];
+			db->contexts[j]->db_index = j;
+			j++;
+		}
+	}
+	db->context_count = j;
+	db->context_free_count = 0;
+
+	/* Give memory back after a large number of clients has gone. */
+	if(db->context_size > 64 && db->context_count < db->context_size/4){
+		tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto *)*db->context_size/2);
+		if(tmp_contexts){
+			db->contexts = tmp_contexts;
+			db->context_size /= 2;
+			/* If this fails the larger array is still fine to use. */
+			tmp_free = _mosquitto_realloc(db->context_free, sizeof(int)*db->context_size);
+			if(tmp_free) db->context_free = tmp_free;
+		}
+	}
+}
+
+/* Stop counting context as a pending connection on its listener, either
+ * because CONNECT has completed or because the client has gone. */
+void mqtt3_context_connect_done(struct mosquitto *context)
+{
+	if(context->connect_pending){
+		context->connect_pending = false;
+		if(context->listener){
+			context->listener->pending_count--;
+			assert(context->listener->pending_count >= 0);
+		}
+	}
+}
+
+/* Find the context with client id id, or return NULL if there isn't one. */
+struct mosquitto *mqtt3_context_find(struct mosquitto_db *db, const char *id)
+{
+	struct mosquitto *context;
+
+	HASH_FIND(hh_id, db->contexts_by_id, id, strlen(id), context);
+	return context;
+}
+
+/* Set the client id of context, taking ownership of id, and add the context
+ * to the index used by mqtt3_context_find(). Any context with an id must have
+ * had it set with this function. */
+void mqtt3_context_id_set(struct mosquitto_db *db, struct mosquitto *context, char *id)
+{
+	if(context->id){
+		HASH_DELETE(hh_id, db->contexts_by_id, context);
+		_mosquitto_free(context->id);
+	}
+	context->id = id;
+	HASH_ADD_KEYPTR(hh_id, db->contexts_by_id, context->id, strlen(context->id), context);
+}
+
 void mqtt3_context_disconnect(struct mosquitto_db *db, struct mosquitto *ctxt)
 {
 	if(ctxt->state != mosq_cs_disconnecting && ctxt->will){
 		/* Unexpected disconnect, queue the client will. */
 		mqtt3_db_messages_easy_queue(db, ctxt, ctxt->will->topic, ctxt->will->qos, ctxt->will->payloadlen, ctxt->will->payload, ctxt->will->retain);
 	}
+	mqtt3_context_connect_done(ctxt);
 	if(ctxt->listener){
 		ctxt->listener->client_count--;
 		assert(ctxt->listener->client_count >= 0);
 		ctxt->listener = NULL;
 	}
 	ctxt->disconnect_t = time(NULL);
+	_mosquitto_packet_cleanup(&ctxt->in_packet);
+#ifdef WITH_PERSISTENCE
+	mqtt3_db_wal_ack_drop(ctxt);
+	mqtt3_db_wal_client_write(ctxt);
+#endif
 	_mosquitto_socket_close(ctxt);
 }
 
@@ -0,0 +1,82 @@
+/*
+Copyright (c) 2013 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdbool.h>
+
+#include <crc32c.h>
+
+/* Slicing-by-8 table driven implementation, processing eight bytes per step. */
+static uint32_t crc_table[8][256];
+static bool crc_table_init = false;
+
+static void _crc32c_table_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for(i=0; i<256; i++){
+		crc = i;
+		for(j=0; j<8; j++){
+			crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+		}
+		crc_table[0][i] = crc;
+	}
+	for(i=0; i<256; i++){
+		crc = crc_table[0][i];
+		for(j=1; j<8; j++){
+			crc = crc_table[0][crc & 0xFF] ^ (crc >> 8);
+			crc_table[j][i] = crc;
+		}
+	}
+	crc_table_init = true;
+}
+
+uint32_t mqtt3_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint32_t lo, hi;
+
+	if(!crc_table_init) _crc32c_table_init();
+
+	crc = ~crc;
+	while(len >= 8){
+		lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1]<<8 | (uint32_t)p[2]<<16 | (uint32_t)p[3]<<24);
+		hi = (uint32_t)p[4] | (uint32_t)p[5]<<8 | (uint32_t)p[6]<<16 | (uint32_t)p[7]<<24;
+		crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF]
+			^ crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24]
+			^ crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF]
+			^ crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while(len--){
+		crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
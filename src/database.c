@@ -46,6 +46,13 @@ POSSIBILITY OF SUCH DAMAGE.
 static int max_inflight = 20;
 static int max_queued = 100;
 
+/* Contexts that may have messages to write, linked through ready_next. Only
+ * these are passed to mqtt3_db_message_write() by the main loop, so idle
+ * clients cost nothing there. ready_drain is the part of the list that
+ * mqtt3_db_ready_write() has still to get to. */
+static struct mosquitto *ready_head = NULL;
+static struct mosquitto *ready_drain = NULL;
+
 uint64_t g_bytes_received = 0;
 uint64_t g_bytes_sent = 0;
 uint64_t g_pub_bytes_received = 0;
@@ -55,9 +62,23 @@ unsigned long g_msgs_sent = 0;
 unsigned long g_pub_msgs_received = 0;
 unsigned long g_pub_msgs_sent = 0;
 static unsigned long g_msgs_dropped = 0;
+static unsigned long g_msgs_conflated = 0;
+static unsigned long g_slow_disconnects = 0;
 int g_clients_expired = 0;
 unsigned int g_socket_connections = 0;
 unsigned int g_connection_count = 0;
+unsigned long g_acl_cache_hits = 0;
+#ifdef WITH_TLS
+unsigned long g_tls_handshakes_full = 0;
+unsigned long g_tls_handshakes_resumed = 0;
+#endif
+unsigned long g_acl_cache_misses = 0;
+unsigned long g_log_dropped = 0;
+unsigned long g_log_truncated = 0;
+#ifdef WITH_PERSISTENCE
+unsigned long g_snapshot_duration = 0;
+unsigned long g_snapshot_size = 0;
+#endif
 
 int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db)
 {
@@ -68,10 +89,14 @@ int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db)
 
 	db->last_db_id = 0;
 
-	db->context_count = 1;
-	db->contexts = _mosquitto_malloc(sizeof(struct mosquitto*)*db->context_count);
-	if(!db->contexts) return MOSQ_ERR_NOMEM;
-	db->contexts[0] = NULL;
+	db->contexts = NULL;
+	db->context_count = 0;
+	db->context_size = 0;
+	db->context_free = NULL;
+	db->context_free_count = 0;
+	db->offline_contexts = NULL;
+	db->offline_count = 0;
+	db->offline_size = 0;
 
 	db->subs.next = NULL;
 	db->subs.subs = NULL;
@@ -146,6 +171,9 @@ static void subhier_clean(struct _mosquitto_subhier *subhier)
 
 int mqtt3_db_close(struct mosquitto_db *db)
 {
+#ifdef WITH_PERSISTENCE
+	mqtt3_db_wal_close(db);
+#endif
 	subhier_clean(db->subs.children);
 	mqtt3_db_store_clean(db);
 
@@ -173,10 +201,70 @@ int mqtt3_db_client_count(struct mosquitto_db *db, unsigned int *count, unsigned
 			}
 		}
 	}
+	*count += db->offline_count;
+	*inactive_count += db->offline_count;
 
 	return MOSQ_ERR_SUCCESS;
 }
 
+static void _db_ready_add(struct mosquitto *context)
+{
+	if(context->ready) return;
+
+	context->ready = true;
+	context->ready_prev = NULL;
+	context->ready_next = ready_head;
+	if(ready_head){
+		ready_head->ready_prev = context;
+	}
+	ready_head = context;
+}
+
+void mqtt3_db_ready_remove(struct mosquitto *context)
+{
+	if(!context->ready) return;
+
+	if(context->ready_prev){
+		context->ready_prev->ready_next = context->ready_next;
+	}else if(ready_head == context){
+		ready_head = context->ready_next;
+	}else if(ready_drain == context){
+		ready_drain = context->ready_next;
+	}
+	if(context->ready_next){
+		context->ready_next->ready_prev = context->ready_prev;
+	}
+	context->ready = false;
+	context->ready_prev = NULL;
+	context->ready_next = NULL;
+}
+
+/* Write messages for each context on the ready list. Contexts that become
+ * ready again whilst this is happening are left for the next call. */
+void mqtt3_db_ready_write(struct mosquitto_db *db)
+{
+	struct mosquitto *context;
+
+	ready_drain = ready_head;
+	ready_head = NULL;
+
+	while(ready_drain){
+		context = ready_drain;
+		ready_drain = context->ready_next;
+		if(ready_drain){
+			ready_drain->ready_prev = NULL;
+		}
+		context->ready = false;
+		context->ready_next = NULL;
+
+		if(context->sock != INVALID_SOCKET){
+			if(mqtt3_db_message_write(db, context)){
+				mqtt3_context_disconnect(db, context);
+			}
+		}
+	}
+}
+
 int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir)
 {
 	struct mosquitto_client_msg *tail, *last = NULL;
@@ -185,6 +273,9 @@ int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosqui
 
 	if(!context) return MOSQ_ERR_INVAL;
 
+	/* Removing a message may let a queued one be sent. */
+	_db_ready_add(context);
+
 	tail = context->msgs;
 	while(tail){
 		msg_index++;
@@ -210,6 +301,9 @@ int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosqui
 		}
 		if(tail->mid == mid && tail->direction == dir){
 			msg_index--;
+#ifdef WITH_PERSISTENCE
+			mqtt3_db_wal_client_msg_delete(context, mid, dir);
+#endif
 			/* FIXME - it would be nice to be able to remove the stored message here if ref_count==0 */
 			tail->store->ref_count--;
 			if(last){
@@ -236,6 +330,67 @@ int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosqui
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* True if context has had at least max_output_bytes waiting to be written for
+ * longer than slow_consumer_timeout. */
+static bool _db_slow_consumer_expired(struct mosquitto_db *db, struct mosquitto *context, time_t now)
+{
+	return context->slow_t && now - context->slow_t >= db->config->slow_consumer_timeout;
+}
+
+/* Remove any QoS 0 message for topic that hasn't been serialised for context
+ * yet, so that only the newest value is delivered. */
+static void _db_message_conflate(struct mosquitto *context, const char *topic)
+{
+	struct mosquitto_client_msg *tail, *last = NULL;
+
+	tail = context->msgs;
+	while(tail){
+		if(tail->state == ms_publish_qos0 && tail->direction == mosq_md_out
+				&& !strcmp(tail->store->msg.topic, topic)){
+
+			if(last){
+				last->next = tail->next;
+			}else{
+				context->msgs = tail->next;
+			}
+			tail->store->ref_count--;
+			_mosquitto_free(tail);
+			g_msgs_conflated++;
+			return;
+		}
+		last = tail;
+		tail = tail->next;
+	}
+}
+
+/* Throw away QoS 0 messages that haven't been serialised for context yet. */
+static void _db_messages_unsent_drop(struct mosquitto *context)
+{
+	struct mosquitto_client_msg *tail, *last = NULL;
+
+	tail = context->msgs;
+	while(tail){
+		if(tail->state == ms_publish_qos0 && tail->direction == mosq_md_out){
+			if(last){
+				last->next = tail->next;
+			}else{
+				context->msgs = tail->next;
+			}
+			tail->store->ref_count--;
+			_mosquitto_free(tail);
+			g_msgs_dropped++;
+			if(last){
+				tail = last->next;
+			}else{
+				tail = context->msgs;
+			}
+		}else{
+			last = tail;
+			tail = tail->next;
+		}
+	}
+}
+
 int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored)
 {
 	struct mosquitto_client_msg *msg, *tail = NULL;
@@ -276,6 +431,14 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 				}
 			}
 		}
+	}else if(dir == mosq_md_out && qos == 0 && _db_slow_consumer_expired(db, context, time(NULL))){
+		/* The client isn't keeping up with what is already queued for it. */
+		if(db->config->slow_consumer_policy == scp_drop){
+			g_msgs_dropped++;
+			return 2;
+		}else if(db->config->slow_consumer_policy == scp_conflate){
+			_db_message_conflate(context, stored->msg.topic);
+		}
 	}
 	if(context->msgs){
 		tail = context->msgs;
@@ -351,6 +514,10 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 	}else{
 		context->msgs = msg;
 	}
+	_db_ready_add(context);
+#ifdef WITH_PERSISTENCE
+	mqtt3_db_wal_client_msg_write(context, msg);
+#endif
 
 	if(db->config->allow_duplicate_messages == false && dir == mosq_md_out && retain == false){
 		/* Record which client ids this message has been sent to so we can avoid duplicates.
@@ -395,6 +562,7 @@ int mqtt3_db_message_update(struct mosquitto *context, uint16_t mid, enum mosqui
 		if(tail->mid == mid && tail->direction == dir){
 			tail->state = state;
 			tail->timestamp = time(NULL);
+			_db_ready_add(context);
 			return MOSQ_ERR_SUCCESS;
 		}
 		tail = tail->next;
@@ -499,6 +667,7 @@ int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t
 	}
 	temp->dest_ids = NULL;
 	temp->dest_id_count = 0;
+	temp->persisted = false;
 	db->msg_store_count++;
 	db->msg_store = temp;
 	(*stored) = temp;
@@ -538,6 +707,8 @@ int mqtt3_db_message_reconnect_reset(struct mosquitto *context)
 	struct mosquitto_client_msg *msg;
 	struct mosquitto_client_msg *prev = NULL;
 
+	_db_ready_add(context);
+
 	msg = context->msgs;
 	while(msg){
 		if(msg->direction == mosq_md_out){
@@ -556,6 +727,9 @@ int mqtt3_db_message_reconnect_reset(struct mosquitto *context)
 			}
 		}else{
 			/* Client must resend any partially completed messages. */
+#ifdef WITH_PERSISTENCE
+			mqtt3_db_wal_client_msg_delete(context, msg->mid, msg->direction);
+#endif
 			msg->store->ref_count--;
 			if(prev){
 				prev->next = msg->next;
@@ -634,6 +808,7 @@ int mqtt3_db_message_timeout_check(struct mosquitto_db *db, unsigned int timeout
 					msg->timestamp = time(NULL);
 					msg->state = new_state;
 					msg->dup = true;
+					_db_ready_add(context);
 				}
 			}
 			msg = msg->next;
@@ -655,6 +830,8 @@ int mqtt3_db_message_release(struct mosquitto_db *db, struct mosquitto *context,
 
 	if(!context) return MOSQ_ERR_INVAL;
 
+	_db_ready_add(context);
+
 	tail = context->msgs;
 	while(tail){
 		msg_index++;
@@ -686,6 +863,9 @@ int mqtt3_db_message_release(struct mosquitto_db *db, struct mosquitto *context,
 			source_id = tail->store->source_id;
 
 			if(!mqtt3_db_messages_queue(db, source_id, topic, qos, retain, tail->store)){
+#ifdef WITH_PERSISTENCE
+				mqtt3_db_wal_client_msg_delete(context, mid, dir);
+#endif
 				tail->store->ref_count--;
 				if(last){
 					last->next = tail->next;
@@ -717,7 +897,7 @@ int mqtt3_db_message_release(struct mosquitto_db *db, struct mosquitto *context,
 	}
 }
 
-int mqtt3_db_message_write(struct mosquitto *context)
+int mqtt3_db_message_write(struct mosquitto_db *db, struct mosquitto *context)
 {
 	int rc;
 	struct mosquitto_client_msg *tail, *last = NULL;
@@ -729,17 +909,29 @@ int mqtt3_db_message_write(struct mosquitto *context)
 	uint32_t payloadlen;
 	const void *payload;
 	int msg_count = 0;
+	uint32_t max_output_bytes;
+	time_t now;
 
 	if(!context || context->sock == -1
 			|| (context->state == mosq_cs_connected && !context->id)){
 		return MOSQ_ERR_INVAL;
 	}
+	max_output_bytes = db->config->max_output_bytes;
 
 	tail = context->msgs;
 	while(tail){
 		if(tail->direction == mosq_md_in){
 			msg_count++;
 		}
+		if(max_output_bytes && context->out_packet_bytes >= max_output_bytes
+				&& (tail->state == ms_publish_qos0 || tail->state == ms_publish_qos1 || tail->state == ms_publish_qos2)){
+
+			/* Leave the message as a reference to the store until the client
+			 * has taken some of the data that is already queued. */
+			last = tail;
+			tail = tail->next;
+			continue;
+		}
 		if(tail->state != ms_queued){
 			mid = tail->mid;
 			retries = tail->dup;
@@ -846,6 +1038,31 @@ int mqtt3_db_message_write(struct mosquitto *context)
 		}
 	}
 
+	if(max_output_bytes && context->out_packet_bytes >= max_output_bytes){
+		/* Come back once some of the output has been written. */
+		_db_ready_add(context);
+		now = time(NULL);
+		if(!context->slow_t){
+			context->slow_t = now;
+		}else if(_db_slow_consumer_expired(db, context, now)){
+			switch(db->config->slow_consumer_policy){
+				case scp_disconnect:
+					if(db->config->connection_messages == true){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Client %s is not reading its messages quickly enough, disconnecting.", context->id);
+					}
+					g_slow_disconnects++;
+					return MOSQ_ERR_CONN_LOST;
+				case scp_drop:
+					_db_messages_unsent_drop(context);
+					break;
+				case scp_conflate:
+					break;
+			}
+		}
+	}else{
+		context->slow_t = 0;
+	}
+
 	return MOSQ_ERR_SUCCESS;
 }
 
@@ -885,17 +1102,111 @@ void mqtt3_db_store_clean(struct mosquitto_db *db)
 	}
 }
 
-/* Send messages for the $SYS hierarchy if the last update is longer than
- * 'interval' seconds ago.
- * 'interval' is the amount of seconds between updates. If 0, then no periodic
- * messages are sent for the $SYS hierarchy.
- * 'start_time' is the result of time() that the broker was started at.
- */
-void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_time)
+/* The topic filter of a $SYS subscription that is about to be added. Values
+ * matching it are published by mqtt3_db_sys_refresh() so that they are
+ * up to date when sent to the client as retained messages. */
+static const char *sys_refresh_sub = NULL;
+static time_t sys_start_time = 0;
+
+/* Moving averages published as $SYS/broker/load/<name>/<n>min. */
+#define SYS_LOAD_COUNT 8
+static const char *sys_load_names[SYS_LOAD_COUNT] = {
+	"messages/received",
+	"messages/sent",
+	"publish/received",
+	"publish/sent",
+	"bytes/received",
+	"bytes/sent",
+	"sockets",
+	"connections"
+};
+static const int sys_load_minutes[3] = {1, 5, 15};
+static double sys_load[SYS_LOAD_COUNT][3];
+static double sys_load_sent[SYS_LOAD_COUNT][3]; /* Values last published. */
+
+/* $SYS values are only formatted and published when a client is subscribed to
+ * them. A value that isn't published keeps comparing as changed, so it is sent
+ * as soon as somebody subscribes. */
+static bool _sys_wanted(struct mosquitto_db *db, const char *topic)
+{
+	bool result;
+
+	if(sys_refresh_sub && !mosquitto_topic_matches_sub(sys_refresh_sub, topic, &result) && result){
+		return true;
+	}
+	return mqtt3_sub_has_subscribers(db, topic);
+}
+
+/* Update the connection rate of each listener. elapsed is the time since the
+ * last update, or 0 for the first update. */
+static void _sys_listeners_load_update(struct mosquitto_db *db, time_t elapsed)
+{
+	struct _mqtt3_listener *listener;
+	double accept_interval;
+	int i;
+
+	for(i=0; i<db->config->listener_count; i++){
+		listener = &db->config->listeners[i];
+
+		if(elapsed == 0){
+			listener->sys_accept_load1 = 0;
+			/* Make sure the starting counts get published. */
+			listener->sys_accept_sent = -1;
+			listener->sys_reject_sent = -1;
+		}else{
+			accept_interval = listener->accept_count - listener->sys_accept_count;
+			listener->sys_accept_load1 = accept_interval + exp(-1.0*elapsed/60.0)*(listener->sys_accept_load1 - accept_interval);
+		}
+		listener->sys_accept_count = listener->accept_count;
+	}
+}
+
+/* Publish the connection counters of each listener that somebody is
+ * subscribed to. */
+static void _sys_listeners_publish(struct mosquitto_db *db)
+{
+	struct _mqtt3_listener *listener;
+	char topic[100];
+	char buf[100];
+	int i;
+
+	for(i=0; i<db->config->listener_count; i++){
+		listener = &db->config->listeners[i];
+		if(listener->unix_path) continue; /* No port to name the topics after. */
+
+		if(fabs(listener->sys_accept_load1 - listener->sys_accept_load1_sent) >= 0.01){
+			snprintf(topic, 100, "$SYS/broker/listener/%d/load/connections/1min", listener->port);
+			if(_sys_wanted(db, topic)){
+				listener->sys_accept_load1_sent = listener->sys_accept_load1;
+				snprintf(buf, 100, "%.2f", listener->sys_accept_load1);
+				mqtt3_db_messages_easy_queue(db, NULL, topic, 2, strlen(buf), buf, 1);
+			}
+		}
+		if(listener->accept_count != listener->sys_accept_sent){
+			snprintf(topic, 100, "$SYS/broker/listener/%d/connections/accepted", listener->port);
+			if(_sys_wanted(db, topic)){
+				listener->sys_accept_sent = listener->accept_count;
+				snprintf(buf, 100, "%lu", listener->sys_accept_sent);
+				mqtt3_db_messages_easy_queue(db, NULL, topic, 2, strlen(buf), buf, 1);
+			}
+		}
+		if(listener->reject_count != listener->sys_reject_sent){
+			snprintf(topic, 100, "$SYS/broker/listener/%d/connections/rejected", listener->port);
+			if(_sys_wanted(db, topic)){
+				listener->sys_reject_sent = listener->reject_count;
+				snprintf(buf, 100, "%lu", listener->sys_reject_sent);
+				mqtt3_db_messages_easy_queue(db, NULL, topic, 2, strlen(buf), buf, 1);
+			}
+		}
+	}
+}
+
+/* Publish the $SYS values that have changed since they were last published
+ * and that somebody is subscribed to. */
+static void _sys_publish(struct mosquitto_db *db, time_t now)
 {
-	static time_t last_update = 0;
-	time_t now = time(NULL);
 	time_t uptime;
+	char topic[100];
 	char buf[100];
 	unsigned int value;
 	unsigned int inactive;
@@ -903,6 +1214,9 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 #ifndef WIN32
 	unsigned long value_ul;
 #endif
+	unsigned long value_packets;
+	unsigned long long value_bytes;
+	int i, j;
 
 	static int msg_store_count = -1;
 	static unsigned int client_count = -1;
@@ -910,6 +1224,10 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 	static unsigned int client_max = -1;
 	static unsigned int inactive_count = -1;
 	static unsigned int active_count = -1;
+	static unsigned int slow_count = -1;
+	static unsigned long slow_disconnects = -1;
+	static unsigned long packets_queued = -1;
+	static unsigned long long bytes_queued = -1;
 #ifdef REAL_WITH_MEMORY_TRACKING
 	static unsigned long current_heap = -1;
 	static unsigned long max_heap = -1;
@@ -917,6 +1235,7 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 	static unsigned long msgs_received = -1;
 	static unsigned long msgs_sent = -1;
 	static unsigned long msgs_dropped = -1;
+	static unsigned long msgs_conflated = -1;
 	static unsigned long pub_msgs_received = -1;
 	static unsigned long pub_msgs_sent = -1;
 	static unsigned long long bytes_received = -1;
@@ -925,372 +1244,319 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 	static unsigned long long pub_bytes_sent = -1;
 	static int subscription_count = -1;
 	static int retained_count = -1;
+	static unsigned long acl_cache_hits = -1;
+	static unsigned long acl_cache_misses = -1;
+	static unsigned long log_dropped = -1;
+	static unsigned long log_truncated = -1;
+#ifdef WITH_TLS
+	static unsigned long tls_handshakes_full = -1;
+	static unsigned long tls_handshakes_resumed = -1;
+#endif
+#ifdef WITH_PERSISTENCE
+	static unsigned long snapshot_duration = -1;
+	static unsigned long snapshot_size = -1;
+#endif
 
-	static double msgs_received_load1 = 0;
-	static double msgs_received_load5 = 0;
-	static double msgs_received_load15 = 0;
-	static double msgs_sent_load1 = 0;
-	static double msgs_sent_load5 = 0;
-	static double msgs_sent_load15 = 0;
-	double new_msgs_received_load1, new_msgs_received_load5, new_msgs_received_load15;
-	double new_msgs_sent_load1, new_msgs_sent_load5, new_msgs_sent_load15;
-	double msgs_received_interval, msgs_sent_interval;
-
-	static double publish_received_load1 = 0;
-	static double publish_received_load5 = 0;
-	static double publish_received_load15 = 0;
-	static double publish_sent_load1 = 0;
-	static double publish_sent_load5 = 0;
-	static double publish_sent_load15 = 0;
-	double new_publish_received_load1, new_publish_received_load5, new_publish_received_load15;
-	double new_publish_sent_load1, new_publish_sent_load5, new_publish_sent_load15;
-	double publish_received_interval, publish_sent_interval;
-
-	static double bytes_received_load1 = 0;
-	static double bytes_received_load5 = 0;
-	static double bytes_received_load15 = 0;
-	static double bytes_sent_load1 = 0;
-	static double bytes_sent_load5 = 0;
-	static double bytes_sent_load15 = 0;
-	double new_bytes_received_load1, new_bytes_received_load5, new_bytes_received_load15;
-	double new_bytes_sent_load1, new_bytes_sent_load5, new_bytes_sent_load15;
-	double bytes_received_interval, bytes_sent_interval;
-
-	static double socket_load1 = 0;
-	static double socket_load5 = 0;
-	static double socket_load15 = 0;
-	double new_socket_load1, new_socket_load5, new_socket_load15;
-	double socket_interval;
-
-	static double connection_load1 = 0;
-	static double connection_load5 = 0;
-	static double connection_load15 = 0;
-	double new_connection_load1, new_connection_load5, new_connection_load15;
-	double connection_interval;
-
-	double exponent;
-
-	if(interval && now - interval > last_update){
-		uptime = now - start_time;
+	if(_sys_wanted(db, "$SYS/broker/uptime")){
+		uptime = now - sys_start_time;
 		snprintf(buf, 100, "%d seconds", (int)uptime);
 		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/uptime", 2, strlen(buf), buf, 1);
+	}
 
-		if(last_update > 0){
-			msgs_received_interval = g_msgs_received - msgs_received;
-			msgs_sent_interval = g_msgs_sent - msgs_sent;
-
-			publish_received_interval = g_pub_msgs_received - pub_msgs_received;
-			publish_sent_interval = g_pub_msgs_sent - pub_msgs_sent;
-
-			bytes_received_interval = g_bytes_received - bytes_received;
-			bytes_sent_interval = g_bytes_sent - bytes_sent;
-
-			socket_interval = g_socket_connections;
-			g_socket_connections = 0;
-			connection_interval = g_connection_count;
-			g_connection_count = 0;
-
-			/* 1 minute load */
-			exponent = exp(-1.0*(now-last_update)/60.0);
-
-			new_msgs_received_load1 = msgs_received_interval + exponent*(msgs_received_load1 - msgs_received_interval);
-			if(fabs(new_msgs_received_load1 - msgs_received_load1) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_msgs_received_load1);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/messages/received/1min", 2, strlen(buf), buf, 1);
-			}
-			msgs_received_load1 = new_msgs_received_load1;
-
-			new_msgs_sent_load1 = msgs_sent_interval + exponent*(msgs_sent_load1 - msgs_sent_interval);
-			if(fabs(new_msgs_sent_load1 - msgs_sent_load1) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_msgs_sent_load1);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/messages/sent/1min", 2, strlen(buf), buf, 1);
-			}
-			msgs_sent_load1 = new_msgs_sent_load1;
-
-
-			new_publish_received_load1 = publish_received_interval + exponent*(publish_received_load1 - publish_received_interval);
-			if(fabs(new_publish_received_load1 - publish_received_load1) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_publish_received_load1);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/publish/received/1min", 2, strlen(buf), buf, 1);
-			}
-			publish_received_load1 = new_publish_received_load1;
-
-			new_publish_sent_load1 = publish_sent_interval + exponent*(publish_sent_load1 - publish_sent_interval);
-			if(fabs(new_publish_sent_load1 - publish_sent_load1) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_publish_sent_load1);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/publish/sent/1min", 2, strlen(buf), buf, 1);
-			}
-			publish_sent_load1 = new_publish_sent_load1;
-
-			new_bytes_received_load1 = bytes_received_interval + exponent*(bytes_received_load1 - bytes_received_interval);
-			if(fabs(new_bytes_received_load1 - bytes_received_load1) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_bytes_received_load1);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/bytes/received/1min", 2, strlen(buf), buf, 1);
-			}
-			bytes_received_load1 = new_bytes_received_load1;
-
-			new_bytes_sent_load1 = bytes_sent_interval + exponent*(bytes_sent_load1 - bytes_sent_interval);
-			if(fabs(new_bytes_sent_load1 - bytes_sent_load1) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_bytes_sent_load1);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/bytes/sent/1min", 2, strlen(buf), buf, 1);
-			}
-			bytes_sent_load1 = new_bytes_sent_load1;
-
-			new_socket_load1 = socket_interval + exponent*(socket_load1 - socket_interval);
-			if(fabs(new_socket_load1 - socket_load1) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_socket_load1);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/sockets/1min", 2, strlen(buf), buf, 1);
-			}
-			socket_load1 = new_socket_load1;
-
-			new_connection_load1 = connection_interval + exponent*(connection_load1 - connection_interval);
-			if(fabs(new_connection_load1 - connection_load1) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_connection_load1);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/connections/1min", 2, strlen(buf), buf, 1);
-			}
-			connection_load1 = new_connection_load1;
-
-			/* 5 minute load */
-			exponent = exp(-1.0*(now-last_update)/300.0);
-
-			new_msgs_received_load5 = msgs_received_interval + exponent*(msgs_received_load5 - msgs_received_interval);
-			if(fabs(new_msgs_received_load5 - msgs_received_load5) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_msgs_received_load5);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/messages/received/5min", 2, strlen(buf), buf, 1);
-			}
-			msgs_received_load5 = new_msgs_received_load5;
-
-			new_msgs_sent_load5 = msgs_sent_interval + exponent*(msgs_sent_load5 - msgs_sent_interval);
-			if(fabs(new_msgs_sent_load5 - msgs_sent_load5) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_msgs_sent_load5);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/messages/sent/5min", 2, strlen(buf), buf, 1);
-			}
-			msgs_sent_load5 = new_msgs_sent_load5;
-
-
-			new_publish_received_load5 = publish_received_interval + exponent*(publish_received_load5 - publish_received_interval);
-			if(fabs(new_publish_received_load5 - publish_received_load5) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_publish_received_load5);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/publish/received/5min", 2, strlen(buf), buf, 1);
-			}
-			publish_received_load5 = new_publish_received_load5;
-
-			new_publish_sent_load5 = publish_sent_interval + exponent*(publish_sent_load5 - publish_sent_interval);
-			if(fabs(new_publish_sent_load5 - publish_sent_load5) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_publish_sent_load5);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/publish/sent/5min", 2, strlen(buf), buf, 1);
-			}
-			publish_sent_load5 = new_publish_sent_load5;
-
-
-			new_bytes_received_load5 = bytes_received_interval + exponent*(bytes_received_load5 - bytes_received_interval);
-			if(fabs(new_bytes_received_load5 - bytes_received_load5) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_bytes_received_load5);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/bytes/received/5min", 2, strlen(buf), buf, 1);
-			}
-			bytes_received_load5 = new_bytes_received_load5;
-
-			new_bytes_sent_load5 = bytes_sent_interval + exponent*(bytes_sent_load5 - bytes_sent_interval);
-			if(fabs(new_bytes_sent_load5 - bytes_sent_load5) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_bytes_sent_load5);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/bytes/sent/5min", 2, strlen(buf), buf, 1);
-			}
-			bytes_sent_load5 = new_bytes_sent_load5;
-
-			new_socket_load5 = socket_interval + exponent*(socket_load5 - socket_interval);
-			if(fabs(new_socket_load5 - socket_load5) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_socket_load5);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/sockets/5min", 2, strlen(buf), buf, 1);
-			}
-			socket_load5 = new_socket_load5;
-
-			new_connection_load5 = connection_interval + exponent*(connection_load5 - connection_interval);
-			if(fabs(new_connection_load5 - connection_load5) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_connection_load5);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/connections/5min", 2, strlen(buf), buf, 1);
+	for(i=0; i<SYS_LOAD_COUNT; i++){
+		for(j=0; j<3; j++){
+			if(fabs(sys_load[i][j] - sys_load_sent[i][j]) >= 0.01){
+				snprintf(topic, 100, "$SYS/broker/load/%s/%dmin", sys_load_names[i], sys_load_minutes[j]);
+				if(_sys_wanted(db, topic)){
+					sys_load_sent[i][j] = sys_load[i][j];
+					snprintf(buf, 100, "%.2f", sys_load[i][j]);
+					mqtt3_db_messages_easy_queue(db, NULL, topic, 2, strlen(buf), buf, 1);
+				}
 			}
-			connection_load5 = new_connection_load5;
+		}
+	}
 
-			/* 15 minute load */
-			exponent = exp(-1.0*(now-last_update)/900.0);
+	if(db->msg_store_count != msg_store_count && _sys_wanted(db, "$SYS/broker/messages/stored")){
+		msg_store_count = db->msg_store_count;
+		snprintf(buf, 100, "%d", msg_store_count);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/stored", 2, strlen(buf), buf, 1);
+	}
 
-			new_msgs_received_load15 = msgs_received_interval + exponent*(msgs_received_load15 - msgs_received_interval);
-			if(fabs(new_msgs_received_load15 - msgs_received_load15) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_msgs_received_load15);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/messages/received/15min", 2, strlen(buf), buf, 1);
-			}
-			msgs_received_load15 = new_msgs_received_load15;
+	if(db->subscription_count != subscription_count && _sys_wanted(db, "$SYS/broker/subscriptions/count")){
+		subscription_count = db->subscription_count;
+		snprintf(buf, 100, "%d", subscription_count);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/subscriptions/count", 2, strlen(buf), buf, 1);
+	}
 
-			new_msgs_sent_load15 = msgs_sent_interval + exponent*(msgs_sent_load15 - msgs_sent_interval);
-			if(fabs(new_msgs_sent_load15 - msgs_sent_load15) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_msgs_sent_load15);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/messages/sent/15min", 2, strlen(buf), buf, 1);
-			}
-			msgs_sent_load15 = new_msgs_sent_load15;
+	if(db->retained_count != retained_count && _sys_wanted(db, "$SYS/broker/retained messages/count")){
+		retained_count = db->retained_count;
+		snprintf(buf, 100, "%d", retained_count);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/retained messages/count", 2, strlen(buf), buf, 1);
+	}
 
+	if(!mqtt3_db_client_count(db, &value, &inactive)){
+		if(client_count != value && _sys_wanted(db, "$SYS/broker/clients/total")){
+			client_count = value;
+			snprintf(buf, 100, "%d", client_count);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/total", 2, strlen(buf), buf, 1);
+		}
+		if(inactive_count != inactive && _sys_wanted(db, "$SYS/broker/clients/inactive")){
+			inactive_count = inactive;
+			snprintf(buf, 100, "%d", inactive_count);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/inactive", 2, strlen(buf), buf, 1);
+		}
+		active = value - inactive;
+		if(active_count != active && _sys_wanted(db, "$SYS/broker/clients/active")){
+			active_count = active;
+			snprintf(buf, 100, "%d", active_count);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/active", 2, strlen(buf), buf, 1);
+		}
+		if(value != client_max && _sys_wanted(db, "$SYS/broker/clients/maximum")){
+			client_max = value;
+			snprintf(buf, 100, "%d", client_max);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/maximum", 2, strlen(buf), buf, 1);
+		}
+	}
+	if(g_clients_expired != clients_expired && _sys_wanted(db, "$SYS/broker/clients/expired")){
+		clients_expired = g_clients_expired;
+		snprintf(buf, 100, "%d", clients_expired);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/expired", 2, strlen(buf), buf, 1);
+	}
 
-			new_publish_received_load15 = publish_received_interval + exponent*(publish_received_load15 - publish_received_interval);
-			if(fabs(new_publish_received_load15 - publish_received_load15) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_publish_received_load15);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/publish/received/15min", 2, strlen(buf), buf, 1);
+	value = 0;
+	value_packets = 0;
+	value_bytes = 0;
+	for(i=0; i<db->context_count; i++){
+		if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET){
+			if(db->contexts[i]->slow_t){
+				value++;
 			}
-			publish_received_load15 = new_publish_received_load15;
+			value_packets += db->contexts[i]->out_packet_count;
+			value_bytes += db->contexts[i]->out_packet_bytes;
+		}
+	}
+	if(packets_queued != value_packets && _sys_wanted(db, "$SYS/broker/messages/queued")){
+		packets_queued = value_packets;
+		snprintf(buf, 100, "%lu", packets_queued);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/queued", 2, strlen(buf), buf, 1);
+	}
+	if(bytes_queued != value_bytes && _sys_wanted(db, "$SYS/broker/bytes/queued")){
+		bytes_queued = value_bytes;
+		snprintf(buf, 100, "%llu", bytes_queued);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/bytes/queued", 2, strlen(buf), buf, 1);
+	}
+	if(slow_count != value && _sys_wanted(db, "$SYS/broker/clients/slow")){
+		slow_count = value;
+		snprintf(buf, 100, "%u", slow_count);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/slow", 2, strlen(buf), buf, 1);
+	}
+	if(slow_disconnects != g_slow_disconnects && _sys_wanted(db, "$SYS/broker/clients/slow/disconnected")){
+		slow_disconnects = g_slow_disconnects;
+		snprintf(buf, 100, "%lu", slow_disconnects);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/slow/disconnected", 2, strlen(buf), buf, 1);
+	}
 
-			new_publish_sent_load15 = publish_sent_interval + exponent*(publish_sent_load15 - publish_sent_interval);
-			if(fabs(new_publish_sent_load15 - publish_sent_load15) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_publish_sent_load15);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/publish/sent/15min", 2, strlen(buf), buf, 1);
-			}
-			publish_sent_load15 = new_publish_sent_load15;
+#ifdef REAL_WITH_MEMORY_TRACKING
+	value_ul = _mosquitto_memory_used();
+	if(current_heap != value_ul && _sys_wanted(db, "$SYS/broker/heap/current size")){
+		current_heap = value_ul;
+		snprintf(buf, 100, "%lu", current_heap);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/heap/current size", 2, strlen(buf), buf, 1);
+	}
+	value_ul =_mosquitto_max_memory_used();
+	if(max_heap != value_ul && _sys_wanted(db, "$SYS/broker/heap/maximum size")){
+		max_heap = value_ul;
+		snprintf(buf, 100, "%lu", max_heap);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/heap/maximum size", 2, strlen(buf), buf, 1);
+	}
+#endif
 
+	if(msgs_received != g_msgs_received && _sys_wanted(db, "$SYS/broker/messages/received")){
+		msgs_received = g_msgs_received;
+		snprintf(buf, 100, "%lu", msgs_received);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/received", 2, strlen(buf), buf, 1);
+	}
+	
+	if(msgs_sent != g_msgs_sent && _sys_wanted(db, "$SYS/broker/messages/sent")){
+		msgs_sent = g_msgs_sent;
+		snprintf(buf, 100, "%lu", msgs_sent);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/sent", 2, strlen(buf), buf, 1);
+	}
 
-			new_bytes_received_load15 = bytes_received_interval + exponent*(bytes_received_load15 - bytes_received_interval);
-			if(fabs(new_bytes_received_load15 - bytes_received_load15) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_bytes_received_load15);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/bytes/received/15min", 2, strlen(buf), buf, 1);
-			}
-			bytes_received_load15 = new_bytes_received_load15;
+	if(msgs_dropped != g_msgs_dropped && _sys_wanted(db, "$SYS/broker/messages/dropped")){
+		msgs_dropped = g_msgs_dropped;
+		snprintf(buf, 100, "%lu", msgs_dropped);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/dropped", 2, strlen(buf), buf, 1);
+	}
 
-			new_bytes_sent_load15 = bytes_sent_interval + exponent*(bytes_sent_load15 - bytes_sent_interval);
-			if(fabs(new_bytes_sent_load15 - bytes_sent_load15) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_bytes_sent_load15);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/bytes/sent/15min", 2, strlen(buf), buf, 1);
-			}
-			bytes_sent_load15 = new_bytes_sent_load15;
+	if(msgs_conflated != g_msgs_conflated && _sys_wanted(db, "$SYS/broker/messages/conflated")){
+		msgs_conflated = g_msgs_conflated;
+		snprintf(buf, 100, "%lu", msgs_conflated);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/conflated", 2, strlen(buf), buf, 1);
+	}
 
-			new_socket_load15 = socket_interval + exponent*(socket_load15 - socket_interval);
-			if(fabs(new_socket_load15 - socket_load15) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_socket_load15);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/sockets/15min", 2, strlen(buf), buf, 1);
-			}
-			socket_load15 = new_socket_load15;
+	if(pub_msgs_received != g_pub_msgs_received && _sys_wanted(db, "$SYS/broker/publish/messages/received")){
+		pub_msgs_received = g_pub_msgs_received;
+		snprintf(buf, 100, "%lu", pub_msgs_received);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/received", 2, strlen(buf), buf, 1);
+	}
+	
+	if(pub_msgs_sent != g_pub_msgs_sent && _sys_wanted(db, "$SYS/broker/publish/messages/sent")){
+		pub_msgs_sent = g_pub_msgs_sent;
+		snprintf(buf, 100, "%lu", pub_msgs_sent);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/sent", 2, strlen(buf), buf, 1);
+	}
 
-			new_connection_load15 = connection_interval + exponent*(connection_load15 - connection_interval);
-			if(fabs(new_connection_load15 - connection_load15) >= 0.01){
-				snprintf(buf, 100, "%.2f", new_connection_load15);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/load/connections/15min", 2, strlen(buf), buf, 1);
-			}
-			connection_load15 = new_connection_load15;
-		}
+	if(bytes_received != g_bytes_received && _sys_wanted(db, "$SYS/broker/bytes/received")){
+		bytes_received = g_bytes_received;
+		snprintf(buf, 100, "%llu", bytes_received);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/bytes/received", 2, strlen(buf), buf, 1);
+	}
+	
+	if(bytes_sent != g_bytes_sent && _sys_wanted(db, "$SYS/broker/bytes/sent")){
+		bytes_sent = g_bytes_sent;
+		snprintf(buf, 100, "%llu", bytes_sent);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/bytes/sent", 2, strlen(buf), buf, 1);
+	}
+	
+	if(pub_bytes_received != g_pub_bytes_received && _sys_wanted(db, "$SYS/broker/publish/bytes/received")){
+		pub_bytes_received = g_pub_bytes_received;
+		snprintf(buf, 100, "%llu", pub_bytes_received);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/bytes/received", 2, strlen(buf), buf, 1);
+	}
 
-		if(db->msg_store_count != msg_store_count){
-			msg_store_count = db->msg_store_count;
-			snprintf(buf, 100, "%d", msg_store_count);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/stored", 2, strlen(buf), buf, 1);
-		}
+	if(pub_bytes_sent != g_pub_bytes_sent && _sys_wanted(db, "$SYS/broker/publish/bytes/sent")){
+		pub_bytes_sent = g_pub_bytes_sent;
+		snprintf(buf, 100, "%llu", pub_bytes_sent);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/bytes/sent", 2, strlen(buf), buf, 1);
+	}
 
-		if(db->subscription_count != subscription_count){
-			subscription_count = db->subscription_count;
-			snprintf(buf, 100, "%d", subscription_count);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/subscriptions/count", 2, strlen(buf), buf, 1);
+	if(db->config->acl_cache_size > 0){
+		if(acl_cache_hits != g_acl_cache_hits && _sys_wanted(db, "$SYS/broker/acl/cache/hits")){
+			acl_cache_hits = g_acl_cache_hits;
+			snprintf(buf, 100, "%lu", acl_cache_hits);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/acl/cache/hits", 2, strlen(buf), buf, 1);
 		}
-
-		if(db->retained_count != retained_count){
-			retained_count = db->retained_count;
-			snprintf(buf, 100, "%d", retained_count);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/retained messages/count", 2, strlen(buf), buf, 1);
+		if(acl_cache_misses != g_acl_cache_misses && _sys_wanted(db, "$SYS/broker/acl/cache/misses")){
+			acl_cache_misses = g_acl_cache_misses;
+			snprintf(buf, 100, "%lu", acl_cache_misses);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/acl/cache/misses", 2, strlen(buf), buf, 1);
 		}
+	}
 
-		if(!mqtt3_db_client_count(db, &value, &inactive)){
-			if(client_count != value){
-				client_count = value;
-				snprintf(buf, 100, "%d", client_count);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/total", 2, strlen(buf), buf, 1);
-			}
-			if(inactive_count != inactive){
-				inactive_count = inactive;
-				snprintf(buf, 100, "%d", inactive_count);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/inactive", 2, strlen(buf), buf, 1);
-			}
-			active = client_count - inactive;
-			if(active_count != active){
-				active_count = active;
-				snprintf(buf, 100, "%d", active_count);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/active", 2, strlen(buf), buf, 1);
-			}
-			if(value != client_max){
-				client_max = value;
-				snprintf(buf, 100, "%d", client_max);
-				mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/maximum", 2, strlen(buf), buf, 1);
-			}
-		}
-		if(g_clients_expired != clients_expired){
-			clients_expired = g_clients_expired;
-			snprintf(buf, 100, "%d", clients_expired);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/clients/expired", 2, strlen(buf), buf, 1);
-		}
+	if(log_dropped != g_log_dropped && _sys_wanted(db, "$SYS/broker/logging/dropped")){
+		log_dropped = g_log_dropped;
+		snprintf(buf, 100, "%lu", log_dropped);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/logging/dropped", 2, strlen(buf), buf, 1);
+	}
+	if(log_truncated != g_log_truncated && _sys_wanted(db, "$SYS/broker/logging/truncated")){
+		log_truncated = g_log_truncated;
+		snprintf(buf, 100, "%lu", log_truncated);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/logging/truncated", 2, strlen(buf), buf, 1);
+	}
 
-#ifdef REAL_WITH_MEMORY_TRACKING
-		value_ul = _mosquitto_memory_used();
-		if(current_heap != value_ul){
-			current_heap = value_ul;
-			snprintf(buf, 100, "%lu", current_heap);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/heap/current size", 2, strlen(buf), buf, 1);
-		}
-		value_ul =_mosquitto_max_memory_used();
-		if(max_heap != value_ul){
-			max_heap = value_ul;
-			snprintf(buf, 100, "%lu", max_heap);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/heap/maximum size", 2, strlen(buf), buf, 1);
-		}
+#ifdef WITH_TLS
+	if(tls_handshakes_full != g_tls_handshakes_full && _sys_wanted(db, "$SYS/broker/tls/handshakes/full")){
+		tls_handshakes_full = g_tls_handshakes_full;
+		snprintf(buf, 100, "%lu", tls_handshakes_full);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/tls/handshakes/full", 2, strlen(buf), buf, 1);
+	}
+	if(tls_handshakes_resumed != g_tls_handshakes_resumed && _sys_wanted(db, "$SYS/broker/tls/handshakes/resumed")){
+		tls_handshakes_resumed = g_tls_handshakes_resumed;
+		snprintf(buf, 100, "%lu", tls_handshakes_resumed);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/tls/handshakes/resumed", 2, strlen(buf), buf, 1);
+	}
 #endif
 
-		if(msgs_received != g_msgs_received){
-			msgs_received = g_msgs_received;
-			snprintf(buf, 100, "%lu", msgs_received);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/received", 2, strlen(buf), buf, 1);
-		}
-		
-		if(msgs_sent != g_msgs_sent){
-			msgs_sent = g_msgs_sent;
-			snprintf(buf, 100, "%lu", msgs_sent);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/sent", 2, strlen(buf), buf, 1);
-		}
-
-		if(msgs_dropped != g_msgs_dropped){
-			msgs_dropped = g_msgs_dropped;
-			snprintf(buf, 100, "%lu", msgs_dropped);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/dropped", 2, strlen(buf), buf, 1);
-		}
+#ifdef WITH_PERSISTENCE
+	if(db->config->persistence && snapshot_duration != g_snapshot_duration && _sys_wanted(db, "$SYS/broker/persistence/snapshot/duration")){
+		snapshot_duration = g_snapshot_duration;
+		snprintf(buf, 100, "%lu", snapshot_duration);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/persistence/snapshot/duration", 2, strlen(buf), buf, 1);
+	}
+	if(db->config->persistence && snapshot_size != g_snapshot_size && _sys_wanted(db, "$SYS/broker/persistence/snapshot/size")){
+		snapshot_size = g_snapshot_size;
+		snprintf(buf, 100, "%lu", snapshot_size);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/persistence/snapshot/size", 2, strlen(buf), buf, 1);
+	}
+#endif
 
-		if(pub_msgs_received != g_pub_msgs_received){
-			pub_msgs_received = g_pub_msgs_received;
-			snprintf(buf, 100, "%lu", pub_msgs_received);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/received", 2, strlen(buf), buf, 1);
-		}
-		
-		if(pub_msgs_sent != g_pub_msgs_sent){
-			pub_msgs_sent = g_pub_msgs_sent;
-			snprintf(buf, 100, "%lu", pub_msgs_sent);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/sent", 2, strlen(buf), buf, 1);
-		}
+	_sys_listeners_publish(db);
+}
 
-		if(bytes_received != g_bytes_received){
-			bytes_received = g_bytes_received;
-			snprintf(buf, 100, "%llu", bytes_received);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/bytes/received", 2, strlen(buf), buf, 1);
-		}
-		
-		if(bytes_sent != g_bytes_sent){
-			bytes_sent = g_bytes_sent;
-			snprintf(buf, 100, "%llu", bytes_sent);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/bytes/sent", 2, strlen(buf), buf, 1);
+/* Send messages for the $SYS hierarchy if the last update is longer than
+ * 'interval' seconds ago.
+ * 'interval' is the amount of seconds between updates. If 0, then no periodic
+ * messages are sent for the $SYS hierarchy.
+ * 'start_time' is the result of time() that the broker was started at.
+ * With no $SYS subscriptions at all, only the load averages are kept up to
+ * date.
+ */
+void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_time)
+{
+	static time_t last_update = 0;
+	time_t now;
+	static uint64_t load_count[SYS_LOAD_COUNT];
+	double load_interval[SYS_LOAD_COUNT];
+	double exponent;
+	int i, j;
+
+	sys_start_time = start_time;
+	now = time(NULL);
+	if(!interval || now - interval <= last_update) return;
+
+	/* The load averages need every interval, whether or not anybody is
+	 * subscribed to them. */
+	if(last_update > 0){
+		load_interval[0] = g_msgs_received - load_count[0];
+		load_interval[1] = g_msgs_sent - load_count[1];
+		load_interval[2] = g_pub_msgs_received - load_count[2];
+		load_interval[3] = g_pub_msgs_sent - load_count[3];
+		load_interval[4] = g_bytes_received - load_count[4];
+		load_interval[5] = g_bytes_sent - load_count[5];
+		load_interval[6] = g_socket_connections;
+		g_socket_connections = 0;
+		load_interval[7] = g_connection_count;
+		g_connection_count = 0;
+
+		for(j=0; j<3; j++){
+			exponent = exp(-1.0*(now-last_update)/(60.0*sys_load_minutes[j]));
+			for(i=0; i<SYS_LOAD_COUNT; i++){
+				sys_load[i][j] = load_interval[i] + exponent*(sys_load[i][j] - load_interval[i]);
+			}
 		}
-		
-		if(pub_bytes_received != g_pub_bytes_received){
-			pub_bytes_received = g_pub_bytes_received;
-			snprintf(buf, 100, "%llu", pub_bytes_received);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/bytes/received", 2, strlen(buf), buf, 1);
+	}else{
+		/* Make sure the starting loads get published. */
+		for(i=0; i<SYS_LOAD_COUNT; i++){
+			for(j=0; j<3; j++){
+				sys_load_sent[i][j] = -1;
+			}
 		}
+	}
+	load_count[0] = g_msgs_received;
+	load_count[1] = g_msgs_sent;
+	load_count[2] = g_pub_msgs_received;
+	load_count[3] = g_pub_msgs_sent;
+	load_count[4] = g_bytes_received;
+	load_count[5] = g_bytes_sent;
+
+	_sys_listeners_load_update(db, last_update > 0 ? now - last_update : 0);
+	last_update = now;
+
+	if(mqtt3_sub_sys_subscribed(db)){
+		_sys_publish(db, now);
+	}
+}
 
-		if(pub_bytes_sent != g_pub_bytes_sent){
-			pub_bytes_sent = g_pub_bytes_sent;
-			snprintf(buf, 100, "%llu", pub_bytes_sent);
-			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/bytes/sent", 2, strlen(buf), buf, 1);
-		}
+/* Publish the $SYS values matching sub, which a client is about to subscribe
+ * to, so that the retained messages it is sent are up to date. */
+void mqtt3_db_sys_refresh(struct mosquitto_db *db, const char *sub)
+{
+	if(!db->config->sys_interval) return;
 
-		last_update = time(NULL);
-	}
+	sys_refresh_sub = sub;
+	_sys_publish(db, time(NULL));
+	sys_refresh_sub = NULL;
 }
 
 void mqtt3_db_limits_set(int inflight, int queued)
@@ -38,11 +38,12 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <mosquitto_broker.h>
 #include <memory_mosq.h>
+#include <crc32c.h>
 #include <persist.h>
 
 static uint32_t db_version;
 
-static int _db_client_chunk_restore(mosquitto_db *db, FILE *db_fd)
+static int _db_client_chunk_restore(struct mosquitto_db *db, FILE *db_fd)
 {
 	uint16_t i16temp, slen, last_mid;
 	char *client_id = NULL;
@@ -86,7 +87,7 @@ error:
 	return 1;
 }
 
-static int _db_client_msg_chunk_restore(mosquitto_db *db, FILE *db_fd)
+static int _db_client_msg_chunk_restore(struct mosquitto_db *db, FILE *db_fd)
 {
 	dbid_t i64temp, store_id;
 	uint16_t i16temp, slen, mid;
@@ -138,7 +139,7 @@ error:
 	return 1;
 }
 
-static int _db_msg_store_chunk_restore(mosquitto_db *db, FILE *db_fd)
+static int _db_msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fd)
 {
 	dbid_t i64temp, store_id;
 	uint32_t i32temp, payloadlen;
@@ -251,7 +252,7 @@ error:
 	return 1;
 }
 
-static int _db_retain_chunk_restore(mosquitto_db *db, FILE *db_fd)
+static int _db_retain_chunk_restore(struct mosquitto_db *db, FILE *db_fd)
 {
 	dbid_t i64temp, store_id;
 
@@ -265,7 +266,7 @@ static int _db_retain_chunk_restore(mosquitto_db *db, FILE *db_fd)
 	return 0;
 }
 
-static int _db_sub_chunk_restore(mosquitto_db *db, FILE *db_fd)
+static int _db_sub_chunk_restore(struct mosquitto_db *db, FILE *db_fd)
 {
 	uint16_t i16temp, slen;
 	uint8_t qos;
@@ -306,6 +307,159 @@ error:
 	return 1;
 }
 
+static int _db_string_print(FILE *db_fd, const char *name)
+{
+	uint16_t i16temp, slen;
+	char *str;
+
+	read_e(db_fd, &i16temp, sizeof(uint16_t));
+	slen = ntohs(i16temp);
+	str = calloc(slen+1, sizeof(char));
+	if(!str){
+		fprintf(stderr, "Error: Out of memory.");
+		return 1;
+	}
+	if(fread(str, 1, slen, db_fd) != slen){
+		free(str);
+		goto error;
+	}
+	printf("\t%s: %s\n", name, str);
+	free(str);
+
+	return 0;
+error:
+	fprintf(stderr, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+static int _db_client_msg_delete_chunk_print(FILE *db_fd)
+{
+	uint16_t i16temp;
+	uint8_t direction;
+
+	if(_db_string_print(db_fd, "Client ID")) return 1;
+	read_e(db_fd, &i16temp, sizeof(uint16_t));
+	printf("\tMID: %d\n", ntohs(i16temp));
+	read_e(db_fd, &direction, sizeof(uint8_t));
+	printf("\tDirection: %d\n", direction);
+
+	return 0;
+error:
+	fprintf(stderr, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+static int _db_uint64_read(FILE *db_fd, uint64_t *value)
+{
+	uint32_t hi, lo;
+
+	read_e(db_fd, &hi, sizeof(uint32_t));
+	read_e(db_fd, &lo, sizeof(uint32_t));
+	*value = ((uint64_t)ntohl(hi) << 32) | ntohl(lo);
+
+	return 0;
+error:
+	return 1;
+}
+
+static int _db_index_print(FILE *db_fd)
+{
+	uint16_t i16temp, count, type;
+	uint32_t i32temp;
+	uint64_t first, end;
+	int i;
+
+	read_e(db_fd, &i16temp, sizeof(uint16_t));
+	count = ntohs(i16temp);
+	printf("\tEntries: %d\n", count);
+	for(i=0; i<count; i++){
+		read_e(db_fd, &i16temp, sizeof(uint16_t));
+		type = ntohs(i16temp);
+		read_e(db_fd, &i32temp, sizeof(uint32_t));
+		if(_db_uint64_read(db_fd, &first)) goto error;
+		if(_db_uint64_read(db_fd, &end)) goto error;
+		printf("\tChunk %d: count %u, offsets %llu-%llu\n", type, ntohl(i32temp),
+				(unsigned long long)first, (unsigned long long)end);
+	}
+
+	return 0;
+error:
+	fprintf(stderr, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+/* Use the index at the end of a version 4 snapshot to find the range of the
+ * file that holds chunks of the given type. Returns 0 if found, -1 if the
+ * file has no index and 1 if it has none of that type. */
+static int _db_index_find(FILE *db_fd, uint16_t chunk_type, long *start, long *end)
+{
+	uint64_t index_offset, first, last;
+	uint16_t i16temp, count;
+	uint32_t i32temp;
+	int i;
+
+	if(fseek(db_fd, -8, SEEK_END)) return -1;
+	if(_db_uint64_read(db_fd, &index_offset)) return -1;
+	if(fseek(db_fd, index_offset, SEEK_SET)) return -1;
+	read_e(db_fd, &i16temp, sizeof(uint16_t));
+	if(ntohs(i16temp) != DB_CHUNK_INDEX) return -1;
+	read_e(db_fd, &i32temp, sizeof(uint32_t));
+
+	read_e(db_fd, &i16temp, sizeof(uint16_t));
+	count = ntohs(i16temp);
+	for(i=0; i<count; i++){
+		read_e(db_fd, &i16temp, sizeof(uint16_t));
+		read_e(db_fd, &i32temp, sizeof(uint32_t));
+		if(_db_uint64_read(db_fd, &first)) return -1;
+		if(_db_uint64_read(db_fd, &last)) return -1;
+		if(ntohs(i16temp) == chunk_type){
+			*start = first;
+			*end = last;
+			return 0;
+		}
+	}
+	return 1;
+error:
+	return -1;
+}
+
+/* Check the CRC-32C that follows each chunk in version 4 files. Leaves the
+ * file positioned at the start of the chunk body. */
+static int _db_chunk_crc_check(FILE *db_fd, long start, uint32_t length)
+{
+	uint8_t *buf;
+	uint32_t crc, i32temp;
+	size_t len = sizeof(uint16_t) + sizeof(uint32_t) + length;
+
+	buf = malloc(len);
+	if(!buf){
+		fprintf(stderr, "Error: Out of memory.");
+		return 1;
+	}
+	if(fseek(db_fd, start, SEEK_SET) || fread(buf, 1, len, db_fd) != len
+			|| fread(&i32temp, sizeof(uint32_t), 1, db_fd) != 1){
+
+		free(buf);
+		printf("\tCRC: missing\n");
+		return 1;
+	}
+	crc = mqtt3_crc32c(0, buf, len);
+	free(buf);
+	if(crc == ntohl(i32temp)){
+		printf("\tCRC: ok\n");
+	}else{
+		printf("\tCRC: BAD (expected 0x%08x, calculated 0x%08x)\n", ntohl(i32temp), crc);
+	}
+	fseek(db_fd, start + sizeof(uint16_t) + sizeof(uint32_t), SEEK_SET);
+	return crc != ntohl(i32temp);
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: db_dump [-t chunk type] <mosquitto db or wal filename>\n");
+	fprintf(stderr, "       -t only print chunks of this type, using the index if the file has one.\n");
+}
+
 int main(int argc, char *argv[])
 {
 	FILE *fd;
@@ -317,40 +471,113 @@ int main(int argc, char *argv[])
 	uint16_t i16temp, chunk;
 	uint8_t i8temp;
 	ssize_t rlen;
-	mosquitto_db db;
-
-	if(argc != 2){
-		fprintf(stderr, "Usage: db_dump <mosquitto db filename>\n");
+	struct mosquitto_db db;
+	int chunk_filter = 0;
+	long start, end = -1;
+	int bad_crc = 0;
+
+	if(argc == 4 && !strcmp(argv[1], "-t")){
+		chunk_filter = atoi(argv[2]);
+	}else if(argc != 2){
+		print_usage();
 		return 1;
 	}
-	memset(&db, 0, sizeof(mosquitto_db));
-	fd = fopen(argv[1], "rb");
+	memset(&db, 0, sizeof(struct mosquitto_db));
+	fd = fopen(argv[argc-1], "rb");
 	if(!fd) return 0;
 	read_e(fd, &header, 15);
 	if(!memcmp(header, magic, 15)){
 		printf("Mosquitto DB dump\n");
 		// Restore DB as normal
 		read_e(fd, &crc, sizeof(uint32_t));
-		printf("CRC: %d\n", crc);
+		printf("CRC: %u\n", ntohl(crc));
 		read_e(fd, &i32temp, sizeof(uint32_t));
 		db_version = ntohl(i32temp);
 		printf("DB version: %d\n", db_version);
+		if(db_version >= 4){
+			if(ntohl(crc) != mqtt3_crc32c(mqtt3_crc32c(0, magic, 15), &i32temp, sizeof(uint32_t))){
+				printf("Header CRC: BAD\n");
+				bad_crc++;
+			}
+		}
+
+		if(chunk_filter && db_version >= 4){
+			rc = _db_index_find(fd, chunk_filter, &start, &end);
+			if(rc > 0){
+				fclose(fd);
+				return 0;
+			}else if(rc == 0){
+				printf("Index: chunk %d at offsets %ld-%ld\n", chunk_filter, start, end);
+				fseek(fd, start, SEEK_SET);
+			}else{
+				/* No index, read the whole file. */
+				end = -1;
+				fseek(fd, 15 + 2*sizeof(uint32_t), SEEK_SET);
+			}
+			rc = 0;
+		}
 
-		while(rlen = fread(&i16temp, sizeof(uint16_t), 1, fd), rlen == 1){
+		while((end < 0 || ftell(fd) < end)
+				&& (rlen = fread(&i16temp, sizeof(uint16_t), 1, fd), rlen == 1)){
+
+			start = ftell(fd) - sizeof(uint16_t);
 			chunk = ntohs(i16temp);
 			read_e(fd, &i32temp, sizeof(uint32_t));
 			length = ntohl(i32temp);
+			if(chunk_filter && chunk != chunk_filter){
+				fseek(fd, length + (db_version >= 4?sizeof(uint32_t):0), SEEK_CUR);
+				continue;
+			}
 			switch(chunk){
 				case DB_CHUNK_CFG:
 					printf("DB_CHUNK_CFG:\n");
-					printf("\tLength: %d\n", length);
+					break;
+				case DB_CHUNK_MSG_STORE:
+					printf("DB_CHUNK_MSG_STORE:\n");
+					break;
+				case DB_CHUNK_CLIENT_MSG:
+					printf("DB_CHUNK_CLIENT_MSG:\n");
+					break;
+				case DB_CHUNK_RETAIN:
+					printf("DB_CHUNK_RETAIN:\n");
+					break;
+				case DB_CHUNK_SUB:
+					printf("DB_CHUNK_SUB:\n");
+					break;
+				case DB_CHUNK_CLIENT:
+					printf("DB_CHUNK_CLIENT:\n");
+					break;
+				case DB_CHUNK_CLIENT_MSG_DELETE:
+					printf("DB_CHUNK_CLIENT_MSG_DELETE:\n");
+					break;
+				case DB_CHUNK_SUB_DELETE:
+					printf("DB_CHUNK_SUB_DELETE:\n");
+					break;
+				case DB_CHUNK_CLIENT_DELETE:
+					printf("DB_CHUNK_CLIENT_DELETE:\n");
+					break;
+				case DB_CHUNK_INDEX:
+					printf("DB_CHUNK_INDEX:\n");
+					break;
+				default:
+					fprintf(stderr, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
+					fseek(fd, length + (db_version >= 4?sizeof(uint32_t):0), SEEK_CUR);
+					continue;
+			}
+			printf("\tLength: %d\n", length);
+			if(db_version >= 4 && _db_chunk_crc_check(fd, start, length)){
+				bad_crc++;
+			}
+
+			switch(chunk){
+				case DB_CHUNK_CFG:
 					read_e(fd, &i8temp, sizeof(uint8_t)); // shutdown
 					printf("\tShutdown: %d\n", i8temp);
 					read_e(fd, &i8temp, sizeof(uint8_t)); // sizeof(dbid_t)
 					printf("\tDB ID size: %d\n", i8temp);
 					if(i8temp != sizeof(dbid_t)){
 						fprintf(stderr, "Error: Incompatible database configuration (dbid size is %d bytes, expected %d)",
-								i8temp, sizeof(dbid_t));
+								i8temp, (int)sizeof(dbid_t));
 						fclose(fd);
 						return 1;
 					}
@@ -359,42 +586,53 @@ int main(int argc, char *argv[])
 					break;
 
 				case DB_CHUNK_MSG_STORE:
-					printf("DB_CHUNK_MSG_STORE:\n");
-					printf("\tLength: %d\n", length);
 					if(_db_msg_store_chunk_restore(&db, fd)) return 1;
 					break;
 
 				case DB_CHUNK_CLIENT_MSG:
-					printf("DB_CHUNK_CLIENT_MSG:\n");
-					printf("\tLength: %d\n", length);
 					if(_db_client_msg_chunk_restore(&db, fd)) return 1;
 					break;
 
 				case DB_CHUNK_RETAIN:
-					printf("DB_CHUNK_RETAIN:\n");
-					printf("\tLength: %d\n", length);
 					if(_db_retain_chunk_restore(&db, fd)) return 1;
 					break;
 
 				case DB_CHUNK_SUB:
-					printf("DB_CHUNK_SUB:\n");
-					printf("\tLength: %d\n", length);
 					if(_db_sub_chunk_restore(&db, fd)) return 1;
 					break;
 
 				case DB_CHUNK_CLIENT:
-					printf("DB_CHUNK_CLIENT:\n");
-					printf("\tLength: %d\n", length);
 					if(_db_client_chunk_restore(&db, fd)) return 1;
 					break;
 
-				default:
-					fprintf(stderr, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
-					fseek(fd, length, SEEK_CUR);
+				case DB_CHUNK_CLIENT_MSG_DELETE:
+					if(_db_client_msg_delete_chunk_print(fd)) return 1;
+					break;
+
+				case DB_CHUNK_SUB_DELETE:
+					if(_db_string_print(fd, "Client ID")) return 1;
+					if(_db_string_print(fd, "Topic")) return 1;
+					break;
+
+				case DB_CHUNK_CLIENT_DELETE:
+					if(_db_string_print(fd, "Client ID")) return 1;
+					break;
+
+				case DB_CHUNK_INDEX:
+					if(_db_index_print(fd)) return 1;
 					break;
 			}
+			/* Skip the checksum, and anything in the chunk that wasn't read. */
+			fseek(fd, start + sizeof(uint16_t) + sizeof(uint32_t) + length + (db_version >= 4?sizeof(uint32_t):0), SEEK_SET);
+			if(chunk == DB_CHUNK_INDEX){
+				/* Only the index offset follows. */
+				break;
+			}
+		}
+		if(bad_crc){
+			printf("%d bad checksums.\n", bad_crc);
+			rc = 1;
 		}
-		if(rlen < 0) goto error;
 	}else{
 		fprintf(stderr, "Error: Unrecognised file format.");
 		rc = 1;
@@ -408,4 +646,3 @@ error:
 	if(fd >= 0) fclose(fd);
 	return 1;
 }
-
@@ -0,0 +1,350 @@
+/*
+Copyright (c) 2013 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#include <stdio.h>
+#ifndef WIN32
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <syslog.h>
+#else
+#include <windows.h>
+#endif
+
+#include <mosquitto.h>
+#include <log_thread.h>
+
+#ifdef WIN32
+extern HANDLE syslog_h;
+#endif
+
+static int _log_syslog_priority(int priority)
+{
+	switch(priority){
+		case MOSQ_LOG_DEBUG:
+#ifndef WIN32
+			return LOG_DEBUG;
+#else
+			return EVENTLOG_INFORMATION_TYPE;
+#endif
+		case MOSQ_LOG_WARNING:
+#ifndef WIN32
+			return LOG_WARNING;
+#else
+			return EVENTLOG_WARNING_TYPE;
+#endif
+		case MOSQ_LOG_NOTICE:
+#ifndef WIN32
+			return LOG_NOTICE;
+#else
+			return EVENTLOG_INFORMATION_TYPE;
+#endif
+		case MOSQ_LOG_INFO:
+#ifndef WIN32
+			return LOG_INFO;
+#else
+			return EVENTLOG_INFORMATION_TYPE;
+#endif
+		case MOSQ_LOG_ERR:
+		default:
+#ifndef WIN32
+			return LOG_ERR;
+#else
+			return EVENTLOG_ERROR_TYPE;
+#endif
+	}
+}
+
+/* Write a record to stdout, stderr and syslog. The caller is responsible for
+ * flushing stdout/stderr. */
+static void _log_output(const struct mqtt3_log_record *rec)
+{
+#ifdef WIN32
+	char *sp;
+#endif
+
+	if(rec->flags & MQTT3_LOG_RECORD_STDOUT){
+		if(rec->flags & MQTT3_LOG_RECORD_TIMESTAMP){
+			fprintf(stdout, "%d: %s\n", (int)rec->timestamp, rec->text);
+		}else{
+			fprintf(stdout, "%s\n", rec->text);
+		}
+	}
+	if(rec->flags & MQTT3_LOG_RECORD_STDERR){
+		if(rec->flags & MQTT3_LOG_RECORD_TIMESTAMP){
+			fprintf(stderr, "%d: %s\n", (int)rec->timestamp, rec->text);
+		}else{
+			fprintf(stderr, "%s\n", rec->text);
+		}
+	}
+	if(rec->flags & MQTT3_LOG_RECORD_SYSLOG){
+#ifndef WIN32
+		syslog(_log_syslog_priority(rec->priority), "%s", rec->text);
+#else
+		sp = (char *)rec->text;
+		ReportEvent(syslog_h, _log_syslog_priority(rec->priority), 0, 0, NULL, 1, 0, &sp, NULL);
+#endif
+	}
+}
+
+static void _log_flush(int flags)
+{
+	if(flags & MQTT3_LOG_RECORD_STDOUT){
+		fflush(stdout);
+	}
+	if(flags & MQTT3_LOG_RECORD_STDERR){
+		fflush(stderr);
+	}
+}
+
+void mqtt3_log_record_write(const struct mqtt3_log_record *rec)
+{
+	_log_output(rec);
+	_log_flush(rec->flags);
+}
+
+#ifndef WIN32
+extern unsigned long g_log_dropped;
+
+/* A slot is claimed by advancing log_head and handed over by setting its seq,
+ * so adding a record never blocks or allocates. */
+#define LOG_RING_SIZE 1024 /* Must be a power of two. */
+
+static struct mqtt3_log_record *log_ring = NULL;
+static volatile unsigned long log_head = 0;
+static unsigned long log_tail = 0; /* Only used by log_thread. */
+static pthread_t log_thread;
+static bool log_thread_running = false;
+static volatile bool log_thread_stop = false;
+static volatile bool log_thread_waiting = false;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+
+/* Write out every complete record in the ring. Returns the destinations that
+ * need flushing. Only one thread may drain the ring at once. */
+static int _log_ring_drain(int *last_flags)
+{
+	struct mqtt3_log_record *rec;
+	int flags = 0;
+
+	while(1){
+		rec = &log_ring[log_tail & (LOG_RING_SIZE-1)];
+		if(rec->seq != log_tail+1) break;
+		__sync_synchronize();
+
+		_log_output(rec);
+		flags |= rec->flags;
+		*last_flags = rec->flags;
+
+		__sync_synchronize();
+		rec->seq = log_tail + LOG_RING_SIZE;
+		log_tail++;
+	}
+	return flags;
+}
+
+static void *_log_thread_main(void *arg)
+{
+	unsigned long dropped = 0;
+	unsigned long value_ul;
+	struct mqtt3_log_record warning;
+	int last_flags = 0;
+	struct timespec ts;
+	int flags;
+
+	while(1){
+		flags = _log_ring_drain(&last_flags);
+
+		value_ul = g_log_dropped;
+		if(value_ul != dropped){
+			/* Goes wherever the last record went. */
+			warning.timestamp = time(NULL);
+			warning.priority = MOSQ_LOG_WARNING;
+			warning.flags = last_flags;
+			snprintf(warning.text, MQTT3_LOG_RECORD_SIZE, "Warning: %lu log messages dropped.", value_ul - dropped);
+			_log_output(&warning);
+			flags |= last_flags;
+			dropped = value_ul;
+		}
+		if(flags){
+			_log_flush(flags);
+			continue;
+		}
+		if(log_thread_stop) break;
+
+		/* Producers don't take log_mutex, so a wakeup can be missed. The
+		 * timeout bounds how long a record can wait in that case. */
+		pthread_mutex_lock(&log_mutex);
+		log_thread_waiting = true;
+		__sync_synchronize();
+		if(log_ring[log_tail & (LOG_RING_SIZE-1)].seq != log_tail+1 && !log_thread_stop){
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 100000000;
+			if(ts.tv_nsec >= 1000000000){
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&log_cond, &log_mutex, &ts);
+		}
+		log_thread_waiting = false;
+		pthread_mutex_unlock(&log_mutex);
+	}
+	return NULL;
+}
+
+/* A forked child has no log thread, so must log synchronously. */
+static void _log_atfork_child(void)
+{
+	log_thread_running = false;
+}
+
+int mqtt3_log_thread_start(void)
+{
+	static bool atfork_registered = false;
+	sigset_t sigs, oldsigs;
+	unsigned long i;
+	int rc;
+
+	if(log_thread_running) return 0;
+
+	if(!log_ring){
+		/* Not tracked, log_thread reads it without the memory lock. */
+		log_ring = calloc(LOG_RING_SIZE, sizeof(struct mqtt3_log_record));
+		if(!log_ring) return 1;
+		for(i=0; i<LOG_RING_SIZE; i++){
+			log_ring[i].seq = i;
+		}
+		log_head = 0;
+		log_tail = 0;
+	}
+	if(!atfork_registered){
+		pthread_atfork(NULL, NULL, _log_atfork_child);
+		atfork_registered = true;
+	}
+
+	/* Signals must be handled by the main thread. */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_SETMASK, &sigs, &oldsigs);
+	log_thread_stop = false;
+	rc = pthread_create(&log_thread, NULL, _log_thread_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+	if(rc) return 1;
+
+	log_thread_running = true;
+	return 0;
+}
+
+void mqtt3_log_thread_stop(void)
+{
+	int last_flags = 0;
+	int flags;
+
+	if(!log_thread_running) return;
+
+	log_thread_stop = true;
+	pthread_mutex_lock(&log_mutex);
+	pthread_cond_signal(&log_cond);
+	pthread_mutex_unlock(&log_mutex);
+	pthread_join(log_thread, NULL);
+	log_thread_running = false;
+
+	/* Anything added while the thread was exiting. */
+	flags = _log_ring_drain(&last_flags);
+	if(flags){
+		_log_flush(flags);
+	}
+}
+
+bool mqtt3_log_thread_running(void)
+{
+	return log_thread_running;
+}
+
+struct mqtt3_log_record *mqtt3_log_thread_reserve(void)
+{
+	struct mqtt3_log_record *rec;
+	unsigned long pos;
+	long dif;
+
+	pos = log_head;
+	while(1){
+		rec = &log_ring[pos & (LOG_RING_SIZE-1)];
+		dif = (long)rec->seq - (long)pos;
+		if(dif == 0){
+			if(__sync_bool_compare_and_swap(&log_head, pos, pos+1)) break;
+			pos = log_head;
+		}else if(dif < 0){
+			return NULL;
+		}else{
+			pos = log_head;
+		}
+	}
+	__sync_synchronize();
+	return rec;
+}
+
+void mqtt3_log_thread_commit(struct mqtt3_log_record *rec)
+{
+	/* The slot was free when claimed, so its seq is the claimed position. */
+	__sync_synchronize();
+	rec->seq = rec->seq + 1;
+
+	if(log_thread_waiting){
+		pthread_cond_signal(&log_cond);
+	}
+}
+
+#else
+
+/* Not supported on Windows, records are always written synchronously. */
+int mqtt3_log_thread_start(void)
+{
+	return 1;
+}
+
+void mqtt3_log_thread_stop(void)
+{
+}
+
+bool mqtt3_log_thread_running(void)
+{
+	return false;
+}
+
+struct mqtt3_log_record *mqtt3_log_thread_reserve(void)
+{
+	return NULL;
+}
+
+void mqtt3_log_thread_commit(struct mqtt3_log_record *rec)
+{
+}
+#endif
@@ -0,0 +1,78 @@
+/*
+Copyright (c) 2013 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef LOG_THREAD_H
+#define LOG_THREAD_H
+
+#include <stdbool.h>
+#include <time.h>
+
+/* Log records for stdout, stderr and syslog are formatted straight into a ring
+ * of preallocated slots and written out by a separate thread, so the main loop
+ * never waits on a slow terminal, disk or syslog daemon. This lives apart from
+ * the rest of the broker because the broker headers replace the pthread
+ * functions with dummies. */
+
+#define MQTT3_LOG_RECORD_SIZE 512
+
+/* Where a record goes. These are copied into every record when it is added,
+ * so that a config reload doesn't change records that are still waiting. */
+#define MQTT3_LOG_RECORD_STDOUT 0x01
+#define MQTT3_LOG_RECORD_STDERR 0x02
+#define MQTT3_LOG_RECORD_SYSLOG 0x04
+#define MQTT3_LOG_RECORD_TIMESTAMP 0x08
+
+struct mqtt3_log_record{
+	volatile unsigned long seq; /* Only used by log_thread.c. */
+	time_t timestamp;
+	int priority;
+	int flags;
+	char text[MQTT3_LOG_RECORD_SIZE];
+};
+
+/* Start the writer thread, allocating the ring the first time. Does nothing
+ * if the thread is already running. Returns 0 on success. */
+int mqtt3_log_thread_start(void);
+
+/* Stop the writer thread once it has written out everything in the ring. */
+void mqtt3_log_thread_stop(void);
+
+bool mqtt3_log_thread_running(void);
+
+/* Claim the next free slot of the ring. Never blocks or allocates. Returns
+ * NULL if the ring is full. Any thread may claim slots, but each must be
+ * handed over with mqtt3_log_thread_commit() for later records to be
+ * written. */
+struct mqtt3_log_record *mqtt3_log_thread_reserve(void);
+void mqtt3_log_thread_commit(struct mqtt3_log_record *rec);
+
+/* Write a record on the calling thread, for when there is no writer thread. */
+void mqtt3_log_record_write(const struct mqtt3_log_record *rec);
+
+#endif
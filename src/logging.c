@@ -29,6 +29,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #ifndef WIN32
 #include <syslog.h>
 #endif
@@ -38,9 +39,12 @@ POSSIBILITY OF SUCH DAMAGE.
 #endif
 
 #include <mosquitto_broker.h>
+#include <log_thread.h>
 #include <memory_mosq.h>
 
 extern struct mosquitto_db int_db;
+extern unsigned long g_log_dropped;
+extern unsigned long g_log_truncated;
 
 #ifdef WIN32
 HANDLE syslog_h;
@@ -60,6 +64,113 @@ HANDLE syslog_h;
  */
 static int log_destinations = MQTT3_LOG_STDERR;
 static int log_priorities = MOSQ_LOG_ERR | MOSQ_LOG_WARNING | MOSQ_LOG_NOTICE | MOSQ_LOG_INFO;
+int g_log_mask = MOSQ_LOG_ERR | MOSQ_LOG_WARNING | MOSQ_LOG_NOTICE | MOSQ_LOG_INFO;
+
+/* Messages for $SYS/broker/log/# are collected here and published together by
+ * mqtt3_log_topic_flush(), up to log_topic_max_lines for each topic per
+ * interval. Debug messages are never sent to topics. */
+struct log_topic{
+	const char *topic;
+	int priority;
+	char *payload;
+	int len;
+	int size;
+	int lines;
+	unsigned long dropped;
+};
+
+#define LOG_TOPIC_COUNT 4
+static struct log_topic log_topics[LOG_TOPIC_COUNT] = {
+	{"$SYS/broker/log/E", MOSQ_LOG_ERR, NULL, 0, 0, 0, 0},
+	{"$SYS/broker/log/W", MOSQ_LOG_WARNING, NULL, 0, 0, 0, 0},
+	{"$SYS/broker/log/N", MOSQ_LOG_NOTICE, NULL, 0, 0, 0, 0},
+	{"$SYS/broker/log/I", MOSQ_LOG_INFO, NULL, 0, 0, 0, 0}
+};
+
+/* Priorities whose topic has at least one subscriber. Rechecked on every
+ * flush and whenever a subscription has been added or removed, until then
+ * assume they all do. */
+static int log_topic_subscribed = MOSQ_LOG_ERR | MOSQ_LOG_WARNING | MOSQ_LOG_NOTICE | MOSQ_LOG_INFO;
+static unsigned long log_topic_subscription_changes = 0;
+
+static struct log_topic *_log_topic_find(int priority)
+{
+	int i;
+
+	for(i=0; i<LOG_TOPIC_COUNT; i++){
+		if(log_topics[i].priority == priority){
+			return &log_topics[i];
+		}
+	}
+	return &log_topics[0];
+}
+
+static void _log_topic_subscribed_update(struct mosquitto_db *db)
+{
+	int i;
+
+	for(i=0; i<LOG_TOPIC_COUNT; i++){
+		if(mqtt3_sub_has_subscribers(db, log_topics[i].topic)){
+			log_topic_subscribed |= log_topics[i].priority;
+		}else{
+			log_topic_subscribed &= ~log_topics[i].priority;
+		}
+	}
+	log_topic_subscription_changes = db->subscription_changes;
+}
+
+/* Add a line to the payload waiting to be published on a log topic. */
+static int _log_topic_append(struct log_topic *lt, time_t now, bool timestamp, const char *s)
+{
+	char *payload;
+	int len;
+	int size;
+
+	len = strlen(s) + 14; /* Separator, timestamp and ": ". */
+	if(lt->len + len + 1 > lt->size){
+		size = lt->size ? lt->size : 256;
+		while(lt->len + len + 1 > size){
+			size *= 2;
+		}
+		payload = _mosquitto_realloc(lt->payload, size);
+		if(!payload) return MOSQ_ERR_NOMEM;
+		lt->payload = payload;
+		lt->size = size;
+	}
+	if(lt->len){
+		lt->payload[lt->len] = '\n';
+		lt->len++;
+	}
+	if(timestamp){
+		lt->len += snprintf(&lt->payload[lt->len], lt->size-lt->len, "%d: %s", (int)now, s);
+	}else{
+		lt->len += snprintf(&lt->payload[lt->len], lt->size-lt->len, "%s", s);
+	}
+	lt->lines++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _log_topic_publish(struct mosquitto_db *db, struct log_topic *lt)
+{
+	char *payload;
+	int len;
+	int qos = 2;
+
+	if(!lt->len) return;
+
+	/* Detach the payload first, queueing the message may log. */
+	payload = lt->payload;
+	len = lt->len;
+	lt->payload = NULL;
+	lt->len = 0;
+	lt->size = 0;
+
+	if(log_topic_subscribed & lt->priority){
+		if(db->config) qos = db->config->log_topic_qos;
+		mqtt3_db_messages_easy_queue(db, NULL, lt->topic, qos, len, payload, 0);
+	}
+	_mosquitto_free(payload);
+}
 
 int mqtt3_log_init(int priorities, int destinations)
 {
@@ -68,6 +179,18 @@ int mqtt3_log_init(int priorities, int destinations)
 	log_priorities = priorities;
 	log_destinations = destinations;
 
+	if(log_destinations == MQTT3_LOG_NONE){
+		g_log_mask = 0;
+	}else if(!(log_destinations & (MQTT3_LOG_STDOUT | MQTT3_LOG_STDERR | MQTT3_LOG_SYSLOG))){
+		/* Debug messages are never sent to topics. */
+		g_log_mask = log_priorities & ~MOSQ_LOG_DEBUG;
+	}else{
+		g_log_mask = log_priorities;
+	}
+#ifndef WITH_DEBUG_LOGGING
+	g_log_mask &= ~MOSQ_LOG_DEBUG;
+#endif
+
 	if(log_destinations & MQTT3_LOG_SYSLOG){
 #ifndef WIN32
 		openlog("mosquitto", LOG_PID, LOG_DAEMON);
@@ -76,11 +199,22 @@ int mqtt3_log_init(int priorities, int destinations)
 #endif
 	}
 
+#ifndef WIN32
+	if(log_destinations & (MQTT3_LOG_STDOUT | MQTT3_LOG_STDERR | MQTT3_LOG_SYSLOG)){
+		if(mqtt3_log_thread_start()){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to start logging thread, logging synchronously.");
+		}
+	}
+#endif
+
 	return rc;
 }
 
 int mqtt3_log_close(void)
 {
+	int i;
+
+	mqtt3_log_thread_stop();
 	if(log_destinations & MQTT3_LOG_SYSLOG){
 #ifndef WIN32
 		closelog();
@@ -88,125 +222,139 @@ int mqtt3_log_close(void)
 		CloseEventLog(syslog_h);
 #endif
 	}
+	for(i=0; i<LOG_TOPIC_COUNT; i++){
+		if(log_topics[i].payload){
+			_mosquitto_free(log_topics[i].payload);
+			log_topics[i].payload = NULL;
+		}
+		log_topics[i].len = 0;
+		log_topics[i].size = 0;
+	}
 	/* FIXME - do something for all destinations! */
 
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Publish the messages collected for each log topic, once per
+ * log_topic_interval. With an interval of 0 messages are published as they
+ * are logged, and this only resets the line limit and checks for subscribers
+ * once a second. */
+void mqtt3_log_topic_flush(struct mosquitto_db *db, time_t now)
+{
+	static time_t last_flush = 0;
+	struct log_topic *lt;
+	int interval;
+	int i;
+	char buf[100];
+
+	if(!(log_destinations & MQTT3_LOG_TOPIC)) return;
+
+	interval = db->config->log_topic_interval;
+	if(interval < 1) interval = 1;
+	if(now - last_flush < interval) return;
+	last_flush = now;
+
+	_log_topic_subscribed_update(db);
+	for(i=0; i<LOG_TOPIC_COUNT; i++){
+		lt = &log_topics[i];
+		if(lt->dropped){
+			snprintf(buf, 100, "%lu further log messages dropped.", lt->dropped);
+			lt->dropped = 0;
+			_log_topic_append(lt, now, db->config->log_timestamp, buf);
+		}
+		_log_topic_publish(db, lt);
+		lt->lines = 0;
+	}
+}
+
+/* The destinations that a record logged now should be written to. */
+static int _log_record_flags(void)
+{
+	int flags = 0;
+
+	if(log_destinations & MQTT3_LOG_STDOUT) flags |= MQTT3_LOG_RECORD_STDOUT;
+	if(log_destinations & MQTT3_LOG_STDERR) flags |= MQTT3_LOG_RECORD_STDERR;
+	if(log_destinations & MQTT3_LOG_SYSLOG) flags |= MQTT3_LOG_RECORD_SYSLOG;
+	if(int_db.config && int_db.config->log_timestamp) flags |= MQTT3_LOG_RECORD_TIMESTAMP;
+	return flags;
+}
+
 int _mosquitto_log_printf(struct mosquitto *mosq, int priority, const char *fmt, ...)
 {
 	va_list va;
-	char *s;
-	char *st;
+	struct mqtt3_log_record local;
+	struct mqtt3_log_record *rec = NULL;
+	int flags;
 	int len;
-#ifdef WIN32
-	char *sp;
-#endif
-	const char *topic;
-	int syslog_priority;
-	time_t now = time(NULL);
+	bool output;
+	bool topic;
+	struct log_topic *lt;
+	int max_lines;
 
-	if((log_priorities & priority) && log_destinations != MQTT3_LOG_NONE){
-		switch(priority){
-			case MOSQ_LOG_DEBUG:
-				topic = "$SYS/broker/log/D";
-#ifndef WIN32
-				syslog_priority = LOG_DEBUG;
-#else
-				syslog_priority = EVENTLOG_INFORMATION_TYPE;
-#endif
-				break;
-			case MOSQ_LOG_ERR:
-				topic = "$SYS/broker/log/E";
-#ifndef WIN32
-				syslog_priority = LOG_ERR;
-#else
-				syslog_priority = EVENTLOG_ERROR_TYPE;
-#endif
-				break;
-			case MOSQ_LOG_WARNING:
-				topic = "$SYS/broker/log/W";
-#ifndef WIN32
-				syslog_priority = LOG_WARNING;
-#else
-				syslog_priority = EVENTLOG_WARNING_TYPE;
-#endif
-				break;
-			case MOSQ_LOG_NOTICE:
-				topic = "$SYS/broker/log/N";
-#ifndef WIN32
-				syslog_priority = LOG_NOTICE;
-#else
-				syslog_priority = EVENTLOG_INFORMATION_TYPE;
-#endif
-				break;
-			case MOSQ_LOG_INFO:
-				topic = "$SYS/broker/log/I";
-#ifndef WIN32
-				syslog_priority = LOG_INFO;
-#else
-				syslog_priority = EVENTLOG_INFORMATION_TYPE;
-#endif
-				break;
-			default:
-				topic = "$SYS/broker/log/E";
+	if(!(log_priorities & priority) || log_destinations == MQTT3_LOG_NONE){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	flags = _log_record_flags();
+	output = flags & (MQTT3_LOG_RECORD_STDOUT | MQTT3_LOG_RECORD_STDERR | MQTT3_LOG_RECORD_SYSLOG);
+	topic = false;
+	if(log_destinations & MQTT3_LOG_TOPIC && priority != MOSQ_LOG_DEBUG){
+		if(log_topic_subscription_changes != int_db.subscription_changes){
+			_log_topic_subscribed_update(&int_db);
+		}
+		topic = log_topic_subscribed & priority;
+	}
+
+	/* The message is formatted once, straight into a ring slot if there is a
+	 * log thread, and log topics take their copy from there. */
+	if(output && mqtt3_log_thread_running()){
+		rec = mqtt3_log_thread_reserve();
+		if(!rec){
 #ifndef WIN32
-				syslog_priority = LOG_ERR;
-#else
-				syslog_priority = EVENTLOG_ERROR_TYPE;
+			__sync_fetch_and_add(&g_log_dropped, 1);
 #endif
+			output = false;
 		}
-		len = strlen(fmt) + 500;
-		s = _mosquitto_malloc(len*sizeof(char));
-		if(!s) return MOSQ_ERR_NOMEM;
-
-		va_start(va, fmt);
-		vsnprintf(s, len, fmt, va);
-		va_end(va);
-		s[len-1] = '\0'; /* Ensure string is null terminated. */
-
-		if(log_destinations & MQTT3_LOG_STDOUT){
-			if(int_db.config && int_db.config->log_timestamp){
-				fprintf(stdout, "%d: %s\n", (int)now, s);
-			}else{
-				fprintf(stdout, "%s\n", s);
-			}
-			fflush(stdout);
-		}
-		if(log_destinations & MQTT3_LOG_STDERR){
-			if(int_db.config && int_db.config->log_timestamp){
-				fprintf(stderr, "%d: %s\n", (int)now, s);
-			}else{
-				fprintf(stderr, "%s\n", s);
-			}
-			fflush(stderr);
-		}
-		if(log_destinations & MQTT3_LOG_SYSLOG){
+	}
+	if(!output && !topic) return MOSQ_ERR_SUCCESS;
+	if(!rec) rec = &local;
+
+	rec->timestamp = time(NULL);
+	rec->priority = priority;
+	rec->flags = flags;
+	va_start(va, fmt);
+	len = vsnprintf(rec->text, MQTT3_LOG_RECORD_SIZE, fmt, va);
+	va_end(va);
+	if(len >= MQTT3_LOG_RECORD_SIZE){
 #ifndef WIN32
-			syslog(syslog_priority, "%s", s);
+		__sync_fetch_and_add(&g_log_truncated, 1);
 #else
-			sp = (char *)s;
-			ReportEvent(syslog_h, syslog_priority, 0, 0, NULL, 1, 0, &sp, NULL);
+		g_log_truncated++;
 #endif
+	}
+
+	lt = NULL;
+	if(topic){
+		lt = _log_topic_find(priority);
+		max_lines = int_db.config ? int_db.config->log_topic_max_lines : 0;
+		if(max_lines > 0 && lt->lines >= max_lines){
+			lt->dropped++;
+			lt = NULL;
+		}else if(_log_topic_append(lt, rec->timestamp, flags & MQTT3_LOG_RECORD_TIMESTAMP, rec->text)){
+			lt = NULL;
 		}
-		if(log_destinations & MQTT3_LOG_TOPIC && priority != MOSQ_LOG_DEBUG){
-			if(int_db.config && int_db.config->log_timestamp){
-				len += 30;
-				st = _mosquitto_malloc(len*sizeof(char));
-				if(!st){
-					_mosquitto_free(s);
-					return MOSQ_ERR_NOMEM;
-				}
-				snprintf(st, len, "%d: %s", (int)now, s);
-				mqtt3_db_messages_easy_queue(&int_db, NULL, topic, 2, strlen(st), st, 0);
-				_mosquitto_free(st);
-			}else{
-				mqtt3_db_messages_easy_queue(&int_db, NULL, topic, 2, strlen(s), s, 0);
-			}
-		}
-		_mosquitto_free(s);
+	}
+
+	if(rec != &local){
+		mqtt3_log_thread_commit(rec);
+	}else if(output){
+		mqtt3_log_record_write(rec);
+	}
+
+	/* Publishing may log, so only once the record has been dealt with. */
+	if(lt && int_db.config && int_db.config->log_topic_interval == 0){
+		_log_topic_publish(&int_db, lt);
 	}
 
 	return MOSQ_ERR_SUCCESS;
 }
-
@@ -46,6 +46,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <mosquitto_broker.h>
 #include <memory_mosq.h>
+#include <shm_mosq.h>
 #include <util_mosq.h>
 
 #ifndef POLLRDHUP
@@ -63,21 +64,31 @@ extern int g_clients_expired;
 
 static void loop_handle_errors(struct mosquitto_db *db, struct pollfd *pollfds);
 static void loop_handle_reads_writes(struct mosquitto_db *db, struct pollfd *pollfds);
+static void loop_handle_async(struct mosquitto_db *db);
+static int loop_read(struct mosquitto_db *db, struct mosquitto *context);
+static void loop_expire_clients(struct mosquitto_db *db, time_t now);
+static void loop_shrink_buffers(struct mosquitto_db *db, time_t now);
 
-int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock_count, int listener_max)
+int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, struct _mqtt3_listener **listensock_listener, int listensock_count, int listener_max)
 {
 	time_t start_time = time(NULL);
 	time_t last_backup = time(NULL);
 	time_t last_store_clean = time(NULL);
+	time_t last_expire_check = 0;
+	time_t last_buffer_check = time(NULL);
 	time_t now;
 	int fdcount;
 #ifndef WIN32
 	sigset_t sigblock, origsig;
 #endif
-	int i;
+	int i, j;
+	int accept_limit;
 	struct pollfd *pollfds = NULL;
 	int pollfd_count = 0;
 	int pollfd_index;
+	int async_fd;
+	int async_index;
+	struct mosquitto *context;
 
 #ifndef WIN32
 	sigemptyset(&sigblock);
@@ -86,9 +97,10 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 
 	while(run){
 		mqtt3_db_sys_update(db, db->config->sys_interval, start_time);
+		mqtt3_context_compact(db);
 
-		if(listensock_count + db->context_count > pollfd_count){
-			pollfd_count = listensock_count + db->context_count;
+		if(listensock_count + db->context_count + 1 > pollfd_count){
+			pollfd_count = listensock_count + db->context_count + 1;
 			pollfds = _mosquitto_realloc(pollfds, sizeof(struct pollfd)*pollfd_count);
 			if(!pollfds){
 				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
@@ -98,15 +110,33 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 
 		memset(pollfds, -1, sizeof(struct pollfd)*pollfd_count);
 
+		now = time(NULL);
 		pollfd_index = 0;
 		for(i=0; i<listensock_count; i++){
-			pollfds[pollfd_index].fd = listensock[i];
+			/* Listeners that can't accept any more connections at the moment
+			 * are left out, otherwise poll() would keep waking up for them. */
+			if(mqtt3_socket_accept_limit(listensock_listener[i], now) > 0){
+				pollfds[pollfd_index].fd = listensock[i];
+			}else{
+				pollfds[pollfd_index].fd = -1;
+			}
 			pollfds[pollfd_index].events = POLLIN;
 			pollfds[pollfd_index].revents = 0;
 			pollfd_index++;
 		}
 
-		now = time(NULL);
+		async_fd = mqtt3_async_fd();
+		async_index = -1;
+		if(async_fd != -1){
+			pollfds[pollfd_index].fd = async_fd;
+			pollfds[pollfd_index].events = POLLIN;
+			pollfds[pollfd_index].revents = 0;
+			async_index = pollfd_index;
+			pollfd_index++;
+		}
+
+		mqtt3_db_ready_write(db);
+
 		for(i=0; i<db->context_count; i++){
 			if(db->contexts[i]){
 				db->contexts[i]->pollfd_index = -1;
@@ -120,18 +150,27 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 
 					/* Local bridges never time out in this fashion. */
 					if(!(db->contexts[i]->keepalive) || db->contexts[i]->bridge || now - db->contexts[i]->last_msg_in < (time_t)(db->contexts[i]->keepalive)*3/2){
-						if(mqtt3_db_message_write(db->contexts[i]) == MOSQ_ERR_SUCCESS){
-							pollfds[pollfd_index].fd = db->contexts[i]->sock;
-							pollfds[pollfd_index].events = POLLIN | POLLRDHUP;
-							pollfds[pollfd_index].revents = 0;
-							if(db->contexts[i]->out_packet){
-								pollfds[pollfd_index].events |= POLLOUT;
-							}
-							db->contexts[i]->pollfd_index = pollfd_index;
-							pollfd_index++;
+						pollfds[pollfd_index].fd = db->contexts[i]->sock;
+						if(db->contexts[i]->state == mosq_cs_authenticating){
+							/* Don't read anything else until CONNECT has
+							 * been dealt with, but notice if the client
+							 * goes away. */
+							pollfds[pollfd_index].events = POLLRDHUP;
 						}else{
-							mqtt3_context_disconnect(db, db->contexts[i]);
+							pollfds[pollfd_index].events = POLLIN | POLLRDHUP;
 						}
+						pollfds[pollfd_index].revents = 0;
+#ifdef WITH_SHM
+						/* An eventfd is always writable, shared memory
+						 * clients wake us when they make room instead. */
+						if((db->contexts[i]->out_packet || db->contexts[i]->current_out_packet) && !db->contexts[i]->shm){
+#else
+						if(db->contexts[i]->out_packet || db->contexts[i]->current_out_packet){
+#endif
+							pollfds[pollfd_index].events |= POLLOUT;
+						}
+						db->contexts[i]->pollfd_index = pollfd_index;
+						pollfd_index++;
 					}else{
 						if(db->config->connection_messages == true){
 							_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Client %s has exceeded timeout, disconnecting.", db->contexts[i]->id);
@@ -166,21 +205,14 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 					}else{
 #endif
 						if(db->contexts[i]->clean_session == true){
-							mqtt3_context_cleanup(db, db->contexts[i], true);
-							db->contexts[i] = NULL;
-						}else if(db->config->persistent_client_expiration > 0){
-							/* This is a persistent client, check to see if the
-							 * last time it connected was longer than
-							 * persistent_client_expiration seconds ago. If so,
-							 * expire it and clean up.
-							 */
-							if(time(NULL) > db->contexts[i]->disconnect_t+db->config->persistent_client_expiration){
-								_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Expiring persistent client %s due to timeout.", db->contexts[i]->id);
-								g_clients_expired++;
-								db->contexts[i]->clean_session = true;
-								mqtt3_context_cleanup(db, db->contexts[i], true);
-								db->contexts[i] = NULL;
-							}
+							context = db->contexts[i];
+							mqtt3_context_remove(db, context);
+							mqtt3_context_cleanup(db, context, true);
+						}else{
+							/* This is a persistent client, move it out of the
+							 * way of the poll/read/write walks until it
+							 * reconnects or expires. */
+							mqtt3_context_offline(db, db->contexts[i]);
 						}
 #ifdef WITH_BRIDGE
 					}
@@ -189,6 +221,18 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 			}
 		}
 
+		if(db->config->persistent_client_expiration > 0 && now != last_expire_check){
+			loop_expire_clients(db, now);
+			last_expire_check = now;
+		}
+
+		if(now - last_buffer_check >= MQTT3_IN_BUFFER_IDLE){
+			loop_shrink_buffers(db, now);
+			last_buffer_check = now;
+		}
+
+		mqtt3_log_topic_flush(db, now);
+
 		mqtt3_db_message_timeout_check(db, db->config->retry_interval);
 
 #ifndef WIN32
@@ -203,14 +247,26 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 		}else{
 			loop_handle_reads_writes(db, pollfds);
 
+			if(async_index != -1 && pollfds[async_index].revents & POLLIN){
+				loop_handle_async(db);
+			}
+
+			/* The listening sockets are the first entries in pollfds, in the
+			 * same order as listensock_listener. */
 			for(i=0; i<listensock_count; i++){
 				if(pollfds[i].revents & (POLLIN | POLLPRI)){
-					while(mqtt3_socket_accept(db, listensock[i]) != -1){
+					accept_limit = mqtt3_socket_accept_limit(listensock_listener[i], time(NULL));
+					for(j=0; j<accept_limit; j++){
+						if(mqtt3_socket_accept(db, listensock[i], listensock_listener[i])){
+							break;
+						}
 					}
 				}
 			}
 		}
 #ifdef WITH_PERSISTENCE
+		mqtt3_db_backup_check(db);
+		mqtt3_db_wal_sync(db);
 		if(db->config->persistence && db->config->autosave_interval){
 			if(db->config->autosave_on_changes){
 				if(db->persistence_changes > db->config->autosave_interval){
@@ -254,6 +310,48 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Expire persistent clients that last connected longer than
+ * persistent_client_expiration seconds ago. Only disconnected clients are
+ * candidates, so only the offline table needs to be checked. */
+static void loop_expire_clients(struct mosquitto_db *db, time_t now)
+{
+	struct mosquitto *context;
+	int i;
+
+	/* Walk backwards, removal swaps the last entry into the current slot. */
+	for(i=db->offline_count-1; i>=0; i--){
+		context = db->offline_contexts[i];
+		if(now > context->disconnect_t+db->config->persistent_client_expiration){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Expiring persistent client %s due to timeout.", context->id);
+			g_clients_expired++;
+#ifdef WITH_PERSISTENCE
+			mqtt3_db_wal_client_delete(context->id);
+#endif
+			mqtt3_context_remove(db, context);
+			context->clean_session = true;
+			mqtt3_context_cleanup(db, context, true);
+		}
+	}
+}
+
+/* Free the incoming packet buffers of clients that haven't sent anything for
+ * MQTT3_IN_BUFFER_IDLE seconds, so a burst of large messages doesn't hold on
+ * to memory for the life of the connection. */
+static void loop_shrink_buffers(struct mosquitto_db *db, time_t now)
+{
+	struct mosquitto *context;
+	int i;
+
+	for(i=0; i<db->context_count; i++){
+		context = db->contexts[i];
+		if(context && context->in_packet.payload && !context->in_packet.command
+				&& now - context->last_msg_in >= MQTT3_IN_BUFFER_IDLE){
+
+			_mosquitto_packet_cleanup(&context->in_packet);
+		}
+	}
+}
+
 static void do_disconnect(struct mosquitto_db *db, int context_index)
 {
 	if(db->config->connection_messages == true){
@@ -282,11 +380,29 @@ static void loop_handle_errors(struct mosquitto_db *db, struct pollfd *pollfds)
 	}
 }
 
+/* Deal with results from work that has finished outside the main loop. */
+static void loop_handle_async(struct mosquitto_db *db)
+{
+	struct mqtt3_async_item *item;
+
+	while((item = mqtt3_async_get())){
+		item->done(db, item);
+	}
+}
+
 static void loop_handle_reads_writes(struct mosquitto_db *db, struct pollfd *pollfds)
 {
 	int i;
 
 	for(i=0; i<db->context_count; i++){
+#ifdef WITH_SHM
+		if(db->contexts[i] && db->contexts[i]->shm
+				&& pollfds[db->contexts[i]->pollfd_index].revents & POLLIN){
+
+			/* A wakeup can mean data to read or room to write. */
+			pollfds[db->contexts[i]->pollfd_index].revents |= POLLOUT;
+		}
+#endif
 		if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET){
 			assert(pollfds[db->contexts[i]->pollfd_index].fd == db->contexts[i]->sock);
 #ifdef WITH_TLS
@@ -318,7 +434,7 @@ static void loop_handle_reads_writes(struct mosquitto_db *db, struct pollfd *pol
 #else
 			if(pollfds[db->contexts[i]->pollfd_index].revents & POLLIN){
 #endif
-				if(_mosquitto_packet_read(db, db->contexts[i])){
+				if(loop_read(db, db->contexts[i])){
 					if(db->config->connection_messages == true){
 						if(db->contexts[i]->state != mosq_cs_disconnecting){
 							_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Socket read error on client %s, disconnecting.", db->contexts[i]->id);
@@ -339,3 +455,32 @@ static void loop_handle_reads_writes(struct mosquitto_db *db, struct pollfd *pol
 	}
 }
 
+static int loop_read(struct mosquitto_db *db, struct mosquitto *context)
+{
+#ifdef WITH_SHM
+	int rc;
+	int i;
+
+	if(context->shm){
+		_mosquitto_shm_wake_clear(context);
+		/* Any number of packets may be waiting in the ring, take a batch of
+		 * them rather than one per pass of the main loop. */
+		for(i=0; i<MQTT3_SHM_READ_BATCH; i++){
+			rc = _mosquitto_packet_read(db, context);
+			if(rc) return rc;
+			if(context->sock == INVALID_SOCKET
+					|| context->state == mosq_cs_authenticating
+					|| !_mosquitto_shm_readable(context)){
+				break;
+			}
+		}
+		if(context->sock != INVALID_SOCKET){
+			_mosquitto_shm_rearm(context);
+		}
+		return MOSQ_ERR_SUCCESS;
+	}else if(context->listener && context->listener->shm_transport){
+		return mqtt3_socket_shm_attach(context);
+	}
+#endif
+	return _mosquitto_packet_read(db, context);
+}
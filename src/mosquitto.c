@@ -143,6 +143,7 @@ void handle_sigusr2(int signal)
 int main(int argc, char *argv[])
 {
 	int *listensock = NULL;
+	struct _mqtt3_listener **listensock_listener = NULL;
 	int listensock_count = 0;
 	int listensock_index = 0;
 	struct mqtt3_config config;
@@ -249,7 +250,8 @@ int main(int argc, char *argv[])
 		}
 		listensock_count += config.listeners[i].sock_count;
 		listensock = _mosquitto_realloc(listensock, sizeof(int)*listensock_count);
-		if(!listensock){
+		listensock_listener = _mosquitto_realloc(listensock_listener, sizeof(struct _mqtt3_listener *)*listensock_count);
+		if(!listensock || !listensock_listener){
 			_mosquitto_free(int_db.contexts);
 			mqtt3_db_close(&int_db);
 			if(config.pid_file){
@@ -267,6 +269,7 @@ int main(int argc, char *argv[])
 				return 1;
 			}
 			listensock[listensock_index] = config.listeners[i].socks[j];
+			listensock_listener[listensock_index] = &config.listeners[i];
 			if(listensock[listensock_index] > listener_max){
 				listener_max = listensock[listensock_index];
 			}
@@ -295,7 +298,7 @@ int main(int argc, char *argv[])
 #endif
 
 	run = 1;
-	rc = mosquitto_main_loop(&int_db, listensock, listensock_count, listener_max);
+	rc = mosquitto_main_loop(&int_db, listensock, listensock_listener, listensock_count, listener_max);
 
 	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "mosquitto version %s terminating", VERSION);
 	mqtt3_log_close();
@@ -311,8 +314,15 @@ int main(int argc, char *argv[])
 			mqtt3_context_cleanup(&int_db, int_db.contexts[i], true);
 		}
 	}
-	_mosquitto_free(int_db.contexts);
+	for(i=0; i<int_db.offline_count; i++){
+		mqtt3_context_cleanup(&int_db, int_db.offline_contexts[i], true);
+	}
+	if(int_db.contexts) _mosquitto_free(int_db.contexts);
 	int_db.contexts = NULL;
+	if(int_db.context_free) _mosquitto_free(int_db.context_free);
+	int_db.context_free = NULL;
+	if(int_db.offline_contexts) _mosquitto_free(int_db.offline_contexts);
+	int_db.offline_contexts = NULL;
 	mqtt3_db_close(&int_db);
 
 	if(listensock){
@@ -327,6 +337,14 @@ int main(int argc, char *argv[])
 		}
 		_mosquitto_free(listensock);
 	}
+	if(listensock_listener) _mosquitto_free(listensock_listener);
+#ifndef WIN32
+	for(i=0; i<config.listener_count; i++){
+		if(config.listeners[i].unix_path && config.listeners[i].unix_path[0] == '/'){
+			unlink(config.listeners[i].unix_path);
+		}
+	}
+#endif
 
 	mosquitto_security_module_cleanup(&int_db);
 
@@ -35,6 +35,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <mosquitto_internal.h>
 #include <mosquitto_plugin.h>
 #include <mosquitto.h>
+#include <async.h>
 #include "uthash.h"
 
 #ifdef WITH_TLS
@@ -55,8 +56,31 @@ POSSIBILITY OF SUCH DAMAGE.
 #define MQTT3_LOG_TOPIC 0x10
 #define MQTT3_LOG_ALL 0xFF
 
+/* Maximum number of connections accepted from a single listening socket in
+ * one pass of the main loop, so a connection storm can't starve clients that
+ * are already connected. */
+#define MQTT3_ACCEPT_BATCH 64
+
+/* Maximum number of packets read from a shared memory client in one pass of
+ * the main loop. */
+#define MQTT3_SHM_READ_BATCH 64
+
+/* Number of seconds a client can go without sending anything before the
+ * buffer used for its incoming packets is freed. */
+#define MQTT3_IN_BUFFER_IDLE 60
+
+/* Longest topic that is kept in the ACL cache. Checks on longer topics always
+ * go to the acl_file or auth plugin. */
+#define MQTT3_ACL_CACHE_TOPIC_MAX 128
+
 typedef uint64_t dbid_t;
 
+enum mqtt3_slow_consumer_policy {
+	scp_disconnect = 0,
+	scp_drop = 1,
+	scp_conflate = 2
+};
+
 enum mqtt3_msg_state {
 	ms_invalid = 0,
 	ms_publish_qos0 = 1,
@@ -72,15 +96,40 @@ enum mqtt3_msg_state {
 	ms_queued = 11
 };
 
+#ifdef WITH_TLS
+struct _mqtt3_ticket_key {
+	unsigned char name[16];
+	unsigned char aes_key[16];
+	unsigned char hmac_key[16];
+};
+#endif
+
 struct _mqtt3_listener {
 	int fd;
 	char *host;
 	uint16_t port;
+	char *unix_path; /* Unix socket path or @abstract name, port is 0. */
+	int socket_mode; /* Permissions for unix_path, or -1 to use the umask. */
+#ifdef WITH_SHM
+	bool shm_transport; /* Clients hand over shared memory rings on connect. */
+#endif
 	int max_connections;
+	int max_connection_rate;
+	int max_pending_connections;
 	char *mount_point;
 	int *socks;
 	int sock_count;
 	int client_count;
+	unsigned long accept_count; /* Connections accepted since start. */
+	unsigned long reject_count; /* Connections closed straight after accept. */
+	int pending_count; /* Accepted clients that haven't finished CONNECT. */
+	int conn_tokens; /* Connections that may still be accepted in conn_token_t. */
+	time_t conn_token_t;
+	unsigned long sys_accept_count; /* Values at the last $SYS update. */
+	double sys_accept_load1;
+	unsigned long sys_accept_sent; /* Values last published in $SYS. */
+	unsigned long sys_reject_sent;
+	double sys_accept_load1_sent;
 #ifdef WITH_TLS
 	char *cafile;
 	char *capath;
@@ -92,11 +141,19 @@ struct _mqtt3_listener {
 	SSL_CTX *ssl_ctx;
 	char *crlfile;
 	bool use_identity_as_username;
+	int tls_session_cache_size;
+	int tls_session_lifetime;
+	bool tls_session_tickets;
+	struct _mqtt3_ticket_key ticket_keys[2]; /* Current, then previous. */
+	int ticket_key_count;
+	time_t ticket_key_t; /* When ticket_keys[0] was made. */
 #endif
 };
 
 struct mqtt3_config {
 	char *config_file;
+	int acl_cache_size;
+	int acl_cache_ttl;
 	char *acl_file;
 	bool allow_anonymous;
 	bool allow_duplicate_messages;
@@ -111,15 +168,27 @@ struct mqtt3_config {
 	int log_dest;
 	int log_type;
 	bool log_timestamp;
+	int log_topic_interval;
+	int log_topic_max_lines;
+	int log_topic_qos;
+	int max_output_bytes;
+	int password_cache_ttl;
+	int password_check_threads;
 	char *password_file;
 	bool persistence;
+	bool persistence_background;
+	bool persistence_durable_acks;
 	char *persistence_location;
 	char *persistence_file;
 	char *persistence_filepath;
+	bool persistence_wal;
+	int persistence_wal_compact_size;
 	time_t persistent_client_expiration;
 	char *psk_file;
 	bool queue_qos0_messages;
 	int retry_interval;
+	enum mqtt3_slow_consumer_policy slow_consumer_policy;
+	int slow_consumer_timeout;
 	int store_clean_interval;
 	int sys_interval;
 	char *pid_file;
@@ -157,6 +226,7 @@ struct mosquitto_msg_store{
 	int dest_id_count;
 	uint16_t source_mid;
 	struct mosquitto_message msg;
+	bool persisted;
 };
 
 struct mosquitto_client_msg{
@@ -178,15 +248,34 @@ struct _mosquitto_unpwd{
 	unsigned int password_len;
 	unsigned char *salt;
 	unsigned int salt_len;
+	/* HMAC of the username and last password that matched, keyed with a
+	 * key private to this broker, so that the password needn't be hashed
+	 * again until cached_expiry. 0 cached_mac_len means empty. */
+	unsigned char cached_mac[EVP_MAX_MD_SIZE];
+	unsigned int cached_mac_len;
+	time_t cached_expiry;
 #endif
 	UT_hash_handle hh;
 };
 
+enum mosquitto_acl_type{
+	at_literal = 0,
+	at_plus = 1, /* + */
+	at_hash = 2, /* # */
+	at_clientid = 3, /* %c, patterns only */
+	at_username = 4 /* %u, patterns only */
+};
+
+/* ACLs are compiled into a trie with one node per topic level. child is the
+ * first node of the next level and next is the following sibling. access is
+ * the access granted by rules that end at this node. Topics beginning with a
+ * '/' are held below a root node with topic "/". */
 struct _mosquitto_acl{
 	struct _mosquitto_acl *child;
 	struct _mosquitto_acl *next;
 	char *topic;
 	int access;
+	enum mosquitto_acl_type type;
 };
 
 struct _mosquitto_acl_user{
@@ -195,6 +284,18 @@ struct _mosquitto_acl_user{
 	struct _mosquitto_acl *acl;
 };
 
+/* One slot of a client's ACL decision cache. Slots are chosen by a hash of
+ * the topic and access, so a new decision replaces whatever was there. The
+ * topic is held in the slot, so replacing it allocates nothing. 0 topic_len
+ * means empty. */
+struct _mosquitto_acl_cache{
+	char topic[MQTT3_ACL_CACHE_TOPIC_MAX];
+	int topic_len;
+	time_t expiry;
+	int access;
+	int result;
+};
+
 struct _mosquitto_auth_plugin{
 	void *lib;
 	void *user_data;
@@ -205,9 +306,21 @@ struct _mosquitto_auth_plugin{
 	int (*security_cleanup)(void *user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count, bool reload);
 	int (*acl_check)(void *user_data, const char *username, const char *topic, int access);
 	int (*unpwd_check)(void *user_data, const char *username, const char *password);
+	int (*unpwd_check_async)(void *user_data, const char *username, const char *password, void *request, void (*complete)(void *request, int result));
 	int (*psk_key_get)(void *user_data, const char *hint, const char *identity, char *key, int max_key_len);
 };
 
+/* A CONNECT that is waiting for its username and password to be checked.
+ * context is set to NULL if the client goes away before the check finishes,
+ * in which case the request is simply freed when the result arrives. */
+struct _mosquitto_auth_request{
+	struct mqtt3_async_item item; /* Must be first. */
+	struct mosquitto *context;
+	char *client_id;
+	struct mosquitto_message *will;
+	uint8_t clean_session;
+};
+
 struct mosquitto_db{
 	dbid_t last_db_id;
 	struct _mosquitto_subhier subs;
@@ -215,14 +328,29 @@ struct mosquitto_db{
 	struct _mosquitto_acl_user *acl_list;
 	struct _mosquitto_acl *acl_patterns;
 	struct _mosquitto_unpwd *psk_id;
+	/* Clients with a connection, bridges, and clients that have
+	 * disconnected but haven't been dealt with by the main loop yet. Slots
+	 * may be NULL, free slots are reused through context_free and the table
+	 * is compacted by mqtt3_context_compact(). context_count is the number
+	 * of slots to look at. */
 	struct mosquitto **contexts;
 	int context_count;
+	int context_size;
+	int *context_free;
+	int context_free_count;
+	/* Persistent clients that aren't connected. No NULL slots. */
+	struct mosquitto **offline_contexts;
+	int offline_count;
+	int offline_size;
+	struct mosquitto *contexts_by_id;
 	struct mosquitto_msg_store *msg_store;
 	int msg_store_count;
 	struct mqtt3_config *config;
 	int persistence_changes;
 	struct _mosquitto_auth_plugin auth_plugin;
 	int subscription_count;
+	/* Incremented whenever a subscription is added or removed. */
+	unsigned long subscription_changes;
 	int retained_count;
 };
 
@@ -287,7 +415,7 @@ struct _mqtt3_bridge{
 /* ============================================================
  * Main functions
  * ============================================================ */
-int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock_count, int listener_max);
+int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, struct _mqtt3_listener **listensock_listener, int listensock_count, int listener_max);
 struct mosquitto_db *_mosquitto_get_db(void);
 
 /* ============================================================
@@ -314,8 +442,12 @@ int _mosquitto_send_suback(struct mosquitto *context, uint16_t mid, uint32_t pay
 /* ============================================================
  * Network functions
  * ============================================================ */
-int mqtt3_socket_accept(struct mosquitto_db *db, int listensock);
+int mqtt3_socket_accept(struct mosquitto_db *db, int listensock, struct _mqtt3_listener *listener);
+int mqtt3_socket_accept_limit(struct _mqtt3_listener *listener, time_t now);
 int mqtt3_socket_listen(struct _mqtt3_listener *listener);
+#ifdef WITH_SHM
+int mqtt3_socket_shm_attach(struct mosquitto *context);
+#endif
 int _mosquitto_socket_get_address(int sock, char *buf, int len);
 
 /* ============================================================
@@ -336,7 +468,26 @@ int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db);
 int mqtt3_db_close(struct mosquitto_db *db);
 #ifdef WITH_PERSISTENCE
 int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown);
+/* Collect the result of a background snapshot if one has finished. */
+int mqtt3_db_backup_check(struct mosquitto_db *db);
 int mqtt3_db_restore(struct mosquitto_db *db);
+/* Write-ahead log. These all do nothing unless persistence_wal is enabled. */
+int mqtt3_db_wal_client_write(struct mosquitto *context);
+int mqtt3_db_wal_client_delete(const char *client_id);
+int mqtt3_db_wal_client_msg_write(struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+int mqtt3_db_wal_client_msg_delete(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir);
+int mqtt3_db_wal_sub_write(struct mosquitto *context, const char *sub, int qos);
+int mqtt3_db_wal_sub_delete(struct mosquitto *context, const char *sub);
+int mqtt3_db_wal_retain_write(struct mosquitto_msg_store *stored);
+/* Send a PUBACK or PUBREC for an incoming message, holding it back until the
+ * next sync if persistence_durable_acks is set and the message is waiting to
+ * be synced. */
+int mqtt3_db_wal_ack(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_msg_store *stored, uint8_t command, uint16_t mid);
+/* Forget any acknowledgements held back for a client that has gone away. */
+void mqtt3_db_wal_ack_drop(struct mosquitto *context);
+/* Flush logged changes to disk, compacting the log if it has grown too large. */
+int mqtt3_db_wal_sync(struct mosquitto_db *db);
+int mqtt3_db_wal_close(struct mosquitto_db *db);
 #endif
 int mqtt3_db_client_count(struct mosquitto_db *db, unsigned int *count, unsigned int *inactive_count);
 void mqtt3_db_limits_set(int inflight, int queued);
@@ -346,7 +497,9 @@ int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosqui
 int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored);
 int mqtt3_db_message_release(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir);
 int mqtt3_db_message_update(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, enum mqtt3_msg_state state);
-int mqtt3_db_message_write(struct mosquitto *context);
+int mqtt3_db_message_write(struct mosquitto_db *db, struct mosquitto *context);
+void mqtt3_db_ready_remove(struct mosquitto *context);
+void mqtt3_db_ready_write(struct mosquitto_db *db);
 int mqtt3_db_messages_delete(struct mosquitto *context);
 int mqtt3_db_messages_easy_queue(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int qos, uint32_t payloadlen, const void *payload, int retain);
 int mqtt3_db_messages_queue(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored);
@@ -358,6 +511,7 @@ int mqtt3_db_message_reconnect_reset(struct mosquitto *context);
 int mqtt3_retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos);
 void mqtt3_db_store_clean(struct mosquitto_db *db);
 void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_time);
+void mqtt3_db_sys_refresh(struct mosquitto_db *db, const char *sub);
 void mqtt3_db_vacuum(void);
 
 /* ============================================================
@@ -366,6 +520,8 @@ void mqtt3_db_vacuum(void);
 int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root);
 int mqtt3_sub_remove(struct mosquitto_db *db, struct mosquitto *context, const char *sub, struct _mosquitto_subhier *root);
 int mqtt3_sub_search(struct mosquitto_db *db, struct _mosquitto_subhier *root, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored);
+bool mqtt3_sub_has_subscribers(struct mosquitto_db *db, const char *topic);
+bool mqtt3_sub_sys_subscribed(struct mosquitto_db *db);
 void mqtt3_sub_tree_print(struct _mosquitto_subhier *root, int level);
 int mqtt3_subs_clean_session(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *root);
 
@@ -374,6 +530,14 @@ int mqtt3_subs_clean_session(struct mosquitto_db *db, struct mosquitto *context,
  * ============================================================ */
 struct mosquitto *mqtt3_context_init(int sock);
 void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, bool do_free);
+int mqtt3_context_add(struct mosquitto_db *db, struct mosquitto *context);
+void mqtt3_context_remove(struct mosquitto_db *db, struct mosquitto *context);
+int mqtt3_context_offline(struct mosquitto_db *db, struct mosquitto *context);
+int mqtt3_context_online(struct mosquitto_db *db, struct mosquitto *context);
+void mqtt3_context_connect_done(struct mosquitto *context);
+void mqtt3_context_compact(struct mosquitto_db *db);
+struct mosquitto *mqtt3_context_find(struct mosquitto_db *db, const char *id);
+void mqtt3_context_id_set(struct mosquitto_db *db, struct mosquitto *context, char *id);
 void mqtt3_context_disconnect(struct mosquitto_db *db, struct mosquitto *context);
 
 /* ============================================================
@@ -381,7 +545,9 @@ void mqtt3_context_disconnect(struct mosquitto_db *db, struct mosquitto *context
  * ============================================================ */
 int mqtt3_log_init(int level, int destinations);
 int mqtt3_log_close(void);
+void mqtt3_log_topic_flush(struct mosquitto_db *db, time_t now);
 int _mosquitto_log_printf(struct mosquitto *mosq, int level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+#include <logging_mosq.h>
 
 /* ============================================================
  * Bridge functions
@@ -402,7 +568,9 @@ int mosquitto_security_init(struct mosquitto_db *db, bool reload);
 int mosquitto_security_apply(struct mosquitto_db *db);
 int mosquitto_security_cleanup(struct mosquitto_db *db, bool reload);
 int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access);
+void mosquitto_acl_cache_flush(struct mosquitto *context);
 int mosquitto_unpwd_check(struct mosquitto_db *db, const char *username, const char *password);
+int mosquitto_unpwd_check_async(struct mosquitto_db *db, struct _mosquitto_auth_request *request, const char *username, const char *password);
 int mosquitto_psk_key_get(struct mosquitto_db *db, const char *hint, const char *identity, char *key, int max_key_len);
 
 int mosquitto_security_init_default(struct mosquitto_db *db, bool reload);
@@ -410,6 +578,7 @@ int mosquitto_security_apply_default(struct mosquitto_db *db);
 int mosquitto_security_cleanup_default(struct mosquitto_db *db, bool reload);
 int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access);
 int mosquitto_unpwd_check_default(struct mosquitto_db *db, const char *username, const char *password);
+int mosquitto_unpwd_check_default_async(struct mosquitto_db *db, struct _mosquitto_auth_request *request, const char *username, const char *password);
 int mosquitto_psk_key_get_default(struct mosquitto_db *db, const char *hint, const char *identity, char *key, int max_key_len);
 
 /* ============================================================
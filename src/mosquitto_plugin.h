@@ -30,7 +30,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifndef MOSQUITTO_PLUGIN_H
 #define MOSQUITTO_PLUGIN_H
 
-#define MOSQ_AUTH_PLUGIN_VERSION 1
+#define MOSQ_AUTH_PLUGIN_VERSION 2
 
 #define MOSQ_ACL_NONE 0x00
 #define MOSQ_ACL_READ 0x01
@@ -55,7 +55,8 @@ struct mosquitto_auth_opt {
  *
  * The broker will call this function immediately after loading the plugin to
  * check it is a supported plugin version. Your code must simply return
- * MOSQ_AUTH_PLUGIN_VERSION.
+ * MOSQ_AUTH_PLUGIN_VERSION. Plugins returning 1 are still accepted, but the
+ * optional functions added in version 2 will not be used.
  *
  *
  * Function: mosquitto_auth_plugin_init
@@ -167,6 +168,30 @@ struct mosquitto_auth_opt {
  * error.
  *
  *
+ * Function: mosquitto_auth_unpwd_check_async
+ *
+ * int mosquitto_auth_unpwd_check_async(void *user_data, const char *username, const char *password, void *request, void (*complete)(void *request, int result));
+ *
+ * Optional, version 2 and above. If this function is present it is used
+ * instead of <mosquitto_auth_unpwd_check> so that the broker can carry on
+ * serving other clients whilst a slow check (a database or network lookup
+ * for example) is in progress.
+ *
+ * Start checking username and password and return MOSQ_ERR_SUCCESS. When the
+ * check has finished, call complete(request, result) exactly once, where
+ * result is one of the values that <mosquitto_auth_unpwd_check> would have
+ * returned. complete may be called from any thread, including from within
+ * this function. username and password are only valid until this function
+ * returns, so copy them if they are needed later.
+ *
+ * Returning any value other than MOSQ_ERR_SUCCESS means that the check was
+ * not started and complete must not be called. If MOSQ_ERR_NOT_SUPPORTED is
+ * returned the broker calls <mosquitto_auth_unpwd_check> instead, otherwise
+ * the return value is used as the result of the check.
+ *
+ * Not supported on Windows.
+ *
+ *
  * Function: mosquitto_psk_key_get
  *
  * int mosquitto_auth_psk_key_get(void *user_data, const char *hint, const char *identity, char *key, int max_key_len);
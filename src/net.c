@@ -28,10 +28,13 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 POSSIBILITY OF SUCH DAMAGE.
 */
 
+#define _GNU_SOURCE
+
 #include <config.h>
 
 #ifndef WIN32
 #include <netdb.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -43,6 +46,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #ifdef WITH_WRAP
@@ -64,24 +68,65 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <mqtt3_protocol.h>
 #include <memory_mosq.h>
 #include <net_mosq.h>
+#include <shm_mosq.h>
 #include <util_mosq.h>
 
 #ifdef WITH_TLS
+#include <openssl/evp.h>
+#include <openssl/rand.h>
 #include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#else
+#include <openssl/hmac.h>
+#endif
 static int tls_ex_index_context = -1;
 static int tls_ex_index_listener = -1;
 #endif
 
 extern unsigned int g_socket_connections;
+#ifdef WITH_TLS
+extern unsigned long g_tls_handshakes_full;
+extern unsigned long g_tls_handshakes_resumed;
+#endif
 
-int mqtt3_socket_accept(struct mosquitto_db *db, int listensock)
+/* Return how many connections may be accepted on listener right now, going
+ * by max_connection_rate and max_pending_connections. Connections that aren't
+ * accepted wait in the listen backlog. */
+int mqtt3_socket_accept_limit(struct _mqtt3_listener *listener, time_t now)
+{
+	int limit = MQTT3_ACCEPT_BATCH;
+
+	if(listener->max_connection_rate > 0){
+		if(listener->conn_token_t != now){
+			listener->conn_tokens = listener->max_connection_rate;
+			listener->conn_token_t = now;
+		}
+		if(listener->conn_tokens < limit){
+			limit = listener->conn_tokens;
+		}
+	}
+	if(listener->max_pending_connections > 0){
+		if(listener->max_pending_connections - listener->pending_count < limit){
+			limit = listener->max_pending_connections - listener->pending_count;
+		}
+	}
+	if(limit < 0) limit = 0;
+	return limit;
+}
+
+/* Accept a single connection from listensock, which belongs to listener.
+ * Returns MOSQ_ERR_SUCCESS if a connection was taken off the queue, whether
+ * or not it was allowed to stay, or -1 once there is nothing left to accept.
+ */
+int mqtt3_socket_accept(struct mosquitto_db *db, int listensock, struct _mqtt3_listener *listener)
 {
-	int i;
-	int j;
 	int new_sock = -1;
-	struct mosquitto **tmp_contexts = NULL;
 	struct mosquitto *new_context;
+#if !defined(__linux__) || defined(WIN32)
 	int opt = 1;
+#endif
 #ifdef WITH_TLS
 	BIO *bio;
 	int rc;
@@ -91,23 +136,31 @@ int mqtt3_socket_accept(struct mosquitto_db *db, int listensock)
 	char address[1024];
 #endif
 
+#if defined(__linux__)
+	/* Saves two fcntl() calls for every connection. */
+	new_sock = accept4(listensock, NULL, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
 	new_sock = accept(listensock, NULL, 0);
+#endif
 	if(new_sock == INVALID_SOCKET) return -1;
 
 	g_socket_connections++;
+	if(listener->conn_tokens > 0) listener->conn_tokens--;
 
-#ifndef WIN32
+#if defined(WIN32)
+	if(ioctlsocket(new_sock, FIONBIO, &opt)){
+		closesocket(new_sock);
+		listener->reject_count++;
+		return MOSQ_ERR_SUCCESS;
+	}
+#elif !defined(__linux__)
 	/* Set non-blocking */
 	opt = fcntl(new_sock, F_GETFL, 0);
 	if(opt == -1 || fcntl(new_sock, F_SETFL, opt | O_NONBLOCK) == -1){
 		/* If either fcntl fails, don't want to allow this client to connect. */
 		close(new_sock);
-		return -1;
-	}
-#else
-	if(ioctlsocket(new_sock, FIONBIO, &opt)){
-		closesocket(new_sock);
-		return INVALID_SOCKET;
+		listener->reject_count++;
+		return MOSQ_ERR_SUCCESS;
 	}
 #endif
 
@@ -121,87 +174,62 @@ int mqtt3_socket_accept(struct mosquitto_db *db, int listensock)
 			_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Client connection from %s denied access by tcpd.", address);
 		}
 		COMPAT_CLOSE(new_sock);
-		return -1;
-	}else{
+		listener->reject_count++;
+		return MOSQ_ERR_SUCCESS;
+	}
 #endif
-		new_context = mqtt3_context_init(new_sock);
-		if(!new_context){
-			COMPAT_CLOSE(new_sock);
-			return -1;
-		}
-		for(i=0; i<db->config->listener_count; i++){
-			for(j=0; j<db->config->listeners[i].sock_count; j++){
-				if(db->config->listeners[i].socks[j] == listensock){
-					new_context->listener = &db->config->listeners[i];
-					break;
-				}
-			}
-		}
-		if(!new_context->listener){
-			COMPAT_CLOSE(new_sock);
-			return -1;
-		}
+	new_context = mqtt3_context_init(new_sock);
+	if(!new_context){
+		COMPAT_CLOSE(new_sock);
+		listener->reject_count++;
+		return MOSQ_ERR_SUCCESS;
+	}
 
-		if(new_context->listener->max_connections > 0 && new_context->listener->client_count >= new_context->listener->max_connections){
-			_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Client connection from %s denied: max_connections exceeded.", new_context->address);
-			COMPAT_CLOSE(new_sock);
-			return -1;
-		}
-		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "New connection from %s.", new_context->address);
-		for(i=0; i<db->context_count; i++){
-			if(db->contexts[i] == NULL){
-				db->contexts[i] = new_context;
-				break;
-			}
-		}
-		if(i==db->context_count){
-			tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*(db->context_count+1));
-			if(tmp_contexts){
-				db->context_count++;
-				db->contexts = tmp_contexts;
-				db->contexts[db->context_count-1] = new_context;
-			}else{
-				mqtt3_context_cleanup(NULL, new_context, true);
-			}
-		}
-		new_context->listener->client_count++;
+	if(listener->max_connections > 0 && listener->client_count >= listener->max_connections){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Client connection from %s denied: max_connections exceeded.", new_context->address);
+		mqtt3_context_cleanup(NULL, new_context, true);
+		listener->reject_count++;
+		return MOSQ_ERR_SUCCESS;
+	}
+	_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "New connection from %s.", new_context->address);
+	if(mqtt3_context_add(db, new_context)){
+		mqtt3_context_cleanup(NULL, new_context, true);
+		listener->reject_count++;
+		return MOSQ_ERR_SUCCESS;
+	}
+	new_context->listener = listener;
+	listener->client_count++;
+	listener->accept_count++;
+	new_context->connect_pending = true;
+	listener->pending_count++;
 
 #ifdef WITH_TLS
-		/* TLS init */
-		for(i=0; i<db->config->listener_count; i++){
-			for(j=0; j<db->config->listeners[i].sock_count; j++){
-				if(db->config->listeners[i].socks[j] == listensock){
-					if(db->config->listeners[i].ssl_ctx){
-						new_context->ssl = SSL_new(db->config->listeners[i].ssl_ctx);
-						if(!new_context->ssl){
-							COMPAT_CLOSE(new_sock);
-							return -1;
-						}
-						SSL_set_ex_data(new_context->ssl, tls_ex_index_context, new_context);
-						SSL_set_ex_data(new_context->ssl, tls_ex_index_listener, &db->config->listeners[i]);
-						new_context->want_read = true;
-						new_context->want_write = true;
-						bio = BIO_new_socket(new_sock, BIO_NOCLOSE);
-						SSL_set_bio(new_context->ssl, bio, bio);
-						rc = SSL_accept(new_context->ssl);
-						if(rc != 1){
-							rc = SSL_get_error(new_context->ssl, rc);
-							if(rc == SSL_ERROR_WANT_READ){
-								new_context->want_read = true;
-							}else if(rc == SSL_ERROR_WANT_WRITE){
-								new_context->want_write = true;
-							}
-						}
-					}
-				}
+	/* TLS init */
+	if(listener->ssl_ctx){
+		new_context->ssl = SSL_new(listener->ssl_ctx);
+		if(!new_context->ssl){
+			mqtt3_context_disconnect(db, new_context);
+			return MOSQ_ERR_SUCCESS;
+		}
+		SSL_set_ex_data(new_context->ssl, tls_ex_index_context, new_context);
+		SSL_set_ex_data(new_context->ssl, tls_ex_index_listener, listener);
+		new_context->want_read = true;
+		new_context->want_write = true;
+		bio = BIO_new_socket(new_sock, BIO_NOCLOSE);
+		SSL_set_bio(new_context->ssl, bio, bio);
+		rc = SSL_accept(new_context->ssl);
+		if(rc != 1){
+			rc = SSL_get_error(new_context->ssl, rc);
+			if(rc == SSL_ERROR_WANT_READ){
+				new_context->want_read = true;
+			}else if(rc == SSL_ERROR_WANT_WRITE){
+				new_context->want_write = true;
 			}
 		}
-#endif
-
-#ifdef WITH_WRAP
 	}
 #endif
-	return new_sock;
+
+	return MOSQ_ERR_SUCCESS;
 }
 
 #ifdef WITH_TLS
@@ -255,11 +283,156 @@ static unsigned int psk_server_callback(SSL *ssl, const char *identity, unsigned
 }
 #endif
 
-/* Creates a socket and listens on port 'port'.
- * Returns 1 on failure
- * Returns 0 on success.
- */
-int mqtt3_socket_listen(struct _mqtt3_listener *listener)
+#ifdef WITH_TLS
+static void tls_info_callback(const SSL *ssl, int where, int ret)
+{
+	if(where & SSL_CB_HANDSHAKE_DONE){
+		if(SSL_session_reused((SSL *)ssl)){
+			g_tls_handshakes_resumed++;
+		}else{
+			g_tls_handshakes_full++;
+		}
+	}
+}
+
+#  ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+static int _ticket_key_new(struct _mqtt3_ticket_key *key)
+{
+	if(RAND_bytes(key->name, sizeof(key->name)) != 1) return 1;
+	if(RAND_bytes(key->aes_key, sizeof(key->aes_key)) != 1) return 1;
+	if(RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) != 1) return 1;
+	return 0;
+}
+
+/* Replace the ticket key once it is tls_session_lifetime seconds old. The old
+ * key is kept for another lifetime so that tickets it issued can still be
+ * used, after which they are refused. */
+static int _ticket_keys_rotate(struct _mqtt3_listener *listener, time_t now)
+{
+	if(listener->ticket_key_count > 0 && now - listener->ticket_key_t < listener->tls_session_lifetime){
+		return 0;
+	}
+	if(listener->ticket_key_count > 0 && now - listener->ticket_key_t < 2*listener->tls_session_lifetime){
+		listener->ticket_keys[1] = listener->ticket_keys[0];
+		listener->ticket_key_count = 2;
+	}else{
+		listener->ticket_key_count = 1;
+	}
+	if(_ticket_key_new(&listener->ticket_keys[0])){
+		listener->ticket_key_count = 0;
+		return 1;
+	}
+	listener->ticket_key_t = now;
+	return 0;
+}
+
+/* Picks the listener key for a session ticket and sets up the cipher for it.
+ * Encrypts new session tickets with the current key of the listener and
+ * decrypts tickets from either of its keys. Returns 2 for tickets from the
+ * previous key, so OpenSSL issues the client a fresh one. The caller sets up
+ * the HMAC with the hmac_key of *key whenever this returns more than 0. */
+static int _ticket_key_select(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *ctx, int enc, struct _mqtt3_ticket_key **key)
+{
+	struct _mqtt3_listener *listener;
+	int i;
+
+	listener = SSL_get_ex_data(ssl, tls_ex_index_listener);
+	if(!listener) return -1;
+
+	if(_ticket_keys_rotate(listener, time(NULL))) return -1;
+
+	if(enc){
+		*key = &listener->ticket_keys[0];
+		if(RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_128_cbc())) != 1) return -1;
+		memcpy(key_name, (*key)->name, sizeof((*key)->name));
+		if(EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, (*key)->aes_key, iv) != 1) return -1;
+		return 1;
+	}else{
+		for(i=0; i<listener->ticket_key_count; i++){
+			*key = &listener->ticket_keys[i];
+			if(!memcmp(key_name, (*key)->name, sizeof((*key)->name))){
+				if(EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, (*key)->aes_key, iv) != 1) return -1;
+				return i==0?1:2;
+			}
+		}
+		/* Unknown or expired key, do a full handshake. */
+		return 0;
+	}
+}
+
+#    if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int tls_ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *ctx, EVP_MAC_CTX *hctx, int enc)
+{
+	struct _mqtt3_ticket_key *key;
+	OSSL_PARAM params[3];
+	int rc;
+
+	rc = _ticket_key_select(ssl, key_name, iv, ctx, enc, &key);
+	if(rc <= 0) return rc;
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key->hmac_key, sizeof(key->hmac_key));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	if(EVP_MAC_CTX_set_params(hctx, params) != 1) return -1;
+	return rc;
+}
+#    else
+static int tls_ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *ctx, HMAC_CTX *hctx, int enc)
+{
+	struct _mqtt3_ticket_key *key;
+	int rc;
+
+	rc = _ticket_key_select(ssl, key_name, iv, ctx, enc, &key);
+	if(rc <= 0) return rc;
+
+	HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(), NULL);
+	return rc;
+}
+#    endif
+#  endif
+
+/* Configure session resumption for the listener's TLS context. */
+static int _tls_session_setup(struct _mqtt3_listener *listener)
+{
+	char sid_ctx[SSL_MAX_SID_CTX_LENGTH];
+
+	SSL_CTX_set_info_callback(listener->ssl_ctx, tls_info_callback);
+
+	/* Sessions must only be resumed on the listener they were created on.
+	 * Without this, resumption fails when client certificates are used. */
+	snprintf(sid_ctx, SSL_MAX_SID_CTX_LENGTH, "mosquitto:%d", listener->port);
+	if(!SSL_CTX_set_session_id_context(listener->ssl_ctx, (unsigned char *)sid_ctx, strlen(sid_ctx))){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to set TLS session id context.");
+		return 1;
+	}
+	if(listener->tls_session_cache_size > 0){
+		SSL_CTX_set_session_cache_mode(listener->ssl_ctx, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(listener->ssl_ctx, listener->tls_session_cache_size);
+	}else{
+		SSL_CTX_set_session_cache_mode(listener->ssl_ctx, SSL_SESS_CACHE_OFF);
+	}
+	SSL_CTX_set_timeout(listener->ssl_ctx, listener->tls_session_lifetime);
+
+#  ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+	if(listener->tls_session_tickets){
+		if(_ticket_keys_rotate(listener, time(NULL))){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to create TLS session ticket key.");
+			return 1;
+		}
+#    if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(listener->ssl_ctx, tls_ticket_key_callback);
+#    else
+		SSL_CTX_set_tlsext_ticket_key_cb(listener->ssl_ctx, tls_ticket_key_callback);
+#    endif
+	}else{
+		SSL_CTX_set_options(listener->ssl_ctx, SSL_OP_NO_TICKET);
+	}
+#  endif
+	return 0;
+}
+#endif
+
+static int _socket_listen_tcp(struct _mqtt3_listener *listener)
 {
 	int sock = -1;
 	struct addrinfo hints;
@@ -271,14 +444,6 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 #else
 	char ss_opt = 1;
 #endif
-#ifdef WITH_TLS
-	int rc;
-	X509_STORE *store;
-	X509_LOOKUP *lookup;
-#endif
-	char err[256];
-
-	if(!listener) return MOSQ_ERR_INVAL;
 
 	snprintf(service, 10, "%d", listener->port);
 	memset(&hints, 0, sizeof(struct addrinfo));
@@ -302,8 +467,7 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 
 		sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
 		if(sock == -1){
-			strerror_r(errno, err, 256);
-			_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: %s", err);
+			_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: %s", strerror(errno));
 			continue;
 		}
 		listener->sock_count++;
@@ -338,24 +502,144 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 #endif
 
 		if(bind(sock, rp->ai_addr, rp->ai_addrlen) == -1){
-			strerror_r(errno, err, 256);
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s", err);
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s", strerror(errno));
 			COMPAT_CLOSE(sock);
 			return 1;
 		}
 
 		if(listen(sock, 100) == -1){
-			strerror_r(errno, err, 256);
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s", err);
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s", strerror(errno));
 			COMPAT_CLOSE(sock);
 			return 1;
 		}
 	}
 	freeaddrinfo(ainfo);
 
+	return 0;
+}
+
+#ifndef WIN32
+static int _socket_listen_unix(struct _mqtt3_listener *listener)
+{
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	struct stat st;
+	mode_t old_umask;
+	int sock;
+	int opt;
+	int rc;
+
+	listener->sock_count = 0;
+	listener->socks = NULL;
+
+	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Opening unix listen socket on %s.", listener->unix_path);
+	if(_mosquitto_socket_unix_addr(listener->unix_path, &addr, &addrlen)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid unix socket path \"%s\".", listener->unix_path);
+		return 1;
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sock == -1){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s", strerror(errno));
+		return 1;
+	}
+
+	/* Set non-blocking */
+	opt = fcntl(sock, F_GETFL, 0);
+	if(opt == -1 || fcntl(sock, F_SETFL, opt | O_NONBLOCK) == -1){
+		COMPAT_CLOSE(sock);
+		return 1;
+	}
+
+	if(listener->unix_path[0] == '/'){
+		/* Remove a socket left behind by a previous broker, but nothing else. */
+		if(!lstat(listener->unix_path, &st) && S_ISSOCK(st.st_mode)){
+			unlink(listener->unix_path);
+		}
+	}
+
+	/* Don't let anyone connect before socket_mode has been applied. */
+	old_umask = umask(0077);
+	rc = bind(sock, (struct sockaddr *)&addr, addrlen);
+	umask(old_umask);
+	if(rc == -1){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s", strerror(errno));
+		COMPAT_CLOSE(sock);
+		return 1;
+	}
+	if(listener->unix_path[0] == '/'){
+		if(listener->socket_mode == -1){
+			listener->socket_mode = 0777 & ~old_umask;
+		}
+		if(chmod(listener->unix_path, listener->socket_mode) == -1){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to set permissions of %s: %s", listener->unix_path, strerror(errno));
+			COMPAT_CLOSE(sock);
+			return 1;
+		}
+	}
+
+	if(listen(sock, 100) == -1){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s", strerror(errno));
+		COMPAT_CLOSE(sock);
+		return 1;
+	}
+
+	listener->socks = _mosquitto_malloc(sizeof(int));
+	if(!listener->socks){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		COMPAT_CLOSE(sock);
+		return MOSQ_ERR_NOMEM;
+	}
+	listener->socks[0] = sock;
+	listener->sock_count = 1;
+	return 0;
+}
+#endif
+
+/* Creates a socket and listens on port 'port', or on the unix socket
+ * unix_path if it is set.
+ * Returns 1 on failure
+ * Returns 0 on success.
+ */
+int mqtt3_socket_listen(struct _mqtt3_listener *listener)
+{
+	int rc;
+#ifdef WITH_TLS
+	int sock;
+	X509_STORE *store;
+	X509_LOOKUP *lookup;
+#endif
+
+	if(!listener) return MOSQ_ERR_INVAL;
+
+#if defined(WITH_SHM) && defined(WITH_TLS)
+	if(listener->shm_transport && (listener->cafile || listener->capath || listener->psk_hint)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: shm_transport cannot be used with SSL/TLS on the same listener.");
+		return 1;
+	}
+#endif
+
+#ifndef WIN32
+	if(listener->unix_path){
+		rc = _socket_listen_unix(listener);
+	}else{
+		rc = _socket_listen_tcp(listener);
+	}
+#else
+	rc = _socket_listen_tcp(listener);
+#endif
+	if(rc) return rc;
+
 	/* We need to have at least one working socket. */
 	if(listener->sock_count > 0){
 #ifdef WITH_TLS
+		sock = listener->socks[listener->sock_count-1];
+		if(tls_ex_index_context == -1){
+			tls_ex_index_context = SSL_get_ex_new_index(0, "client context", NULL, NULL, NULL);
+		}
+		if(tls_ex_index_listener == -1){
+			tls_ex_index_listener = SSL_get_ex_new_index(0, "listener", NULL, NULL, NULL);
+		}
 		if((listener->cafile || listener->capath) && listener->certfile && listener->keyfile){
 			listener->ssl_ctx = SSL_CTX_new(TLSv1_server_method());
 			if(!listener->ssl_ctx){
@@ -432,16 +716,13 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 				}
 				X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK);
 			}
+			if(_tls_session_setup(listener)){
+				COMPAT_CLOSE(sock);
+				return 1;
+			}
 
 #  ifdef WITH_TLS_PSK
 		}else if(listener->psk_hint){
-			if(tls_ex_index_context == -1){
-				tls_ex_index_context = SSL_get_ex_new_index(0, "client context", NULL, NULL, NULL);
-			}
-			if(tls_ex_index_listener == -1){
-				tls_ex_index_listener = SSL_get_ex_new_index(0, "listener", NULL, NULL, NULL);
-			}
-
 			listener->ssl_ctx = SSL_CTX_new(TLSv1_server_method());
 			if(!listener->ssl_ctx){
 				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to create TLS context.");
@@ -465,6 +746,10 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 					return 1;
 				}
 			}
+			if(_tls_session_setup(listener)){
+				COMPAT_CLOSE(sock);
+				return 1;
+			}
 #  endif /* WITH_TLS_PSK */
 		}
 #endif /* WITH_TLS */
@@ -474,6 +759,99 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 	}
 }
 
+#ifdef WITH_SHM
+/* Take over the shared memory handed to us by a client on a shm_transport
+ * listener, see _mosquitto_shm_connect(). This is the first and only thing
+ * read from the unix socket, which is closed once the client has been told
+ * whether the memory was accepted. From then on context->sock is the eventfd
+ * that the client uses to wake us. */
+int mqtt3_socket_shm_attach(struct mosquitto *context)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(3*sizeof(int))];
+	} cbuf;
+	struct cmsghdr *cmsg;
+	/* Memory, broker eventfd, client eventfd. */
+	int fds[3] = {-1, -1, -1};
+	int fd_count = 0;
+	int fd;
+	ssize_t len;
+	uint8_t byte;
+	int rc;
+	int i;
+	int opt;
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+
+	len = recvmsg(context->sock, &msg, MSG_CMSG_CLOEXEC);
+	if(len == 0) return MOSQ_ERR_CONN_LOST;
+	if(len < 0){
+		if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK) return MOSQ_ERR_SUCCESS;
+		return MOSQ_ERR_ERRNO;
+	}
+	for(cmsg=CMSG_FIRSTHDR(&msg); cmsg; cmsg=CMSG_NXTHDR(&msg, cmsg)){
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+			fd_count = (cmsg->cmsg_len - CMSG_LEN(0))/sizeof(int);
+			for(i=0; i<fd_count; i++){
+				memcpy(&fd, CMSG_DATA(cmsg)+i*sizeof(int), sizeof(int));
+				if(i < 3){
+					fds[i] = fd;
+				}else{
+					close(fd);
+				}
+			}
+			break;
+		}
+	}
+
+	if(byte != MOSQ_SHM_VERSION || fd_count != 3 || (msg.msg_flags & MSG_CTRUNC)){
+		rc = MOSQ_ERR_PROTOCOL;
+	}else{
+		rc = MOSQ_ERR_SUCCESS;
+		/* Don't let a client block us with descriptors it has set up
+		 * itself. */
+		for(i=1; i<3; i++){
+			opt = fcntl(fds[i], F_GETFL, 0);
+			if(opt == -1 || fcntl(fds[i], F_SETFL, opt | O_NONBLOCK) == -1){
+				rc = MOSQ_ERR_ERRNO;
+			}
+		}
+		if(!rc){
+			rc = _mosquitto_shm_map(context, fds[0], fds[2], true);
+		}
+	}
+	if(fds[0] != -1) close(fds[0]);
+
+	byte = rc?1:0;
+	if(send(context->sock, &byte, 1, MSG_NOSIGNAL) != 1 && !rc){
+		rc = MOSQ_ERR_CONN_LOST;
+	}
+	if(rc){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Shared memory from %s refused.", context->address);
+		if(context->shm){
+			_mosquitto_shm_close(context);
+		}else if(fds[2] != -1){
+			close(fds[2]);
+		}
+		if(fds[1] != -1) close(fds[1]);
+		return rc;
+	}
+
+	COMPAT_CLOSE(context->sock);
+	context->sock = fds[1];
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
+
 int _mosquitto_socket_get_address(int sock, char *buf, int len)
 {
 	struct sockaddr_storage addr;
@@ -489,6 +867,22 @@ int _mosquitto_socket_get_address(int sock, char *buf, int len)
 			if(inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr.s6_addr, buf, len)){
 				return 0;
 			}
+#ifndef WIN32
+		}else if(addr.ss_family == AF_UNIX){
+			/* Unix socket clients are normally unnamed, so use the path of
+			 * the listener they connected to. */
+			addrlen = sizeof(addr);
+			if(!getsockname(sock, (struct sockaddr *)&addr, &addrlen)
+					&& addrlen > offsetof(struct sockaddr_un, sun_path)){
+
+				addrlen -= offsetof(struct sockaddr_un, sun_path);
+				if((int)addrlen > len-1) addrlen = len-1;
+				memcpy(buf, ((struct sockaddr_un *)&addr)->sun_path, addrlen);
+				buf[addrlen] = '\0';
+				if(buf[0] == '\0') buf[0] = '@';
+				return 0;
+			}
+#endif
 		}
 	}
 	return 1;
@@ -33,6 +33,10 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #ifndef WIN32
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #endif
 #include <assert.h>
 #include <errno.h>
@@ -43,47 +47,172 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <mosquitto_broker.h>
 #include <memory_mosq.h>
+#include <mqtt3_protocol.h>
+#include <crc32c.h>
 #include <persist.h>
+#include <send_mosq.h>
 
 static uint32_t db_version;
 
+/* Write-ahead log state. wal_fptr is only non-NULL when persistence_wal is
+ * enabled and the initial restore has completed, so nothing gets logged whilst
+ * the database is being rebuilt. */
+static FILE *wal_fptr = NULL;
+static char *wal_filepath = NULL;
+static long wal_size = 0;
+static bool wal_dirty = false;
+static bool wal_replay = false;
+static bool wal_stale = false;
+/* Log that was set aside when the current background snapshot started. It
+ * is only removed once a snapshot covering it has been written. */
+static char *wal_old_filepath = NULL;
+
+/* PUBACK/PUBREC packets waiting for the records they acknowledge to be synced
+ * to the log, in the order they were generated. */
+struct _db_held_ack{
+	struct mosquitto *context;
+	uint16_t mid;
+	uint8_t command;
+};
+static struct _db_held_ack *held_acks = NULL;
+static int held_ack_count = 0;
+static int held_ack_max = 0;
+
+/* Background snapshot state. At most one snapshot child runs at a time. */
+#ifndef WIN32
+static pid_t snapshot_pid = 0;
+#endif
+static unsigned long snapshot_start = 0;
+static dbid_t snapshot_last_db_id = 0;
+
+extern unsigned long g_snapshot_duration;
+extern unsigned long g_snapshot_size;
+
+/* Restore state. Message store entries are looked up by id through an open
+ * addressing hash table that only exists whilst restoring, so there is no
+ * per message cost once the broker is running. */
+#define _DB_STORE_HASH(id) ((size_t)((id) * 0x9E3779B97F4A7C15ULL >> 16))
+static struct mosquitto_msg_store **store_index = NULL;
+static size_t store_index_size = 0;
+static size_t store_index_count = 0;
+static struct mosquitto *restore_context = NULL;
+static struct mosquitto_client_msg *restore_tail = NULL;
+
+/* Scratch space for turning strings in the mapped file into C strings. Each
+ * is large enough for any string in the file. */
+struct _db_restore_strings{
+	char client_id[65536];
+	char source_id[65536];
+	char topic[65536];
+};
+static struct _db_restore_strings *restore_str = NULL;
+
+/* Restore reads from the whole file mapped into memory. Each chunk handler is
+ * given a view of exactly one chunk, so a bad length can't run past it. */
+struct _db_chunk{
+	const uint8_t *pos;
+	const uint8_t *end;
+};
 
 static int _db_restore_sub(struct mosquitto_db *db, const char *client_id, const char *sub, int qos);
+static int _db_wal_open(void);
 
-static struct mosquitto *_db_find_or_add_context(struct mosquitto_db *db, const char *client_id, uint16_t last_mid)
+static struct mosquitto *_db_find_context(struct mosquitto_db *db, const char *client_id)
 {
 	struct mosquitto *context;
-	struct mosquitto **tmp_contexts;
-	int i;
 
-	context = NULL;
-	for(i=0; i<db->context_count; i++){
-		if(db->contexts[i] && !strcmp(db->contexts[i]->id, client_id)){
-			context = db->contexts[i];
-			break;
+	/* Records for the same client are grouped together in a snapshot, so
+	 * check the last match first. */
+	if(restore_context && !strcmp(restore_context->id, client_id)){
+		return restore_context;
+	}
+	context = mqtt3_context_find(db, client_id);
+	if(context){
+		restore_context = context;
+		restore_tail = NULL;
+	}
+	return context;
+}
+
+static int _db_store_index_add(struct mosquitto_msg_store *stored)
+{
+	struct mosquitto_msg_store **new_index;
+	size_t new_size;
+	size_t i, slot;
+
+	if((store_index_count+1)*2 > store_index_size){
+		new_size = store_index_size?store_index_size*2:1024;
+		new_index = _mosquitto_calloc(new_size, sizeof(struct mosquitto_msg_store *));
+		if(!new_index){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return MOSQ_ERR_NOMEM;
+		}
+		for(i=0; i<store_index_size; i++){
+			if(store_index[i]){
+				slot = _DB_STORE_HASH(store_index[i]->db_id) & (new_size-1);
+				while(new_index[slot]){
+					slot = (slot+1) & (new_size-1);
+				}
+				new_index[slot] = store_index[i];
+			}
+		}
+		if(store_index) _mosquitto_free(store_index);
+		store_index = new_index;
+		store_index_size = new_size;
+	}
+
+	slot = _DB_STORE_HASH(stored->db_id) & (store_index_size-1);
+	while(store_index[slot]){
+		slot = (slot+1) & (store_index_size-1);
+	}
+	store_index[slot] = stored;
+	store_index_count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static struct mosquitto_msg_store *_db_find_store(struct mosquitto_db *db, dbid_t store_id)
+{
+	size_t slot;
+
+	if(!store_index) return NULL;
+
+	slot = _DB_STORE_HASH(store_id) & (store_index_size-1);
+	while(store_index[slot]){
+		if(store_index[slot]->db_id == store_id){
+			return store_index[slot];
 		}
+		slot = (slot+1) & (store_index_size-1);
 	}
+	return NULL;
+}
+
+static void _db_store_index_free(void)
+{
+	if(store_index) _mosquitto_free(store_index);
+	store_index = NULL;
+	store_index_size = 0;
+	store_index_count = 0;
+}
+
+static struct mosquitto *_db_find_or_add_context(struct mosquitto_db *db, const char *client_id, uint16_t last_mid)
+{
+	struct mosquitto *context;
+	char *id;
+
+	context = _db_find_context(db, client_id);
 	if(!context){
 		context = mqtt3_context_init(-1);
+		if(!context) return NULL;
 		context->clean_session = false;
-
-		for(i=0; i<db->context_count; i++){
-			if(!db->contexts[i]){
-				db->contexts[i] = context;
-				break;
-			}
-		}
-		if(i==db->context_count){
-			db->context_count++;
-			tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*db->context_count);
-			if(tmp_contexts){
-				db->contexts = tmp_contexts;
-				db->contexts[db->context_count-1] = context;
-			}else{
-				return NULL;
-			}
+		id = _mosquitto_strdup(client_id);
+		if(!id || mqtt3_context_offline(db, context)){
+			if(id) _mosquitto_free(id);
+			mqtt3_context_cleanup(db, context, true);
+			return NULL;
 		}
-		context->id = _mosquitto_strdup(client_id);
+		mqtt3_context_id_set(db, context, id);
+		restore_context = context;
+		restore_tail = NULL;
 	}
 	if(last_mid){
 		context->last_mid = last_mid;
@@ -91,12 +220,169 @@ static struct mosquitto *_db_find_or_add_context(struct mosquitto_db *db, const
 	return context;
 }
 
-static int mqtt3_db_client_messages_write(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto *context)
+/* Running state for the file being written, so that each chunk can be
+ * followed by its checksum and a snapshot by an index of where each type of
+ * chunk can be found. */
+struct _db_index_entry{
+	uint32_t count;
+	uint64_t first;
+	uint64_t end;
+};
+static uint32_t write_crc = 0;
+static uint64_t write_offset = 0;
+static uint64_t write_chunk_offset = 0;
+static uint16_t write_chunk_type = 0;
+static struct _db_index_entry write_index[DB_CHUNK_INDEX];
+
+static int _db_write(FILE *db_fptr, const void *buf, size_t len)
+{
+	if(fwrite(buf, 1, len, db_fptr) != len) return 1;
+	write_crc = mqtt3_crc32c(write_crc, buf, len);
+	write_offset += len;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_uint64_write(FILE *db_fptr, uint64_t value)
+{
+	uint32_t i32temp;
+
+	i32temp = htonl((uint32_t)(value >> 32));
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	i32temp = htonl((uint32_t)value);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	return 1;
+}
+
+/* The checksum covers the chunk type, length and body. */
+static int _db_chunk_header_write(FILE *db_fptr, uint16_t type, uint32_t length)
+{
+	uint16_t i16temp;
+	uint32_t i32temp;
+
+	write_crc = 0;
+	write_chunk_offset = write_offset;
+	write_chunk_type = type;
+
+	i16temp = htons(type);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	i32temp = htonl(length);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	return 1;
+}
+
+static int _db_chunk_end_write(FILE *db_fptr)
+{
+	uint32_t crc;
+	struct _db_index_entry *entry;
+
+	crc = htonl(write_crc);
+	write_e(db_fptr, &crc, sizeof(uint32_t));
+
+	if(write_chunk_type < DB_CHUNK_INDEX){
+		entry = &write_index[write_chunk_type];
+		if(!entry->count){
+			entry->first = write_chunk_offset;
+		}
+		entry->count++;
+		entry->end = write_offset;
+	}
+	return MOSQ_ERR_SUCCESS;
+error:
+	return 1;
+}
+
+/* For each chunk type present: the number of chunks, the offset of the first
+ * one and the offset just past the last one. Chunks of other types may be
+ * mixed in between. */
+static int _db_index_write(FILE *db_fptr)
+{
+	uint64_t index_offset;
+	uint32_t i32temp;
+	uint16_t i16temp, type, count = 0;
+
+	for(type=0; type<DB_CHUNK_INDEX; type++){
+		if(write_index[type].count) count++;
+	}
+	index_offset = write_offset;
+	if(_db_chunk_header_write(db_fptr, DB_CHUNK_INDEX,
+				sizeof(uint16_t) + count*(sizeof(uint16_t) + sizeof(uint32_t) + 2*sizeof(uint64_t)))){
+		goto error;
+	}
+	i16temp = htons(count);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	for(type=0; type<DB_CHUNK_INDEX; type++){
+		if(!write_index[type].count) continue;
+
+		i16temp = htons(type);
+		write_e(db_fptr, &i16temp, sizeof(uint16_t));
+		i32temp = htonl(write_index[type].count);
+		write_e(db_fptr, &i32temp, sizeof(uint32_t));
+		if(_db_uint64_write(db_fptr, write_index[type].first)) goto error;
+		if(_db_uint64_write(db_fptr, write_index[type].end)) goto error;
+	}
+	if(_db_chunk_end_write(db_fptr)) goto error;
+
+	return _db_uint64_write(db_fptr, index_offset);
+error:
+	return 1;
+}
+
+static int _db_client_msg_chunk_write(FILE *db_fptr, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
 {
 	uint32_t length;
 	dbid_t i64temp;
 	uint16_t i16temp, slen;
 	uint8_t i8temp;
+
+	slen = strlen(context->id);
+
+	length = sizeof(dbid_t) + sizeof(uint16_t) + sizeof(uint8_t) +
+			sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint8_t) +
+			sizeof(uint8_t) + 2+slen;
+
+	if(_db_chunk_header_write(db_fptr, DB_CHUNK_CLIENT_MSG, length)) goto error;
+
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, context->id, slen);
+
+	i64temp = cmsg->store->db_id;
+	write_e(db_fptr, &i64temp, sizeof(dbid_t));
+
+	i16temp = htons(cmsg->mid);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+
+	i8temp = (uint8_t )cmsg->qos;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+
+	i8temp = (uint8_t )cmsg->retain;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+
+	i8temp = (uint8_t )cmsg->direction;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+
+	i8temp = (uint8_t )cmsg->state;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+
+	i8temp = (uint8_t )cmsg->dup;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
+
+	if(_db_chunk_end_write(db_fptr)) goto error;
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+static int mqtt3_db_client_messages_write(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto *context)
+{
 	struct mosquitto_client_msg *cmsg;
 
 	assert(db);
@@ -105,123 +391,117 @@ static int mqtt3_db_client_messages_write(struct mosquitto_db *db, FILE *db_fptr
 
 	cmsg = context->msgs;
 	while(cmsg){
-		slen = strlen(context->id);
+		if(_db_client_msg_chunk_write(db_fptr, context, cmsg)) return 1;
+		cmsg = cmsg->next;
+	}
 
-		length = htonl(sizeof(dbid_t) + sizeof(uint16_t) + sizeof(uint8_t) +
-				sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint8_t) +
-				sizeof(uint8_t) + 2+slen);
+	return MOSQ_ERR_SUCCESS;
+}
 
-		i16temp = htons(DB_CHUNK_CLIENT_MSG);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, &length, sizeof(uint32_t));
+static int _db_msg_store_chunk_write(FILE *db_fptr, struct mosquitto_msg_store *stored)
+{
+	uint32_t length;
+	dbid_t i64temp;
+	uint32_t i32temp;
+	uint16_t i16temp, slen;
+	uint8_t i8temp;
+	bool force_no_retain;
 
-		i16temp = htons(slen);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, context->id, slen);
+	if(!strncmp(stored->msg.topic, "$SYS", 4)){
+		/* Don't save $SYS messages as retained otherwise they can give
+		 * misleading information when reloaded. They should still be saved
+		 * because a disconnected durable client may have them in their
+		 * queue. */
+		force_no_retain = true;
+	}else{
+		force_no_retain = false;
+	}
+	length = sizeof(dbid_t) + 2+strlen(stored->source_id) +
+			sizeof(uint16_t) + sizeof(uint16_t) +
+			2+strlen(stored->msg.topic) + sizeof(uint32_t) +
+			stored->msg.payloadlen + sizeof(uint8_t) + sizeof(uint8_t);
 
-		i64temp = cmsg->store->db_id;
-		write_e(db_fptr, &i64temp, sizeof(dbid_t));
+	if(_db_chunk_header_write(db_fptr, DB_CHUNK_MSG_STORE, length)) goto error;
 
-		i16temp = htons(cmsg->mid);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	i64temp = stored->db_id;
+	write_e(db_fptr, &i64temp, sizeof(dbid_t));
+
+	slen = strlen(stored->source_id);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	if(slen){
+		write_e(db_fptr, stored->source_id, slen);
+	}
 
-		i8temp = (uint8_t )cmsg->qos;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	i16temp = htons(stored->source_mid);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
 
-		i8temp = (uint8_t )cmsg->retain;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	i16temp = htons(stored->msg.mid);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
 
-		i8temp = (uint8_t )cmsg->direction;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	slen = strlen(stored->msg.topic);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, stored->msg.topic, slen);
 
-		i8temp = (uint8_t )cmsg->state;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	i8temp = (uint8_t )stored->msg.qos;
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
 
-		i8temp = (uint8_t )cmsg->dup;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	if(force_no_retain == false){
+		i8temp = (uint8_t )stored->msg.retain;
+	}else{
+		i8temp = 0;
+	}
+	write_e(db_fptr, &i8temp, sizeof(uint8_t));
 
-		cmsg = cmsg->next;
+	i32temp = htonl(stored->msg.payloadlen);
+	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	if(stored->msg.payloadlen){
+		write_e(db_fptr, stored->msg.payload, (unsigned int)stored->msg.payloadlen);
 	}
 
+	if(_db_chunk_end_write(db_fptr)) goto error;
+
 	return MOSQ_ERR_SUCCESS;
 error:
 	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
 	return 1;
 }
 
-
 static int mqtt3_db_message_store_write(struct mosquitto_db *db, FILE *db_fptr)
 {
-	uint32_t length;
-	dbid_t i64temp;
-	uint32_t i32temp;
-	uint16_t i16temp, slen;
-	uint8_t i8temp;
 	struct mosquitto_msg_store *stored;
-	bool force_no_retain;
 
 	assert(db);
 	assert(db_fptr);
 
 	stored = db->msg_store;
 	while(stored){
-		if(!strncmp(stored->msg.topic, "$SYS", 4)){
-			/* Don't save $SYS messages as retained otherwise they can give
-			 * misleading information when reloaded. They should still be saved
-			 * because a disconnected durable client may have them in their
-			 * queue. */
-			force_no_retain = true;
-		}else{
-			force_no_retain = false;
-		}
-		length = htonl(sizeof(dbid_t) + 2+strlen(stored->source_id) +
-				sizeof(uint16_t) + sizeof(uint16_t) +
-				2+strlen(stored->msg.topic) + sizeof(uint32_t) +
-				stored->msg.payloadlen + sizeof(uint8_t) + sizeof(uint8_t));
-
-		i16temp = htons(DB_CHUNK_MSG_STORE);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, &length, sizeof(uint32_t));
-
-		i64temp = stored->db_id;
-		write_e(db_fptr, &i64temp, sizeof(dbid_t));
-
-		slen = strlen(stored->source_id);
-		i16temp = htons(slen);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		if(slen){
-			write_e(db_fptr, stored->source_id, slen);
-		}
-
-		i16temp = htons(stored->source_mid);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
+		if(_db_msg_store_chunk_write(db_fptr, stored)) return 1;
+		stored = stored->next;
+	}
 
-		i16temp = htons(stored->msg.mid);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	return MOSQ_ERR_SUCCESS;
+}
 
-		slen = strlen(stored->msg.topic);
-		i16temp = htons(slen);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, stored->msg.topic, slen);
+static int _db_client_chunk_write(FILE *db_fptr, struct mosquitto *context)
+{
+	uint16_t i16temp, slen;
+	uint32_t length;
 
-		i8temp = (uint8_t )stored->msg.qos;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	length = 2+strlen(context->id) + sizeof(uint16_t) + sizeof(time_t);
 
-		if(force_no_retain == false){
-			i8temp = (uint8_t )stored->msg.retain;
-		}else{
-			i8temp = 0;
-		}
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	if(_db_chunk_header_write(db_fptr, DB_CHUNK_CLIENT, length)) goto error;
 
-		i32temp = htonl(stored->msg.payloadlen);
-		write_e(db_fptr, &i32temp, sizeof(uint32_t));
-		if(stored->msg.payloadlen){
-			write_e(db_fptr, stored->msg.payload, (unsigned int)stored->msg.payloadlen);
-		}
+	slen = strlen(context->id);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, context->id, slen);
+	i16temp = htons(context->last_mid);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, &(context->disconnect_t), sizeof(time_t));
 
-		stored = stored->next;
-	}
+	if(_db_chunk_end_write(db_fptr)) goto error;
 
 	return MOSQ_ERR_SUCCESS;
 error:
@@ -233,8 +513,6 @@ static int mqtt3_db_client_write(struct mosquitto_db *db, FILE *db_fptr)
 {
 	int i;
 	struct mosquitto *context;
-	uint16_t i16temp, slen;
-	uint32_t length;
 
 	assert(db);
 	assert(db_fptr);
@@ -242,23 +520,61 @@ static int mqtt3_db_client_write(struct mosquitto_db *db, FILE *db_fptr)
 	for(i=0; i<db->context_count; i++){
 		context = db->contexts[i];
 		if(context && context->clean_session == false){
-			length = htonl(2+strlen(context->id) + sizeof(uint16_t) + sizeof(time_t));
-
-			i16temp = htons(DB_CHUNK_CLIENT);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &length, sizeof(uint32_t));
-
-			slen = strlen(context->id);
-			i16temp = htons(slen);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, context->id, slen);
-			i16temp = htons(context->last_mid);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &(context->disconnect_t), sizeof(time_t));
-
+			if(_db_client_chunk_write(db_fptr, context)) return 1;
 			if(mqtt3_db_client_messages_write(db, db_fptr, context)) return 1;
 		}
 	}
+	for(i=0; i<db->offline_count; i++){
+		context = db->offline_contexts[i];
+		if(_db_client_chunk_write(db_fptr, context)) return 1;
+		if(mqtt3_db_client_messages_write(db, db_fptr, context)) return 1;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_sub_chunk_write(FILE *db_fptr, const char *client_id, const char *topic, uint8_t qos)
+{
+	uint32_t length;
+	uint16_t i16temp, slen;
+
+	length = 2+strlen(client_id) + 2+strlen(topic) + sizeof(uint8_t);
+
+	if(_db_chunk_header_write(db_fptr, DB_CHUNK_SUB, length)) goto error;
+
+	slen = strlen(client_id);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, client_id, slen);
+
+	slen = strlen(topic);
+	i16temp = htons(slen);
+	write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	write_e(db_fptr, topic, slen);
+
+	write_e(db_fptr, &qos, sizeof(uint8_t));
+
+	if(_db_chunk_end_write(db_fptr)) goto error;
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+static int _db_retain_chunk_write(FILE *db_fptr, struct mosquitto_msg_store *stored)
+{
+	uint32_t length;
+	dbid_t i64temp;
+
+	length = sizeof(dbid_t);
+
+	if(_db_chunk_header_write(db_fptr, DB_CHUNK_RETAIN, length)) goto error;
+
+	i64temp = stored->db_id;
+	write_e(db_fptr, &i64temp, sizeof(dbid_t));
+
+	if(_db_chunk_end_write(db_fptr)) goto error;
 
 	return MOSQ_ERR_SUCCESS;
 error:
@@ -271,9 +587,6 @@ static int _db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr, struct
 	struct _mosquitto_subhier *subhier;
 	struct _mosquitto_subleaf *sub;
 	char *thistopic;
-	uint32_t length;
-	uint16_t i16temp;
-	dbid_t i64temp;
 	size_t slen;
 
 	slen = strlen(topic) + strlen(node->topic) + 2;
@@ -288,37 +601,20 @@ static int _db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr, struct
 	sub = node->subs;
 	while(sub){
 		if(sub->context->clean_session == false){
-			length = htonl(2+strlen(sub->context->id) + 2+strlen(thistopic) + sizeof(uint8_t));
-
-			i16temp = htons(DB_CHUNK_SUB);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &length, sizeof(uint32_t));
-
-			slen = strlen(sub->context->id);
-			i16temp = htons(slen);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, sub->context->id, slen);
-
-			slen = strlen(thistopic);
-			i16temp = htons(slen);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, thistopic, slen);
-
-			write_e(db_fptr, &sub->qos, sizeof(uint8_t));
+			if(_db_sub_chunk_write(db_fptr, sub->context->id, thistopic, sub->qos)){
+				_mosquitto_free(thistopic);
+				return 1;
+			}
 		}
 		sub = sub->next;
 	}
 	if(node->retained){
 		if(strncmp(node->retained->msg.topic, "$SYS", 4)){
 			/* Don't save $SYS messages. */
-			length = htonl(sizeof(dbid_t));
-
-			i16temp = htons(DB_CHUNK_RETAIN);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &length, sizeof(uint32_t));
-
-			i64temp = node->retained->db_id;
-			write_e(db_fptr, &i64temp, sizeof(dbid_t));
+			if(_db_retain_chunk_write(db_fptr, node->retained)){
+				_mosquitto_free(thistopic);
+				return 1;
+			}
 		}
 	}
 
@@ -329,9 +625,6 @@ static int _db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr, struct
 	}
 	_mosquitto_free(thistopic);
 	return MOSQ_ERR_SUCCESS;
-error:
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	return 1;
 }
 
 static int mqtt3_db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr)
@@ -347,40 +640,348 @@ static int mqtt3_db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr)
 	return MOSQ_ERR_SUCCESS;
 }
 
-int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown)
+/* The header checksum covers the magic and the version. */
+static int _db_header_write(FILE *db_fptr)
 {
-	int rc = 0;
-	FILE *db_fptr = NULL;
 	uint32_t db_version = htonl(MOSQ_DB_VERSION);
-	uint32_t crc = htonl(0);
-	dbid_t i64temp;
-	uint32_t i32temp;
-	uint16_t i16temp;
-	uint8_t i8temp;
-	char err[256];
+	uint32_t crc;
 
-	if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
-	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s.", db->config->persistence_filepath);
-	if(cleanup){
-		mqtt3_db_store_clean(db);
+	crc = mqtt3_crc32c(0, magic, 15);
+	crc = htonl(mqtt3_crc32c(crc, &db_version, sizeof(uint32_t)));
+
+	write_offset = 0;
+	memset(write_index, 0, sizeof(write_index));
+
+	write_e(db_fptr, magic, 15);
+	write_e(db_fptr, &crc, sizeof(uint32_t));
+	write_e(db_fptr, &db_version, sizeof(uint32_t));
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	return 1;
+}
+
+/* Called when a write to the log fails. Anything not yet in a snapshot is
+ * still held in memory, so carry on with snapshots only rather than risk
+ * leaving a log with holes in it. */
+static void _db_wal_error(void)
+{
+	char err[256];
+
+	strerror_r(errno, err, 256);
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to write to persistence log %s: %s. Write-ahead logging disabled.", wal_filepath, err);
+	fclose(wal_fptr);
+	wal_fptr = NULL;
+}
+
+static int _db_wal_result(int rc)
+{
+	if(rc){
+		_db_wal_error();
+		return 1;
+	}
+	wal_dirty = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Discard the log contents once a snapshot containing them is safely on disk. */
+static int _db_wal_truncate(void)
+{
+	if(fflush(wal_fptr) || ftruncate(fileno(wal_fptr), 0)){
+		_db_wal_error();
+		return 1;
+	}
+	wal_size = 0;
+	return _db_wal_result(_db_header_write(wal_fptr));
+}
+
+static int _db_wal_msg_store_write(struct mosquitto_msg_store *stored)
+{
+	/* Message store entries are only logged once something that must survive
+	 * a restart refers to them, so most QoS 0 traffic never touches the disk. */
+	if(stored->persisted) return MOSQ_ERR_SUCCESS;
+	if(_db_msg_store_chunk_write(wal_fptr, stored)) return 1;
+	stored->persisted = true;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt3_db_wal_client_write(struct mosquitto *context)
+{
+	if(!wal_fptr || !context->id || context->clean_session) return MOSQ_ERR_SUCCESS;
+
+	return _db_wal_result(_db_client_chunk_write(wal_fptr, context));
+}
+
+int mqtt3_db_wal_client_delete(const char *client_id)
+{
+	uint32_t length;
+	uint16_t i16temp, slen;
+
+	if(!wal_fptr || !client_id) return MOSQ_ERR_SUCCESS;
+
+	slen = strlen(client_id);
+	length = 2+slen;
+
+	if(_db_chunk_header_write(wal_fptr, DB_CHUNK_CLIENT_DELETE, length)) goto error;
+
+	i16temp = htons(slen);
+	write_e(wal_fptr, &i16temp, sizeof(uint16_t));
+	write_e(wal_fptr, client_id, slen);
+
+	if(_db_chunk_end_write(wal_fptr)) goto error;
+
+	return _db_wal_result(MOSQ_ERR_SUCCESS);
+error:
+	return _db_wal_result(1);
+}
+
+int mqtt3_db_wal_client_msg_write(struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	/* QoS 0 messages are never redelivered after a restart so don't need
+	 * logging. */
+	if(!wal_fptr || context->clean_session || cmsg->qos == 0) return MOSQ_ERR_SUCCESS;
+
+	if(_db_wal_msg_store_write(cmsg->store)) return _db_wal_result(1);
+	return _db_wal_result(_db_client_msg_chunk_write(wal_fptr, context, cmsg));
+}
+
+int mqtt3_db_wal_client_msg_delete(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir)
+{
+	uint32_t length;
+	uint16_t i16temp, slen;
+	uint8_t i8temp;
+
+	if(!wal_fptr || context->clean_session) return MOSQ_ERR_SUCCESS;
+
+	slen = strlen(context->id);
+	length = 2+slen + sizeof(uint16_t) + sizeof(uint8_t);
+
+	if(_db_chunk_header_write(wal_fptr, DB_CHUNK_CLIENT_MSG_DELETE, length)) goto error;
+
+	i16temp = htons(slen);
+	write_e(wal_fptr, &i16temp, sizeof(uint16_t));
+	write_e(wal_fptr, context->id, slen);
+
+	i16temp = htons(mid);
+	write_e(wal_fptr, &i16temp, sizeof(uint16_t));
+
+	i8temp = (uint8_t )dir;
+	write_e(wal_fptr, &i8temp, sizeof(uint8_t));
+
+	if(_db_chunk_end_write(wal_fptr)) goto error;
+
+	return _db_wal_result(MOSQ_ERR_SUCCESS);
+error:
+	return _db_wal_result(1);
+}
+
+int mqtt3_db_wal_sub_write(struct mosquitto *context, const char *sub, int qos)
+{
+	if(!wal_fptr || context->clean_session) return MOSQ_ERR_SUCCESS;
+
+	return _db_wal_result(_db_sub_chunk_write(wal_fptr, context->id, sub, (uint8_t)qos));
+}
+
+int mqtt3_db_wal_sub_delete(struct mosquitto *context, const char *sub)
+{
+	uint32_t length;
+	uint16_t i16temp, slen;
+
+	if(!wal_fptr || context->clean_session) return MOSQ_ERR_SUCCESS;
+
+	length = 2+strlen(context->id) + 2+strlen(sub);
+
+	if(_db_chunk_header_write(wal_fptr, DB_CHUNK_SUB_DELETE, length)) goto error;
+
+	slen = strlen(context->id);
+	i16temp = htons(slen);
+	write_e(wal_fptr, &i16temp, sizeof(uint16_t));
+	write_e(wal_fptr, context->id, slen);
+
+	slen = strlen(sub);
+	i16temp = htons(slen);
+	write_e(wal_fptr, &i16temp, sizeof(uint16_t));
+	write_e(wal_fptr, sub, slen);
+
+	if(_db_chunk_end_write(wal_fptr)) goto error;
+
+	return _db_wal_result(MOSQ_ERR_SUCCESS);
+error:
+	return _db_wal_result(1);
+}
+
+int mqtt3_db_wal_retain_write(struct mosquitto_msg_store *stored)
+{
+	if(!wal_fptr || !strncmp(stored->msg.topic, "$SYS", 4)) return MOSQ_ERR_SUCCESS;
+
+	if(_db_wal_msg_store_write(stored)) return _db_wal_result(1);
+	return _db_wal_result(_db_retain_chunk_write(wal_fptr, stored));
+}
+
+static int _db_ack_send(struct mosquitto *context, uint8_t command, uint16_t mid)
+{
+	if(command == PUBACK){
+		return _mosquitto_send_puback(context, mid);
+	}else{
+		return _mosquitto_send_pubrec(context, mid);
+	}
+}
+
+int mqtt3_db_wal_ack(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_msg_store *stored, uint8_t command, uint16_t mid)
+{
+	struct _db_held_ack *acks;
+
+	/* Only hold the acknowledgement if the message has been logged and not yet
+	 * synced. Messages with nowhere durable to go never reach the log, so
+	 * there is nothing to wait for. */
+	if(!db->config->persistence_durable_acks || !wal_fptr || !wal_dirty
+			|| !stored || !stored->persisted){
+
+		return _db_ack_send(context, command, mid);
 	}
 
-	db_fptr = fopen(db->config->persistence_filepath, "wb");
+	if(held_ack_count == held_ack_max){
+		acks = _mosquitto_realloc(held_acks, sizeof(struct _db_held_ack)*(held_ack_max?held_ack_max*2:64));
+		if(!acks){
+			return _db_ack_send(context, command, mid);
+		}
+		held_acks = acks;
+		held_ack_max = held_ack_max?held_ack_max*2:64;
+	}
+	held_acks[held_ack_count].context = context;
+	held_acks[held_ack_count].mid = mid;
+	held_acks[held_ack_count].command = command;
+	held_ack_count++;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+void mqtt3_db_wal_ack_drop(struct mosquitto *context)
+{
+	int i;
+
+	for(i=0; i<held_ack_count; i++){
+		if(held_acks[i].context == context){
+			held_acks[i].context = NULL;
+		}
+	}
+}
+
+/* Send the acknowledgements that were waiting on the last sync. A client
+ * whose send fails has already been disconnected by the write, so the error
+ * is dealt with by the main loop as usual. */
+static void _db_held_acks_send(void)
+{
+	int i;
+
+	for(i=0; i<held_ack_count; i++){
+		if(held_acks[i].context){
+			_db_ack_send(held_acks[i].context, held_acks[i].command, held_acks[i].mid);
+		}
+	}
+	held_ack_count = 0;
+}
+
+/* Group commit: everything logged since the last call shares a single fsync.
+ * This is called once per pass of the main loop. Any acknowledgements held
+ * back during the pass are released once the sync has completed. */
+int mqtt3_db_wal_sync(struct mosquitto_db *db)
+{
+	if(!wal_fptr || !wal_dirty){
+		_db_held_acks_send();
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	if(fflush(wal_fptr) || fsync(fileno(wal_fptr))){
+		_db_wal_error();
+		/* The messages are still held in memory and will be in the next
+		 * snapshot, which is the same guarantee as without the log. */
+		_db_held_acks_send();
+		return 1;
+	}
+	_db_held_acks_send();
+	wal_dirty = false;
+	wal_size = ftell(wal_fptr);
+
+	if(db->config->persistence_wal_compact_size > 0
+			&& wal_size > db->config->persistence_wal_compact_size){
+
+		return mqtt3_db_backup(db, true, false);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt3_db_wal_close(struct mosquitto_db *db)
+{
+	int rc = 0;
+
+	if(wal_fptr){
+		if(fflush(wal_fptr) || fsync(fileno(wal_fptr))){
+			rc = 1;
+		}
+		fclose(wal_fptr);
+		wal_fptr = NULL;
+	}
+	if(wal_filepath){
+		_mosquitto_free(wal_filepath);
+		wal_filepath = NULL;
+	}
+	if(wal_old_filepath){
+		_mosquitto_free(wal_old_filepath);
+		wal_old_filepath = NULL;
+	}
+	if(held_acks){
+		_mosquitto_free(held_acks);
+		held_acks = NULL;
+	}
+	held_ack_count = 0;
+	held_ack_max = 0;
+	return rc;
+}
+
+static unsigned long _db_time_ms(void)
+{
+#ifdef WIN32
+	return GetTickCount();
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec*1000 + tv.tv_usec/1000;
+#endif
+}
+
+/* Write a complete snapshot to a temporary file, make sure it is on disk and
+ * then move it over the old snapshot, so that a crash part way through never
+ * leaves a truncated database behind.
+ * This may run in a forked child, so must not touch anything but the file. */
+static int _db_snapshot_write(struct mosquitto_db *db, bool shutdown)
+{
+	FILE *db_fptr = NULL;
+	char *tmp_filepath;
+	dbid_t i64temp;
+	uint32_t i32temp;
+	uint8_t i8temp;
+	char err[256];
+
+	tmp_filepath = _mosquitto_malloc(strlen(db->config->persistence_filepath) + 5);
+	if(!tmp_filepath){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	sprintf(tmp_filepath, "%s.new", db->config->persistence_filepath);
+
+	db_fptr = fopen(tmp_filepath, "wb");
 	if(db_fptr == NULL){
 		goto error;
 	}
 
 	/* Header */
-	write_e(db_fptr, magic, 15);
-	write_e(db_fptr, &crc, sizeof(uint32_t));
-	write_e(db_fptr, &db_version, sizeof(uint32_t));
+	if(_db_header_write(db_fptr)) goto error;
 
 	/* DB config */
-	i16temp = htons(DB_CHUNK_CFG);
-	write_e(db_fptr, &i16temp, sizeof(uint16_t));
-	/* chunk length */
-	i32temp = htonl(sizeof(dbid_t) + sizeof(uint8_t) + sizeof(uint8_t));
-	write_e(db_fptr, &i32temp, sizeof(uint32_t));
+	i32temp = sizeof(dbid_t) + sizeof(uint8_t) + sizeof(uint8_t);
+	if(_db_chunk_header_write(db_fptr, DB_CHUNK_CFG, i32temp)) goto error;
 	/* db written at broker shutdown or not */
 	i8temp = shutdown;
 	write_e(db_fptr, &i8temp, sizeof(uint8_t));
@@ -389,438 +990,934 @@ int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown)
 	/* last db mid */
 	i64temp = db->last_db_id;
 	write_e(db_fptr, &i64temp, sizeof(dbid_t));
+	if(_db_chunk_end_write(db_fptr)) goto error;
 
 	if(mqtt3_db_message_store_write(db, db_fptr)){
 		goto error;
 	}
-
-	mqtt3_db_client_write(db, db_fptr);
-	mqtt3_db_subs_retain_write(db, db_fptr);
-
-	fclose(db_fptr);
-	return rc;
+
+	if(mqtt3_db_client_write(db, db_fptr)) goto error;
+	if(mqtt3_db_subs_retain_write(db, db_fptr)) goto error;
+	if(_db_index_write(db_fptr)) goto error;
+
+	if(fflush(db_fptr) || fsync(fileno(db_fptr))) goto error;
+	fclose(db_fptr);
+	db_fptr = NULL;
+
+#ifdef WIN32
+	/* rename() won't replace an existing file on Windows. */
+	remove(db->config->persistence_filepath);
+#endif
+	if(rename(tmp_filepath, db->config->persistence_filepath)) goto error;
+
+	_mosquitto_free(tmp_filepath);
+	return MOSQ_ERR_SUCCESS;
+error:
+	strerror_r(errno, err, 256);
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
+	if(db_fptr) fclose(db_fptr);
+	remove(tmp_filepath);
+	_mosquitto_free(tmp_filepath);
+	return 1;
+}
+
+/* Called once a snapshot has been written successfully. Everything that was
+ * in the database when the snapshot started is now on disk, so the log
+ * records covering it can go. */
+static int _db_snapshot_done(struct mosquitto_db *db, bool background)
+{
+	struct mosquitto_msg_store *stored;
+	struct stat st;
+
+	g_snapshot_duration = _db_time_ms() - snapshot_start;
+	if(!stat(db->config->persistence_filepath, &st)){
+		g_snapshot_size = st.st_size;
+	}
+	_mosquitto_log_debug(NULL, "Saved in-memory database in %lu ms.", g_snapshot_duration);
+
+	/* Only entries that existed when the snapshot started are in it. Newer
+	 * ones have ids above snapshot_last_db_id. */
+	stored = db->msg_store;
+	while(stored){
+		if(stored->db_id <= snapshot_last_db_id){
+			stored->persisted = true;
+		}
+		stored = stored->next;
+	}
+
+	if(wal_old_filepath){
+		remove(wal_old_filepath);
+	}
+	if(wal_fptr && !background){
+		return _db_wal_truncate();
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+#ifndef WIN32
+/* Start a new log for the records that arrive whilst a background snapshot
+ * is being written. The old one is kept until the snapshot is known to be
+ * good. If an earlier background snapshot failed, the old log is still
+ * needed so the current one just carries on; replaying records that are
+ * already in the snapshot is harmless. */
+static int _db_wal_rotate(void)
+{
+	struct stat st;
+
+	if(!wal_fptr) return MOSQ_ERR_SUCCESS;
+
+	if(fflush(wal_fptr) || fsync(fileno(wal_fptr))){
+		_db_wal_error();
+		return 1;
+	}
+	wal_dirty = false;
+	if(!stat(wal_old_filepath, &st)){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	fclose(wal_fptr);
+	wal_fptr = NULL;
+	if(rename(wal_filepath, wal_old_filepath)){
+		_db_wal_error();
+		return 1;
+	}
+	return _db_wal_open();
+}
+
+/* Check whether a background snapshot has finished. If block is true, wait
+ * for it. */
+static int _db_snapshot_reap(struct mosquitto_db *db, bool block)
+{
+	pid_t pid;
+	int status;
+
+	if(snapshot_pid <= 0) return MOSQ_ERR_SUCCESS;
+
+	pid = waitpid(snapshot_pid, &status, block?0:WNOHANG);
+	if(pid == 0) return MOSQ_ERR_SUCCESS;
+	snapshot_pid = 0;
+
+	if(pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Background save of in-memory database to %s failed.", db->config->persistence_filepath);
+		return 1;
+	}
+	return _db_snapshot_done(db, true);
+}
+#endif
+
+static int _db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown, bool background)
+{
+#ifndef WIN32
+	pid_t pid;
+	char err[256];
+
+	if(snapshot_pid > 0){
+		if(background){
+			/* Only one snapshot at a time - the one already running will do. */
+			return MOSQ_ERR_SUCCESS;
+		}
+		_db_snapshot_reap(db, true);
+	}
+#endif
+
+	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s.", db->config->persistence_filepath);
+	if(cleanup){
+		mqtt3_db_store_clean(db);
+	}
+	snapshot_start = _db_time_ms();
+	snapshot_last_db_id = db->last_db_id;
+
+#ifndef WIN32
+	if(background){
+		_db_wal_rotate();
+
+		pid = fork();
+		if(pid == 0){
+			/* Child: the copy-on-write view of memory is frozen at the point
+			 * of the fork. The log belongs to the parent, so never write to
+			 * it from here. */
+			wal_fptr = NULL;
+			_exit(_db_snapshot_write(db, shutdown));
+		}else if(pid > 0){
+			snapshot_pid = pid;
+			return MOSQ_ERR_SUCCESS;
+		}
+		strerror_r(errno, err, 256);
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to start background save: %s. Saving in the foreground instead.", err);
+	}
+#endif
+
+	if(_db_snapshot_write(db, shutdown)) return 1;
+	return _db_snapshot_done(db, false);
+}
+
+int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown)
+{
+	if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
+
+	return _db_backup(db, cleanup, shutdown, db->config->persistence_background && !shutdown);
+}
+
+/* Called once per pass of the main loop to pick up a finished background
+ * snapshot. */
+int mqtt3_db_backup_check(struct mosquitto_db *db)
+{
+#ifndef WIN32
+	return _db_snapshot_reap(db, false);
+#else
+	return MOSQ_ERR_SUCCESS;
+#endif
+}
+
+static int _db_chunk_read(struct _db_chunk *chunk, void *dest, size_t len)
+{
+	if((size_t)(chunk->end - chunk->pos) < len) return 1;
+	memcpy(dest, chunk->pos, len);
+	chunk->pos += len;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Point *data at the next len bytes of the chunk without copying them. */
+static int _db_chunk_data(struct _db_chunk *chunk, const void **data, size_t len)
+{
+	if((size_t)(chunk->end - chunk->pos) < len) return 1;
+	*data = chunk->pos;
+	chunk->pos += len;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Copy a length prefixed string out of the chunk into str, which must have
+ * room for 65536 bytes. */
+static int _db_chunk_string(struct _db_chunk *chunk, char *str, uint16_t *len)
+{
+	uint16_t i16temp, slen;
+
+	if(_db_chunk_read(chunk, &i16temp, sizeof(uint16_t))) return 1;
+	slen = ntohs(i16temp);
+	if(_db_chunk_read(chunk, str, slen)) return 1;
+	str[slen] = '\0';
+	if(len) *len = slen;
+	return MOSQ_ERR_SUCCESS;
+}
+
+#define chunk_read_e(c, b, l) if(_db_chunk_read(c, b, l)){ goto error; }
+#define chunk_string_e(c, s, l) if(_db_chunk_string(c, s, l)){ goto error; }
+
+static int _db_client_msg_restore(struct mosquitto_db *db, const char *client_id, uint16_t mid, uint8_t qos, uint8_t retain, uint8_t direction, uint8_t state, uint8_t dup, uint64_t store_id)
+{
+	struct mosquitto_client_msg *cmsg, *tail;
+	struct mosquitto_msg_store *store;
+	struct mosquitto *context;
+
+	cmsg = _mosquitto_calloc(1, sizeof(struct mosquitto_client_msg));
+	if(!cmsg){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+
+	cmsg->store = NULL;
+	cmsg->mid = mid;
+	cmsg->qos = qos;
+	cmsg->retain = retain;
+	cmsg->direction = direction;
+	cmsg->state = state;
+	cmsg->dup = dup;
+
+	store = _db_find_store(db, store_id);
+	if(!store){
+		_mosquitto_free(cmsg);
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
+		return 1;
+	}
+	context = _db_find_or_add_context(db, client_id, 0);
+	if(!context){
+		_mosquitto_free(cmsg);
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
+		return 1;
+	}
+	if(wal_replay){
+		/* If the broker stopped between writing a snapshot and truncating
+		 * the log, the log repeats what the snapshot already holds. */
+		tail = context->msgs;
+		while(tail){
+			if(tail->mid == mid && tail->direction == direction){
+				_mosquitto_free(cmsg);
+				return MOSQ_ERR_SUCCESS;
+			}
+			tail = tail->next;
+		}
+		if(direction == mosq_md_out){
+			context->last_mid = mid;
+		}
+	}
+	cmsg->store = store;
+	cmsg->store->ref_count++;
+	if(context->msgs){
+		/* Remember the end of the list for the next message for this client,
+		 * rather than walking the whole list each time. */
+		if(restore_tail && context == restore_context){
+			tail = restore_tail;
+		}else{
+			tail = context->msgs;
+		}
+		while(tail->next){
+			tail = tail->next;
+		}
+		tail->next = cmsg;
+	}else{
+		context->msgs = cmsg;
+	}
+	cmsg->next = NULL;
+	if(context == restore_context){
+		restore_tail = cmsg;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_client_chunk_restore(struct mosquitto_db *db, struct _db_chunk *chunk)
+{
+	uint16_t i16temp, slen, last_mid;
+	char *client_id = restore_str->client_id;
+	struct mosquitto *context;
+	time_t disconnect_t;
+
+	chunk_string_e(chunk, client_id, &slen);
+	if(!slen) goto error;
+
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
+	last_mid = ntohs(i16temp);
+
+	if(db_version == 2){
+		disconnect_t = time(NULL);
+	}else{
+		chunk_read_e(chunk, &disconnect_t, sizeof(time_t));
+	}
+
+	context = _db_find_or_add_context(db, client_id, last_mid);
+	if(!context) return 1;
+
+	context->disconnect_t = disconnect_t;
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+static int _db_client_msg_chunk_restore(struct mosquitto_db *db, struct _db_chunk *chunk)
+{
+	dbid_t i64temp, store_id;
+	uint16_t i16temp, slen, mid;
+	uint8_t qos, retain, direction, state, dup;
+	char *client_id = restore_str->client_id;
+
+	chunk_string_e(chunk, client_id, &slen);
+	if(!slen) goto error;
+
+	chunk_read_e(chunk, &i64temp, sizeof(dbid_t));
+	store_id = i64temp;
+
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
+	mid = ntohs(i16temp);
+
+	chunk_read_e(chunk, &qos, sizeof(uint8_t));
+	chunk_read_e(chunk, &retain, sizeof(uint8_t));
+	chunk_read_e(chunk, &direction, sizeof(uint8_t));
+	chunk_read_e(chunk, &state, sizeof(uint8_t));
+	chunk_read_e(chunk, &dup, sizeof(uint8_t));
+
+	return _db_client_msg_restore(db, client_id, mid, qos, retain, direction, state, dup, store_id);
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+/* The payload is copied straight from the mapped file into the new store
+ * entry, so it is only copied once. */
+static int _db_msg_store_chunk_restore(struct mosquitto_db *db, struct _db_chunk *chunk)
+{
+	dbid_t i64temp, store_id;
+	uint32_t i32temp, payloadlen;
+	uint16_t i16temp, slen, source_mid;
+	uint8_t qos, retain;
+	const void *payload = NULL;
+	char *source_id = restore_str->source_id;
+	char *topic = restore_str->topic;
+	int rc = 0;
+	struct mosquitto_msg_store *stored = NULL;
+
+	chunk_read_e(chunk, &i64temp, sizeof(dbid_t));
+	store_id = i64temp;
+
+	chunk_string_e(chunk, source_id, &slen);
+	if(!slen) source_id = NULL;
+
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
+	source_mid = ntohs(i16temp);
+
+	/* This is the mid - don't need it */
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
+
+	chunk_string_e(chunk, topic, &slen);
+	if(!slen){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid msg_store chunk when restoring persistent database.");
+		return 1;
+	}
+	chunk_read_e(chunk, &qos, sizeof(uint8_t));
+	chunk_read_e(chunk, &retain, sizeof(uint8_t));
+
+	chunk_read_e(chunk, &i32temp, sizeof(uint32_t));
+	payloadlen = ntohl(i32temp);
+	if(_db_chunk_data(chunk, &payload, payloadlen)) goto error;
+
+	if(wal_replay && _db_find_store(db, store_id)){
+		/* Already restored from the snapshot. */
+		return MOSQ_ERR_SUCCESS;
+	}
+	rc = mqtt3_db_message_store(db, source_id, source_mid, topic, qos, payloadlen, payload, retain, &stored, store_id);
+	if(rc) return rc;
+
+	stored->persisted = true;
+	if(store_id > db->last_db_id){
+		db->last_db_id = store_id;
+	}
+	return _db_store_index_add(stored);
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+static int _db_retain_chunk_restore(struct mosquitto_db *db, struct _db_chunk *chunk)
+{
+	dbid_t i64temp, store_id;
+	struct mosquitto_msg_store *store;
+
+	if(_db_chunk_read(chunk, &i64temp, sizeof(dbid_t))){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+		return 1;
+	}
+	store_id = i64temp;
+	store = _db_find_store(db, store_id);
+	if(store){
+		mqtt3_db_messages_queue(db, NULL, store->msg.topic, store->msg.qos, store->msg.retain, store);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_sub_chunk_restore(struct mosquitto_db *db, struct _db_chunk *chunk)
+{
+	uint8_t qos;
+	char *client_id = restore_str->client_id;
+	char *topic = restore_str->topic;
+
+	chunk_string_e(chunk, client_id, NULL);
+	chunk_string_e(chunk, topic, NULL);
+	chunk_read_e(chunk, &qos, sizeof(uint8_t));
+
+	return _db_restore_sub(db, client_id, topic, qos);
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+static int _db_client_msg_delete_chunk_restore(struct mosquitto_db *db, struct _db_chunk *chunk)
+{
+	uint16_t i16temp, mid;
+	uint8_t direction;
+	char *client_id = restore_str->client_id;
+	struct mosquitto *context;
+	struct mosquitto_client_msg *tail, *last = NULL;
+
+	chunk_string_e(chunk, client_id, NULL);
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
+	mid = ntohs(i16temp);
+	chunk_read_e(chunk, &direction, sizeof(uint8_t));
+
+	context = _db_find_context(db, client_id);
+	if(!context) return MOSQ_ERR_SUCCESS;
+
+	tail = context->msgs;
+	while(tail){
+		if(tail->mid == mid && tail->direction == direction){
+			tail->store->ref_count--;
+			if(last){
+				last->next = tail->next;
+			}else{
+				context->msgs = tail->next;
+			}
+			if(restore_tail == tail){
+				restore_tail = NULL;
+			}
+			_mosquitto_free(tail);
+			break;
+		}
+		last = tail;
+		tail = tail->next;
+	}
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+static int _db_sub_delete_chunk_restore(struct mosquitto_db *db, struct _db_chunk *chunk)
+{
+	char *client_id = restore_str->client_id;
+	char *topic = restore_str->topic;
+	struct mosquitto *context;
+
+	chunk_string_e(chunk, client_id, NULL);
+	chunk_string_e(chunk, topic, NULL);
+
+	context = _db_find_context(db, client_id);
+	if(context){
+		mqtt3_sub_remove(db, context, topic, &db->subs);
+	}
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+static int _db_client_delete_chunk_restore(struct mosquitto_db *db, struct _db_chunk *chunk)
+{
+	char *client_id = restore_str->client_id;
+	struct mosquitto *context;
+
+	chunk_string_e(chunk, client_id, NULL);
+
+	context = mqtt3_context_find(db, client_id);
+	if(context){
+		if(restore_context == context){
+			restore_context = NULL;
+			restore_tail = NULL;
+		}
+		mqtt3_context_remove(db, context);
+		context->clean_session = true;
+		mqtt3_context_cleanup(db, context, true);
+	}
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+/* Map the whole of filepath into memory. On success *size is set, and if the
+ * file doesn't exist *data is set to NULL. */
+static int _db_file_map(const char *filepath, const uint8_t **data, size_t *size)
+{
+	char err[256];
+#ifdef WIN32
+	FILE *fptr;
+	uint8_t *buf;
+#else
+	int fd;
+	void *map;
+#endif
+	struct stat st;
+
+	*data = NULL;
+	*size = 0;
+#ifdef WIN32
+	fptr = fopen(filepath, "rb");
+	if(!fptr) return MOSQ_ERR_SUCCESS;
+	if(fstat(fileno(fptr), &st)) goto error;
+	if(st.st_size == 0){
+		fclose(fptr);
+		return MOSQ_ERR_SUCCESS;
+	}
+	buf = _mosquitto_malloc(st.st_size);
+	if(!buf){
+		fclose(fptr);
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	if(fread(buf, 1, st.st_size, fptr) != (size_t)st.st_size){
+		_mosquitto_free(buf);
+		goto error;
+	}
+	fclose(fptr);
+	*data = buf;
+#else
+	fd = open(filepath, O_RDONLY);
+	if(fd < 0) return MOSQ_ERR_SUCCESS;
+	if(fstat(fd, &st)) goto error;
+	if(st.st_size == 0){
+		close(fd);
+		return MOSQ_ERR_SUCCESS;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(map == MAP_FAILED) goto error;
+	/* The file is read front to back exactly once. */
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	close(fd);
+	*data = map;
+#endif
+	*size = st.st_size;
+	return MOSQ_ERR_SUCCESS;
 error:
 	strerror_r(errno, err, 256);
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	if(db_fptr) fclose(db_fptr);
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to read %s: %s.", filepath, err);
+#ifdef WIN32
+	fclose(fptr);
+#else
+	close(fd);
+#endif
 	return 1;
 }
 
-static int _db_client_msg_restore(struct mosquitto_db *db, const char *client_id, uint16_t mid, uint8_t qos, uint8_t retain, uint8_t direction, uint8_t state, uint8_t dup, uint64_t store_id)
+static void _db_file_unmap(const uint8_t *data, size_t size)
 {
-	struct mosquitto_client_msg *cmsg, *tail;
-	struct mosquitto_msg_store *store;
-	struct mosquitto *context;
+#ifdef WIN32
+	_mosquitto_free((void *)data);
+#else
+	munmap((void *)data, size);
+#endif
+}
 
-	cmsg = _mosquitto_calloc(1, sizeof(struct mosquitto_client_msg));
-	if(!cmsg){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
-	}
+/* Check the magic and, from version 4 on, the header checksum. */
+static int _db_header_read(struct _db_chunk *file, uint32_t *version)
+{
+	uint32_t crc, i32temp;
 
-	cmsg->store = NULL;
-	cmsg->mid = mid;
-	cmsg->qos = qos;
-	cmsg->retain = retain;
-	cmsg->direction = direction;
-	cmsg->state = state;
-	cmsg->dup = dup;
+	if((size_t)(file->end - file->pos) < 15) return 1;
+	if(memcmp(file->pos, magic, 15)) return 1;
+	file->pos += 15;
 
-	store = db->msg_store;
-	while(store){
-		if(store->db_id == store_id){
-			cmsg->store = store;
-			cmsg->store->ref_count++;
-			break;
-		}
-		store = store->next;
-	}
-	if(!cmsg->store){
-		_mosquitto_free(cmsg);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
-		return 1;
-	}
-	context = _db_find_or_add_context(db, client_id, 0);
-	if(!context){
-		_mosquitto_free(cmsg);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
+	if(_db_chunk_read(file, &crc, sizeof(uint32_t))
+			|| _db_chunk_read(file, &i32temp, sizeof(uint32_t))){
 		return 1;
 	}
-	if(context->msgs){
-		tail = context->msgs;
-		while(tail->next){
-			tail = tail->next;
+	*version = ntohl(i32temp);
+	if(*version >= 4){
+		if(ntohl(crc) != mqtt3_crc32c(mqtt3_crc32c(0, magic, 15), &i32temp, sizeof(uint32_t))){
+			return 1;
 		}
-		tail->next = cmsg;
-	}else{
-		context->msgs = cmsg;
 	}
-	cmsg->next = NULL;
-
 	return MOSQ_ERR_SUCCESS;
 }
 
-static int _db_client_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+/* Split the next chunk off the front of file. Returns 0 on success, -1 at the
+ * end of the file and 1 if the chunk is truncated or, if verify is true, its
+ * checksum is wrong. */
+static int _db_chunk_next(struct _db_chunk *file, struct _db_chunk *chunk, uint16_t *type, uint32_t version, bool verify)
 {
-	uint16_t i16temp, slen, last_mid;
-	char *client_id = NULL;
-	int rc = 0;
-	struct mosquitto *context;
-	time_t disconnect_t;
+	const uint8_t *start = file->pos;
+	uint16_t i16temp;
+	uint32_t i32temp, length, crc;
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	if(!slen){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
-		fclose(db_fptr);
+	if(file->pos == file->end) return -1;
+
+	if(_db_chunk_read(file, &i16temp, sizeof(uint16_t))
+			|| _db_chunk_read(file, &i32temp, sizeof(uint32_t))){
 		return 1;
 	}
-	client_id = _mosquitto_calloc(slen+1, sizeof(char));
-	if(!client_id){
-		fclose(db_fptr);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
+	*type = ntohs(i16temp);
+	length = ntohl(i32temp);
+	if((size_t)(file->end - file->pos) < length) return 1;
+	chunk->pos = file->pos;
+	chunk->end = file->pos + length;
+	file->pos += length;
+
+	if(version >= 4){
+		if(_db_chunk_read(file, &crc, sizeof(uint32_t))) return 1;
+		if(verify && ntohl(crc) != mqtt3_crc32c(0, start, chunk->end - start)){
+			return 1;
+		}
 	}
-	read_e(db_fptr, client_id, slen);
+	return MOSQ_ERR_SUCCESS;
+}
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	last_mid = ntohs(i16temp);
+/* Check every chunk before anything is restored, so that a damaged file is
+ * rejected as a whole rather than found out part way through. A snapshot must
+ * also end with its index, which shows it was written out completely.
+ * Returns 0 if the file is good, otherwise 1 with *bad_offset set. */
+static int _db_file_verify(struct _db_chunk file, const uint8_t *data, uint32_t version, bool snapshot, size_t *bad_offset)
+{
+	struct _db_chunk chunk;
+	uint16_t type;
+	int rc;
 
-	if(db_version == 2){
-		disconnect_t = time(NULL);
-	}else{
-		read_e(db_fptr, &disconnect_t, sizeof(time_t));
+	while(1){
+		*bad_offset = file.pos - data;
+		rc = _db_chunk_next(&file, &chunk, &type, version, true);
+		if(rc < 0) return snapshot?1:MOSQ_ERR_SUCCESS;
+		if(rc > 0) return 1;
+		if(type == DB_CHUNK_INDEX){
+			*bad_offset = file.pos - data;
+			return (file.end - file.pos == 2*sizeof(uint32_t))?MOSQ_ERR_SUCCESS:1;
+		}
 	}
-
-	context = _db_find_or_add_context(db, client_id, last_mid);
-	if(!context) rc = 1;
-
-	context->disconnect_t = disconnect_t;
-
-	_mosquitto_free(client_id);
-
-	return rc;
-error:
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	if(db_fptr) fclose(db_fptr);
-	if(client_id) _mosquitto_free(client_id);
-	return 1;
 }
 
-static int _db_client_msg_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+static int _db_restore_file(struct mosquitto_db *db, const char *filepath)
 {
-	dbid_t i64temp, store_id;
-	uint16_t i16temp, slen, mid;
-	uint8_t qos, retain, direction, state, dup;
-	char *client_id = NULL;
-	int rc;
-	char err[256];
+	const uint8_t *data;
+	size_t size, bad_offset;
+	struct _db_chunk file, chunk;
+	int rc = 0;
+	dbid_t i64temp;
+	uint16_t chunk_type;
+	uint8_t i8temp;
+	unsigned long start, elapsed;
+	int msg_count = 0;
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	if(!slen){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
-		fclose(db_fptr);
+	start = _db_time_ms();
+	rc = _db_file_map(filepath, &data, &size);
+	if(rc || !data) return rc;
+
+	file.pos = data;
+	file.end = data + size;
+	if(_db_header_read(&file, &db_version)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to restore persistent database. Unrecognised file format.");
+		_db_file_unmap(data, size);
 		return 1;
 	}
-	client_id = _mosquitto_calloc(slen+1, sizeof(char));
-	if(!client_id){
-		fclose(db_fptr);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
+
+	// Restore DB as normal
+	/* IMPORTANT - this is where compatibility checks are made.
+	 * Is your DB change still compatible with previous versions?
+	 */
+	if(db_version > MOSQ_DB_VERSION && db_version != 0){
+		if(db_version == 2){
+			/* Addition of disconnect_t to client chunk in v3. */
+		}else{
+			_db_file_unmap(data, size);
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unsupported persistent database format version %d (need version %d).", db_version, MOSQ_DB_VERSION);
+			return 1;
+		}
+	}
+	/* Version 4 added checksums and the index. */
+	if(db_version >= 4 && _db_file_verify(file, data, db_version, !wal_replay, &bad_offset)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database %s is corrupt at offset %lu.", filepath, (unsigned long)bad_offset);
+		_db_file_unmap(data, size);
+		return 1;
 	}
-	read_e(db_fptr, client_id, slen);
 
-	read_e(db_fptr, &i64temp, sizeof(dbid_t));
-	store_id = i64temp;
+	while(rc = _db_chunk_next(&file, &chunk, &chunk_type, db_version, false), rc == 0){
+		switch(chunk_type){
+			case DB_CHUNK_CFG:
+				_db_chunk_read(&chunk, &i8temp, sizeof(uint8_t)); // shutdown
+				if(_db_chunk_read(&chunk, &i8temp, sizeof(uint8_t)) // sizeof(dbid_t)
+						|| i8temp != sizeof(dbid_t)){
+
+					_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Incompatible database configuration (dbid size is %d bytes, expected %lu)",
+							i8temp, (unsigned long)sizeof(dbid_t));
+					_db_file_unmap(data, size);
+					return 1;
+				}
+				if(_db_chunk_read(&chunk, &i64temp, sizeof(dbid_t))){
+					rc = 1;
+					break;
+				}
+				db->last_db_id = i64temp;
+				break;
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	mid = ntohs(i16temp);
+			case DB_CHUNK_MSG_STORE:
+				rc = _db_msg_store_chunk_restore(db, &chunk);
+				msg_count++;
+				break;
 
-	read_e(db_fptr, &qos, sizeof(uint8_t));
-	read_e(db_fptr, &retain, sizeof(uint8_t));
-	read_e(db_fptr, &direction, sizeof(uint8_t));
-	read_e(db_fptr, &state, sizeof(uint8_t));
-	read_e(db_fptr, &dup, sizeof(uint8_t));
+			case DB_CHUNK_CLIENT_MSG:
+				rc = _db_client_msg_chunk_restore(db, &chunk);
+				break;
 
-	rc = _db_client_msg_restore(db, client_id, mid, qos, retain, direction, state, dup, store_id);
-	_mosquitto_free(client_id);
+			case DB_CHUNK_RETAIN:
+				rc = _db_retain_chunk_restore(db, &chunk);
+				break;
 
-	return rc;
-error:
-	strerror_r(errno, err, 256);
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	if(db_fptr) fclose(db_fptr);
-	if(client_id) _mosquitto_free(client_id);
-	return 1;
-}
+			case DB_CHUNK_SUB:
+				rc = _db_sub_chunk_restore(db, &chunk);
+				break;
 
-static int _db_msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
-{
-	dbid_t i64temp, store_id;
-	uint32_t i32temp, payloadlen;
-	uint16_t i16temp, slen, source_mid;
-	uint8_t qos, retain, *payload = NULL;
-	char *source_id = NULL;
-	char *topic = NULL;
-	int rc = 0;
-	struct mosquitto_msg_store *stored = NULL;
-	char err[256];
+			case DB_CHUNK_CLIENT:
+				rc = _db_client_chunk_restore(db, &chunk);
+				break;
 
-	read_e(db_fptr, &i64temp, sizeof(dbid_t));
-	store_id = i64temp;
+			case DB_CHUNK_CLIENT_MSG_DELETE:
+				rc = _db_client_msg_delete_chunk_restore(db, &chunk);
+				break;
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	if(slen){
-		source_id = _mosquitto_calloc(slen+1, sizeof(char));
-		if(!source_id){
-			fclose(db_fptr);
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-			return MOSQ_ERR_NOMEM;
-		}
-		if(fread(source_id, 1, slen, db_fptr) != slen){
-			strerror_r(errno, err, 256);
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-			fclose(db_fptr);
-			_mosquitto_free(source_id);
-			return 1;
+			case DB_CHUNK_SUB_DELETE:
+				rc = _db_sub_delete_chunk_restore(db, &chunk);
+				break;
+
+			case DB_CHUNK_CLIENT_DELETE:
+				rc = _db_client_delete_chunk_restore(db, &chunk);
+				break;
+
+			case DB_CHUNK_INDEX:
+				/* Only needed by tools that want to find one type of chunk.
+				 * Nothing but the index offset follows it. */
+				rc = -1;
+				break;
+
+			default:
+				_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk_type);
+				break;
 		}
+		if(rc) break;
+	}
+	_db_file_unmap(data, size);
+	if(rc > 0){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to restore persistent database %s.", filepath);
+		return rc;
 	}
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	source_mid = ntohs(i16temp);
 
-	/* This is the mid - don't need it */
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	elapsed = _db_time_ms() - start;
+	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Restored %d messages (%lu bytes) from %s in %lu ms (%.1f MB/s).",
+			msg_count, (unsigned long)size, filepath, elapsed,
+			elapsed?(double)size/1048.576/elapsed:0.0);
+	return MOSQ_ERR_SUCCESS;
+}
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	if(slen){
-		topic = _mosquitto_calloc(slen+1, sizeof(char));
-		if(!topic){
-			fclose(db_fptr);
-			_mosquitto_free(source_id);
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-			return MOSQ_ERR_NOMEM;
-		}
-		if(fread(topic, 1, slen, db_fptr) != slen){
-			strerror_r(errno, err, 256);
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-			fclose(db_fptr);
-			_mosquitto_free(source_id);
-			_mosquitto_free(topic);
-			return 1;
+/* Walk the records of the log and cut off any trailing record that was only
+ * partly written, or that fails its checksum, when the broker stopped, so
+ * that replay and subsequent appends both see a log made of whole records.
+ * Returns 0 if a usable log exists, -1 if there is no log and 1 on error. */
+static int _db_wal_check(const char *filepath)
+{
+	const uint8_t *data;
+	size_t size, good_pos = 0;
+	struct _db_chunk file, chunk;
+	uint32_t version;
+	uint16_t type;
+	char err[256];
+
+	if(_db_file_map(filepath, &data, &size)) return 1;
+	if(!data) return -1;
+
+	file.pos = data;
+	file.end = data + size;
+	if(!_db_header_read(&file, &version)){
+		good_pos = file.pos - data;
+		while(_db_chunk_next(&file, &chunk, &type, version, true) == 0){
+			good_pos = file.pos - data;
 		}
-	}else{
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid msg_store chunk when restoring persistent database.");
-		fclose(db_fptr);
-		_mosquitto_free(source_id);
+	}else if(size >= 15 + 2*sizeof(uint32_t)){
+		_db_file_unmap(data, size);
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to replay persistence log %s. Unrecognised file format.", filepath);
 		return 1;
 	}
-	read_e(db_fptr, &qos, sizeof(uint8_t));
-	read_e(db_fptr, &retain, sizeof(uint8_t));
-	
-	read_e(db_fptr, &i32temp, sizeof(uint32_t));
-	payloadlen = ntohl(i32temp);
+	_db_file_unmap(data, size);
 
-	if(payloadlen){
-		payload = _mosquitto_malloc(payloadlen);
-		if(!payload){
-			fclose(db_fptr);
-			_mosquitto_free(source_id);
-			_mosquitto_free(topic);
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-			return MOSQ_ERR_NOMEM;
-		}
-		if(fread(payload, 1, payloadlen, db_fptr) != payloadlen){
+	if(good_pos < size){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Discarding incomplete or damaged record at end of persistence log %s.", filepath);
+		if(truncate(filepath, good_pos)){
 			strerror_r(errno, err, 256);
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-			fclose(db_fptr);
-			_mosquitto_free(source_id);
-			_mosquitto_free(topic);
-			_mosquitto_free(payload);
 			return 1;
 		}
 	}
-
-	rc = mqtt3_db_message_store(db, source_id, source_mid, topic, qos, payloadlen, payload, retain, &stored, store_id);
-	_mosquitto_free(source_id);
-	_mosquitto_free(topic);
-	_mosquitto_free(payload);
-
-	return rc;
-error:
-	strerror_r(errno, err, 256);
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	if(db_fptr) fclose(db_fptr);
-	if(source_id) _mosquitto_free(source_id);
-	if(topic) _mosquitto_free(topic);
-	return 1;
+	if(good_pos == 0) return -1;
+	return MOSQ_ERR_SUCCESS;
 }
 
-static int _db_retain_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+static int _db_wal_open(void)
 {
-	dbid_t i64temp, store_id;
-	struct mosquitto_msg_store *store;
 	char err[256];
 
-	if(fread(&i64temp, sizeof(dbid_t), 1, db_fptr) != 1){
+	wal_fptr = fopen(wal_filepath, "ab");
+	if(!wal_fptr){
 		strerror_r(errno, err, 256);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-		fclose(db_fptr);
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open persistence log %s: %s.", wal_filepath, err);
 		return 1;
 	}
-	store_id = i64temp;
-	store = db->msg_store;
-	while(store){
-		if(store->db_id == store_id){
-			mqtt3_db_messages_queue(db, NULL, store->msg.topic, store->msg.qos, store->msg.retain, store);
-			break;
-		}
-		store = store->next;
+	fseek(wal_fptr, 0, SEEK_END);
+	wal_size = ftell(wal_fptr);
+	wal_dirty = false;
+	if(wal_size == 0){
+		return _db_wal_result(_db_header_write(wal_fptr));
 	}
 	return MOSQ_ERR_SUCCESS;
 }
 
-static int _db_sub_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+static int _db_wal_replay(struct mosquitto_db *db, const char *filepath)
 {
-	uint16_t i16temp, slen;
-	uint8_t qos;
-	char *client_id;
-	char *topic;
-	int rc = 0;
-	char err[256];
+	int rc;
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	client_id = _mosquitto_calloc(slen+1, sizeof(char));
-	if(!client_id){
-		fclose(db_fptr);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
+	rc = _db_wal_check(filepath);
+	if(rc < 0) return MOSQ_ERR_SUCCESS;
+	if(rc > 0) return rc;
+
+	wal_replay = true;
+	rc = _db_restore_file(db, filepath);
+	wal_replay = false;
+	if(db_version != MOSQ_DB_VERSION){
+		/* Written by an older version, so can't be appended to. */
+		wal_stale = true;
 	}
-	read_e(db_fptr, client_id, slen);
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	topic = _mosquitto_calloc(slen+1, sizeof(char));
-	if(!topic){
-		fclose(db_fptr);
+	return rc;
+}
+
+static int _db_restore(struct mosquitto_db *db)
+{
+	int rc;
+	struct stat st;
+
+	rc = _db_restore_file(db, db->config->persistence_filepath);
+	if(rc) return rc;
+
+	/* Replay anything logged since the snapshot was written, oldest log
+	 * first. */
+	wal_filepath = _mosquitto_malloc(strlen(db->config->persistence_filepath) + 5);
+	wal_old_filepath = _mosquitto_malloc(strlen(db->config->persistence_filepath) + 9);
+	if(!wal_filepath || !wal_old_filepath){
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		_mosquitto_free(client_id);
 		return MOSQ_ERR_NOMEM;
 	}
-	read_e(db_fptr, topic, slen);
-	read_e(db_fptr, &qos, sizeof(uint8_t));
-	if(_db_restore_sub(db, client_id, topic, qos)){
-		rc = 1;
+	sprintf(wal_filepath, "%s.wal", db->config->persistence_filepath);
+	sprintf(wal_old_filepath, "%s.wal.old", db->config->persistence_filepath);
+
+	rc = _db_wal_replay(db, wal_old_filepath);
+	if(rc) return rc;
+	rc = _db_wal_replay(db, wal_filepath);
+	if(rc) return rc;
+
+	if((!db->config->persistence_wal || wal_stale)
+			&& (!stat(wal_filepath, &st) || !stat(wal_old_filepath, &st))){
+
+		/* Left over from a previous run with persistence_wal enabled, or
+		 * in an older format. Fold it into a snapshot so it isn't replayed
+		 * again later. */
+		if(_db_backup(db, false, false, false)) return 1;
+		remove(wal_filepath);
 	}
-	_mosquitto_free(client_id);
-	_mosquitto_free(topic);
-
-	return rc;
-error:
-	strerror_r(errno, err, 256);
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	if(db_fptr) fclose(db_fptr);
-	return 1;
+	return MOSQ_ERR_SUCCESS;
 }
 
 int mqtt3_db_restore(struct mosquitto_db *db)
 {
-	FILE *fptr;
-	char header[15];
-	int rc = 0;
-	uint32_t crc;
-	dbid_t i64temp;
-	uint32_t i32temp, length;
-	uint16_t i16temp, chunk;
-	uint8_t i8temp;
-	ssize_t rlen;
-	char err[256];
+	int rc;
 
 	assert(db);
 	assert(db->config);
 	assert(db->config->persistence_filepath);
 
-	fptr = fopen(db->config->persistence_filepath, "rb");
-	if(fptr == NULL) return MOSQ_ERR_SUCCESS;
-	read_e(fptr, &header, 15);
-	if(!memcmp(header, magic, 15)){
-		// Restore DB as normal
-		read_e(fptr, &crc, sizeof(uint32_t));
-		read_e(fptr, &i32temp, sizeof(uint32_t));
-		db_version = ntohl(i32temp);
-		/* IMPORTANT - this is where compatibility checks are made.
-		 * Is your DB change still compatible with previous versions?
-		 */
-		if(db_version > MOSQ_DB_VERSION && db_version != 0){
-			if(db_version == 2){
-				/* Addition of disconnect_t to client chunk in v3. */
-			}else{
-				fclose(fptr);
-				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unsupported persistent database format version %d (need version %d).", db_version, MOSQ_DB_VERSION);
-				return 1;
-			}
-		}
-
-		while(rlen = fread(&i16temp, sizeof(uint16_t), 1, fptr), rlen == 1){
-			chunk = ntohs(i16temp);
-			read_e(fptr, &i32temp, sizeof(uint32_t));
-			length = ntohl(i32temp);
-			switch(chunk){
-				case DB_CHUNK_CFG:
-					read_e(fptr, &i8temp, sizeof(uint8_t)); // shutdown
-					read_e(fptr, &i8temp, sizeof(uint8_t)); // sizeof(dbid_t)
-					if(i8temp != sizeof(dbid_t)){
-						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Incompatible database configuration (dbid size is %d bytes, expected %lu)",
-								i8temp, (unsigned long)sizeof(dbid_t));
-						fclose(fptr);
-						return 1;
-					}
-					read_e(fptr, &i64temp, sizeof(dbid_t));
-					db->last_db_id = i64temp;
-					break;
-
-				case DB_CHUNK_MSG_STORE:
-					if(_db_msg_store_chunk_restore(db, fptr)) return 1;
-					break;
-
-				case DB_CHUNK_CLIENT_MSG:
-					if(_db_client_msg_chunk_restore(db, fptr)) return 1;
-					break;
-
-				case DB_CHUNK_RETAIN:
-					if(_db_retain_chunk_restore(db, fptr)) return 1;
-					break;
-
-				case DB_CHUNK_SUB:
-					if(_db_sub_chunk_restore(db, fptr)) return 1;
-					break;
-
-				case DB_CHUNK_CLIENT:
-					if(_db_client_chunk_restore(db, fptr)) return 1;
-					break;
-
-				default:
-					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
-					fseek(fptr, length, SEEK_CUR);
-					break;
-			}
-		}
-		if(rlen < 0) goto error;
-	}else{
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to restore persistent database. Unrecognised file format.");
-		rc = 1;
+	restore_str = _mosquitto_malloc(sizeof(struct _db_restore_strings));
+	if(!restore_str){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
 	}
-
-	fclose(fptr);
-
-	return rc;
-error:
-	strerror_r(errno, err, 256);
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	if(fptr) fclose(fptr);
-	return 1;
+	rc = _db_restore(db);
+	_mosquitto_free(restore_str);
+	restore_str = NULL;
+	_db_store_index_free();
+	restore_context = NULL;
+	restore_tail = NULL;
+	if(rc) return rc;
+
+	if(db->config->persistence_wal){
+		return _db_wal_open();
+	}
+	_mosquitto_free(wal_filepath);
+	wal_filepath = NULL;
+	_mosquitto_free(wal_old_filepath);
+	wal_old_filepath = NULL;
+	return MOSQ_ERR_SUCCESS;
 }
 
 static int _db_restore_sub(struct mosquitto_db *db, const char *client_id, const char *sub, int qos)
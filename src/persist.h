@@ -30,7 +30,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifndef PERSIST_H
 #define PERSIST_H
 
-#define MOSQ_DB_VERSION 3
+/* Version 4 adds a CRC-32C after every chunk and an index of chunk offsets at
+ * the end of a snapshot. */
+#define MOSQ_DB_VERSION 4
 
 /* DB read/write */
 const unsigned char magic[15] = {0x00, 0xB5, 0x00, 'm','o','s','q','u','i','t','t','o',' ','d','b'};
@@ -40,9 +42,16 @@ const unsigned char magic[15] = {0x00, 0xB5, 0x00, 'm','o','s','q','u','i','t','
 #define DB_CHUNK_RETAIN 4
 #define DB_CHUNK_SUB 5
 #define DB_CHUNK_CLIENT 6
+/* The following chunks only appear in the write-ahead log. */
+#define DB_CHUNK_CLIENT_MSG_DELETE 7
+#define DB_CHUNK_SUB_DELETE 8
+#define DB_CHUNK_CLIENT_DELETE 9
+/* Always the last chunk in a snapshot, followed only by its own offset as a
+ * 64 bit value so that it can be found from the end of the file. */
+#define DB_CHUNK_INDEX 10
 /* End DB read/write */
 
 #define read_e(f, b, c) if(fread(b, 1, c, f) != c){ goto error; }
-#define write_e(f, b, c) if(fwrite(b, 1, c, f) != c){ goto error; }
+#define write_e(f, b, c) if(_db_write(f, b, c)){ goto error; }
 
 #endif
@@ -87,7 +87,7 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 {
 	char *topic;
 	char *topic_temp;
-	void *payload = NULL;
+	const void *payload = NULL;
 	uint32_t payloadlen;
 	uint8_t dup, qos, retain;
 	uint16_t mid = 0;
@@ -196,24 +196,20 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 		topic = topic_mount;
 	}
 
-	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
+	_mosquitto_log_debug(NULL, "Received PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
 	if(payloadlen){
-		payload = _mosquitto_calloc(payloadlen+1, sizeof(uint8_t));
-		if(_mosquitto_read_bytes(&context->in_packet, payload, payloadlen)){
-			_mosquitto_free(topic);
-			return 1;
-		}
+		/* The message store takes its own copy if it keeps the message, so
+		 * there's no need to copy the payload out of the packet here. */
+		payload = &(context->in_packet.payload[context->in_packet.pos]);
 	}
 
 	/* Check for topic access */
 	rc = mosquitto_acl_check(db, context, topic, MOSQ_ACL_WRITE);
 	if(rc == MOSQ_ERR_ACL_DENIED){
 		_mosquitto_free(topic);
-		if(payload) _mosquitto_free(payload);
 		return MOSQ_ERR_SUCCESS;
 	}else if(rc != MOSQ_ERR_SUCCESS){
 		_mosquitto_free(topic);
-		if(payload) _mosquitto_free(payload);
 		return rc;
 	}
 
@@ -224,7 +220,6 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 		dup = 0;
 		if(mqtt3_db_message_store(db, context->id, mid, topic, qos, payloadlen, payload, retain, &stored, 0)){
 			_mosquitto_free(topic);
-			if(payload) _mosquitto_free(payload);
 			return 1;
 		}
 	}else{
@@ -236,7 +231,11 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 			break;
 		case 1:
 			if(mqtt3_db_messages_queue(db, context->id, topic, qos, retain, stored)) rc = 1;
+#ifdef WITH_PERSISTENCE
+			if(mqtt3_db_wal_ack(db, context, stored, PUBACK, mid)) rc = 1;
+#else
 			if(_mosquitto_send_puback(context, mid)) rc = 1;
+#endif
 			break;
 		case 2:
 			if(!dup){
@@ -247,14 +246,17 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 			/* mqtt3_db_message_insert() returns 2 to indicate dropped message
 			 * due to queue. This isn't an error so don't disconnect them. */
 			if(!res){
+#ifdef WITH_PERSISTENCE
+				if(mqtt3_db_wal_ack(db, context, stored, PUBREC, mid)) rc = 1;
+#else
 				if(_mosquitto_send_pubrec(context, mid)) rc = 1;
+#endif
 			}else if(res == 1){
 				rc = 1;
 			}
 			break;
 	}
 	_mosquitto_free(topic);
-	if(payload) _mosquitto_free(payload);
 
 	return rc;
 }
@@ -36,10 +36,14 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <mqtt3_protocol.h>
 #include <memory_mosq.h>
 #include <send_mosq.h>
+#include <shm_mosq.h>
 #include <util_mosq.h>
 
 extern unsigned int g_connection_count;
 
+static int _connect_finish(struct mosquitto_db *db, struct mosquitto *context, char *client_id, uint8_t clean_session, struct mosquitto_message *will_struct);
+static void _connect_auth_done(struct mosquitto_db *db, struct mqtt3_async_item *item);
+
 int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 {
 	char *protocol_name;
@@ -52,11 +56,11 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 	uint8_t will, will_retain, will_qos, clean_session;
 	uint8_t username_flag, password_flag;
 	char *username, *password = NULL;
-	int i;
 	int rc;
-	struct _mosquitto_acl_user *acl_tail;
 	int slen;
+	struct _mosquitto_auth_request *request;
 #ifdef WITH_TLS
+	int i;
 	X509 *client_cert;
 	X509_NAME *name;
 	X509_NAME_ENTRY *name_entry;
@@ -179,6 +183,11 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 			mqtt3_context_disconnect(db, context);
 			return 1;
 		}
+		will_struct->topic = will_topic;
+		will_struct->payload = will_payload;
+		will_struct->payloadlen = will_payloadlen;
+		will_struct->qos = will_qos;
+		will_struct->retain = will_retain;
 	}
 
 	if(username_flag){
@@ -257,9 +266,33 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 	}else{
 #endif /* WITH_TLS */
 		if(username_flag){
-			rc = mosquitto_unpwd_check(db, username, password);
 			context->username = username;
 			context->password = password;
+			request = _mosquitto_calloc(1, sizeof(struct _mosquitto_auth_request));
+			if(!request){
+				_mosquitto_free(client_id);
+				return MOSQ_ERR_NOMEM;
+			}
+			request->item.done = _connect_auth_done;
+			request->context = context;
+			request->client_id = client_id;
+			request->will = will_struct;
+			request->clean_session = clean_session;
+			context->auth_request = request;
+			context->state = mosq_cs_authenticating;
+
+			rc = mosquitto_unpwd_check_async(db, request, username, password);
+			if(rc == MOSQ_ERR_SUCCESS){
+				/* Carried on in _connect_auth_done(). */
+				return MOSQ_ERR_SUCCESS;
+			}
+			/* The check wasn't started. */
+			context->auth_request = NULL;
+			context->state = mosq_cs_new;
+			_mosquitto_free(request);
+			if(rc == MOSQ_ERR_NOT_SUPPORTED){
+				rc = mosquitto_unpwd_check(db, username, password);
+			}
 			if(rc == MOSQ_ERR_AUTH){
 				_mosquitto_send_connack(context, CONNACK_REFUSED_BAD_USERNAME_PASSWORD);
 				mqtt3_context_disconnect(db, context);
@@ -281,70 +314,134 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 	}
 #endif
 
+	return _connect_finish(db, context, client_id, clean_session, will_struct);
+}
+
+static void _auth_request_free(struct _mosquitto_auth_request *request)
+{
+	_mosquitto_free(request->client_id);
+	if(request->will){
+		if(request->will->topic) _mosquitto_free(request->will->topic);
+		if(request->will->payload) _mosquitto_free(request->will->payload);
+		_mosquitto_free(request->will);
+	}
+	_mosquitto_free(request);
+}
+
+/* Called from the main loop with the result of an asynchronous
+ * username/password check started by mqtt3_handle_connect(). The result is
+ * treated in the same way as that of mosquitto_unpwd_check(). */
+static void _connect_auth_done(struct mosquitto_db *db, struct mqtt3_async_item *item)
+{
+	struct _mosquitto_auth_request *request = (struct _mosquitto_auth_request *)item;
+	struct mosquitto *context = request->context;
+	int result = item->result;
+
+	if(context){
+		context->auth_request = NULL;
+		context->state = mosq_cs_new;
+	}
+	if(!context || context->sock == INVALID_SOCKET){
+		/* Client went away while waiting. */
+		_auth_request_free(request);
+		return;
+	}
+
+	if(result == MOSQ_ERR_AUTH){
+		_mosquitto_send_connack(context, CONNACK_REFUSED_BAD_USERNAME_PASSWORD);
+		mqtt3_context_disconnect(db, context);
+		_auth_request_free(request);
+	}else if(result == MOSQ_ERR_INVAL){
+		mqtt3_context_disconnect(db, context);
+		_auth_request_free(request);
+	}else{
+		/* client_id and will now belong to the context. */
+		if(_connect_finish(db, context, request->client_id, request->clean_session, request->will)){
+			mqtt3_context_disconnect(db, context);
+		}
+		_mosquitto_free(request);
+	}
+}
+
+static int _connect_finish(struct mosquitto_db *db, struct mosquitto *context, char *client_id, uint8_t clean_session, struct mosquitto_message *will_struct)
+{
+	struct _mosquitto_acl_user *acl_tail;
+	struct mosquitto *found;
+
+	mqtt3_context_connect_done(context);
+
 	/* Find if this client already has an entry. This must be done *after* any security checks. */
-	for(i=0; i<db->context_count; i++){
-		if(db->contexts[i] && db->contexts[i]->id && !strcmp(db->contexts[i]->id, client_id)){
-			/* Client does match. */
-			if(db->contexts[i]->sock == -1){
-				/* Client is reconnecting after a disconnect */
-				/* FIXME - does anything else need to be done here? */
-			}else{
-				/* Client is already connected, disconnect old version */
-				if(db->config->connection_messages == true){
-					_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Client %s already connected, closing old connection.", client_id);
-				}
+	found = mqtt3_context_find(db, client_id);
+	if(found){
+		/* Client does match. */
+		if(found->offline && mqtt3_context_online(db, found)){
+			return MOSQ_ERR_NOMEM;
+		}
+		if(found->sock == -1){
+			/* Client is reconnecting after a disconnect */
+			/* FIXME - does anything else need to be done here? */
+		}else{
+			/* Client is already connected, disconnect old version */
+			if(db->config->connection_messages == true){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Client %s already connected, closing old connection.", client_id);
 			}
-			db->contexts[i]->clean_session = clean_session;
-			mqtt3_context_cleanup(db, db->contexts[i], false);
-			db->contexts[i]->state = mosq_cs_connected;
-			db->contexts[i]->address = _mosquitto_strdup(context->address);
-			db->contexts[i]->sock = context->sock;
-			db->contexts[i]->listener = context->listener;
-			db->contexts[i]->last_msg_in = time(NULL);
-			db->contexts[i]->last_msg_out = time(NULL);
-			db->contexts[i]->keepalive = context->keepalive;
-			db->contexts[i]->pollfd_index = context->pollfd_index;
+		}
+#ifdef WITH_PERSISTENCE
+		if(found->clean_session == false && clean_session){
+			mqtt3_db_wal_client_delete(client_id);
+		}
+#endif
+		found->clean_session = clean_session;
+		mqtt3_context_cleanup(db, found, false);
+		found->state = mosq_cs_connected;
+		found->address = _mosquitto_strdup(context->address);
+		found->sock = context->sock;
+		found->listener = context->listener;
+		found->last_msg_in = time(NULL);
+		found->last_msg_out = time(NULL);
+		found->keepalive = context->keepalive;
+		found->pollfd_index = context->pollfd_index;
 #ifdef WITH_TLS
-			db->contexts[i]->ssl = context->ssl;
+		found->ssl = context->ssl;
 #endif
-			if(context->username){
-				db->contexts[i]->username = _mosquitto_strdup(context->username);
-			}
-			context->sock = -1;
+#ifdef WITH_SHM
+		found->shm = context->shm;
+#endif
+		if(context->username){
+			found->username = _mosquitto_strdup(context->username);
+		}
+		context->sock = -1;
 #ifdef WITH_TLS
-			context->ssl = NULL;
+		context->ssl = NULL;
 #endif
-			context->state = mosq_cs_disconnecting;
-			context = db->contexts[i];
-			if(context->msgs){
-				mqtt3_db_message_reconnect_reset(context);
-			}
-			break;
+#ifdef WITH_SHM
+		context->shm = NULL;
+#endif
+		context->state = mosq_cs_disconnecting;
+		context = found;
+#ifdef WITH_SHM
+		if(context->shm){
+			/* loop_read() stops at the old context, so ask the client to
+			 * wake us for anything it sends next. */
+			_mosquitto_shm_rearm(context);
+		}
+#endif
+		if(context->msgs){
+			mqtt3_db_message_reconnect_reset(context);
 		}
 	}
 
-	context->id = client_id;
+	mqtt3_context_id_set(db, context, client_id);
 	context->clean_session = clean_session;
 	context->ping_t = 0;
 
 #ifdef WITH_PERSISTENCE
 	if(!clean_session){
 		db->persistence_changes++;
+		mqtt3_db_wal_client_write(context);
 	}
 #endif
 	context->will = will_struct;
-	if(context->will){
-		context->will->topic = will_topic;
-		if(will_payload){
-			context->will->payload = will_payload;
-			context->will->payloadlen = will_payloadlen;
-		}else{
-			context->will->payload = NULL;
-			context->will->payloadlen = 0;
-		}
-		context->will->qos = will_qos;
-		context->will->retain = will_retain;
-	}
 
 	/* Associate user with its ACL, assuming we have ACLs loaded. */
 	if(db->acl_list){
@@ -383,7 +480,7 @@ int mqtt3_handle_disconnect(struct mosquitto_db *db, struct mosquitto *context)
 	if(context->in_packet.remaining_length != 0){
 		return MOSQ_ERR_PROTOCOL;
 	}
-	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received DISCONNECT from %s", context->id);
+	_mosquitto_log_debug(NULL, "Received DISCONNECT from %s", context->id);
 	context->state = mosq_cs_disconnecting;
 	mqtt3_context_disconnect(db, context);
 	return MOSQ_ERR_SUCCESS;
@@ -403,7 +500,7 @@ int mqtt3_handle_subscribe(struct mosquitto_db *db, struct mosquitto *context)
 	char *sub_mount;
 
 	if(!context) return MOSQ_ERR_INVAL;
-	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received SUBSCRIBE from %s", context->id);
+	_mosquitto_log_debug(NULL, "Received SUBSCRIBE from %s", context->id);
 	/* FIXME - plenty of potential for memory leaks here */
 
 	if(_mosquitto_read_uint16(&context->in_packet, &mid)) return 1;
@@ -453,9 +550,19 @@ int mqtt3_handle_subscribe(struct mosquitto_db *db, struct mosquitto *context)
 				sub = sub_mount;
 
 			}
-			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "\t%s (QoS %d)", sub, qos);
+			_mosquitto_log_debug(NULL, "\t%s (QoS %d)", sub, qos);
 
+			if(!strncmp(sub, "$SYS/", 5)){
+				/* $SYS values are only published while somebody is
+				 * subscribed, so bring the retained ones up to date first. */
+				mqtt3_db_sys_refresh(db, sub);
+			}
 			rc2 = mqtt3_sub_add(db, context, sub, qos, &db->subs);
+#ifdef WITH_PERSISTENCE
+			if(rc2 == MOSQ_ERR_SUCCESS || rc2 == -1){
+				mqtt3_db_wal_sub_write(context, sub, qos);
+			}
+#endif
 			if(rc2 == MOSQ_ERR_SUCCESS){
 				if(mqtt3_retain_queue(db, context, sub, qos)) rc = 1;
 			}else if(rc2 != -1){
@@ -492,7 +599,7 @@ int mqtt3_handle_unsubscribe(struct mosquitto_db *db, struct mosquitto *context)
 	char *sub;
 
 	if(!context) return MOSQ_ERR_INVAL;
-	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received UNSUBSCRIBE from %s", context->id);
+	_mosquitto_log_debug(NULL, "Received UNSUBSCRIBE from %s", context->id);
 
 	if(_mosquitto_read_uint16(&context->in_packet, &mid)) return 1;
 
@@ -503,8 +610,11 @@ int mqtt3_handle_unsubscribe(struct mosquitto_db *db, struct mosquitto *context)
 		}
 
 		if(sub){
-			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "\t%s", sub);
+			_mosquitto_log_debug(NULL, "\t%s", sub);
 			mqtt3_sub_remove(db, context, sub, &db->subs);
+#ifdef WITH_PERSISTENCE
+			mqtt3_db_wal_sub_delete(context, sub);
+#endif
 			_mosquitto_free(sub);
 		}
 	}
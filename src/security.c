@@ -31,6 +31,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include <mosquitto_broker.h>
 #include "mosquitto_plugin.h"
@@ -44,8 +45,12 @@ typedef int (*FUNC_auth_plugin_security_init)(void *, struct mosquitto_auth_opt
 typedef int (*FUNC_auth_plugin_security_cleanup)(void *, struct mosquitto_auth_opt *, int, bool);
 typedef int (*FUNC_auth_plugin_acl_check)(void *, const char *, const char *, int);
 typedef int (*FUNC_auth_plugin_unpwd_check)(void *, const char *, const char *);
+typedef int (*FUNC_auth_plugin_unpwd_check_async)(void *, const char *, const char *, void *, void (*)(void *, int));
 typedef int (*FUNC_auth_plugin_psk_key_get)(void *, const char *, const char *, char *, int);
 
+extern unsigned long g_acl_cache_hits;
+extern unsigned long g_acl_cache_misses;
+
 int mosquitto_security_module_init(struct mosquitto_db *db)
 {
 	void *lib;
@@ -67,7 +72,9 @@ int mosquitto_security_module_init(struct mosquitto_db *db)
 			return 1;
 		}
 		version = plugin_version();
-		if(version != MOSQ_AUTH_PLUGIN_VERSION){
+		/* Version 2 only adds optional functions, so version 1 plugins are
+		 * still fine. */
+		if(version != MOSQ_AUTH_PLUGIN_VERSION && version != 1){
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR,
 					"Error: Incorrect auth plugin version (got %d, expected %d).",
 					version, MOSQ_AUTH_PLUGIN_VERSION);
@@ -123,6 +130,16 @@ int mosquitto_security_module_init(struct mosquitto_db *db)
 			return 1;
 		}
 
+		db->auth_plugin.unpwd_check_async = NULL;
+		if(version >= 2){
+			db->auth_plugin.unpwd_check_async = (FUNC_auth_plugin_unpwd_check_async)LIB_SYM(lib, "mosquitto_auth_unpwd_check_async");
+			if(db->auth_plugin.unpwd_check_async && mqtt3_async_init()){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING,
+						"Warning: Unable to use asynchronous auth plugin functions, falling back to mosquitto_auth_unpwd_check().");
+				db->auth_plugin.unpwd_check_async = NULL;
+			}
+		}
+
 		db->auth_plugin.lib = lib;
 		db->auth_plugin.user_data = NULL;
 		if(db->auth_plugin.plugin_init){
@@ -136,6 +153,7 @@ int mosquitto_security_module_init(struct mosquitto_db *db)
 		db->auth_plugin.security_cleanup = NULL;
 		db->auth_plugin.acl_check = NULL;
 		db->auth_plugin.unpwd_check = NULL;
+		db->auth_plugin.unpwd_check_async = NULL;
 		db->auth_plugin.psk_key_get = NULL;
 	}
 
@@ -164,7 +182,9 @@ int mosquitto_security_module_cleanup(struct mosquitto_db *db)
 	db->auth_plugin.security_cleanup = NULL;
 	db->auth_plugin.acl_check = NULL;
 	db->auth_plugin.unpwd_check = NULL;
+	db->auth_plugin.unpwd_check_async = NULL;
 	db->auth_plugin.psk_key_get = NULL;
+	mqtt3_async_cleanup();
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -186,6 +206,18 @@ int mosquitto_security_init(struct mosquitto_db *db, bool reload)
  */
 int mosquitto_security_apply(struct mosquitto_db *db)
 {
+	int i;
+
+	/* Cached ACL decisions may no longer hold. */
+	for(i=0; i<db->context_count; i++){
+		if(db->contexts[i]){
+			mosquitto_acl_cache_flush(db->contexts[i]);
+		}
+	}
+	for(i=0; i<db->offline_count; i++){
+		mosquitto_acl_cache_flush(db->offline_contexts[i]);
+	}
+
 	if(!db->auth_plugin.lib){
 		return mosquitto_security_apply_default(db);
 	}
@@ -201,7 +233,7 @@ int mosquitto_security_cleanup(struct mosquitto_db *db, bool reload)
 	}
 }
 
-int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
+static int _acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
 {
 	if(!db->auth_plugin.lib){
 		return mosquitto_acl_check_default(db, context, topic, access);
@@ -210,6 +242,80 @@ int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, cons
 	}
 }
 
+/* Find the cache slot for a topic and access, allocating the cache for this
+ * client if needed, and set topic_len to the length of the topic. Returns
+ * NULL if the cache can't be used, including for topics too long to cache. */
+static struct _mosquitto_acl_cache *_acl_cache_slot(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access, int *topic_len)
+{
+	uint32_t hash = 2166136261U;
+	const char *pos;
+
+	if(context->acl_cache_size != db->config->acl_cache_size){
+		mosquitto_acl_cache_flush(context);
+		context->acl_cache = _mosquitto_calloc(db->config->acl_cache_size, sizeof(struct _mosquitto_acl_cache));
+		if(!context->acl_cache) return NULL;
+		context->acl_cache_size = db->config->acl_cache_size;
+	}
+
+	/* FNV-1a */
+	for(pos = topic; *pos; pos++){
+		if(pos - topic == MQTT3_ACL_CACHE_TOPIC_MAX) return NULL;
+		hash = (hash ^ (uint8_t)(*pos)) * 16777619U;
+	}
+	hash = (hash ^ (uint32_t)access) * 16777619U;
+	*topic_len = pos - topic;
+
+	return &context->acl_cache[hash % context->acl_cache_size];
+}
+
+int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
+{
+	struct _mosquitto_acl_cache *slot;
+	time_t now;
+	int topic_len;
+	int rc;
+
+	/* Only worth caching if the check is more than a trivial pass. */
+	if(db->config->acl_cache_size == 0 || db->config->acl_cache_ttl == 0
+			|| !context || !topic
+			|| (!db->auth_plugin.lib && !db->acl_list && !db->acl_patterns)){
+
+		return _acl_check(db, context, topic, access);
+	}
+
+	slot = _acl_cache_slot(db, context, topic, access, &topic_len);
+	if(!slot){
+		return _acl_check(db, context, topic, access);
+	}
+	now = time(NULL);
+	if(slot->topic_len == topic_len && slot->access == access
+			&& slot->expiry > now && !memcmp(slot->topic, topic, topic_len)){
+
+		g_acl_cache_hits++;
+		return slot->result;
+	}
+	g_acl_cache_misses++;
+
+	rc = _acl_check(db, context, topic, access);
+	if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_ACL_DENIED){
+		memcpy(slot->topic, topic, topic_len);
+		slot->topic_len = topic_len;
+		slot->access = access;
+		slot->result = rc;
+		slot->expiry = now + db->config->acl_cache_ttl;
+	}
+	return rc;
+}
+
+void mosquitto_acl_cache_flush(struct mosquitto *context)
+{
+	if(!context->acl_cache) return;
+
+	_mosquitto_free(context->acl_cache);
+	context->acl_cache = NULL;
+	context->acl_cache_size = 0;
+}
+
 int mosquitto_unpwd_check(struct mosquitto_db *db, const char *username, const char *password)
 {
 	if(!db->auth_plugin.lib){
@@ -219,6 +325,27 @@ int mosquitto_unpwd_check(struct mosquitto_db *db, const char *username, const c
 	}
 }
 
+static void _unpwd_check_complete(void *request, int result)
+{
+	mqtt3_async_complete(&((struct _mosquitto_auth_request *)request)->item, result);
+}
+
+/* Start checking a username and password without waiting for the result,
+ * which is passed back through the async queue to the main loop. Returns
+ * MOSQ_ERR_SUCCESS if the check has started, MOSQ_ERR_NOT_SUPPORTED if
+ * mosquitto_unpwd_check() must be used instead, or any other value as the
+ * result of the check. */
+int mosquitto_unpwd_check_async(struct mosquitto_db *db, struct _mosquitto_auth_request *request, const char *username, const char *password)
+{
+	if(!db->auth_plugin.lib){
+		return mosquitto_unpwd_check_default_async(db, request, username, password);
+	}
+	if(!db->auth_plugin.unpwd_check_async){
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+	return db->auth_plugin.unpwd_check_async(db->auth_plugin.user_data, username, password, request, _unpwd_check_complete);
+}
+
 int mosquitto_psk_key_get(struct mosquitto_db *db, const char *hint, const char *identity, char *key, int max_key_len)
 {
 	if(!db->auth_plugin.lib){
@@ -35,6 +35,12 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <mosquitto_broker.h>
 #include <memory_mosq.h>
 
+#ifdef WITH_TLS
+#  include <openssl/crypto.h>
+#  include <openssl/hmac.h>
+#  include <openssl/rand.h>
+#endif
+
 static int _aclfile_parse(struct mosquitto_db *db);
 static int _unpwd_file_parse(struct mosquitto_db *db);
 static int _acl_cleanup(struct mosquitto_db *db, bool reload);
@@ -43,6 +49,11 @@ static int _psk_file_parse(struct mosquitto_db *db);
 #ifdef WITH_TLS
 static int _pw_digest(const char *password, const unsigned char *salt, unsigned int salt_len, unsigned char *hash, unsigned int *hash_len);
 static int _base64_decode(char *in, unsigned char **decoded, unsigned int *decoded_len);
+
+/* Key for the password cache MACs. It is never written anywhere, so the cache
+ * is no use outside this process. */
+#define UNPWD_CACHE_KEY_LEN 32
+static unsigned char unpwd_cache_key[UNPWD_CACHE_KEY_LEN];
 #endif
 
 int mosquitto_security_init_default(struct mosquitto_db *db, bool reload)
@@ -56,6 +67,20 @@ int mosquitto_security_init_default(struct mosquitto_db *db, bool reload)
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error opening password file \"%s\".", db->config->password_file);
 			return rc;
 		}
+#ifdef WITH_TLS
+		/* A new key on each load, so nothing cached before a reload can
+		 * match afterwards. */
+		if(RAND_bytes(unpwd_cache_key, UNPWD_CACHE_KEY_LEN) != 1){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to create password cache key.");
+			return MOSQ_ERR_UNKNOWN;
+		}
+		/* Hash passwords away from the main loop. */
+		if(db->config->password_check_threads > 0
+				&& mqtt3_async_workers_start(db->config->password_check_threads)){
+
+			_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to start password check threads, checking passwords in the main loop.");
+		}
+#endif
 	}
 
 	/* Load acl data if required. */
@@ -90,21 +115,93 @@ int mosquitto_security_cleanup_default(struct mosquitto_db *db, bool reload)
 }
 
 
-int _add_acl(struct mosquitto_db *db, const char *user, const char *topic, int access)
+/* Topics with more levels than this are split into a heap allocated array
+ * when being checked. */
+#define ACL_TOPIC_LEVELS 32
+
+struct _acl_token{
+	const char *str;
+	int len;
+};
+
+static struct _mosquitto_acl *_acl_node_get(struct _mosquitto_acl **root, const char *topic, int len, bool pattern)
 {
-	struct _mosquitto_acl_user *acl_user=NULL, *user_tail;
-	struct _mosquitto_acl *acl, *acl_root=NULL, *acl_tail=NULL;
-	char *local_topic;
-	char *token = NULL;
-	bool new_user = false;
-	char *saveptr = NULL;
+	struct _mosquitto_acl *acl, *tail = NULL;
 
-	if(!db || !topic) return MOSQ_ERR_INVAL;
+	for(acl = *root; acl; acl = acl->next){
+		if(!strncmp(acl->topic, topic, len) && acl->topic[len] == '\0'){
+			return acl;
+		}
+		tail = acl;
+	}
+
+	acl = _mosquitto_calloc(1, sizeof(struct _mosquitto_acl));
+	if(!acl) return NULL;
+	acl->topic = _mosquitto_malloc(len+1);
+	if(!acl->topic){
+		_mosquitto_free(acl);
+		return NULL;
+	}
+	memcpy(acl->topic, topic, len);
+	acl->topic[len] = '\0';
+	acl->access = MOSQ_ACL_NONE;
+
+	if(!strcmp(acl->topic, "+")){
+		acl->type = at_plus;
+	}else if(!strcmp(acl->topic, "#")){
+		acl->type = at_hash;
+	}else if(pattern && !strcmp(acl->topic, "%c")){
+		acl->type = at_clientid;
+	}else if(pattern && !strcmp(acl->topic, "%u")){
+		acl->type = at_username;
+	}else{
+		acl->type = at_literal;
+	}
 
-	local_topic = _mosquitto_strdup(topic);
-	if(!local_topic){
-		return MOSQ_ERR_NOMEM;
+	if(tail){
+		tail->next = acl;
+	}else{
+		*root = acl;
 	}
+	return acl;
+}
+
+/* Add a rule to an ACL trie, merging it with any rules that share a prefix. */
+static int _acl_trie_add(struct _mosquitto_acl **root, const char *topic, int access, bool pattern)
+{
+	struct _mosquitto_acl *acl = NULL;
+	const char *end;
+
+	if(topic[0] == '/'){
+		acl = _acl_node_get(root, "/", 1, pattern);
+		if(!acl) return MOSQ_ERR_NOMEM;
+		root = &acl->child;
+	}
+
+	while(*topic){
+		if(*topic == '/'){
+			topic++;
+			continue;
+		}
+		end = strchr(topic, '/');
+		if(!end) end = topic + strlen(topic);
+
+		acl = _acl_node_get(root, topic, end-topic, pattern);
+		if(!acl) return MOSQ_ERR_NOMEM;
+		root = &acl->child;
+		topic = end;
+	}
+	if(!acl) return MOSQ_ERR_INVAL;
+
+	acl->access |= access;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int _add_acl(struct mosquitto_db *db, const char *user, const char *topic, int access)
+{
+	struct _mosquitto_acl_user *acl_user=NULL, *user_tail;
+
+	if(!db || !topic || !topic[0]) return MOSQ_ERR_INVAL;
 
 	if(db->acl_list){
 		user_tail = db->acl_list;
@@ -124,14 +221,11 @@ int _add_acl(struct mosquitto_db *db, const char *user, const char *topic, int a
 	if(!acl_user){
 		acl_user = _mosquitto_malloc(sizeof(struct _mosquitto_acl_user));
 		if(!acl_user){
-			_mosquitto_free(local_topic);
 			return MOSQ_ERR_NOMEM;
 		}
-		new_user = true;
 		if(user){
 			acl_user->username = _mosquitto_strdup(user);
 			if(!acl_user->username){
-				_mosquitto_free(local_topic);
 				_mosquitto_free(acl_user);
 				return MOSQ_ERR_NOMEM;
 			}
@@ -140,64 +234,7 @@ int _add_acl(struct mosquitto_db *db, const char *user, const char *topic, int a
 		}
 		acl_user->next = NULL;
 		acl_user->acl = NULL;
-	}
-
-	/* Tokenise topic */
-	if(local_topic[0] == '/'){
-		acl_root = _mosquitto_malloc(sizeof(struct _mosquitto_acl));
-		if(!acl_root) return MOSQ_ERR_NOMEM;
-		acl_tail = acl_root;
-		acl_root->child = NULL;
-		acl_root->next = NULL;
-		acl_root->access = MOSQ_ACL_NONE;
-		acl_root->topic = _mosquitto_strdup("/");
-		if(!acl_root->topic) return MOSQ_ERR_NOMEM;
-
-		token = strtok_r(local_topic+1, "/", &saveptr);
-	}else{
-		token = strtok_r(local_topic, "/", &saveptr);
-	}
-
-	while(token){
-		acl = _mosquitto_malloc(sizeof(struct _mosquitto_acl));
-		if(!acl) return MOSQ_ERR_NOMEM;
-		acl->child = NULL;
-		acl->next = NULL;
-		acl->access = MOSQ_ACL_NONE;
-		acl->topic = _mosquitto_strdup(token);
-		if(!acl->topic) return MOSQ_ERR_NOMEM;
-		if(acl_root){
-			acl_tail->child = acl;
-			acl_tail = acl;
-		}else{
-			acl_root = acl;
-			acl_tail = acl;
-		}
-
-		token = strtok_r(NULL, "/", &saveptr);
-	}
-	if(acl_root){
-		acl_tail = acl_root;
-		while(acl_tail->child){
-			acl_tail = acl_tail->child;
-		}
-		acl_tail->access = access;
-	}else{
-		return MOSQ_ERR_INVAL;
-	}
-
-	/* Add acl to user acl list */
-	if(acl_user->acl){
-		acl_tail = acl_user->acl;
-		while(acl_tail->next){
-			acl_tail = acl_tail->next;
-		}
-		acl_tail->next = acl_root;
-	}else{
-		acl_user->acl = acl_root;
-	}
 
-	if(new_user){
 		/* Add to end of list */
 		if(db->acl_list){
 			user_tail = db->acl_list;
@@ -210,89 +247,65 @@ int _add_acl(struct mosquitto_db *db, const char *user, const char *topic, int a
 		}
 	}
 
-	_mosquitto_free(local_topic);
-	return MOSQ_ERR_SUCCESS;
+	return _acl_trie_add(&acl_user->acl, topic, access, false);
 }
 
 int _add_acl_pattern(struct mosquitto_db *db, const char *topic, int access)
 {
-	struct _mosquitto_acl *acl, *acl_root=NULL, *acl_tail=NULL;
-	char *local_topic;
-	char *token = NULL;
-	char *saveptr = NULL;
-
-	if(!db || !topic) return MOSQ_ERR_INVAL;
+	if(!db || !topic || !topic[0]) return MOSQ_ERR_INVAL;
 
-	local_topic = _mosquitto_strdup(topic);
-	if(!local_topic){
-		return MOSQ_ERR_NOMEM;
-	}
-
-	/* Tokenise topic */
-	if(local_topic[0] == '/'){
-		acl_root = _mosquitto_malloc(sizeof(struct _mosquitto_acl));
-		if(!acl_root) return MOSQ_ERR_NOMEM;
-		acl_tail = acl_root;
-		acl_root->child = NULL;
-		acl_root->next = NULL;
-		acl_root->access = MOSQ_ACL_NONE;
-		acl_root->topic = _mosquitto_strdup("/");
-		if(!acl_root->topic) return MOSQ_ERR_NOMEM;
+	return _acl_trie_add(&db->acl_patterns, topic, access, true);
+}
 
-		token = strtok_r(local_topic+1, "/", &saveptr);
-	}else{
-		token = strtok_r(local_topic, "/", &saveptr);
-	}
+/* Walk every branch of the trie that matches the topic levels in tokens,
+ * returning true as soon as a rule granting access is found. */
+static bool _acl_trie_match(struct _mosquitto_acl *acl, struct _acl_token *tokens, int count, struct mosquitto *context, int access)
+{
+	const char *value;
 
-	while(token){
-		acl = _mosquitto_malloc(sizeof(struct _mosquitto_acl));
-		if(!acl) return MOSQ_ERR_NOMEM;
-		acl->child = NULL;
-		acl->next = NULL;
-		acl->access = MOSQ_ACL_NONE;
-		acl->topic = _mosquitto_strdup(token);
-		if(!acl->topic) return MOSQ_ERR_NOMEM;
-		if(acl_root){
-			acl_tail->child = acl;
-			acl_tail = acl;
-		}else{
-			acl_root = acl;
-			acl_tail = acl;
+	for(; acl; acl = acl->next){
+		switch(acl->type){
+			case at_plus:
+				value = NULL;
+				break;
+			case at_hash:
+				/* A # at the end of a rule matches one or more levels. */
+				if(acl->access & access) return true;
+				value = acl->topic;
+				break;
+			case at_clientid:
+				if(!context->id) continue;
+				value = context->id;
+				break;
+			case at_username:
+				if(!context->username) continue;
+				value = context->username;
+				break;
+			default:
+				value = acl->topic;
+				break;
 		}
-
-		token = strtok_r(NULL, "/", &saveptr);
-	}
-
-	if(acl_root){
-		acl_tail = acl_root;
-		while(acl_tail->child){
-			acl_tail = acl_tail->child;
+		if(value && (strncmp(value, tokens[0].str, tokens[0].len) || value[tokens[0].len] != '\0')){
+			continue;
 		}
-		acl_tail->access = access;
 
-		if(db->acl_patterns){
-			acl_tail = db->acl_patterns;
-			while(acl_tail->next){
-				acl_tail = acl_tail->next;
-			}
-			acl_tail->next = acl_root;
-		}else{
-			db->acl_patterns = acl_root;
+		if(count == 1){
+			if(acl->access & access) return true;
+		}else if(acl->child && _acl_trie_match(acl->child, &tokens[1], count-1, context, access)){
+			return true;
 		}
-	}else{
-		return MOSQ_ERR_INVAL;
 	}
-
-	_mosquitto_free(local_topic);
-	return MOSQ_ERR_SUCCESS;
+	return false;
 }
 
 int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
 {
-	char *local_topic;
-	char *token;
-	struct _mosquitto_acl *acl_root, *acl_tail;
-	char *saveptr = NULL;
+	struct _acl_token local_tokens[ACL_TOPIC_LEVELS];
+	struct _acl_token *tokens = local_tokens;
+	struct _mosquitto_acl *acl_root, *pattern_root;
+	const char *pos;
+	int count, max;
+	int rc = MOSQ_ERR_ACL_DENIED;
 
 	if(!db || !context || !topic) return MOSQ_ERR_INVAL;
 	if(!db->acl_list && !db->acl_patterns) return MOSQ_ERR_SUCCESS;
@@ -304,147 +317,54 @@ int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *conte
 	}else{
 		acl_root = NULL;
 	}
+	pattern_root = db->acl_patterns;
 
-	/* Loop through all ACLs for this client. */
-	while(acl_root){
-		local_topic = _mosquitto_strdup(topic);
-		if(!local_topic) return MOSQ_ERR_NOMEM;
-
-		acl_tail = acl_root;
-
-		if(local_topic[0] == '/'){
-			if(strcmp(acl_tail->topic, "/")){
-				acl_root = acl_root->next;
-				continue;
-			}
-			acl_tail = acl_tail->child;
-		}
-
-		token = strtok_r(local_topic, "/", &saveptr);
-		/* Loop through the topic looking for matches to this ACL. */
-		while(token){
-			if(acl_tail){
-				if(!strcmp(acl_tail->topic, "#") && acl_tail->child == NULL){
-					/* We have a match */
-					if(access & acl_tail->access){
-						/* And access is allowed. */
-						_mosquitto_free(local_topic);
-						return MOSQ_ERR_SUCCESS;
-					}else{
-						break;
-					}
-				}else if(!strcmp(acl_tail->topic, token) || !strcmp(acl_tail->topic, "+")){
-					token = strtok_r(NULL, "/", &saveptr);
-					if(!token && acl_tail->child == NULL){
-						/* We have a match */
-						if(access & acl_tail->access){
-							/* And access is allowed. */
-							_mosquitto_free(local_topic);
-							return MOSQ_ERR_SUCCESS;
-						}else{
-							break;
-						}
-					}
-				}else{
-					break;
-				}
-				acl_tail = acl_tail->child;
-			}else{
-				break;
-			}
+	/* Topics beginning with a '/' can only match rules that do too. */
+	if(topic[0] == '/'){
+		while(acl_root && strcmp(acl_root->topic, "/")){
+			acl_root = acl_root->next;
 		}
-		_mosquitto_free(local_topic);
-
-		acl_root = acl_root->next;
+		if(acl_root) acl_root = acl_root->child;
+		while(pattern_root && strcmp(pattern_root->topic, "/")){
+			pattern_root = pattern_root->next;
+		}
+		if(pattern_root) pattern_root = pattern_root->child;
 	}
 
-	acl_root = db->acl_patterns;
-	/* Loop through all pattern ACLs. */
-	while(acl_root){
-		local_topic = _mosquitto_strdup(topic);
-		if(!local_topic) return MOSQ_ERR_NOMEM;
+	/* Split the topic into levels once, ignoring empty levels. */
+	max = 1;
+	for(pos = topic; *pos; pos++){
+		if(*pos == '/') max++;
+	}
+	if(max > ACL_TOPIC_LEVELS){
+		tokens = _mosquitto_malloc(max*sizeof(struct _acl_token));
+		if(!tokens) return MOSQ_ERR_NOMEM;
+	}
+	count = 0;
+	pos = topic;
+	while(*pos){
+		if(*pos == '/'){
+			pos++;
+			continue;
+		}
+		tokens[count].str = pos;
+		while(*pos && *pos != '/') pos++;
+		tokens[count].len = pos - tokens[count].str;
+		count++;
+	}
 
-		acl_tail = acl_root;
+	if(count > 0){
+		if(_acl_trie_match(acl_root, tokens, count, context, access)
+				|| _acl_trie_match(pattern_root, tokens, count, context, access)){
 
-		if(local_topic[0] == '/'){
-			if(strcmp(acl_tail->topic, "/")){
-				acl_root = acl_root->next;
-				continue;
-			}
-			acl_tail = acl_tail->child;
-		}
-
-		token = strtok_r(local_topic, "/", &saveptr);
-		/* Loop through the topic looking for matches to this ACL. */
-		while(token){
-			if(acl_tail){
-				if(!strcmp(acl_tail->topic, "#") && acl_tail->child == NULL){
-					/* We have a match */
-					if(access & acl_tail->access){
-						/* And access is allowed. */
-						_mosquitto_free(local_topic);
-						return MOSQ_ERR_SUCCESS;
-					}else{
-						break;
-					}
-				}else if(!strcmp(acl_tail->topic, "%c")){
-					if(!context->id || strcmp(token, context->id)){
-						/* No access */
-						break;
-					}
-					token = strtok_r(NULL, "/", &saveptr);
-					if(!token && acl_tail->child == NULL){
-						/* We have a match */
-						if(access & acl_tail->access){
-							/* And access is allowed. */
-							_mosquitto_free(local_topic);
-							return MOSQ_ERR_SUCCESS;
-						}else{
-							break;
-						}
-					}
-				}else if(!strcmp(acl_tail->topic, "%u")){
-					if(!context->username || strcmp(token, context->username)){
-						/* No access */
-						break;
-					}
-					token = strtok_r(NULL, "/", &saveptr);
-					if(!token && acl_tail->child == NULL){
-						/* We have a match */
-						if(access & acl_tail->access){
-							/* And access is allowed. */
-							_mosquitto_free(local_topic);
-							return MOSQ_ERR_SUCCESS;
-						}else{
-							break;
-						}
-					}
-				}else if(!strcmp(acl_tail->topic, token) || !strcmp(acl_tail->topic, "+")){
-					token = strtok_r(NULL, "/", &saveptr);
-					if(!token && acl_tail->child == NULL){
-						/* We have a match */
-						if(access & acl_tail->access){
-							/* And access is allowed. */
-							_mosquitto_free(local_topic);
-							return MOSQ_ERR_SUCCESS;
-						}else{
-							break;
-						}
-					}
-				}else{
-					break;
-				}
-				acl_tail = acl_tail->child;
-			}else{
-				break;
-			}
+			rc = MOSQ_ERR_SUCCESS;
 		}
-		_mosquitto_free(local_topic);
-
-		acl_root = acl_root->next;
 	}
 
-	return MOSQ_ERR_ACL_DENIED;
+	if(tokens != local_tokens){
+		_mosquitto_free(tokens);
+	}
+	return rc;
 }
 
 static int _aclfile_parse(struct mosquitto_db *db)
@@ -584,6 +504,9 @@ static int _acl_cleanup(struct mosquitto_db *db, bool reload)
 			}
 		}
 	}
+	for(i=0; i<db->offline_count; i++){
+		db->offline_contexts[i]->acl_list = NULL;
+	}
 
 	while(db->acl_list){
 		user_tail = db->acl_list->next;
@@ -607,7 +530,7 @@ static int _acl_cleanup(struct mosquitto_db *db, bool reload)
 static int _pwfile_parse(const char *file, struct _mosquitto_unpwd **root)
 {
 	FILE *pwfile;
-	struct _mosquitto_unpwd *unpwd;
+	struct _mosquitto_unpwd *unpwd, *dup;
 	char buf[256];
 	char *username, *password;
 	int len;
@@ -648,6 +571,14 @@ static int _pwfile_parse(const char *file, struct _mosquitto_unpwd **root)
 						len = strlen(unpwd->password);
 					}
 				}
+				HASH_FIND(hh, *root, unpwd->username, strlen(unpwd->username), dup);
+				if(dup){
+					/* The first entry for a username is the one that is used. */
+					if(unpwd->password) _mosquitto_free(unpwd->password);
+					_mosquitto_free(unpwd->username);
+					_mosquitto_free(unpwd);
+					continue;
+				}
 				HASH_ADD_KEYPTR(hh, *root, unpwd->username, strlen(unpwd->username), unpwd);
 			}
 		}
@@ -746,9 +677,61 @@ static int _psk_file_parse(struct mosquitto_db *db)
 	return MOSQ_ERR_SUCCESS;
 }
 
+#ifdef WITH_TLS
+#define UNPWD_CACHE_MAX_INPUT 512
+
+/* HMAC-SHA256 of username and password, for the password cache. This is much
+ * cheaper than _pw_digest(), so that a cache hit costs a lookup rather than a
+ * hash run. Longer credentials aren't cached. Also called from worker threads,
+ * so mustn't use the _mosquitto_ memory functions. */
+static int _unpwd_cache_mac(const unsigned char *key, const char *username, const char *password, unsigned char *mac, unsigned int *mac_len)
+{
+	unsigned char buf[UNPWD_CACHE_MAX_INPUT];
+	size_t ulen, plen;
+
+	ulen = strlen(username);
+	plen = strlen(password);
+	if(ulen + 1 + plen > UNPWD_CACHE_MAX_INPUT) return 1;
+
+	memcpy(buf, username, ulen);
+	buf[ulen] = '\0';
+	memcpy(&buf[ulen+1], password, plen);
+	if(!HMAC(EVP_sha256(), key, UNPWD_CACHE_KEY_LEN, buf, ulen+1+plen, mac, mac_len)){
+		return 1;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static bool _unpwd_cache_valid(struct _mosquitto_unpwd *u)
+{
+	return u->cached_mac_len && u->cached_expiry >= time(NULL);
+}
+
+static bool _unpwd_cache_check(struct mosquitto_db *db, struct _mosquitto_unpwd *u, const char *password)
+{
+	unsigned char mac[EVP_MAX_MD_SIZE];
+	unsigned int mac_len;
+
+	if(!_unpwd_cache_valid(u)) return false;
+	if(_unpwd_cache_mac(unpwd_cache_key, u->username, password, mac, &mac_len)) return false;
+
+	return mac_len == u->cached_mac_len
+		&& !CRYPTO_memcmp(u->cached_mac, mac, mac_len);
+}
+
+static void _unpwd_cache_add(struct mosquitto_db *db, struct _mosquitto_unpwd *u, const unsigned char *mac, unsigned int mac_len)
+{
+	if(!db->config->password_cache_ttl) return;
+
+	memcpy(u->cached_mac, mac, mac_len);
+	u->cached_mac_len = mac_len;
+	u->cached_expiry = time(NULL) + db->config->password_cache_ttl;
+}
+#endif
+
 int mosquitto_unpwd_check_default(struct mosquitto_db *db, const char *username, const char *password)
 {
-	struct _mosquitto_unpwd *u, *tmp;
+	struct _mosquitto_unpwd *u;
 #ifdef WITH_TLS
 	unsigned char hash[EVP_MAX_MD_SIZE];
 	unsigned int hash_len;
@@ -758,36 +741,165 @@ int mosquitto_unpwd_check_default(struct mosquitto_db *db, const char *username,
 	if(!db || !username) return MOSQ_ERR_INVAL;
 	if(!db->unpwd) return MOSQ_ERR_SUCCESS;
 
-	HASH_ITER(hh, db->unpwd, u, tmp){
-		if(!strcmp(u->username, username)){
-			if(u->password){
-				if(password){
+	HASH_FIND(hh, db->unpwd, username, strlen(username), u);
+	if(!u) return MOSQ_ERR_AUTH;
+	if(!u->password) return MOSQ_ERR_SUCCESS;
+	if(!password) return MOSQ_ERR_AUTH;
+
 #ifdef WITH_TLS
-					rc = _pw_digest(password, u->salt, u->salt_len, hash, &hash_len);
-					if(rc == MOSQ_ERR_SUCCESS){
-						if(hash_len == u->password_len && !memcmp(u->password, hash, hash_len)){
-							return MOSQ_ERR_SUCCESS;
-						}else{
-							return MOSQ_ERR_AUTH;
-						}
-					}else{
-						return rc;
-					}
+	if(_unpwd_cache_check(db, u, password)) return MOSQ_ERR_SUCCESS;
+
+	rc = _pw_digest(password, u->salt, u->salt_len, hash, &hash_len);
+	if(rc == MOSQ_ERR_SUCCESS){
+		if(hash_len == u->password_len && !memcmp(u->password, hash, hash_len)){
+			if(db->config->password_cache_ttl
+					&& !_unpwd_cache_mac(unpwd_cache_key, u->username, password, hash, &hash_len)){
+
+				_unpwd_cache_add(db, u, hash, hash_len);
+			}
+			return MOSQ_ERR_SUCCESS;
+		}else{
+			return MOSQ_ERR_AUTH;
+		}
+	}else{
+		return rc;
+	}
 #else
-					if(!strcmp(u->password, password)){
-						return MOSQ_ERR_SUCCESS;
-					}
+	if(!strcmp(u->password, password)){
+		return MOSQ_ERR_SUCCESS;
+	}
+	return MOSQ_ERR_AUTH;
 #endif
-				}else{
-					return MOSQ_ERR_AUTH;
-				}
-			}else{
-				return MOSQ_ERR_SUCCESS;
+}
+
+#ifdef WITH_TLS
+/* A password to be hashed by a worker thread. Everything the worker needs is
+ * copied in here, because the password file may be reloaded and the client
+ * may disconnect before it has finished. */
+struct _pw_check{
+	struct mqtt3_async_item item; /* Must be first. */
+	struct _mosquitto_auth_request *request;
+	char *username;
+	char *password;
+	unsigned char *salt;
+	unsigned int salt_len;
+	unsigned char hash[EVP_MAX_MD_SIZE];
+	unsigned int hash_len;
+	/* If cache is set, the worker also fills in the cache MAC when the
+	 * password matches, so the password itself never needs to be kept. */
+	bool cache;
+	unsigned char cache_key[UNPWD_CACHE_KEY_LEN];
+	unsigned char cache_mac[EVP_MAX_MD_SIZE];
+	unsigned int cache_mac_len;
+};
+
+static void _pw_check_free(struct _pw_check *check)
+{
+	if(check->username) _mosquitto_free(check->username);
+	if(check->password) _mosquitto_free(check->password);
+	if(check->salt) _mosquitto_free(check->salt);
+	_mosquitto_free(check);
+}
+
+/* Runs on a worker thread. */
+static void _pw_check_work(struct mqtt3_async_item *item)
+{
+	struct _pw_check *check = (struct _pw_check *)item;
+	unsigned char hash[EVP_MAX_MD_SIZE];
+	unsigned int hash_len;
+
+	item->result = _pw_digest(check->password, check->salt, check->salt_len, hash, &hash_len);
+	if(item->result == MOSQ_ERR_SUCCESS){
+		if(hash_len != check->hash_len || memcmp(check->hash, hash, hash_len)){
+			item->result = MOSQ_ERR_AUTH;
+		}else if(check->cache){
+			if(_unpwd_cache_mac(check->cache_key, check->username, check->password, check->cache_mac, &check->cache_mac_len)){
+				check->cache_mac_len = 0;
 			}
 		}
 	}
+}
 
-	return MOSQ_ERR_AUTH;
+static void _pw_check_done(struct mosquitto_db *db, struct mqtt3_async_item *item)
+{
+	struct _pw_check *check = (struct _pw_check *)item;
+	struct _mosquitto_auth_request *request = check->request;
+	struct _mosquitto_unpwd *u;
+
+	if(item->result == MOSQ_ERR_SUCCESS){
+		/* Only cache the password if it is still the one in the password
+		 * file, which may have been reloaded in the meantime. */
+		HASH_FIND(hh, db->unpwd, check->username, strlen(check->username), u);
+		if(u && u->password && u->password_len == check->hash_len
+				&& !memcmp(u->password, check->hash, check->hash_len)
+				&& check->cache_mac_len
+				&& !memcmp(check->cache_key, unpwd_cache_key, UNPWD_CACHE_KEY_LEN)){
+
+			_unpwd_cache_add(db, u, check->cache_mac, check->cache_mac_len);
+		}
+	}
+	request->item.result = item->result;
+	_pw_check_free(check);
+	request->item.done(db, &request->item);
+}
+#endif
+
+/* Hash the password on a worker thread. Returns MOSQ_ERR_NOT_SUPPORTED for
+ * anything that is as quick to check directly with
+ * mosquitto_unpwd_check_default(), including a password that matches the
+ * cache. Anything else, including a different password for a cached user,
+ * goes to a worker. */
+int mosquitto_unpwd_check_default_async(struct mosquitto_db *db, struct _mosquitto_auth_request *request, const char *username, const char *password)
+{
+#ifdef WITH_TLS
+	struct _mosquitto_unpwd *u;
+	struct _pw_check *check;
+
+	if(!db || !username) return MOSQ_ERR_INVAL;
+	if(!db->unpwd || !password || db->config->password_check_threads < 1){
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+
+	HASH_FIND(hh, db->unpwd, username, strlen(username), u);
+	if(!u || !u->password || u->password_len > EVP_MAX_MD_SIZE
+			|| _unpwd_cache_check(db, u, password)){
+
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+
+	check = _mosquitto_calloc(1, sizeof(struct _pw_check));
+	if(!check) return MOSQ_ERR_NOT_SUPPORTED;
+	check->item.work = _pw_check_work;
+	check->item.done = _pw_check_done;
+	check->request = request;
+	check->username = _mosquitto_strdup(username);
+	check->password = _mosquitto_strdup(password);
+	if(u->salt_len){
+		check->salt = _mosquitto_malloc(u->salt_len);
+	}
+	if(!check->username || !check->password || (u->salt_len && !check->salt)){
+		_pw_check_free(check);
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+	if(u->salt_len){
+		memcpy(check->salt, u->salt, u->salt_len);
+	}
+	check->salt_len = u->salt_len;
+	memcpy(check->hash, u->password, u->password_len);
+	check->hash_len = u->password_len;
+	if(db->config->password_cache_ttl){
+		memcpy(check->cache_key, unpwd_cache_key, UNPWD_CACHE_KEY_LEN);
+		check->cache = true;
+	}
+
+	if(mqtt3_async_run(&check->item)){
+		_pw_check_free(check);
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+	return MOSQ_ERR_SUCCESS;
+#else
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
 }
 
 static int _unpwd_cleanup(struct _mosquitto_unpwd **root, bool reload)
@@ -811,6 +923,29 @@ static int _unpwd_cleanup(struct _mosquitto_unpwd **root, bool reload)
 	return MOSQ_ERR_SUCCESS;
 }
 
+static void _acl_user_apply(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct _mosquitto_acl_user *acl_user_tail;
+
+	acl_user_tail = db->acl_list;
+	while(acl_user_tail){
+		if(acl_user_tail->username){
+			if(context->username){
+				if(!strcmp(acl_user_tail->username, context->username)){
+					context->acl_list = acl_user_tail;
+					break;
+				}
+			}
+		}else{
+			if(!context->username){
+				context->acl_list = acl_user_tail;
+				break;
+			}
+		}
+		acl_user_tail = acl_user_tail->next;
+	}
+}
+
 /* Apply security settings after a reload.
  * Includes:
  * - Disconnecting anonymous users if appropriate
@@ -819,7 +954,6 @@ static int _unpwd_cleanup(struct _mosquitto_unpwd **root, bool reload)
  */
 int mosquitto_security_apply_default(struct mosquitto_db *db)
 {
-	struct _mosquitto_acl_user *acl_user_tail;
 	struct _mosquitto_unpwd *u, *tmp;
 	bool allow_anonymous;
 	int i;
@@ -868,28 +1002,15 @@ int mosquitto_security_apply_default(struct mosquitto_db *db)
 					}
 				}
 				/* Check for ACLs and apply to user. */
-				if(db->acl_list){
-  					acl_user_tail = db->acl_list;
-					while(acl_user_tail){
-						if(acl_user_tail->username){
-							if(db->contexts[i]->username){
-								if(!strcmp(acl_user_tail->username, db->contexts[i]->username)){
-									db->contexts[i]->acl_list = acl_user_tail;
-									break;
-								}
-							}
-						}else{
-							if(!db->contexts[i]->username){
-								db->contexts[i]->acl_list = acl_user_tail;
-								break;
-							}
-						}
-						acl_user_tail = acl_user_tail->next;
-					}
-				}
+				_acl_user_apply(db, db->contexts[i]);
 			}
 		}
 	}
+	/* Clients that aren't connected only need their ACLs, the rest is
+	 * checked again when they reconnect. */
+	for(i=0; i<db->offline_count; i++){
+		_acl_user_apply(db, db->offline_contexts[i]);
+	}
 	return MOSQ_ERR_SUCCESS;
 }
 
@@ -911,34 +1032,30 @@ int mosquitto_psk_key_get_default(struct mosquitto_db *db, const char *hint, con
 }
 
 #ifdef WITH_TLS
+/* Also called from worker threads, so mustn't use the _mosquitto_ memory
+ * functions. */
 int _pw_digest(const char *password, const unsigned char *salt, unsigned int salt_len, unsigned char *hash, unsigned int *hash_len)
 {
 	const EVP_MD *digest;
-	EVP_MD_CTX context;
-	char *pass_salt;
-	int pass_salt_len;
+	EVP_MD_CTX *context;
 
-	digest = EVP_get_digestbyname("sha512");
+	digest = EVP_sha512();
 	if(!digest){
 		// FIXME fprintf(stderr, "Error: Unable to create openssl digest.\n");
 		return 1;
 	}
 
-	pass_salt_len = strlen(password) + salt_len;
-	pass_salt = _mosquitto_malloc(pass_salt_len);
-	if(!pass_salt){
+	context = EVP_MD_CTX_create();
+	if(!context){
 		// FIXME fprintf(stderr, "Error: Out of memory.\n");
 		return 1;
 	}
-	memcpy(pass_salt, password, strlen(password));
-	memcpy(pass_salt+strlen(password), salt, salt_len);
-	EVP_MD_CTX_init(&context);
-	EVP_DigestInit_ex(&context, digest, NULL);
-	EVP_DigestUpdate(&context, pass_salt, pass_salt_len);
+	EVP_DigestInit_ex(context, digest, NULL);
+	EVP_DigestUpdate(context, password, strlen(password));
+	EVP_DigestUpdate(context, salt, salt_len);
 	/* hash is assumed to be EVP_MAX_MD_SIZE bytes long. */
-	EVP_DigestFinal_ex(&context, hash, hash_len);
-	EVP_MD_CTX_cleanup(&context);
-	_mosquitto_free(pass_salt);
+	EVP_DigestFinal_ex(context, hash, hash_len);
+	EVP_MD_CTX_destroy(context);
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -41,20 +41,20 @@ int _mosquitto_send_connack(struct mosquitto *context, int result)
 
 	if(context){
 		if(context->id){
-			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending CONNACK to %s (%d)", context->id, result);
+			_mosquitto_log_debug(NULL, "Sending CONNACK to %s (%d)", context->id, result);
 		}else{
-			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending CONNACK to %s (%d)", context->address, result);
+			_mosquitto_log_debug(NULL, "Sending CONNACK to %s (%d)", context->address, result);
 		}
 	}
 
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_packet_new();
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->command = CONNACK;
 	packet->remaining_length = 2;
 	rc = _mosquitto_packet_alloc(packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 		return rc;
 	}
 	packet->payload[packet->pos+0] = 0;
@@ -68,16 +68,16 @@ int _mosquitto_send_suback(struct mosquitto *context, uint16_t mid, uint32_t pay
 	struct _mosquitto_packet *packet = NULL;
 	int rc;
 
-	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Sending SUBACK to %s", context->id);
+	_mosquitto_log_debug(NULL, "Sending SUBACK to %s", context->id);
 
-	packet = _mosquitto_calloc(1, sizeof(struct _mosquitto_packet));
+	packet = _mosquitto_packet_new();
 	if(!packet) return MOSQ_ERR_NOMEM;
 
 	packet->command = SUBACK;
 	packet->remaining_length = 2+payloadlen;
 	rc = _mosquitto_packet_alloc(packet);
 	if(rc){
-		_mosquitto_free(packet);
+		_mosquitto_packet_free(packet);
 		return rc;
 	}
 	_mosquitto_write_uint16(packet, mid);
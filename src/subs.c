@@ -90,6 +90,7 @@ static int _subs_process(struct mosquitto_db *db, struct _mosquitto_subhier *hie
 			/* Retained messages count as a persistence change, but only if
 			 * they aren't for $SYS. */
 			db->persistence_changes++;
+			mqtt3_db_wal_retain_write(stored);
 		}
 #endif
 		if(hier->retained){
@@ -244,6 +245,7 @@ static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos,
 				leaf->prev = NULL;
 			}
 			db->subscription_count++;
+			db->subscription_changes++;
 		}
 		return MOSQ_ERR_SUCCESS;
 	}
@@ -279,6 +281,7 @@ static int _sub_remove(struct mosquitto_db *db, struct mosquitto *context, struc
 		while(leaf){
 			if(leaf->context==context){
 				db->subscription_count--;
+				db->subscription_changes++;
 				if(leaf->prev){
 					leaf->prev->next = leaf->next;
 				}else{
@@ -484,6 +487,92 @@ int mqtt3_db_messages_queue(struct mosquitto_db *db, const char *source_id, cons
 	return rc;
 }
 
+static bool _sub_has_subscribers(struct _mosquitto_subhier *subhier, struct _sub_token *tokens)
+{
+	struct _mosquitto_subhier *branch;
+
+	branch = subhier->children;
+	while(branch){
+		if(tokens && tokens->topic && (!strcmp(branch->topic, tokens->topic) || !strcmp(branch->topic, "+"))){
+			if(!tokens->next && branch->subs) return true;
+			if(_sub_has_subscribers(branch, tokens->next)) return true;
+		}else if(!strcmp(branch->topic, "#") && !branch->children){
+			if(branch->subs) return true;
+		}
+		branch = branch->next;
+	}
+	return false;
+}
+
+/* Returns true if a message published to topic would be delivered to at
+ * least one client, following the same matching rules as
+ * mqtt3_db_messages_queue(). */
+bool mqtt3_sub_has_subscribers(struct mosquitto_db *db, const char *topic)
+{
+	bool found = false;
+	int tree;
+	struct _mosquitto_subhier *subhier;
+	struct _sub_token *tokens = NULL, *tail;
+
+	assert(db);
+	assert(topic);
+
+	if(!strncmp(topic, "$SYS/", 5)){
+		tree = 2;
+		if(_sub_topic_tokenise(topic+5, &tokens)) return false;
+	}else{
+		tree = 0;
+		if(_sub_topic_tokenise(topic, &tokens)) return false;
+	}
+
+	subhier = db->subs.children;
+	while(subhier && !found){
+		if((!strcmp(subhier->topic, "") && tree == 0) || (!strcmp(subhier->topic, "$SYS") && tree == 2)){
+			found = _sub_has_subscribers(subhier, tokens);
+		}
+		subhier = subhier->next;
+	}
+	while(tokens){
+		tail = tokens->next;
+		_mosquitto_free(tokens->topic);
+		_mosquitto_free(tokens);
+		tokens = tail;
+	}
+
+	return found;
+}
+
+static bool _sub_any(struct _mosquitto_subhier *subhier)
+{
+	struct _mosquitto_subhier *branch;
+
+	if(subhier->subs) return true;
+
+	branch = subhier->children;
+	while(branch){
+		if(_sub_any(branch)) return true;
+		branch = branch->next;
+	}
+	return false;
+}
+
+/* Returns true if any client is subscribed to anything in $SYS. */
+bool mqtt3_sub_sys_subscribed(struct mosquitto_db *db)
+{
+	struct _mosquitto_subhier *subhier;
+
+	assert(db);
+
+	subhier = db->subs.children;
+	while(subhier){
+		if(!strcmp(subhier->topic, "$SYS")){
+			return _sub_any(subhier);
+		}
+		subhier = subhier->next;
+	}
+	return false;
+}
+
 static int _subs_clean_session(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *root)
 {
 	int rc = 0;
@@ -496,6 +585,7 @@ static int _subs_clean_session(struct mosquitto_db *db, struct mosquitto *contex
 	while(leaf){
 		if(leaf->context == context){
 			db->subscription_count--;
+			db->subscription_changes++;
 			if(leaf->prev){
 				leaf->prev->next = leaf->next;
 			}else{
@@ -0,0 +1,66 @@
+#!/usr/bin/python
+
+# Test whether a listener refuses connections beyond max_connections and
+# counts them in $SYS/broker/listener/<port>/connections/rejected.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+
+topic = "$SYS/broker/listener/1888/connections/rejected"
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, topic, 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+publish0_packet = mosq_test.gen_publish(topic, qos=0, payload="0", retain=True)
+publish1_packet = mosq_test.gen_publish(topic, qos=0, payload="1")
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '01-connect-max-connections.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(1.5)
+
+    sock1 = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock1.settimeout(10)
+    sock1.connect(("localhost", 1888))
+    sock1.send(mosq_test.gen_connect("max-connections-1", keepalive=keepalive))
+    if mosq_test.expect_packet(sock1, "connack 1", connack_packet):
+        sock1.send(subscribe_packet)
+        if mosq_test.expect_packet(sock1, "suback", suback_packet):
+            if mosq_test.expect_packet(sock1, "publish 0", publish0_packet):
+                sock2 = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                sock2.settimeout(10)
+                sock2.connect(("localhost", 1888))
+                sock2.send(mosq_test.gen_connect("max-connections-2", keepalive=keepalive))
+                if mosq_test.expect_packet(sock2, "connack 2", connack_packet):
+                    sock3 = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                    sock3.settimeout(10)
+                    sock3.connect(("localhost", 1888))
+                    if sock3.recv(1) == "":
+                        if mosq_test.expect_packet(sock1, "publish 1", publish1_packet):
+                            rc = 0
+                    else:
+                        print("FAIL: Third connection not refused.")
+                    sock3.close()
+                sock2.close()
+    sock1.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
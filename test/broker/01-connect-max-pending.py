@@ -0,0 +1,60 @@
+#!/usr/bin/python
+
+# Test whether a listener with max_pending_connections leaves new connections
+# in the listen backlog while another client has yet to send CONNECT, and
+# accepts them once it has.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connect1_packet = mosq_test.gen_connect("max-pending-1", keepalive=keepalive)
+connect2_packet = mosq_test.gen_connect("max-pending-2", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '01-connect-max-pending.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock1 = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock1.settimeout(10)
+    sock1.connect(("localhost", 1888))
+    time.sleep(0.5)
+
+    # The TCP handshake is completed by the kernel, but the broker must not
+    # accept the connection whilst sock1 is pending.
+    sock2 = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock2.connect(("localhost", 1888))
+    sock2.send(connect2_packet)
+    sock2.settimeout(1)
+    try:
+        sock2.recv(1)
+        print("FAIL: Second connection accepted whilst first was pending.")
+    except socket.timeout:
+        sock2.settimeout(10)
+        sock1.send(connect1_packet)
+        if mosq_test.expect_packet(sock1, "connack 1", connack_packet):
+            if mosq_test.expect_packet(sock2, "connack 2", connack_packet):
+                rc = 0
+
+    sock2.close()
+    sock1.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,71 @@
+#!/usr/bin/python
+
+# Test whether a client connected with mosquitto_connect_shm() can publish to,
+# and receive from, a client connected over the network. The shm client
+# connects twice with the same client id first, so the second connection
+# takes over the existing context.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+if not sys.platform.startswith('linux'):
+    print("WARNING: Shared memory transport only supported on Linux")
+    exit(0)
+
+env = dict(os.environ)
+env['LD_LIBRARY_PATH'] = '../../lib:../../lib/cpp'
+
+rc = 1
+keepalive = 10
+connect_packet = mosq_test.gen_connect("shm-sub-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "shm/test", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+publish_packet = mosq_test.gen_publish(topic="shm/test", payload="message", qos=0)
+reply_packet = mosq_test.gen_publish(topic="shm/reply", payload="reply", qos=0)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '01-connect-shm.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.settimeout(5)
+    sock.connect(("localhost", 1888))
+    sock.send(connect_packet)
+
+    if mosq_test.expect_packet(sock, "connack", connack_packet):
+        sock.send(subscribe_packet)
+
+        if mosq_test.expect_packet(sock, "suback", suback_packet):
+            client = subprocess.Popen(['./c/01-connect-shm.test'], env=env)
+
+            if mosq_test.expect_packet(sock, "publish", publish_packet):
+                sock.send(reply_packet)
+                if client.wait() == 0:
+                    rc = 0
+            else:
+                client.terminate()
+                client.wait()
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,68 @@
+#!/usr/bin/python
+
+# Test whether a client connecting with the same client id as an existing
+# client takes over its session. The first client must be disconnected and the
+# second must receive messages for the first client's subscription.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("connect-takeover", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "takeover/test", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+publish_packet = mosq_test.gen_publish("takeover/test", qos=0, payload="message")
+
+broker = subprocess.Popen(['../../src/mosquitto', '-p', '1888'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock1 = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock1.settimeout(10)
+    sock1.connect(("localhost", 1888))
+    sock1.send(connect_packet)
+    if mosq_test.expect_packet(sock1, "connack 1", connack_packet):
+        sock1.send(subscribe_packet)
+        if mosq_test.expect_packet(sock1, "suback", suback_packet):
+            sock2 = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            sock2.settimeout(10)
+            sock2.connect(("localhost", 1888))
+            sock2.send(connect_packet)
+            if mosq_test.expect_packet(sock2, "connack 2", connack_packet):
+                if sock1.recv(1) == "":
+                    pub = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                    pub.settimeout(10)
+                    pub.connect(("localhost", 1888))
+                    pub.send(mosq_test.gen_connect("connect-takeover-pub", keepalive=keepalive))
+                    if mosq_test.expect_packet(pub, "connack pub", connack_packet):
+                        pub.send(publish_packet)
+                        if mosq_test.expect_packet(sock2, "publish", publish_packet):
+                            rc = 0
+                    pub.close()
+                else:
+                    print("FAIL: First client not disconnected.")
+            sock2.close()
+    sock1.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
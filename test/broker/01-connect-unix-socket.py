@@ -0,0 +1,44 @@
+#!/usr/bin/python
+
+# Test whether a client can connect over a unix domain socket listener.
+
+import inspect, os, sys
+import os
+import subprocess
+import socket
+import sys
+import time
+
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 10
+connect_packet = mosq_test.gen_connect("connect-unix-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '01-connect-unix-socket.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect("/tmp/mosquitto-test-01.sock")
+    sock.send(connect_packet)
+    if mosq_test.expect_packet(sock, "connack", connack_packet):
+        rc = 0
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
+
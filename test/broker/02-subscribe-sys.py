@@ -0,0 +1,56 @@
+#!/usr/bin/python
+
+# Test whether $SYS values are brought up to date when a client subscribes to
+# them, rather than at the next sys_interval. The broker doesn't publish $SYS
+# values while nobody is subscribed, so the client should get the current
+# value as a retained message rather than a stale one.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("subscribe-sys-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "$SYS/broker/clients/total", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+publish_packet = mosq_test.gen_publish("$SYS/broker/clients/total", qos=0, payload="1", retain=True)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '02-subscribe-sys.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.settimeout(5)
+    sock.connect(("localhost", 1888))
+    sock.send(connect_packet)
+
+    if mosq_test.expect_packet(sock, "connack", connack_packet):
+        sock.send(subscribe_packet)
+
+        if mosq_test.expect_packet(sock, "suback", suback_packet):
+            if mosq_test.expect_packet(sock, "publish", publish_packet):
+                rc = 0
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
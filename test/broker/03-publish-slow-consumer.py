@@ -0,0 +1,93 @@
+#!/usr/bin/python
+
+# Test whether a subscriber that stops reading is disconnected once it has had
+# more than max_output_bytes waiting for longer than slow_consumer_timeout, and
+# that this is reported in $SYS.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def read_packet(sock):
+    packet = sock.recv(1)
+    mult = 1
+    remaining_length = 0
+    while True:
+        byte = sock.recv(1)
+        packet = packet + byte
+        remaining_length = remaining_length + (ord(byte) & 127)*mult
+        mult = mult*128
+        if ord(byte) & 128 == 0:
+            break
+    while remaining_length > 0:
+        data = sock.recv(remaining_length)
+        packet = packet + data
+        remaining_length = remaining_length - len(data)
+    return packet
+
+rc = 1
+keepalive = 60
+sub_connect_packet = mosq_test.gen_connect("slow-consumer-sub", keepalive=keepalive)
+pub_connect_packet = mosq_test.gen_connect("slow-consumer-pub", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "slow/consumer", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+sys_subscribe_packet = mosq_test.gen_subscribe(mid, "$SYS/broker/clients/slow/disconnected", 0)
+sys_publish_packet = mosq_test.gen_publish("$SYS/broker/clients/slow/disconnected", qos=0, payload="1")
+sys_retained_packet = mosq_test.gen_publish("$SYS/broker/clients/slow/disconnected", qos=0, payload="1", retain=True)
+
+publish_packet = mosq_test.gen_publish("slow/consumer", qos=0, payload="x"*100)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '03-publish-slow-consumer.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sub = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sub.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+    sub.settimeout(10)
+    sub.connect(("localhost", 1888))
+    sub.send(sub_connect_packet)
+    if mosq_test.expect_packet(sub, "connack", connack_packet):
+        sub.send(subscribe_packet)
+        if mosq_test.expect_packet(sub, "suback", suback_packet):
+            pub = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            pub.settimeout(10)
+            pub.connect(("localhost", 1888))
+            pub.send(pub_connect_packet)
+            if mosq_test.expect_packet(pub, "connack", connack_packet):
+                pub.send(sys_subscribe_packet)
+                if mosq_test.expect_packet(pub, "suback", suback_packet):
+                    # sub never reads, so these back up in the broker.
+                    for i in range(100):
+                        pub.sendall(publish_packet*1000)
+
+                    start = time.time()
+                    while time.time() - start < 10:
+                        packet = read_packet(pub)
+                        if packet == sys_publish_packet or packet == sys_retained_packet:
+                            rc = 0
+                            break
+                    if rc:
+                        print("FAIL: Slow consumer not disconnected.")
+            pub.close()
+    sub.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,69 @@
+#!/usr/bin/python
+
+# Check that repeated topic access checks are answered from the ACL cache.
+# The client subscribes to test/# and publishes twice to the same topic. The
+# first publish needs a write and a read check, the second must get both from
+# the cache, so $SYS/broker/acl/cache/hits must reach 2.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("acl-cache-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "test/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+mid = 2
+sys_subscribe_packet = mosq_test.gen_subscribe(mid, "$SYS/broker/acl/cache/hits", 0)
+sys_suback_packet = mosq_test.gen_suback(mid, 0)
+
+publish_packet = mosq_test.gen_publish("test/cache", qos=0, payload="message")
+hits_packet = mosq_test.gen_publish("$SYS/broker/acl/cache/hits", qos=0, retain=True, payload="2")
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '09-acl-cache.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.settimeout(10)
+    sock.connect(("localhost", 1888))
+    sock.send(connect_packet)
+
+    if mosq_test.expect_packet(sock, "connack", connack_packet):
+        sock.send(subscribe_packet)
+
+        if mosq_test.expect_packet(sock, "suback", suback_packet):
+            sock.send(publish_packet)
+            if mosq_test.expect_packet(sock, "publish", publish_packet):
+                sock.send(publish_packet)
+                if mosq_test.expect_packet(sock, "publish", publish_packet):
+                    # Wait for the next $SYS update.
+                    time.sleep(2.5)
+                    sock.send(sys_subscribe_packet)
+                    if mosq_test.expect_packet(sock, "suback", sys_suback_packet):
+                        if mosq_test.expect_packet(sock, "hits", hits_packet):
+                            rc = 0
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
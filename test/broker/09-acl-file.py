@@ -0,0 +1,74 @@
+#!/usr/bin/python
+
+# Check that topic and pattern rules in an acl_file allow and deny publishing
+# and delivery as expected. The client subscribes to everything, then
+# publishes to a mixture of allowed and denied topics. Only messages that may
+# be both written and read must come back, in order.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("acl-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+topics = [
+        ("open/a", True),
+        ("open", False),
+        ("/open/a", False),
+        ("closed/a", False),
+        ("a/write/only", False),
+        ("read/a/only", False),
+        ("clients/other/a", False),
+        ("clients/acl-test/a/b", True),
+        ("open/a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p/q/r/s/t/u/v/w/x/y/z/a/b/c/d/e/f/g/h", True),
+        ("open/end", True)]
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '09-acl-file.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.settimeout(10)
+    sock.connect(("localhost", 1888))
+    sock.send(connect_packet)
+
+    if mosq_test.expect_packet(sock, "connack", connack_packet):
+        sock.send(subscribe_packet)
+
+        if mosq_test.expect_packet(sock, "suback", suback_packet):
+            for (topic, allowed) in topics:
+                sock.send(mosq_test.gen_publish(topic, qos=0, payload="message"))
+
+            rc = 0
+            for (topic, allowed) in topics:
+                if allowed:
+                    publish_packet = mosq_test.gen_publish(topic, qos=0, payload="message")
+                    if not mosq_test.expect_packet(sock, "publish", publish_packet):
+                        rc = 1
+                        break
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,65 @@
+#!/usr/bin/python
+
+# Test whether a slow asynchronous username/password check in an auth_plugin
+# holds up other clients. Client 1 connects with a username, which the plugin
+# takes 0.5 seconds to check. Client 2 connects anonymously in the meantime and
+# must be accepted first. Client 3 uses the wrong password and must be refused.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 10
+connect1_packet = mosq_test.gen_connect("plugin-async-1", keepalive=keepalive, username="test-username", password="cnwTICONIURW")
+connect2_packet = mosq_test.gen_connect("plugin-async-2", keepalive=keepalive)
+connect3_packet = mosq_test.gen_connect("plugin-async-3", keepalive=keepalive, username="test-username", password="wrong")
+connack_packet = mosq_test.gen_connack(rc=0)
+connack_refused_packet = mosq_test.gen_connack(rc=4)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '09-plugin-auth-async.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock1 = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock1.settimeout(10)
+    sock1.connect(("localhost", 1888))
+    sock1.send(connect1_packet)
+    start = time.time()
+
+    sock2 = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock2.settimeout(10)
+    sock2.connect(("localhost", 1888))
+    sock2.send(connect2_packet)
+
+    if mosq_test.expect_packet(sock2, "connack 2", connack_packet):
+        if time.time() - start > 0.3:
+            print("FAIL: Anonymous client waited for the other check.")
+        elif mosq_test.expect_packet(sock1, "connack 1", connack_packet):
+            sock3 = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            sock3.settimeout(10)
+            sock3.connect(("localhost", 1888))
+            sock3.send(connect3_packet)
+            if mosq_test.expect_packet(sock3, "connack 3", connack_refused_packet):
+                rc = 0
+            sock3.close()
+
+    sock2.close()
+    sock1.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
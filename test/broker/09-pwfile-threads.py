@@ -0,0 +1,50 @@
+#!/usr/bin/python
+
+# Test whether password file checks made by worker threads, and answered from
+# the password cache, give the right result. The correct password is used
+# twice, the second time it should come from the cache. A wrong password must
+# still be refused after the correct one has been cached.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def do_connect(client_id, password, connack_rc):
+    connect_packet = mosq_test.gen_connect(client_id, keepalive=10, username="user", password=password)
+    connack_packet = mosq_test.gen_connack(rc=connack_rc)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.settimeout(10)
+    sock.connect(("localhost", 1888))
+    sock.send(connect_packet)
+    ok = mosq_test.expect_packet(sock, "connack", connack_packet)
+    sock.close()
+    return ok
+
+rc = 1
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '09-pwfile-threads.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    if do_connect("pwfile-threads-1", "password", 0):
+        if do_connect("pwfile-threads-2", "password", 0):
+            if do_connect("pwfile-threads-3", "wrong", 4):
+                rc = 0
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,92 @@
+#!/usr/bin/python
+
+# Check that a message queued for a durable client survives the broker being
+# killed once a background snapshot has been written, and that the snapshot is
+# moved into place rather than left as a temporary file.
+
+import subprocess
+import socket
+import time
+from os import environ
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def remove_db():
+    for f in ['10-persistence-background.db', '10-persistence-background.db.new']:
+        try:
+            os.remove(f)
+        except OSError:
+            pass
+
+rc = 1
+mid = 109
+keepalive = 60
+connect_packet = mosq_test.gen_connect("persistence-bg-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+subscribe_packet = mosq_test.gen_subscribe(mid, "qos1/persistence/background", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+mid = 1
+publish_packet = mosq_test.gen_publish("qos1/persistence/background", qos=1, mid=mid, payload="background-message")
+puback_packet = mosq_test.gen_puback(mid)
+
+remove_db()
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '10-persistence-background.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.connect(("localhost", 1888))
+    sock.send(connect_packet)
+
+    if mosq_test.expect_packet(sock, "connack", connack_packet):
+        sock.send(subscribe_packet)
+
+        if mosq_test.expect_packet(sock, "suback", suback_packet):
+            sock.send(disconnect_packet)
+            sock.close()
+
+            pub = subprocess.Popen(['./10-persistence-background-helper.py'])
+            pub.wait()
+            # Allow time for an autosave to run and complete.
+            time.sleep(3.5)
+
+            # Kill the broker so that no snapshot is written on exit, then
+            # restart it. The queued message must come from the background
+            # snapshot alone.
+            broker.kill()
+            broker.wait()
+            broker = subprocess.Popen(['../../src/mosquitto', '-c', '10-persistence-background.conf'], stderr=subprocess.PIPE)
+            time.sleep(0.5)
+
+            sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            sock.settimeout(30)
+            sock.connect(("localhost", 1888))
+            sock.send(connect_packet)
+
+            if mosq_test.expect_packet(sock, "connack", connack_packet):
+                if mosq_test.expect_packet(sock, "publish", publish_packet):
+                    sock.send(puback_packet)
+                    if not os.path.exists('10-persistence-background.db.new'):
+                        rc = 0
+
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+    remove_db()
+
+exit(rc)
@@ -0,0 +1,79 @@
+#!/usr/bin/python
+
+# Check that the broker refuses to start from a persistence database that has
+# been damaged, rather than restoring part of it.
+
+import subprocess
+import socket
+import time
+from os import environ
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def remove_db():
+    try:
+        os.remove('10-persistence-corrupt.db')
+    except OSError:
+        pass
+
+rc = 1
+mid = 109
+keepalive = 60
+connect_packet = mosq_test.gen_connect("persistence-corrupt-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+subscribe_packet = mosq_test.gen_subscribe(mid, "qos1/persistence/corrupt", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+remove_db()
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '10-persistence-corrupt.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.connect(("localhost", 1888))
+    sock.send(connect_packet)
+
+    if mosq_test.expect_packet(sock, "connack", connack_packet):
+        sock.send(subscribe_packet)
+
+        if mosq_test.expect_packet(sock, "suback", suback_packet):
+            sock.close()
+
+            # A clean exit writes the database.
+            broker.terminate()
+            broker.wait()
+
+            # Flip one byte in the middle of the database.
+            f = open('10-persistence-corrupt.db', 'r+b')
+            data = f.read()
+            pos = len(data)/2
+            f.seek(pos)
+            f.write(chr(ord(data[pos]) ^ 0xFF))
+            f.close()
+
+            broker = subprocess.Popen(['../../src/mosquitto', '-c', '10-persistence-corrupt.conf'], stderr=subprocess.PIPE)
+            for i in range(20):
+                if broker.poll() is not None:
+                    break
+                time.sleep(0.1)
+            if broker.returncode is not None and broker.returncode != 0:
+                rc = 0
+    sock.close()
+finally:
+    if broker.returncode is None:
+        broker.terminate()
+        broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+    remove_db()
+
+exit(rc)
@@ -0,0 +1,101 @@
+#!/usr/bin/python
+
+# Check that with persistence_durable_acks, a message is on disk by the time
+# its PUBACK is received, by killing the broker as soon as the PUBACK arrives.
+
+import subprocess
+import socket
+import time
+from os import environ
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def remove_db():
+    for f in ['10-persistence-durable-acks.db', '10-persistence-durable-acks.db.wal']:
+        try:
+            os.remove(f)
+        except OSError:
+            pass
+
+rc = 1
+mid = 109
+keepalive = 60
+connect_packet = mosq_test.gen_connect("persistence-acks-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+subscribe_packet = mosq_test.gen_subscribe(mid, "qos1/persistence/acks", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+pub_connect_packet = mosq_test.gen_connect("persistence-acks-helper", keepalive=keepalive)
+
+mid = 128
+pub_publish_packet = mosq_test.gen_publish("qos1/persistence/acks", qos=1, mid=mid, payload="acked-message")
+pub_puback_packet = mosq_test.gen_puback(mid)
+
+mid = 1
+publish_packet = mosq_test.gen_publish("qos1/persistence/acks", qos=1, mid=mid, payload="acked-message")
+puback_packet = mosq_test.gen_puback(mid)
+
+remove_db()
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '10-persistence-durable-acks.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.connect(("localhost", 1888))
+    sock.send(connect_packet)
+
+    if mosq_test.expect_packet(sock, "connack", connack_packet):
+        sock.send(subscribe_packet)
+
+        if mosq_test.expect_packet(sock, "suback", suback_packet):
+            sock.send(disconnect_packet)
+            sock.close()
+
+            sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            sock.settimeout(10)
+            sock.connect(("localhost", 1888))
+            sock.send(pub_connect_packet)
+
+            if mosq_test.expect_packet(sock, "connack", connack_packet):
+                sock.send(pub_publish_packet)
+
+                if mosq_test.expect_packet(sock, "puback", pub_puback_packet):
+                    # No grace period: the message must already be synced.
+                    broker.kill()
+                    broker.wait()
+                    sock.close()
+
+                    broker = subprocess.Popen(['../../src/mosquitto', '-c', '10-persistence-durable-acks.conf'], stderr=subprocess.PIPE)
+                    time.sleep(0.5)
+
+                    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                    sock.settimeout(30)
+                    sock.connect(("localhost", 1888))
+                    sock.send(connect_packet)
+
+                    if mosq_test.expect_packet(sock, "connack", connack_packet):
+                        if mosq_test.expect_packet(sock, "publish", publish_packet):
+                            sock.send(puback_packet)
+                            rc = 0
+
+    sock.close()
+finally:
+    if broker.returncode is None:
+        broker.terminate()
+        broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+    remove_db()
+
+exit(rc)
@@ -0,0 +1,73 @@
+#!/usr/bin/python
+
+# Test whether a client subscribing to $SYS/broker/log/N gets log messages
+# straight away, even when another client unsubscribes at the same time so the
+# number of subscriptions doesn't change.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def do_connect(client_id):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.settimeout(10)
+    sock.connect(("localhost", 1888))
+    sock.send(mosq_test.gen_connect(client_id, keepalive=60))
+    if mosq_test.expect_packet(sock, "connack", mosq_test.gen_connack(rc=0)):
+        return sock
+    sock.close()
+    return None
+
+rc = 1
+mid = 1
+other_subscribe_packet = mosq_test.gen_subscribe(mid, "log/other", 0)
+other_suback_packet = mosq_test.gen_suback(mid, 0)
+unsubscribe_packet = mosq_test.gen_unsubscribe(mid, "log/other")
+unsuback_packet = mosq_test.gen_unsuback(mid)
+log_subscribe_packet = mosq_test.gen_subscribe(mid, "$SYS/broker/log/N", 0)
+log_suback_packet = mosq_test.gen_suback(mid, 0)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '11-log-topic-resubscribe.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    other = do_connect("log-topic-other")
+    sub = do_connect("log-topic-sub")
+    if other and sub:
+        other.send(other_subscribe_packet)
+        if mosq_test.expect_packet(other, "suback", other_suback_packet):
+            # Let the broker see that nobody is subscribed to the log topics.
+            time.sleep(1.5)
+
+            other.send(unsubscribe_packet)
+            sub.send(log_subscribe_packet)
+            if mosq_test.expect_packet(other, "unsuback", unsuback_packet) \
+                    and mosq_test.expect_packet(sub, "suback", log_suback_packet):
+
+                client = do_connect("log-topic-client")
+                if client:
+                    client.close()
+                    publish_packet = sub.recv(256)
+                    if "$SYS/broker/log/N" in publish_packet and "New connection" in publish_packet:
+                        rc = 0
+                    else:
+                        print("FAIL: Log message not received.")
+    if other: other.close()
+    if sub: sub.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
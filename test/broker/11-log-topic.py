@@ -0,0 +1,97 @@
+#!/usr/bin/python
+
+# Test whether log messages sent to $SYS/broker/log/N are collected into
+# multi-line payloads at the configured QoS, and that lines over
+# log_topic_max_lines are dropped and reported.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def read_packet(sock):
+    packet = sock.recv(1)
+    mult = 1
+    remaining_length = 0
+    while True:
+        byte = sock.recv(1)
+        packet = packet + byte
+        remaining_length = remaining_length + (ord(byte) & 127)*mult
+        mult = mult*128
+        if ord(byte) & 128 == 0:
+            break
+    header_length = len(packet)
+    while remaining_length > 0:
+        data = sock.recv(remaining_length)
+        packet = packet + data
+        remaining_length = remaining_length - len(data)
+    return (packet, header_length)
+
+rc = 1
+keepalive = 60
+sub_connect_packet = mosq_test.gen_connect("log-topic-sub", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "$SYS/broker/log/N", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '11-log-topic.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sub = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sub.settimeout(10)
+    sub.connect(("localhost", 1888))
+    sub.send(sub_connect_packet)
+    if mosq_test.expect_packet(sub, "connack", connack_packet):
+        sub.send(subscribe_packet)
+        if mosq_test.expect_packet(sub, "suback", suback_packet):
+            # Each connection logs two notices.
+            for i in range(5):
+                client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                client.settimeout(10)
+                client.connect(("localhost", 1888))
+                client.send(mosq_test.gen_connect("log-topic-%d" % (i), keepalive=keepalive))
+                mosq_test.expect_packet(client, "connack", connack_packet)
+                client.close()
+
+            multi_line = False
+            dropped = False
+            start = time.time()
+            while time.time() - start < 5 and not (multi_line and dropped):
+                (packet, header_length) = read_packet(sub)
+                if packet[0] != '\x30':
+                    print("FAIL: Log message not sent at QoS 0.")
+                    break
+                topic_length = ord(packet[header_length])*256 + ord(packet[header_length+1])
+                payload = packet[header_length+2+topic_length:]
+                lines = payload.split('\n')
+                if len(lines) > 1:
+                    multi_line = True
+                if lines[-1].endswith("further log messages dropped."):
+                    dropped = True
+                if len(lines) > 3:
+                    print("FAIL: More than log_topic_max_lines sent.")
+                    break
+            if multi_line and dropped:
+                rc = 0
+            else:
+                print("FAIL: multi_line=%s dropped=%s" % (multi_line, dropped))
+    sub.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,85 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <mosquitto.h>
+
+static int run = -1;
+static bool first_connected = false;
+
+void on_connect(struct mosquitto *mosq, void *obj, int rc)
+{
+	if(rc){
+		exit(1);
+	}else if(obj == &first_connected){
+		/* The first connection, which is about to be taken over. */
+		first_connected = true;
+	}else{
+		mosquitto_subscribe(mosq, NULL, "shm/reply", 0);
+	}
+}
+
+void on_subscribe(struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted_qos)
+{
+	mosquitto_publish(mosq, NULL, "shm/test", strlen("message"), "message", 1, false);
+}
+
+void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
+{
+	if(!strcmp(msg->topic, "shm/reply") && msg->payloadlen == strlen("reply")
+			&& !memcmp(msg->payload, "reply", msg->payloadlen)){
+
+		mosquitto_disconnect(mosq);
+	}else{
+		exit(1);
+	}
+}
+
+void on_disconnect(struct mosquitto *mosq, void *obj, int rc)
+{
+	run = rc;
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+	struct mosquitto *first, *mosq;
+	time_t start;
+
+	mosquitto_lib_init();
+
+	/* Connect twice with the same persistent client id, so the second
+	 * connection takes over the first one's context in the broker. */
+	first = mosquitto_new("01-connect-shm", false, &first_connected);
+	mosquitto_connect_callback_set(first, on_connect);
+
+	rc = mosquitto_connect_shm(first, "/tmp/mosquitto-test-shm.sock", 60);
+	if(rc) return rc;
+
+	start = time(NULL);
+	while(!first_connected && time(NULL) < start+10){
+		mosquitto_loop(first, -1, 1);
+	}
+	if(!first_connected) return 1;
+
+	mosq = mosquitto_new("01-connect-shm", false, NULL);
+	mosquitto_connect_callback_set(mosq, on_connect);
+	mosquitto_disconnect_callback_set(mosq, on_disconnect);
+	mosquitto_subscribe_callback_set(mosq, on_subscribe);
+	mosquitto_message_callback_set(mosq, on_message);
+
+	rc = mosquitto_connect_shm(mosq, "/tmp/mosquitto-test-shm.sock", 60);
+	if(rc) return rc;
+
+	start = time(NULL);
+	while(run == -1 && time(NULL) < start+10){
+		mosquitto_loop(mosq, -1, 1);
+	}
+
+	mosquitto_destroy(mosq);
+	mosquitto_destroy(first);
+	mosquitto_lib_cleanup();
+	return run;
+}
@@ -0,0 +1,93 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mosquitto.h>
+#include <mosquitto_plugin.h>
+
+struct check{
+	char *username;
+	char *password;
+	void *request;
+	void (*complete)(void *request, int result);
+};
+
+int mosquitto_auth_plugin_version(void)
+{
+	return MOSQ_AUTH_PLUGIN_VERSION;
+}
+
+int mosquitto_auth_plugin_init(void **user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_plugin_cleanup(void *user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_security_init(void *user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count, bool reload)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_security_cleanup(void *user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count, bool reload)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_acl_check(void *user_data, const char *username, const char *topic, int access)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_unpwd_check(void *user_data, const char *username, const char *password)
+{
+	if(!strcmp(username, "test-username") && password && !strcmp(password, "cnwTICONIURW")){
+		return MOSQ_ERR_SUCCESS;
+	}else{
+		return MOSQ_ERR_AUTH;
+	}
+}
+
+static void *check_thread(void *obj)
+{
+	struct check *c = obj;
+
+	/* Pretend to be a slow lookup. */
+	usleep(500000);
+	c->complete(c->request, mosquitto_auth_unpwd_check(NULL, c->username, c->password));
+	free(c->username);
+	free(c->password);
+	free(c);
+	return NULL;
+}
+
+int mosquitto_auth_unpwd_check_async(void *user_data, const char *username, const char *password, void *request, void (*complete)(void *request, int result))
+{
+	struct check *c;
+	pthread_t thread;
+
+	c = calloc(1, sizeof(struct check));
+	if(!c) return MOSQ_ERR_NOMEM;
+	c->username = strdup(username);
+	if(password) c->password = strdup(password);
+	c->request = request;
+	c->complete = complete;
+
+	if(pthread_create(&thread, NULL, check_thread, c)){
+		free(c->username);
+		free(c->password);
+		free(c);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	pthread_detach(thread);
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_psk_key_get(void *user_data, const char *hint, const char *identity, char *key, int max_key_len)
+{
+	return MOSQ_ERR_AUTH;
+}
+